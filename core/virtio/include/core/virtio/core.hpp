@@ -68,13 +68,30 @@ enum {
 	DEVICE_NEEDS_RESET = 64
 };
 
+// Transport-independent feature bits.
+enum {
+	VIRTIO_F_INDIRECT_DESC = 28,
+	VIRTIO_F_RING_EVENT_IDX = 29,
+	VIRTIO_F_RING_PACKED = 34
+};
+
 enum {
 	// Bits of the spec::Descriptor::flags field.
 	VIRTQ_DESC_F_NEXT = 1, // descriptor is part of a chain
 	VIRTQ_DESC_F_WRITE = 2, // buffer is written by device
+	VIRTQ_DESC_F_INDIRECT = 4, // buffer contains a table of descriptors
+
+	// Additional bits of the spec::PackedDescriptor::flags field.
+	VIRTQ_DESC_F_AVAIL = 1 << 7,
+	VIRTQ_DESC_F_USED = 1 << 15,
 
 	// Bits of the spec::UsedRing::flags field.
-	VIRTQ_USED_F_NO_NOTIFY = 1 // no need to notify the device
+	VIRTQ_USED_F_NO_NOTIFY = 1, // no need to notify the device
+
+	// Values of the spec::EventSuppression::flags field.
+	VIRTQ_EVENT_F_ENABLE = 0, // always send events
+	VIRTQ_EVENT_F_DISABLE = 1, // never send events
+	VIRTQ_EVENT_F_DESC = 2 // send an event at spec::EventSuppression::descriptor
 };
 
 namespace spec {
@@ -122,6 +139,23 @@ namespace spec {
 
 		arch::scalar_variable<uint16_t> eventIndex;
 	};
+
+	// Descriptor of a packed virtq.
+	struct PackedDescriptor {
+		arch::scalar_variable<uint64_t> address;
+		arch::scalar_variable<uint32_t> length;
+		arch::scalar_variable<uint16_t> id;
+		arch::scalar_variable<uint16_t> flags;
+	};
+	static_assert(sizeof(PackedDescriptor) == 16);
+
+	// Driver and device event suppression areas of a packed virtq.
+	struct EventSuppression {
+		// Bits 0-14 hold the ring offset, bit 15 holds the wrap counter.
+		arch::scalar_variable<uint16_t> descriptor;
+		arch::scalar_variable<uint16_t> flags;
+	};
+	static_assert(sizeof(EventSuppression) == 4);
 };
 
 struct DeviceSpace;
@@ -141,7 +175,8 @@ struct QueueInfo {
  * Usual initialization works as follows:
  * - Call discover() to obtain a transport.
  * - Negotiate features via Transport::checkDeviceFeature() / acknowledgeDriverFeature().
- * - Call Transport::finalizeFeatures().
+ * - Call Transport::finalizeFeatures(). This also negotiates the features that
+ *   are handled by Queue itself (VIRTIO_F_INDIRECT_DESC, VIRTIO_F_RING_EVENT_IDX).
  * - Call Transport::claimQueues().
  * - Call Transport::setupQueue() for each virtq.
  * - Call Transport::runDevice().
@@ -163,7 +198,18 @@ struct Transport {
 
 	virtual void claimQueues(unsigned int max_index) = 0;
 
-	virtual Queue *setupQueue(unsigned int index) = 0;
+	// Returns the number of interrupt vectors that queues can be bound to.
+	// Vector i is steered to CPU i if the transport supports MSI-X. Drivers that
+	// want one queue per CPU should not claim more queues than this.
+	virtual unsigned int numQueueVectors() = 0;
+
+	// Sets up a virtq and binds it to the given vector (< numQueueVectors()).
+	virtual Queue *setupQueue(unsigned int index, unsigned int vector) = 0;
+
+	// Sets up a virtq and binds it to vector (index % numQueueVectors()).
+	Queue *setupQueue(unsigned int index) {
+		return setupQueue(index, index % numQueueVectors());
+	}
 
 	virtual void runDevice() = 0;
 };
@@ -183,7 +229,7 @@ struct DeviceSpace {
 		} else {
 			static_assert(sizeof(typename RT::rep_type) == 4,
 					"Unsupported size for DeviceSpace::load()");
-			auto v = _transport->loadConfig16(r.offset());
+			auto v = _transport->loadConfig32(r.offset());
 			return static_cast<typename RT::rep_type>(v);
 		}
 	}
@@ -289,11 +335,26 @@ struct Request {
 };
 
 // Represents a single virtq.
+// The virtq either uses the split layout or, if VIRTIO_F_RING_PACKED is negotiated,
+// the packed layout. For packed virtqs, descriptors are prepared in a driver-private
+// table and copied to the ring on submission, such that the API is the same for both.
+// If VIRTIO_F_RING_EVENT_IDX is negotiated, notifications and interrupts are suppressed
+// using the event index fields. If VIRTIO_F_INDIRECT_DESC is negotiated, descriptor chains
+// are moved to indirect tables on submission, such that they occupy only a single
+// descriptor of the virtq while they are in flight.
 struct Queue {
 	friend struct Handle;
 
+	// Maximal length of chains that are moved to indirect tables.
+	static constexpr size_t maxIndirectDescriptors = 128;
+
 	Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
-			spec::AvailableRing *available, spec::UsedRing *used);
+			spec::AvailableRing *available, spec::UsedRing *used,
+			bool event_idx, bool indirect_desc);
+
+	Queue(unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+			spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+			bool event_idx, bool indirect_desc);
 protected:
 	~Queue() = default;
 
@@ -342,18 +403,69 @@ protected:
 	virtual void notifyTransport() = 0;
 
 private:
+	// Constructs the state that does not depend on the virtq layout.
+	void _setupSoftwareState();
+
+	// Moves the chain starting at the given descriptor to its indirect table.
+	void _makeIndirect(size_t table_index);
+
+	// Copies the chain starting at the given descriptor to the packed ring.
+	void _postPacked(size_t table_index);
+
+	void _notifyPacked();
+
+	void _processPacked();
+
+	// Frees the chain starting at the given descriptor and completes its request.
+	void _retire(size_t table_index);
+
 	// Index of this queue as part of its owning device.
 	unsigned int _queueIndex;
 
 	// Number of descriptors in this queue.
 	size_t _queueSize;
 
-	// Pointers to different data structures of this virtq.
+	// Negotiated features.
+	bool _usePacked;
+	bool _useEventIdx;
+	bool _useIndirect;
+
+	// Descriptor table. For packed virtqs, this table is not visible to the device.
 	spec::Descriptor *_table;
-	spec::AvailableRing *_availableRing;
-	spec::UsedRing *_usedRing;
-	spec::AvailableExtra *_availableExtra;
-	spec::UsedExtra *_usedExtra;
+
+	// Pointers to different data structures of split virtqs.
+	spec::AvailableRing *_availableRing = nullptr;
+	spec::UsedRing *_usedRing = nullptr;
+	spec::AvailableExtra *_availableExtra = nullptr;
+	spec::UsedExtra *_usedExtra = nullptr;
+
+	// Pointers to different data structures of packed virtqs.
+	spec::PackedDescriptor *_ring = nullptr;
+	spec::EventSuppression *_driverEvent = nullptr;
+	spec::EventSuppression *_deviceEvent = nullptr;
+	std::unique_ptr<spec::Descriptor[]> _shadowTable;
+
+	// Number of ring entries occupied by each chain of a packed virtq,
+	// indexed by the chain's first descriptor (which is also its buffer ID).
+	std::vector<uint16_t> _chainLengths;
+
+	// Next ring entry that we make available and its wrap counter.
+	uint16_t _availIndex = 0;
+	bool _availWrap = true;
+
+	// Next ring entry that we expect the device to use and its wrap counter.
+	uint16_t _usedIndex = 0;
+	bool _usedWrap = true;
+
+	// Number of ring entries that were made available since we last notified the device.
+	uint16_t _pendingEntries = 0;
+
+	// One indirect table (of maxIndirectDescriptors entries) per descriptor of the virtq.
+	spec::Descriptor *_indirectTables = nullptr;
+	std::vector<uintptr_t> _indirectPhysicals;
+
+	// Value of the available ring's head index when we last notified the device.
+	uint16_t _notifiedHead = 0;
 
 	// Keeps track of unused descriptor indices.
 	std::vector<uint16_t> _descriptorStack;
@@ -363,7 +475,7 @@ private:
 	std::vector<Request *> _activeRequests;
 
 	// Keeps track of which entries in the used ring have already been processed.
-	uint16_t _progressHead;
+	uint16_t _progressHead = 0;
 };
 
 } // namespace virtio_core
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <atomic>
 #include <iostream>
 #include <unordered_map>
 #include <optional>
@@ -10,6 +11,11 @@
 
 namespace virtio_core {
 
+namespace {
+	// Maximal number of MSI-X vectors that are used for queues.
+	constexpr unsigned int maxQueueVectors = 16;
+}
+
 struct Mapping {
 	static constexpr size_t pageSize = 0x1000;
 
@@ -96,7 +102,9 @@ struct LegacyPciTransport : Transport {
 	void finalizeFeatures() override;
 
 	void claimQueues(unsigned int max_index) override;
-	Queue *setupQueue(unsigned int index) override;
+	unsigned int numQueueVectors() override;
+	using Transport::setupQueue;
+	Queue *setupQueue(unsigned int index, unsigned int vector) override;
 
 	void runDevice() override;
 
@@ -107,13 +115,17 @@ private:
 	arch::io_space _legacySpace;
 	helix::UniqueDescriptor _irq;
 
+	bool _eventIdx = false;
+	bool _indirectDesc = false;
+
 	std::vector<std::unique_ptr<LegacyPciQueue>> _queues;
 };
 
 struct LegacyPciQueue final : Queue {
 	LegacyPciQueue(LegacyPciTransport *transport,
 			unsigned int queue_index, size_t queue_size,
-			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used);
+			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+			bool event_idx, bool indirect_desc);
 
 protected:
 	void notifyTransport() override;
@@ -155,16 +167,31 @@ void LegacyPciTransport::acknowledgeDriverFeature(unsigned int feature) {
 }
 
 void LegacyPciTransport::finalizeFeatures() {
-	// Does nothing for now.
+	// Negotiate the features that are implemented by Queue.
+	if(checkDeviceFeature(VIRTIO_F_RING_EVENT_IDX)) {
+		acknowledgeDriverFeature(VIRTIO_F_RING_EVENT_IDX);
+		_eventIdx = true;
+	}
+	if(checkDeviceFeature(VIRTIO_F_INDIRECT_DESC)) {
+		acknowledgeDriverFeature(VIRTIO_F_INDIRECT_DESC);
+		_indirectDesc = true;
+	}
 }
 
 void LegacyPciTransport::claimQueues(unsigned int max_index) {
 	_queues.resize(max_index);
 }
 
-Queue *LegacyPciTransport::setupQueue(unsigned int queue_index) {
+unsigned int LegacyPciTransport::numQueueVectors() {
+	// All queues share the INTx line.
+	return 1;
+}
+
+Queue *LegacyPciTransport::setupQueue(unsigned int queue_index,
+		[[maybe_unused]] unsigned int vector) {
 	assert(queue_index < _queues.size());
 	assert(!_queues[queue_index]);
+	assert(vector < numQueueVectors());
 
 	_legacySpace.store(PCI_L_QUEUE_SELECT, queue_index);
 	auto queue_size = _legacySpace.load(PCI_L_QUEUE_SIZE);
@@ -200,7 +227,7 @@ Queue *LegacyPciTransport::setupQueue(unsigned int queue_index) {
 	auto available = reinterpret_cast<spec::AvailableRing *>((char *)window + available_offset);
 	auto used = reinterpret_cast<spec::UsedRing *>((char *)window + used_offset);
 	_queues[queue_index] = std::make_unique<LegacyPciQueue>(this, queue_index, queue_size,
-			table, available, used);
+			table, available, used, _eventIdx, _indirectDesc);
 
 	// Hand the queue to the device.
 	uintptr_t table_physical;
@@ -251,8 +278,10 @@ async::detached LegacyPciTransport::_processIrqs() {
 
 LegacyPciQueue::LegacyPciQueue(LegacyPciTransport *transport,
 		unsigned int queue_index, size_t queue_size,
-		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used)
-: Queue{queue_index, queue_size, table, available, used}, _transport{transport} { }
+		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
+		bool event_idx, bool indirect_desc)
+: Queue{queue_index, queue_size, table, available, used, event_idx, indirect_desc},
+		_transport{transport} { }
 
 void LegacyPciQueue::notifyTransport() {
 	_transport->_legacySpace.store(PCI_L_QUEUE_NOTIFY, queueIndex());
@@ -278,7 +307,7 @@ struct StandardPciTransport : Transport {
 			Mapping common_mapping, Mapping notify_mapping,
 			Mapping isr_mapping, Mapping device_mapping,
 			unsigned int notify_multiplier, helix::UniqueDescriptor irq,
-			helix::UniqueDescriptor queueMsi);
+			std::vector<helix::UniqueDescriptor> queueMsis);
 
 	protocols::hw::Device &hwDevice() override {
 		return _hwDevice;
@@ -293,7 +322,9 @@ struct StandardPciTransport : Transport {
 	void finalizeFeatures() override;
 
 	void claimQueues(unsigned int max_index) override;
-	Queue *setupQueue(unsigned int index) override;
+	unsigned int numQueueVectors() override;
+	using Transport::setupQueue;
+	Queue *setupQueue(unsigned int index, unsigned int vector) override;
 
 	void runDevice() override;
 
@@ -303,8 +334,14 @@ private:
 	arch::mem_space _isrSpace() { return arch::mem_space{_isrMapping.get()}; }
 	arch::mem_space _deviceSpace() { return arch::mem_space{_deviceMapping.get()}; }
 
+	Queue *_setupPackedQueue(unsigned int queue_index,
+			size_t queue_size, uint16_t notify_index, unsigned int msi_vector);
+
+	// Binds the currently selected virtq to its MSI-X vector and enables it.
+	void _enableQueue(unsigned int msi_vector);
+
 	async::detached _processIrqs();
-	async::detached _processQueueMsi();
+	async::detached _processQueueMsi(unsigned int vector);
 
 	protocols::hw::Device _hwDevice;
 	bool _useMsi;
@@ -314,8 +351,12 @@ private:
 	Mapping _deviceMapping;
 	unsigned int _notifyMultiplier;
 	helix::UniqueDescriptor _irq;
-	helix::UniqueDescriptor _queueMsi;
+	// MSI-X vector i is steered to CPU i.
+	std::vector<helix::UniqueDescriptor> _queueMsis;
 
+	bool _eventIdx = false;
+	bool _indirectDesc = false;
+	bool _packedRing = false;
 
 	std::vector<std::unique_ptr<StandardPciQueue>> _queues;
 };
@@ -324,7 +365,18 @@ struct StandardPciQueue final : Queue {
 	StandardPciQueue(StandardPciTransport *transport,
 			unsigned int queue_index, size_t queue_size,
 			spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
-			arch::scalar_register<uint16_t> notify_register);
+			arch::scalar_register<uint16_t> notify_register, unsigned int msi_vector,
+			bool event_idx, bool indirect_desc);
+
+	StandardPciQueue(StandardPciTransport *transport,
+			unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+			spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+			arch::scalar_register<uint16_t> notify_register, unsigned int msi_vector,
+			bool event_idx, bool indirect_desc);
+
+	unsigned int msiVector() {
+		return _msiVector;
+	}
 
 protected:
 	void notifyTransport() override;
@@ -332,6 +384,7 @@ protected:
 private:
 	StandardPciTransport *_transport;
 	arch::scalar_register<uint16_t> _notifyRegister;
+	unsigned int _msiVector;
 };
 
 StandardPciTransport::StandardPciTransport(protocols::hw::Device hw_device,
@@ -339,13 +392,13 @@ StandardPciTransport::StandardPciTransport(protocols::hw::Device hw_device,
 		Mapping common_mapping, Mapping notify_mapping,
 		Mapping isr_mapping, Mapping device_mapping,
 		unsigned int notify_multiplier, helix::UniqueDescriptor irq,
-		helix::UniqueDescriptor queueMsi)
+		std::vector<helix::UniqueDescriptor> queueMsis)
 : _hwDevice{std::move(hw_device)},
 		_useMsi{useMsi},
 		_commonMapping{std::move(common_mapping)}, _notifyMapping{std::move(notify_mapping)},
 		_isrMapping{std::move(isr_mapping)}, _deviceMapping{std::move(device_mapping)},
 		_notifyMultiplier{notify_multiplier}, _irq{std::move(irq)},
-		_queueMsi{std::move(queueMsi)} { }
+		_queueMsis{std::move(queueMsis)} { }
 
 uint8_t StandardPciTransport::loadConfig8(size_t offset) {
 	return _deviceSpace().load(arch::scalar_register<uint8_t>(offset));
@@ -375,6 +428,20 @@ void StandardPciTransport::finalizeFeatures() {
 	assert(checkDeviceFeature(32));
 	acknowledgeDriverFeature(32);
 
+	// Negotiate the features that are implemented by Queue.
+	if(checkDeviceFeature(VIRTIO_F_RING_EVENT_IDX)) {
+		acknowledgeDriverFeature(VIRTIO_F_RING_EVENT_IDX);
+		_eventIdx = true;
+	}
+	if(checkDeviceFeature(VIRTIO_F_INDIRECT_DESC)) {
+		acknowledgeDriverFeature(VIRTIO_F_INDIRECT_DESC);
+		_indirectDesc = true;
+	}
+	if(checkDeviceFeature(VIRTIO_F_RING_PACKED)) {
+		acknowledgeDriverFeature(VIRTIO_F_RING_PACKED);
+		_packedRing = true;
+	}
+
 	_commonSpace().store(PCI_DEVICE_STATUS, _commonSpace().load(PCI_DEVICE_STATUS) | FEATURES_OK);
 	auto confirm = _commonSpace().load(PCI_DEVICE_STATUS);
 	assert(confirm & FEATURES_OK);
@@ -384,15 +451,25 @@ void StandardPciTransport::claimQueues(unsigned int max_index) {
 	_queues.resize(max_index);
 }
 
-Queue *StandardPciTransport::setupQueue(unsigned int queue_index) {
+unsigned int StandardPciTransport::numQueueVectors() {
+	if(!_useMsi)
+		return 1;
+	return _queueMsis.size();
+}
+
+Queue *StandardPciTransport::setupQueue(unsigned int queue_index, unsigned int msi_vector) {
 	assert(queue_index < _queues.size());
 	assert(!_queues[queue_index]);
+	assert(msi_vector < numQueueVectors());
 
 	_commonSpace().store(PCI_QUEUE_SELECT, queue_index);
 	auto queue_size = _commonSpace().load(PCI_QUEUE_SIZE);
 	auto notify_index = _commonSpace().load(PCI_QUEUE_NOTIFY);
 	assert(queue_size);
 
+	if(_packedRing)
+		return _setupPackedQueue(queue_index, queue_size, notify_index, msi_vector);
+
 	// TODO: Ensure that the queue size is indeed a power of 2.
 
 	// Determine the queue size in bytes.
@@ -424,7 +501,8 @@ Queue *StandardPciTransport::setupQueue(unsigned int queue_index) {
 	auto used = reinterpret_cast<spec::UsedRing *>((char *)window + used_offset);
 	_queues[queue_index] = std::make_unique<StandardPciQueue>(this, queue_index, queue_size,
 			table, available, used,
-			arch::scalar_register<uint16_t>{_notifyMultiplier * notify_index});
+			arch::scalar_register<uint16_t>{_notifyMultiplier * notify_index}, msi_vector,
+			_eventIdx, _indirectDesc);
 
 	// Hand the queue to the device.
 	uintptr_t table_physical, available_physical, used_physical;
@@ -438,24 +516,81 @@ Queue *StandardPciTransport::setupQueue(unsigned int queue_index) {
 	_commonSpace().store(PCI_QUEUE_USED[0], used_physical);
 	_commonSpace().store(PCI_QUEUE_USED[1], used_physical >> 32);
 
+	_enableQueue(msi_vector);
+
+	return _queues[queue_index].get();
+}
+
+Queue *StandardPciTransport::_setupPackedQueue(unsigned int queue_index,
+		size_t queue_size, uint16_t notify_index, unsigned int msi_vector) {
+	// Determine the queue size in bytes.
+	// The packed layout does not require the queue size to be a power of 2.
+	constexpr size_t event_align = 4;
+
+	auto driver_event_offset = (queue_size * sizeof(spec::PackedDescriptor)
+				+ (event_align - 1))
+			& ~size_t(event_align - 1);
+	auto device_event_offset = driver_event_offset + sizeof(spec::EventSuppression);
+
+	auto region_size = device_event_offset + sizeof(spec::EventSuppression);
+
+	// Allocate physical memory for the virtq structs.
+	assert(region_size < 0x4000); // FIXME: do not hardcode 0x4000
+	HelHandle memory;
+	void *window;
+	HEL_CHECK(helAllocateMemory(0x4000, kHelAllocContinuous, nullptr, &memory));
+	HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
+			0, 0x4000, kHelMapProtRead | kHelMapProtWrite, &window));
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+
+	// Setup the memory region.
+	auto ring = reinterpret_cast<spec::PackedDescriptor *>((char *)window);
+	auto driver_event = reinterpret_cast<spec::EventSuppression *>(
+			(char *)window + driver_event_offset);
+	auto device_event = reinterpret_cast<spec::EventSuppression *>(
+			(char *)window + device_event_offset);
+	_queues[queue_index] = std::make_unique<StandardPciQueue>(this, queue_index, queue_size,
+			ring, driver_event, device_event,
+			arch::scalar_register<uint16_t>{_notifyMultiplier * notify_index}, msi_vector,
+			_eventIdx, _indirectDesc);
+
+	// Hand the queue to the device. For packed virtqs, the registers of the available
+	// and used rings point to the driver and device event suppression areas.
+	uintptr_t ring_physical, driver_event_physical, device_event_physical;
+	HEL_CHECK(helPointerPhysical(ring, &ring_physical));
+	HEL_CHECK(helPointerPhysical(driver_event, &driver_event_physical));
+	HEL_CHECK(helPointerPhysical(device_event, &device_event_physical));
+	_commonSpace().store(PCI_QUEUE_TABLE[0], ring_physical);
+	_commonSpace().store(PCI_QUEUE_TABLE[1], ring_physical >> 32);
+	_commonSpace().store(PCI_QUEUE_AVAILABLE[0], driver_event_physical);
+	_commonSpace().store(PCI_QUEUE_AVAILABLE[1], driver_event_physical >> 32);
+	_commonSpace().store(PCI_QUEUE_USED[0], device_event_physical);
+	_commonSpace().store(PCI_QUEUE_USED[1], device_event_physical >> 32);
+
+	_enableQueue(msi_vector);
+
+	return _queues[queue_index].get();
+}
+
+void StandardPciTransport::_enableQueue(unsigned int msi_vector) {
 	// Setup MSI-X.
 	if(_useMsi) {
-		_commonSpace().store(PCI_QUEUE_MSIX_VECTOR, 0);
-		if(_commonSpace().load(PCI_QUEUE_MSIX_VECTOR) != 0)
+		_commonSpace().store(PCI_QUEUE_MSIX_VECTOR, msi_vector);
+		if(_commonSpace().load(PCI_QUEUE_MSIX_VECTOR) != msi_vector)
 			throw std::runtime_error("Device failed to allocate MSI-X interrupt");
 	}
 
 	_commonSpace().store(PCI_QUEUE_ENABLE, 1);
-
-	return _queues[queue_index].get();
 }
 
 void StandardPciTransport::runDevice() {
 	// Finally set the DRIVER_OK bit to finish the configuration.
 	_commonSpace().store(PCI_DEVICE_STATUS, _commonSpace().load(PCI_DEVICE_STATUS) | DRIVER_OK);
 
-	if(_useMsi)
-		_processQueueMsi();
+	if(_useMsi) {
+		for(unsigned int i = 0; i < _queueMsis.size(); i++)
+			_processQueueMsi(i);
+	}
 	_processIrqs();
 }
 
@@ -563,26 +698,39 @@ async::detached StandardPciTransport::_processIrqs() {
 #endif
 }
 
-async::detached StandardPciTransport::_processQueueMsi() {
+async::detached StandardPciTransport::_processQueueMsi(unsigned int vector) {
+	auto &msi = _queueMsis[vector];
+
 	uint64_t sequence = 0;
 	while(true) {
-		auto await = co_await helix_ng::awaitEvent(_queueMsi, sequence);
+		auto await = co_await helix_ng::awaitEvent(msi, sequence);
 		HEL_CHECK(await.error());
 		sequence = await.sequence();
 
-		HEL_CHECK(helAcknowledgeIrq(_queueMsi.getHandle(), kHelAckAcknowledge, sequence));
+		HEL_CHECK(helAcknowledgeIrq(msi.getHandle(), kHelAckAcknowledge, sequence));
 
-		for(auto &queue : _queues)
-			queue->processInterrupt();
+		for(auto &queue : _queues) {
+			if(queue && queue->msiVector() == vector)
+				queue->processInterrupt();
+		}
 	}
 }
 
 StandardPciQueue::StandardPciQueue(StandardPciTransport *transport,
 		unsigned int queue_index, size_t queue_size,
 		spec::Descriptor *table, spec::AvailableRing *available, spec::UsedRing *used,
-		arch::scalar_register<uint16_t> notify_register)
-: Queue{queue_index, queue_size, table, available, used},
-		_transport{transport}, _notifyRegister{notify_register} { }
+		arch::scalar_register<uint16_t> notify_register, unsigned int msi_vector,
+		bool event_idx, bool indirect_desc)
+: Queue{queue_index, queue_size, table, available, used, event_idx, indirect_desc},
+		_transport{transport}, _notifyRegister{notify_register}, _msiVector{msi_vector} { }
+
+StandardPciQueue::StandardPciQueue(StandardPciTransport *transport,
+		unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+		spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+		arch::scalar_register<uint16_t> notify_register, unsigned int msi_vector,
+		bool event_idx, bool indirect_desc)
+: Queue{queue_index, queue_size, ring, driver_event, device_event, event_idx, indirect_desc},
+		_transport{transport}, _notifyRegister{notify_register}, _msiVector{msi_vector} { }
 
 void StandardPciQueue::notifyTransport() {
 	_transport->_notifySpace().store(_notifyRegister, queueIndex());
@@ -661,12 +809,18 @@ discover(protocols::hw::Device hw_device, DiscoverMode mode) {
 			common_space.store(PCI_DEVICE_STATUS, 0);
 			assert(!common_space.load(PCI_DEVICE_STATUS));
 
-			helix::UniqueDescriptor queueMsi;
+			std::vector<helix::UniqueDescriptor> queueMsis;
 
-			// Enable MSI-X.
+			// Enable MSI-X. Vector i is steered to CPU i; we stop at the first
+			// vector that cannot be installed (e.g., because there are fewer CPUs).
 			if (info.numMsis) {
 				co_await hw_device.enableMsi();
-				queueMsi = co_await hw_device.installMsi(0);
+				for(unsigned int i = 0; i < std::min(info.numMsis, maxQueueVectors); i++) {
+					auto msi = co_await hw_device.tryInstallMsi(i, i);
+					if(!msi)
+						break;
+					queueMsis.push_back(std::move(msi));
+				}
 			}
 
 			// Set the ACKNOWLEDGE and DRIVER bits.
@@ -677,11 +831,12 @@ discover(protocols::hw::Device hw_device, DiscoverMode mode) {
 					common_space.load(PCI_DEVICE_STATUS) | DRIVER);
 
 			std::cout << "virtio: Using standard PCI transport" << std::endl;
+			bool useMsi = !queueMsis.empty();
 			co_return std::make_unique<StandardPciTransport>(std::move(hw_device),
-					info.numMsis,
+					useMsi,
 					std::move(*common_mapping), std::move(*notify_mapping),
 					std::move(*isr_mapping), std::move(*device_mapping),
-					notify_multiplier, std::move(irq), std::move(queueMsi));
+					notify_multiplier, std::move(irq), std::move(queueMsis));
 		}
 	}
 
@@ -782,8 +937,10 @@ async::result<void> scatterGather(DeviceToHostType, Chain &chain, Queue *queue,
 // --------------------------------------------------------
 
 Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *table,
-		spec::AvailableRing *available, spec::UsedRing *used)
-: _queueIndex{queue_index}, _queueSize{queue_size}, _progressHead{0} {
+		spec::AvailableRing *available, spec::UsedRing *used,
+		bool event_idx, bool indirect_desc)
+: _queueIndex{queue_index}, _queueSize{queue_size},
+		_usePacked{false}, _useEventIdx{event_idx}, _useIndirect{indirect_desc} {
 	// Construct the hardware state.
 	_table = new (table) spec::Descriptor[_queueSize];
 	_availableRing = new (available) spec::AvailableRing;
@@ -806,15 +963,82 @@ Queue::Queue(unsigned int queue_index, size_t queue_size, spec::Descriptor *tabl
 		_usedRing->elements[i].tableIndex.store(0xFFFF);
 	_usedExtra->eventIndex.store(0);
 
-	// Construct the software state.
+	_setupSoftwareState();
+}
+
+Queue::Queue(unsigned int queue_index, size_t queue_size, spec::PackedDescriptor *ring,
+		spec::EventSuppression *driver_event, spec::EventSuppression *device_event,
+		bool event_idx, bool indirect_desc)
+: _queueIndex{queue_index}, _queueSize{queue_size},
+		_usePacked{true}, _useEventIdx{event_idx}, _useIndirect{indirect_desc} {
+	// Construct the hardware state. Since the wrap counters start at 1,
+	// zeroed descriptors are neither available nor used.
+	_ring = new (ring) spec::PackedDescriptor[_queueSize];
+	_driverEvent = new (driver_event) spec::EventSuppression;
+	_deviceEvent = new (device_event) spec::EventSuppression;
+
+	for(size_t i = 0; i < _queueSize; i++) {
+		_ring[i].address.store(0);
+		_ring[i].length.store(0);
+		_ring[i].id.store(0);
+		_ring[i].flags.store(0);
+	}
+
+	// Without EVENT_IDX, ask for an interrupt for each used buffer.
+	// Otherwise, ask for an interrupt once the first ring entry is used.
+	if(_useEventIdx) {
+		_driverEvent->descriptor.store(uint16_t(1) << 15);
+		_driverEvent->flags.store(VIRTQ_EVENT_F_DESC);
+	}else{
+		_driverEvent->descriptor.store(0);
+		_driverEvent->flags.store(VIRTQ_EVENT_F_ENABLE);
+	}
+	_deviceEvent->descriptor.store(0);
+	_deviceEvent->flags.store(VIRTQ_EVENT_F_ENABLE);
+
+	// The descriptor table is only used by the driver.
+	_shadowTable = std::make_unique<spec::Descriptor[]>(_queueSize);
+	_table = _shadowTable.get();
+	_chainLengths.resize(_queueSize);
+
+	_setupSoftwareState();
+}
+
+void Queue::_setupSoftwareState() {
 	for(size_t i = 0; i < _queueSize; i++)
 		_descriptorStack.push_back(i);
 	_activeRequests.resize(_queueSize);
+
+	// Allocate the indirect tables. Since each table is naturally aligned and
+	// at most a page large, tables do not cross page boundaries.
+	if(_useIndirect) {
+		constexpr size_t page_size = 0x1000;
+		constexpr size_t table_size = maxIndirectDescriptors * sizeof(spec::Descriptor);
+		static_assert(table_size <= page_size && !(page_size % table_size));
+
+		auto size = (_queueSize * table_size + (page_size - 1)) & ~(page_size - 1);
+		HelHandle memory;
+		void *window;
+		HEL_CHECK(helAllocateMemory(size, 0, nullptr, &memory));
+		HEL_CHECK(helMapMemory(memory, kHelNullHandle, nullptr,
+				0, size, kHelMapProtRead | kHelMapProtWrite, &window));
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+
+		_indirectTables = new (window) spec::Descriptor[_queueSize * maxIndirectDescriptors];
+		for(size_t i = 0; i < _queueSize; i++) {
+			uintptr_t physical;
+			HEL_CHECK(helPointerPhysical(_indirectTables + i * maxIndirectDescriptors, &physical));
+			_indirectPhysicals.push_back(physical);
+		}
+	}
 }
 
 async::result<Handle> Queue::obtainDescriptor() {
 	while(true) {
 		if(_descriptorStack.empty()) {
+			// Descriptors that were posted in a batch are only returned
+			// once the device is notified about them.
+			notify();
 			co_await _descriptorDoorbell.async_wait();
 			continue;
 		}
@@ -839,6 +1063,14 @@ void Queue::postDescriptor(Handle handle, Request *request,
 	assert(!_activeRequests[handle.tableIndex()]);
 	_activeRequests[handle.tableIndex()] = request;
 
+	if(_useIndirect)
+		_makeIndirect(handle.tableIndex());
+
+	if(_usePacked) {
+		_postPacked(handle.tableIndex());
+		return;
+	}
+
 	auto enqueue_head = _availableRing->headIndex.load();
 	auto ring_index = enqueue_head & (_queueSize - 1);
 	_availableRing->elements[ring_index].tableIndex.store(handle.tableIndex());
@@ -848,17 +1080,47 @@ void Queue::postDescriptor(Handle handle, Request *request,
 }
 
 void Queue::notify() {
-	asm volatile ( "" : : : "memory" );
-	if(!(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY))
+	// The device must see the new head index before we read its event index.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if(_usePacked) {
+		_notifyPacked();
+	}else if(_useEventIdx) {
+		// Only notify if the device asked for a notification at an index
+		// that we posted since the last notification.
+		auto head = _availableRing->headIndex.load();
+		auto event = _usedExtra->eventIndex.load();
+		bool needed = static_cast<uint16_t>(head - event - 1)
+				< static_cast<uint16_t>(head - _notifiedHead);
+		_notifiedHead = head;
+		if(needed)
+			notifyTransport();
+	}else if(!(_usedRing->flags.load() & VIRTQ_USED_F_NO_NOTIFY)) {
 		notifyTransport();
+	}
 }
 
 void Queue::processInterrupt() {
+	if(_usePacked) {
+		_processPacked();
+		return;
+	}
+
 	while(true) {
 		auto used_head = _usedRing->headIndex.load();
 
-		if((_progressHead & 0xFFFF) == used_head)
-			break;
+		if((_progressHead & 0xFFFF) == used_head) {
+			if(!_useEventIdx)
+				break;
+
+			// Ask for an interrupt once the next element is used. Afterwards,
+			// check again to avoid missing elements that were used in between.
+			_availableExtra->eventIndex.store(_progressHead);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if((_progressHead & 0xFFFF) == _usedRing->headIndex.load())
+				break;
+			continue;
+		}
 
 		asm volatile ( "" : : : "memory" );
 
@@ -866,26 +1128,167 @@ void Queue::processInterrupt() {
 		auto table_index = _usedRing->elements[ring_index].tableIndex.load();
 		assert(table_index < _queueSize);
 
-		// Dequeue the Request object.
-		auto request = _activeRequests[table_index];
-		assert(request);
-		_activeRequests[table_index] = nullptr;
-
-		// Free all descriptors in the descriptor chain.
-		auto chain_index = table_index;
-		while(_table[chain_index].flags.load() & VIRTQ_DESC_F_NEXT) {
-			auto successor = _table[chain_index].next.load();
-			_descriptorStack.push_back(chain_index);
-			chain_index = successor;
+		_progressHead++;
+		_retire(table_index);
+	}
+}
+
+void Queue::_postPacked(size_t table_index) {
+	// Fill in all ring entries of the chain. The flags of the first entry are written last,
+	// such that the device cannot observe a partially written chain.
+	auto head_index = _availIndex;
+	uint16_t head_flags = 0;
+	uint16_t length = 0;
+	auto chain_index = table_index;
+	while(true) {
+		auto flags = _table[chain_index].flags.load();
+		uint16_t ring_flags = flags & (VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE
+				| VIRTQ_DESC_F_INDIRECT);
+		ring_flags |= _availWrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+
+		auto entry = _ring + _availIndex;
+		entry->address.store(_table[chain_index].address.load());
+		entry->length.store(_table[chain_index].length.load());
+		entry->id.store(table_index);
+		if(length) {
+			entry->flags.store(ring_flags);
+		}else{
+			head_flags = ring_flags;
+		}
+		length++;
+
+		if(++_availIndex == _queueSize) {
+			_availIndex = 0;
+			_availWrap = !_availWrap;
 		}
+
+		if(!(flags & VIRTQ_DESC_F_NEXT))
+			break;
+		chain_index = _table[chain_index].next.load();
+	}
+	_chainLengths[table_index] = length;
+	_pendingEntries += length;
+
+	asm volatile ( "" : : : "memory" );
+	_ring[head_index].flags.store(head_flags);
+}
+
+void Queue::_notifyPacked() {
+	bool needed;
+	auto flags = _deviceEvent->flags.load();
+	if(flags == VIRTQ_EVENT_F_DESC) {
+		// Same as for split virtqs, but the event index is qualified by a wrap counter.
+		auto descriptor = _deviceEvent->descriptor.load();
+		uint16_t event = descriptor & 0x7FFF;
+		if(bool(descriptor >> 15) != _availWrap)
+			event -= _queueSize;
+		needed = static_cast<uint16_t>(_availIndex - event - 1) < _pendingEntries;
+	}else{
+		needed = (flags != VIRTQ_EVENT_F_DISABLE);
+	}
+	_pendingEntries = 0;
+
+	if(needed)
+		notifyTransport();
+}
+
+void Queue::_processPacked() {
+	auto is_used = [&] {
+		auto flags = _ring[_usedIndex].flags.load();
+		bool avail = flags & VIRTQ_DESC_F_AVAIL;
+		bool used = flags & VIRTQ_DESC_F_USED;
+		return avail == used && used == _usedWrap;
+	};
+
+	while(true) {
+		if(!is_used()) {
+			if(!_useEventIdx)
+				break;
+
+			// Same as for split virtqs.
+			_driverEvent->descriptor.store(_usedIndex | (uint16_t(_usedWrap) << 15));
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(!is_used())
+				break;
+			continue;
+		}
+
+		asm volatile ( "" : : : "memory" );
+
+		// The device writes a single entry per chain; skip the remaining entries.
+		auto table_index = _ring[_usedIndex].id.load();
+		assert(table_index < _queueSize);
+		_usedIndex += _chainLengths[table_index];
+		if(_usedIndex >= _queueSize) {
+			_usedIndex -= _queueSize;
+			_usedWrap = !_usedWrap;
+		}
+
+		_retire(table_index);
+	}
+}
+
+void Queue::_retire(size_t table_index) {
+	// Dequeue the Request object.
+	auto request = _activeRequests[table_index];
+	assert(request);
+	_activeRequests[table_index] = nullptr;
+
+	// Free all descriptors in the descriptor chain.
+	auto chain_index = table_index;
+	while(_table[chain_index].flags.load() & VIRTQ_DESC_F_NEXT) {
+		auto successor = _table[chain_index].next.load();
 		_descriptorStack.push_back(chain_index);
-		_descriptorDoorbell.raise();
+		chain_index = successor;
+	}
+	_descriptorStack.push_back(chain_index);
+	_descriptorDoorbell.raise();
 
-		// Call the completion handler.
-		request->complete(request);
+	// Call the completion handler.
+	request->complete(request);
+}
 
-		_progressHead++;
+void Queue::_makeIndirect(size_t table_index) {
+	auto head = _table + table_index;
+	if(!(head->flags.load() & VIRTQ_DESC_F_NEXT))
+		return;
+
+	size_t length = 1;
+	for(auto index = table_index; _table[index].flags.load() & VIRTQ_DESC_F_NEXT;
+			index = _table[index].next.load())
+		length++;
+	if(length > maxIndirectDescriptors)
+		return;
+
+	// Copy the chain to the indirect table and free all descriptors except for the head.
+	// For packed virtqs, the table consists of implicitly chained packed descriptors.
+	auto indirect = _indirectTables + table_index * maxIndirectDescriptors;
+	auto index = table_index;
+	for(size_t n = 0; n < length; n++) {
+		auto flags = _table[index].flags.load();
+		if(_usePacked) {
+			auto packed = reinterpret_cast<spec::PackedDescriptor *>(indirect + n);
+			packed->address.store(_table[index].address.load());
+			packed->length.store(_table[index].length.load());
+			packed->id.store(0);
+			packed->flags.store(flags & VIRTQ_DESC_F_WRITE);
+		}else{
+			indirect[n].address.store(_table[index].address.load());
+			indirect[n].length.store(_table[index].length.load());
+			indirect[n].flags.store(flags);
+			indirect[n].next.store(n + 1);
+		}
+
+		auto successor = _table[index].next.load();
+		if(index != table_index)
+			_descriptorStack.push_back(index);
+		index = successor;
 	}
+	_descriptorDoorbell.raise();
+
+	head->address.store(_indirectPhysicals[table_index]);
+	head->length.store(length * sizeof(spec::Descriptor));
+	head->flags.store(VIRTQ_DESC_F_INDIRECT);
 }
 
 } // namespace virtio_core
@@ -1,7 +1,7 @@
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <inttypes.h>
-#include <unistd.h>
 
 #include <helix/memory.hpp>
 
@@ -29,7 +29,7 @@ void Command::notifyCompletion() {
 	event_.raise();
 }
 
-void Command::prepare(commandTable& table, commandHeader& header) {
+void Command::prepare(commandTable& table, commandHeader& header, std::optional<size_t> ncqTag) {
 	auto tablePhys = helix::ptrToPhysical(&table);
 	assert((tablePhys & 0x7F) == 0 && tablePhys < std::numeric_limits<uint32_t>::max());
 	assert(numSectors_ < std::numeric_limits<uint16_t>::max());
@@ -68,25 +68,41 @@ void Command::prepare(commandTable& table, commandHeader& header) {
 		case CommandType::identify:
 			table.commandFis.command = 0xEC; // IDENTIFY DEVICE
 			break;
+		case CommandType::readLog:
+			table.commandFis.command = 0x2F; // READ LOG EXT
+			break;
 		default:
 			assert(!"unknown command type");
 	}
 
+	if (ncqTag) {
+		assert(type_ == CommandType::read || type_ == CommandType::write);
+		assert(*ncqTag < limits::maxCmdSlots);
+
+		// For FPDMA commands, the sector count moves to the features register,
+		// while the count register carries the tag in bits 7:3.
+		table.commandFis.command = (type_ == CommandType::read)
+				? 0x60  // READ FPDMA QUEUED
+				: 0x61; // WRITE FPDMA QUEUED
+		table.commandFis.features = numSectors_ & 0xFF;
+		table.commandFis.featuresUpper = (numSectors_ >> 8) & 0xFF;
+		table.commandFis.sectorCount = static_cast<uint16_t>(*ncqTag << 3);
+	}
+
 	if (logCommands) {
-		printf("block/ahci: submitting %zu byte %s to %p at sector %" PRIu64 "\n",
-				numBytes_, cmdTypeToString(type_), buffer_, sector_);
+		printf("block/ahci: submitting %zu byte %s%s to %p at sector %" PRIu64 "\n",
+				numBytes_, ncqTag ? "queued " : "", cmdTypeToString(type_), buffer_, sector_);
 	}
 }
 
 /* Returns the number of PRDT entries written.
  *
- * Note on buffer_: libblockfs guarantees us that buffer_ is locked into memory,
- * and calling helPointerPhysical ensures that the pages are allocated and present
- * in the page tables. Hence, we know the buffer remains in memory during the DMA.
+ * The buffer is pinned (and translated) by a helix::PinnedRange that lives as long
+ * as the command, hence it remains in memory during the DMA.
  */
 size_t Command::writeScatterGather_(commandTable& table) {
-	// TODO: Grab the page size for each individual address
-	size_t pageSize = getpagesize();
+	// Maximal byte count of a single PRDT entry.
+	constexpr size_t maxEntrySize = size_t{4} << 20;
 
 	size_t prdtIndex = 0;
 	auto addEntry = [&](uintptr_t phys, size_t bytesToWrite) {
@@ -97,32 +113,16 @@ size_t Command::writeScatterGather_(commandTable& table) {
 			static_cast<uint32_t>(phys),
 			0,
 			0,
-			static_cast<uint32_t>(std::min(pageSize, bytesToWrite)) - 1,
+			static_cast<uint32_t>(bytesToWrite) - 1,
 		};
 	};
 
-	uintptr_t virtStart = reinterpret_cast<uintptr_t>(buffer_);
-	uintptr_t virtEnd = virtStart + numBytes_;
-	assert(virtEnd > virtStart);
-
-	// As virtStart may not be aligned to pageSize, we split off the initial
-	// unaligned part, then work with pageSize aligned chunks.
-	if (virtStart % pageSize > 0) {
-		auto nextAlignedAddr = (virtStart + pageSize) & ~(pageSize - 1);
-		auto bytesUntilAligned = nextAlignedAddr - virtStart;
-		auto bytesToWrite = std::min(numBytes_, bytesUntilAligned);
-		addEntry(helix::addressToPhysical(virtStart), bytesToWrite);
-
-		virtStart = nextAlignedAddr;
-	}
+	pinnedBuffer_ = helix::PinnedRange{buffer_, numBytes_};
 
-	// Insert every page in the buffer into the scatter-gather list.
-	for (uintptr_t virt = virtStart; virt < virtEnd; virt += pageSize) {
-		uintptr_t phys = helix::addressToPhysical(virt);
-		
-		// TODO: As a small optimisation, we could accumulate into the previous entry if they
-		// happen to be physically contiguous.
-		addEntry(phys, virtEnd - virt);
+	// Physically contiguous parts of the buffer only need a single entry.
+	for (auto &run : pinnedBuffer_) {
+		for (size_t offset = 0; offset < run.length; offset += maxEntrySize)
+			addEntry(run.address + offset, std::min(run.length - offset, maxEntrySize));
 	}
 
 	return prdtIndex;
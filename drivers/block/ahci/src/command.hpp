@@ -1,13 +1,17 @@
 #pragma once
 
+#include <optional>
+
 #include <async/oneshot-event.hpp>
+#include <helix/memory.hpp>
 
 #include "spec.hpp"
 
 enum class CommandType {
 	read,
 	write,
-	identify
+	identify,
+	readLog
 };
 
 struct Command {
@@ -22,14 +26,29 @@ public:
 		assert(type == CommandType::identify);
 	}
 
-	void prepare(commandTable& table, commandHeader& header);
+	// Reads the NCQ Command Error log; the log address is passed in the LBA field.
+	Command(ncqErrorLog *buffer, CommandType type)
+		: Command(0x10, 1, sizeof(ncqErrorLog), reinterpret_cast<void *>(buffer), type) {
+		assert(type == CommandType::readLog);
+	}
+
+	// If ncqTag is set, the command is issued as READ/WRITE FPDMA QUEUED.
+	void prepare(commandTable& table, commandHeader& header,
+			std::optional<size_t> ncqTag = std::nullopt);
 	void notifyCompletion(); 
 
+	// Returns false once the command has exhausted its retries.
+	bool retry() {
+		return ++retries_ <= maxRetries;
+	}
+
 	auto getFuture() {
 		return event_.wait();
 	}
 
 private:
+	static constexpr unsigned int maxRetries = 3;
+
 	size_t writeScatterGather_(commandTable& table);
 
 private:
@@ -39,6 +58,9 @@ private:
 	void *buffer_;
 	CommandType type_;
 	async::oneshot_event event_;
+	unsigned int retries_ = 0;
+	// Keeps buffer_ pinned until the command is destructed.
+	helix::PinnedRange pinnedBuffer_;
 };
 
 constexpr const char *cmdTypeToString(CommandType type) {
@@ -49,6 +71,8 @@ constexpr const char *cmdTypeToString(CommandType type) {
 			return "write";
 		case CommandType::identify:
 			return "identify";
+		case CommandType::readLog:
+			return "read log";
 		default:
 			assert(!"unknown command type");
 	}
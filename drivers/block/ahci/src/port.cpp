@@ -36,12 +36,14 @@ namespace flags {
 		constexpr int hostDataError   = 1 << 28;
 		constexpr int ifFatalError    = 1 << 27;
 		constexpr int ifNonFatalError = 1 << 26;
+		constexpr int setDeviceBits   = 1 << 3;
 		constexpr int d2hFis          = 1;
 	}
 
 	namespace tfd {
 		constexpr int bsy = 1 << 7;
 		constexpr int drq = 1 << 3;
+		constexpr int err = 1;
 	}
 }
 
@@ -50,10 +52,12 @@ namespace {
 }
 
 // TODO: We can use a more appropriate block size, but this breaks other parts of the OS.
-Port::Port(int64_t parentId, int portIndex, size_t numCommandSlots, bool staggeredSpinUp, arch::mem_space regs)
+Port::Port(int64_t parentId, int portIndex, size_t numCommandSlots, bool staggeredSpinUp,
+		bool hbaSupportsNcq, arch::mem_space regs)
 	: BlockDevice{::sectorSize, parentId},  regs_{regs}, deviceSize_{0},
 	numCommandSlots_{numCommandSlots}, commandsInFlight_{0}, portIndex_{portIndex}, 
-	staggeredSpinUp_{staggeredSpinUp}
+	staggeredSpinUp_{staggeredSpinUp}, hbaSupportsNcq_{hbaSupportsNcq}, ncqEnabled_{false},
+	recovering_{false}
 {
 }
 
@@ -66,17 +70,12 @@ async::result<bool> Port::init() {
 		co_return false;
 
 	// 10.1.2, part 3:
-	// Clear PxCMD.ST
-	auto cas = regs_.load(regs::commandAndStatus);
-	regs_.store(regs::commandAndStatus, cas & ~flags::cmd::start);
-
-	// Wait until PxCMD.CR = 0 with 500ms timeout
-	auto success = co_await helix::kindaBusyWait(500'000'000, [&](){
-		return !(regs_.load(regs::commandAndStatus) & flags::cmd::cmdListRunning); });
+	// Clear PxCMD.ST and wait until PxCMD.CR = 0
+	auto success = co_await stop_();
 	assert(success);
 
 	// Clear PxCMD.FRE (must be done before rebase)
-	cas = regs_.load(regs::commandAndStatus);
+	auto cas = regs_.load(regs::commandAndStatus);
 	regs_.store(regs::commandAndStatus, cas & ~flags::cmd::fisReceiveEnable);
 
 	// Wait until PxCMD.FR = 0 with 500ms timeout
@@ -123,6 +122,7 @@ void Port::dumpState() {
 	printf("  PxIS: %#x\n", regs_.load(regs::interruptStatus));
 	printf("  PxIE: %#x\n", regs_.load(regs::interruptEnable));
 	printf("  commandsInFlight: %zu\n", commandsInFlight_);
+	printf("  NCQ: %s\n", ncqEnabled_ ? "enabled" : "disabled");
 	printf("  submittedCmds slots used: %zu\n", std::count_if(submittedCmds_.begin(), submittedCmds_.end(), [](auto &p){ return p != nullptr; }));
 }
 
@@ -169,8 +169,7 @@ async::result<bool> Port::run() {
 
 	// Set PxCMD.ST
 	assert(!(regs_.load(regs::commandAndStatus) & flags::cmd::cmdListRunning));
-	cas = regs_.load(regs::commandAndStatus);
-	regs_.store(regs::commandAndStatus, cas | flags::cmd::start);
+	start_();
 
 	size_t slot = co_await findFreeSlot_();
 
@@ -195,17 +194,35 @@ async::result<bool> Port::run() {
 	auto model = identify->getModel();
 	deviceSize_ = logicalSize * sectorCount;
 
-	printf("block/ahci: Started port %d, model %s, size %.1fGiB (sectors: logical %zu, physical %zu, count %" PRIu64 ")\n",
+	// NCQ commands are tagged with their command slot, so we cannot use more slots
+	// than the device's queue depth.
+	if (hbaSupportsNcq_ && identify->supportsNcq()) {
+		numCommandSlots_ = std::min(numCommandSlots_, identify->getQueueDepth());
+		ncqEnabled_ = true;
+	}
+
+	printf("block/ahci: Started port %d, model %s, size %.1fGiB (sectors: logical %zu, physical %zu, count %" PRIu64 "), ",
 			portIndex_, model.c_str(), static_cast<float>(deviceSize_ / (1 << 30)),
 			logicalSize, physicalSize, sectorCount);
+	if (ncqEnabled_) {
+		printf("NCQ depth %zu\n", numCommandSlots_);
+	} else {
+		printf("NCQ unsupported\n");
+	}
 	assert(logicalSize == 512 && "block/ahci: logical sector size > 512 is not supported");
 
+	// Commands transfer less than 64 KiB (see Command), and each command slot
+	// can process one request.
+	maxSectorsPerRequest = (65536 - 1) / ::sectorSize;
+	maxInflightRequests = numCommandSlots_;
+
 	// Clear and enable interrupts on this port
 	auto is = regs_.load(regs::interruptStatus);
 	regs_.store(regs::interruptStatus, is);
 	auto ie = regs_.load(regs::interruptEnable);
 	regs_.store(regs::interruptEnable, ie
 			| flags::is::d2hFis
+			| flags::is::setDeviceBits
 			| flags::is::taskFileError
 			| flags::is::hostDataError
 			| flags::is::hostFatalError
@@ -220,7 +237,7 @@ async::result<bool> Port::run() {
 }
 
 async::result<size_t> Port::findFreeSlot_() {
-	while (commandsInFlight_ >= numCommandSlots_) {
+	while (recovering_ || commandsInFlight_ >= numCommandSlots_) {
 		if (logCommands) {
 			printf("block/ahci: submission queue full, waiting...\n");
 		}
@@ -264,17 +281,40 @@ void Port::handleIrq() {
 	auto is = regs_.load(regs::interruptStatus);
 
 	if (logCommands) {
-		printf("block/ahci: Port %d handling IRQ: PxIS %#x, PxIE %#x, PxTFD %#x, PxCI %#x, PxCAS %#x\n",
+		printf("block/ahci: Port %d handling IRQ: PxIS %#x, PxIE %#x, PxTFD %#x, PxCI %#x, PxSACT %#x, PxCAS %#x\n",
 				portIndex_, is, regs_.load(regs::interruptEnable), regs_.load(regs::tfd),
-				regs_.load(regs::commandIssue), regs_.load(regs::commandAndStatus));
+				regs_.load(regs::commandIssue), regs_.load(regs::sataActive),
+				regs_.load(regs::commandAndStatus));
+	}
+
+	// The recovery task polls for the completion of its own commands.
+	if (recovering_) {
+		regs_.store(regs::interruptStatus, is);
+		return;
+	}
+
+	if (hasErrors_(is)) {
+		recover_(is);
+		return;
+	}
+
+	if (is & flags::is::ifNonFatalError) {
+		printf("\e[33mblock/ahci: Port %d encountered non-fatal error, PxSERR %#x\e[39m\n",
+				portIndex_, regs_.load(regs::sErr));
+		regs_.store(regs::sErr, regs_.load(regs::sErr));
 	}
 
-	checkErrors();
+	// Clear PxIS before looking at PxCI and PxSACT, such that we do not miss
+	// completions that happen in between.
+	regs_.store(regs::interruptStatus, is);
 
 	std::vector<Command *> completed;
 
-	// Notify all completed commands
+	// Notify all completed commands. Queued commands are only complete once the device
+	// clears their PxSACT bit by a Set Device Bits FIS.
 	auto cmdActiveMask = regs_.load(regs::commandIssue);
+	if (ncqEnabled_)
+		cmdActiveMask |= regs_.load(regs::sataActive);
 	for (size_t i = 0; i < numCommandSlots_; i++) {
 		if (submittedCmds_[i] && !(cmdActiveMask & (1 << i))) {
 			completed.push_back(std::exchange(submittedCmds_[i], nullptr));
@@ -282,7 +322,6 @@ void Port::handleIrq() {
 	}
 
 	commandsInFlight_ -= completed.size();
-	regs_.store(regs::interruptStatus, is);
 
 	for (auto &cmd : completed) {
 		cmd->notifyCompletion();
@@ -296,6 +335,146 @@ void Port::handleIrq() {
 	}
 }
 
+bool Port::hasErrors_(uint32_t is) {
+	return (is & (flags::is::taskFileError
+			| flags::is::hostFatalError
+			| flags::is::hostDataError
+			| flags::is::ifFatalError))
+		|| (regs_.load(regs::tfd) & flags::tfd::err);
+}
+
+// Error recovery, following AHCI spec 6.2.2. On an NCQ error, the device aborts all
+// outstanding commands, hence we re-issue every command that was in flight. Only the
+// command that caused the error is charged a retry.
+async::detached Port::recover_(uint32_t is) {
+	recovering_ = true;
+
+	auto tfd = regs_.load(regs::tfd);
+	printf("\e[33mblock/ahci: Port %d encountered error (PxIS %#x, PxTFD %#x, PxSERR %#x), recovering\e[39m\n",
+			portIndex_, is, tfd, regs_.load(regs::sErr));
+	if (logCommands)
+		dumpState();
+
+	// For non-queued commands, PxCMD.CCS points to the failing command.
+	std::optional<size_t> failedSlot;
+	if (!ncqEnabled_ && (is & flags::is::taskFileError))
+		failedSlot = (regs_.load(regs::commandAndStatus) >> 8) & 0x1F;
+
+	// Stopping the port clears PxCI and PxSACT.
+	bool stopped = co_await stop_();
+
+	auto outstanding = std::exchange(submittedCmds_, {});
+	commandsInFlight_ = 0;
+
+	regs_.store(regs::sErr, regs_.load(regs::sErr));
+	regs_.store(regs::interruptStatus, regs_.load(regs::interruptStatus));
+
+	// If the HBA did not stop or the device is still busy, a COMRESET is required.
+	bool reset = !stopped
+		|| (is & (flags::is::hostFatalError | flags::is::ifFatalError))
+		|| (regs_.load(regs::tfd) & (flags::tfd::bsy | flags::tfd::drq));
+	if (reset && !(co_await comReset_())) {
+		printf("\e[31mblock/ahci: Port %d failed to reset\e[39m\n", portIndex_);
+		dumpState();
+		abort();
+	}
+
+	start_();
+
+	// Reading the NCQ Command Error log also clears the error condition on the device.
+	// The log is not valid after a COMRESET.
+	if (ncqEnabled_ && !reset) {
+		failedSlot = co_await readNcqErrorLog_();
+
+		if (regs_.load(regs::tfd) & (flags::tfd::bsy | flags::tfd::drq | flags::tfd::err)) {
+			co_await stop_();
+			if (!(co_await comReset_())) {
+				printf("\e[31mblock/ahci: Port %d failed to reset\e[39m\n", portIndex_);
+				dumpState();
+				abort();
+			}
+			start_();
+		}
+	}
+
+	// If we could not determine the failing command, charge all of them.
+	for (size_t i = 0; i < numCommandSlots_; i++) {
+		auto cmd = outstanding[i];
+		if (!cmd)
+			continue;
+
+		if ((!failedSlot || *failedSlot == i) && !cmd->retry()) {
+			printf("\e[31mblock/ahci: Port %d command in slot %zu failed after retrying\e[39m\n",
+					portIndex_, i);
+			dumpState();
+			abort();
+		}
+
+		pendingCmdQueue_.put(cmd);
+	}
+
+	recovering_ = false;
+	freeSlotDoorbell_.raise();
+}
+
+// Returns the tag of the failed queued command, if any.
+async::result<std::optional<size_t>> Port::readNcqErrorLog_() {
+	// All slots are free at this point, as the port was restarted.
+	arch::dma_object<ncqErrorLog> log{&dmaPool_};
+	Command cmd{log.data(), CommandType::readLog};
+	cmd.prepare(commandTables_[0], commandList_->slots[0]);
+
+	regs_.store(regs::commandIssue, 1);
+
+	auto success = co_await helix::kindaBusyWait(500'000'000,
+			[&](){ return !(regs_.load(regs::commandIssue) & 1); });
+	if (!success || (regs_.load(regs::tfd) & flags::tfd::err)) {
+		printf("\e[33mblock/ahci: Port %d failed to read NCQ error log\e[39m\n", portIndex_);
+		co_return std::nullopt;
+	}
+
+	if (log->nonQueued())
+		co_return std::nullopt;
+	co_return log->tag();
+}
+
+// Port reset (AHCI spec 10.4.2). PxCMD.ST must be cleared.
+async::result<bool> Port::comReset_() {
+	printf("block/ahci: Resetting port %d\n", portIndex_);
+
+	// Set PxSCTL.DET = 1 for at least 1ms, then clear it again
+	auto sctl = regs_.load(regs::sataControl);
+	regs_.store(regs::sataControl, (sctl & ~0xF) | 1);
+	co_await helix::sleepFor(1'000'000);
+	regs_.store(regs::sataControl, sctl & ~0xF);
+
+	// Wait until communication is re-established (PxSSTS.DET = 3)
+	auto success = co_await helix::kindaBusyWait(1'000'000'000,
+			[&](){ return (regs_.load(regs::status) & 0xF) == 3; });
+	regs_.store(regs::sErr, regs_.load(regs::sErr));
+	if (!success)
+		co_return false;
+
+	// Wait for the device to become ready
+	co_return co_await helix::kindaBusyWait(10'000'000'000, [&](){
+		return !(regs_.load(regs::tfd) & (flags::tfd::bsy | flags::tfd::drq));
+	});
+}
+
+void Port::start_() {
+	auto cas = regs_.load(regs::commandAndStatus);
+	regs_.store(regs::commandAndStatus, cas | flags::cmd::start);
+}
+
+// Clears PxCMD.ST and waits until PxCMD.CR = 0 with 500ms timeout.
+async::result<bool> Port::stop_() {
+	auto cas = regs_.load(regs::commandAndStatus);
+	regs_.store(regs::commandAndStatus, cas & ~flags::cmd::start);
+
+	co_return co_await helix::kindaBusyWait(500'000'000, [&](){
+		return !(regs_.load(regs::commandAndStatus) & flags::cmd::cmdListRunning); });
+}
+
 async::detached Port::submitPendingLoop_() {
 	while (true) {
 		auto cmd = co_await pendingCmdQueue_.async_get();
@@ -309,8 +488,9 @@ async::result<void> Port::submitCommand_(Command *cmd) {
 	assert(!(regs_.load(regs::commandIssue) & (1 << slot)));
 	assert(!submittedCmds_[slot]);
 
-	// Setup command table and FIS
-	cmd->prepare(commandTables_[slot], commandList_->slots[slot]);
+	// Setup command table and FIS. NCQ commands use their slot as tag.
+	cmd->prepare(commandTables_[slot], commandList_->slots[slot],
+			ncqEnabled_ ? std::optional<size_t>{slot} : std::nullopt);
 
 	// Issue command
 	submittedCmds_[slot] = cmd;
@@ -320,6 +500,9 @@ async::result<void> Port::submitCommand_(Command *cmd) {
 	while (regs_.load(regs::tfd) & (flags::tfd::bsy | flags::tfd::drq))
 		;
 
+	// PxSACT must be set before PxCI for queued commands
+	if (ncqEnabled_)
+		regs_.store(regs::sataActive, 1 << slot);
 	regs_.store(regs::commandIssue, 1 << slot);
 	co_return;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <optional>
 #include <queue>
 
 #include <arch/mem_space.hpp>
@@ -17,7 +18,7 @@
 class Port : public blockfs::BlockDevice {
 public:
 	Port(int64_t parentId, int index, size_t numCommandSlots, bool staggeredSpinUp,
-			arch::mem_space regs);
+			bool hbaSupportsNcq, arch::mem_space regs);
 
 public:
 	async::result<bool> init();
@@ -36,8 +37,12 @@ private:
 	async::result<size_t> findFreeSlot_();
 	async::detached submitPendingLoop_();
 	async::result<void> submitCommand_(Command *cmd);
+	bool hasErrors_(uint32_t is);
+	async::detached recover_(uint32_t is);
+	async::result<std::optional<size_t>> readNcqErrorLog_();
+	async::result<bool> comReset_();
 	void start_();
-	void stop_();
+	async::result<bool> stop_();
 
 private:
 	// Mapping is owned by Controller
@@ -68,4 +73,9 @@ private:
 	size_t commandsInFlight_;
 	int portIndex_;
 	bool staggeredSpinUp_;
+	bool hbaSupportsNcq_;
+	// Whether read and write commands are issued as FPDMA QUEUED.
+	bool ncqEnabled_;
+	// Set while the port is stopped for error recovery; no commands are issued meanwhile.
+	bool recovering_;
 };
@@ -90,15 +90,18 @@ static_assert(alignof(commandTable) >= 128);
 struct identifyDevice {
 	uint16_t _junkA[27];
 	uint16_t model[20];
-	uint16_t _junkB[36];
+	uint16_t _junkB[28];
+	uint16_t queueDepth;
+	uint16_t sataCapabilities;
+	uint16_t _junkC[6];
 	uint16_t capabilities;
-	uint16_t _junkC[16];
+	uint16_t _junkD[16];
 	uint64_t maxLBA48;
-	uint16_t _junkD[2];
+	uint16_t _junkE[2];
 	uint16_t sectorSizeInfo;
-	uint16_t _junkE[9];
+	uint16_t _junkF[9];
 	uint16_t logicalSectorSize;
-	uint16_t _junkF[139];
+	uint16_t _junkG[139];
 
 	std::string getModel() const {
 		char modelNative[41];
@@ -143,5 +146,36 @@ struct identifyDevice {
 	bool supportsLba48() const {
 		return capabilities & (1 << 10);
 	}
+
+	bool supportsNcq() const {
+		// Word 76 is invalid if it reads as 0 or 0xFFFF.
+		if (sataCapabilities == 0 || sataCapabilities == 0xFFFF)
+			return false;
+		return sataCapabilities & (1 << 8);
+	}
+
+	// Maximum number of outstanding NCQ commands
+	size_t getQueueDepth() const {
+		return (queueDepth & 0x1F) + 1;
+	}
 };
 static_assert(sizeof(identifyDevice) == 512);
+
+// NCQ Command Error log (log address 10h), read by READ LOG EXT.
+struct ncqErrorLog {
+	uint8_t tagInfo;
+	uint8_t _reservedA;
+	uint8_t status;
+	uint8_t error;
+	uint8_t _junk[508];
+
+	// Set if the error was caused by a non-queued command.
+	bool nonQueued() const {
+		return tagInfo & (1 << 7);
+	}
+
+	size_t tag() const {
+		return tagInfo & 0x1F;
+	}
+};
+static_assert(sizeof(ncqErrorLog) == 512);
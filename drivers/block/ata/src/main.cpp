@@ -1,9 +1,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
+#include <optional>
 #include <queue>
+#include <stdexcept>
 #include <memory>
+#include <new>
 
 #include <async/result.hpp>
 #include <async/recurring-event.hpp>
@@ -11,6 +15,7 @@
 #include <arch/io_space.hpp>
 #include <arch/register.hpp>
 #include <helix/ipc.hpp>
+#include <helix/memory.hpp>
 #include <helix/timer.hpp>
 #include <protocols/hw/client.hpp>
 #include <protocols/mbus/client.hpp>
@@ -30,6 +35,7 @@ namespace regs {
 	inline constexpr arch::scalar_register<uint16_t> ioData{0};
 	inline constexpr arch::scalar_register<uint8_t> inStatus{7};
 
+	inline constexpr arch::scalar_register<uint8_t> outFeatures{1};
 	inline constexpr arch::scalar_register<uint8_t> outSectorCount{2};
 	inline constexpr arch::scalar_register<uint8_t> outLba1{3};
 	inline constexpr arch::scalar_register<uint8_t> outLba2{4};
@@ -42,11 +48,34 @@ namespace alt_regs {
 	inline constexpr arch::scalar_register<uint8_t> inStatus{0};
 }
 
+// Bus-master IDE registers of the primary channel (SFF-8038i).
+namespace bm_regs {
+	inline constexpr arch::scalar_register<uint8_t> command{0};
+	inline constexpr arch::scalar_register<uint8_t> status{2};
+	inline constexpr arch::scalar_register<uint32_t> prdtAddress{4};
+}
+
+struct PrdEntry {
+	uint32_t address;
+	uint16_t byteCount; // 0 means 64 KiB.
+	uint16_t flags;
+};
+static_assert(sizeof(PrdEntry) == 8);
+
+// The PRD table must not cross a 64 KiB boundary; the alignment guarantees that.
+struct alignas(512) PrdTable {
+	// Enough to cover 255 sectors, even if the buffer is not physically contiguous.
+	static constexpr size_t numEntries = 64;
+	PrdEntry entries[numEntries];
+};
+static_assert(sizeof(PrdTable) == 512);
+
 class Controller : public blockfs::BlockDevice {
 	enum class IoResult {
 		none,
 		timeout,
 		notReady,
+		error,
 		noData,
 		withData
 	};
@@ -54,7 +83,8 @@ class Controller : public blockfs::BlockDevice {
 public:
 	Controller(int64_t parentId, uint16_t mainOffset, uint16_t altOffset,
 			helix::UniqueDescriptor mainBar, helix::UniqueDescriptor altBar,
-			helix::UniqueDescriptor irq);
+			helix::UniqueDescriptor irq, std::optional<uint16_t> bmOffset,
+			helix::UniqueDescriptor bmBar);
 
 public:
 	async::detached run();
@@ -79,7 +109,16 @@ private:
 		kCommandReadSectorsExt = 0x24,
 		kCommandWriteSectors = 0x30,
 		kCommandWriteSectorsExt = 0x34,
+		kCommandReadDma = 0xC8,
+		kCommandReadDmaExt = 0x25,
+		kCommandWriteDma = 0xCA,
+		kCommandWriteDmaExt = 0x35,
 		kCommandIdentify = 0xEC,
+		kCommandSetFeatures = 0xEF,
+	};
+
+	enum Features {
+		kFeatureSetTransferMode = 0x03,
 	};
 
 	enum Flags {
@@ -90,7 +129,16 @@ private:
 		kStatusBsy = 0x80,
 
 		kDeviceSlave = 0x10,
-		kDeviceLba = 0x40
+		kDeviceLba = 0x40,
+
+		kBmCommandStart = 0x01,
+		kBmCommandRead = 0x08, // Device-to-memory transfer.
+
+		kBmStatusActive = 0x01,
+		kBmStatusErr = 0x02,
+		kBmStatusIrq = 0x04,
+
+		kPrdEndOfTable = 0x8000
 	};
 
 	struct Request {
@@ -98,12 +146,18 @@ private:
 		uint64_t sector;
 		size_t numSectors;
 		void *buffer;
+		// Set by _performRequest() if the transfer failed.
+		bool failed;
 		async::oneshot_event event;
 	};
 
-	async::result<void> _performRequest(Request *request);
+	async::result<bool> _performRequest(Request *request);
+	async::result<bool> _performDmaRequest(Request *request);
+	void _setupTaskFile(Request *request);
+	void _logPioError(Request *request, size_t k, IoResult ioRes);
 
 	async::result<bool> _detectDevice();
+	async::result<bool> _setTransferMode(uint8_t mode);
 
 	std::queue<Request *> _requestQueue;
 	async::recurring_event _doorbell;
@@ -111,19 +165,42 @@ private:
 	helix::UniqueDescriptor _irq;
 	arch::io_space _ioSpace;
 	arch::io_space _altSpace;
+	std::optional<arch::io_space> _bmSpace;
+
+	// The bus-master only takes 32-bit addresses of the PRD table.
+	helix::Mapping _prdMapping;
+	PrdTable *_prdTable = nullptr;
+	uintptr_t _prdtPhysical = 0;
 
 	bool _supportsLBA48;
+	// Set if the device was switched to a DMA mode; otherwise, we use PIO.
+	bool _useDma;
 
 	uint64_t _irqSequence;
 };
 
 Controller::Controller(int64_t parentId, uint16_t mainOffset, uint16_t altOffset,
 		helix::UniqueDescriptor mainBar, helix::UniqueDescriptor altBar,
-		helix::UniqueDescriptor irq)
+		helix::UniqueDescriptor irq, std::optional<uint16_t> bmOffset,
+		helix::UniqueDescriptor bmBar)
 : BlockDevice{512, parentId}, _irq{std::move(irq)},
-		_ioSpace{mainOffset}, _altSpace{altOffset}, _supportsLBA48{false} {
+		_ioSpace{mainOffset}, _altSpace{altOffset}, _supportsLBA48{false}, _useDma{false} {
 	HEL_CHECK(helEnableIo(mainBar.getHandle()));
 	HEL_CHECK(helEnableIo(altBar.getHandle()));
+
+	if(bmOffset) {
+		HEL_CHECK(helEnableIo(bmBar.getHandle()));
+		_bmSpace = arch::io_space{*bmOffset};
+
+		HelAllocRestrictions restrictions{.addressBits = 32};
+		HelHandle memory;
+		HEL_CHECK(helAllocateMemory(0x1000, kHelAllocContinuous, &restrictions, &memory));
+		_prdMapping = helix::Mapping{helix::BorrowedDescriptor{memory}, 0, 0x1000};
+		HEL_CHECK(helCloseDescriptor(kHelThisUniverse, memory));
+		_prdTable = new (_prdMapping.get()) PrdTable{};
+		_prdtPhysical = helix::ptrToPhysical(_prdTable);
+		assert(_prdtPhysical + sizeof(PrdTable) <= (uintptr_t(1) << 32));
+	}
 }
 
 async::detached Controller::run() {
@@ -138,6 +215,11 @@ async::detached Controller::run() {
 
 	_doRequestLoop();
 
+	// The sector count register is 8 bits wide (see _setupTaskFile()) and the
+	// controller processes one request at a time.
+	maxSectorsPerRequest = 255;
+	maxInflightRequests = 1;
+
 	blockfs::runDevice(this);
 }
 
@@ -150,7 +232,7 @@ async::detached Controller::_doRequestLoop() {
 
 		auto request = _requestQueue.front();
 		_requestQueue.pop();
-		co_await _performRequest(request);
+		request->failed = !(co_await _performRequest(request));
 		request->event.raise();
 	}
 }
@@ -163,8 +245,8 @@ auto Controller::_pollForBsy() -> async::result<IoResult> {
 		// TODO: Report those errors to the caller.
 		if(!(altStatus & kStatusRdy)) // Device was disconnected?
 			co_return IoResult::notReady;
-		assert(!(altStatus & kStatusErr));
-		assert(!(altStatus & kStatusDf));
+		if(altStatus & (kStatusErr | kStatusDf))
+			co_return IoResult::error;
 		co_return ((altStatus & kStatusDrq) ? IoResult::withData : IoResult::noData);
 	}
 }
@@ -186,9 +268,10 @@ auto Controller::_waitForBsyIrq() -> async::result<IoResult> {
 		// or error out below.
 		auto altStatus = _altSpace.load(alt_regs::inStatus);
 		if(altStatus & kStatusBsy) {
-			// TODO: Check the PCI registers if the IRQ is pending.
-			//       This is the only situation where we should loop.
-			if(false) {
+			// If we have a bus-master register block, its IRQ bit tells us if the IRQ is pending.
+			// This is the only situation where we should loop.
+			// TODO: Check the PCI status register otherwise.
+			if(_bmSpace && !(_bmSpace->load(bm_regs::status) & kBmStatusIrq)) {
 				HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckNack, _irqSequence));
 				continue;
 			}
@@ -196,6 +279,12 @@ auto Controller::_waitForBsyIrq() -> async::result<IoResult> {
 					"\e[39m" << std::endl;
 		}
 
+		// Clear the bus-master IRQ bit (but leave the error bit to the DMA code).
+		if(_bmSpace) {
+			auto bmStatus = _bmSpace->load(bm_regs::status);
+			_bmSpace->store(bm_regs::status, (bmStatus & ~kBmStatusErr) | kBmStatusIrq);
+		}
+
 		// Clear and acknowledge the IRQ.
 		auto status = _ioSpace.load(regs::inStatus);
 		HEL_CHECK(helAcknowledgeIrq(_irq.getHandle(), kHelAckAcknowledge, _irqSequence));
@@ -205,8 +294,8 @@ auto Controller::_waitForBsyIrq() -> async::result<IoResult> {
 		// TODO: Report those errors to the caller.
 		if(!(status & kStatusRdy)) // Device was disconnected?
 			co_return IoResult::notReady;
-		assert(!(status & kStatusErr));
-		assert(!(status & kStatusDf));
+		if(status & (kStatusErr | kStatusDf))
+			co_return IoResult::error;
 		co_return ((status & kStatusDrq) ? IoResult::withData : IoResult::noData);
 	}
 }
@@ -223,6 +312,8 @@ async::result<void> Controller::readSectors(uint64_t sector,
 	_doorbell.raise();
 
 	co_await request.event.wait();
+	if(request.failed)
+		throw std::runtime_error("block/ata: Read failed");
 }
 
 async::result<void> Controller::writeSectors(uint64_t sector,
@@ -237,6 +328,8 @@ async::result<void> Controller::writeSectors(uint64_t sector,
 	_doorbell.raise();
 
 	co_await request.event.wait();
+	if(request.failed)
+		throw std::runtime_error("block/ata: Write failed");
 }
 
 async::result<size_t> Controller::getSize() {
@@ -300,14 +393,59 @@ async::result<bool> Controller::_detectDevice() {
 
 	printf("block/ata: detected device, model: '%s', %s 48-bit LBA\n", model, _supportsLBA48 ? "supports" : "doesn't support");
 
+	if(!_bmSpace) {
+		printf("block/ata: No bus-master IDE controller, using PIO\n");
+		co_return true;
+	}
+
+	// Pick the fastest DMA mode that the device supports.
+	// Note that we do not program controller-specific timing registers;
+	// the firmware's (or emulator's) defaults are assumed to be sufficient.
+	auto identWords = reinterpret_cast<uint16_t *>(ident_data);
+	uint8_t transferMode = 0;
+	if((identWords[53] & (1 << 2)) && (identWords[88] & 0x7F)) {
+		// Word 88 lists the supported UDMA modes.
+		int udmaMode = 0;
+		for(int i = 0; i < 7; i++) {
+			if(identWords[88] & (1 << i))
+				udmaMode = i;
+		}
+		// Modes above UDMA2 require an 80-conductor cable.
+		if(udmaMode > 2 && !(identWords[93] & (1 << 13)))
+			udmaMode = 2;
+		transferMode = 0x40 | udmaMode;
+		printf("block/ata: Using UDMA mode %d\n", udmaMode);
+	}else if(identWords[63] & 0x7) {
+		// Word 63 lists the supported multiword DMA modes.
+		int mwdmaMode = (identWords[63] & 4) ? 2 : ((identWords[63] & 2) ? 1 : 0);
+		transferMode = 0x20 | mwdmaMode;
+		printf("block/ata: Using multiword DMA mode %d\n", mwdmaMode);
+	}else{
+		printf("block/ata: Device does not support DMA, using PIO\n");
+		co_return true;
+	}
+
+	if(!(co_await _setTransferMode(transferMode))) {
+		std::cout << "\e[33m" "block/ata: Failed to set transfer mode, using PIO"
+				"\e[39m" << std::endl;
+		co_return true;
+	}
+	_useDma = true;
+
 	co_return true;
 }
 
-async::result<void> Controller::_performRequest(Request *request) {
-	if(logRequests)
-		std::cout << "block/ata: Reading/writing " << request->numSectors
-				<< " sectors from " << request->sector << std::endl;
+async::result<bool> Controller::_setTransferMode(uint8_t mode) {
+	_ioSpace.store(regs::outDevice, kDeviceLba);
+	_ioSpace.store(regs::outFeatures, kFeatureSetTransferMode);
+	_ioSpace.store(regs::outSectorCount, mode);
+	_ioSpace.store(regs::outCommand, kCommandSetFeatures);
+
+	auto ioRes = co_await _waitForBsyIrq();
+	co_return ioRes == IoResult::noData;
+}
 
+void Controller::_setupTaskFile(Request *request) {
 	assert(!(request->sector & ~((size_t(1) << 48) - 1)));
 	assert(request->numSectors <= 255);
 
@@ -325,6 +463,87 @@ async::result<void> Controller::_performRequest(Request *request) {
 	_ioSpace.store(regs::outLba1, request->sector & 0xFF);
 	_ioSpace.store(regs::outLba2, (request->sector >> 8) & 0xFF);
 	_ioSpace.store(regs::outLba3, (request->sector >> 16) & 0xFF);
+}
+
+// Returns false if the buffer cannot be reached by DMA or if the transfer failed;
+// the caller falls back to PIO then.
+async::result<bool> Controller::_performDmaRequest(Request *request) {
+	// The pinned range keeps the buffer in memory until the transfer is done.
+	helix::PinnedRange pinned{request->buffer, request->numSectors * 512};
+
+	// The PRD table only supports 32-bit physical addresses.
+	for(auto &run : pinned) {
+		if(run.address + run.length > (uintptr_t(1) << 32))
+			co_return false;
+	}
+
+	// Fill the PRD table. Entries must not cross a 64 KiB boundary.
+	size_t n = 0;
+	for(auto &run : pinned) {
+		uintptr_t address = run.address;
+		size_t remaining = run.length;
+		while(remaining) {
+			auto chunk = std::min(remaining, 0x10000 - (address & 0xFFFF));
+			assert(n < PrdTable::numEntries);
+			assert(!(address & 1));
+			_prdTable->entries[n++] = PrdEntry{
+				static_cast<uint32_t>(address),
+				static_cast<uint16_t>(chunk & 0xFFFF),
+				0
+			};
+			address += chunk;
+			remaining -= chunk;
+		}
+	}
+	assert(n);
+	_prdTable->entries[n - 1].flags = kPrdEndOfTable;
+
+	uint8_t direction = request->isWrite ? 0 : kBmCommandRead;
+	_bmSpace->store(bm_regs::command, direction);
+	_bmSpace->store(bm_regs::prdtAddress, _prdtPhysical);
+	_bmSpace->store(bm_regs::status, _bmSpace->load(bm_regs::status) | kBmStatusErr | kBmStatusIrq);
+
+	_setupTaskFile(request);
+	if(request->isWrite) {
+		_ioSpace.store(regs::outCommand, _supportsLBA48 ? kCommandWriteDmaExt : kCommandWriteDma);
+	}else{
+		_ioSpace.store(regs::outCommand, _supportsLBA48 ? kCommandReadDmaExt : kCommandReadDma);
+	}
+	_bmSpace->store(bm_regs::command, direction | kBmCommandStart);
+
+	// The device raises a single IRQ once the whole transfer is done.
+	auto ioRes = co_await _waitForBsyIrq();
+
+	auto bmStatus = _bmSpace->load(bm_regs::status);
+	_bmSpace->store(bm_regs::command, direction);
+	_bmSpace->store(bm_regs::status, bmStatus | kBmStatusErr | kBmStatusIrq);
+
+	if((bmStatus & (kBmStatusErr | kBmStatusActive)) || ioRes != IoResult::noData) {
+		// Some controllers and emulators advertise bus-mastering but do not
+		// implement it correctly. Stop using DMA and let the caller retry via PIO.
+		std::cout << "\e[31m" "block/ata: DMA transfer failed (bus-master status 0x"
+				<< std::hex << static_cast<unsigned int>(bmStatus) << std::dec
+				<< "), falling back to PIO" "\e[39m" << std::endl;
+		_useDma = false;
+		co_return false;
+	}
+	co_return true;
+}
+
+// Returns false if the device reports an error.
+async::result<bool> Controller::_performRequest(Request *request) {
+	if(logRequests)
+		std::cout << "block/ata: Reading/writing " << request->numSectors
+				<< " sectors from " << request->sector << std::endl;
+
+	if(_useDma && (co_await _performDmaRequest(request))) {
+		if(logRequests)
+			std::cout << "block/ata: DMA transfer from " << request->sector
+					<< " complete" << std::endl;
+		co_return true;
+	}
+
+	_setupTaskFile(request);
 
 	if(!request->isWrite) {
 		if (_supportsLBA48)
@@ -335,7 +554,10 @@ async::result<void> Controller::_performRequest(Request *request) {
 		// Receive the result for each sector.
 		for(size_t k = 0; k < request->numSectors; k++) {
 			auto ioRes = co_await _waitForBsyIrq();
-			assert(ioRes == IoResult::withData);
+			if(ioRes != IoResult::withData) {
+				_logPioError(request, k, ioRes);
+				co_return false;
+			}
 
 			// Read the data.
 			// TODO: Do we have to be careful with endianess here?
@@ -352,7 +574,10 @@ async::result<void> Controller::_performRequest(Request *request) {
 
 		// Write requests do not generate an IRQ for the first sector.
 		auto ioRes = co_await _pollForBsy();
-		assert(ioRes == IoResult::withData);
+		if(ioRes != IoResult::withData) {
+			_logPioError(request, 0, ioRes);
+			co_return false;
+		}
 
 		// Receive the result for each sector.
 		for(size_t k = 0; k < request->numSectors; k++) {
@@ -365,10 +590,10 @@ async::result<void> Controller::_performRequest(Request *request) {
 
 			// Wait for the device to process the sector.
 			auto ioRes = co_await _waitForBsyIrq();
-			if(k + 1 < request->numSectors) {
-				assert(ioRes == IoResult::withData);
-			}else{
-				assert(ioRes == IoResult::noData);
+			auto expected = (k + 1 < request->numSectors) ? IoResult::withData : IoResult::noData;
+			if(ioRes != expected) {
+				_logPioError(request, k, ioRes);
+				co_return false;
 			}
 		}
 	}
@@ -376,6 +601,13 @@ async::result<void> Controller::_performRequest(Request *request) {
 	if(logRequests)
 		std::cout << "block/ata: Reading/writing from " << request->sector
 				<< " complete" << std::endl;
+	co_return true;
+}
+
+void Controller::_logPioError(Request *request, size_t k, IoResult ioRes) {
+	std::cout << "\e[31m" "block/ata: PIO " << (request->isWrite ? "write" : "read")
+			<< " of sector " << (request->sector + k) << " failed (result "
+			<< static_cast<int>(ioRes) << ")" "\e[39m" << std::endl;
 }
 
 std::vector<std::shared_ptr<Controller>> globalControllers;
@@ -393,10 +625,19 @@ async::detached bindController(mbus::Entity entity) {
 	auto altBar = co_await device.accessBar(1);
 	auto irq = co_await device.accessIrq();
 
+	// BAR 4 holds the bus-master IDE registers, if the controller supports DMA.
+	std::optional<uint16_t> bmOffset;
+	helix::UniqueDescriptor bmBar;
+	if(info.barInfo[4].ioType == protocols::hw::IoType::kIoTypePort) {
+		bmOffset = info.barInfo[4].address;
+		bmBar = co_await device.accessBar(4);
+		co_await device.enableBusmaster();
+	}
+
 	auto controller = std::make_shared<Controller>(entity.getId(),
 			info.barInfo[0].address, info.barInfo[1].address,
 			std::move(mainBar), std::move(altBar),
-			std::move(irq));
+			std::move(irq), bmOffset, std::move(bmBar));
 	controller->run();
 	globalControllers.push_back(std::move(controller));
 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <arch/bit.hpp>
 #include <helix/memory.hpp>
 #include <unistd.h>
@@ -10,71 +11,56 @@ void Command::setupBuffer(arch::dma_buffer_view view) {
 
 	static size_t pageSize = getpagesize();
 
-	uintptr_t virtStart = reinterpret_cast<uintptr_t>(view.data());
-	auto offset = virtStart % pageSize;
-
-	if (offset + view.size() <= pageSize * 2) {
-		// Inline
-		command_.common.dataPtr.prp1 = convert_endian<endian::little, endian::native>(
-			helix::ptrToPhysical(view.data()));
-
-		auto firstPrpLen = pageSize - offset;
-		if (view.size() > firstPrpLen) {
-			command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
-				helix::ptrToPhysical(view.subview(firstPrpLen).data()));
+	// Translate (and pin) the whole buffer with a single syscall.
+	pinnedBuffer_ = helix::PinnedRange{view.data(), view.size()};
+
+	// Collect the physical address of each page that the buffer touches.
+	// Only the first address can have a non-zero page offset.
+	std::vector<uint64_t> pages;
+	for (auto &run : pinnedBuffer_) {
+		uintptr_t physical = run.address;
+		size_t remaining = run.length;
+		while (remaining) {
+			auto chunk = std::min(remaining, pageSize - (physical & (pageSize - 1)));
+			pages.push_back(physical);
+			physical += chunk;
+			remaining -= chunk;
 		}
-
-		return;
 	}
+	assert(!pages.empty());
 
-	uintptr_t prp1, prp2;
-	auto size = view.size();
-
-	prp1 = helix::addressToPhysical(virtStart);
+	command_.common.dataPtr.prp1 = convert_endian<endian::little, endian::native>(pages[0]);
 
-	if (offset + view.size() <= pageSize) {
-		command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-		command_.readWrite.dataPtr.prp2 = 0;
+	if (pages.size() == 1) {
+		command_.common.dataPtr.prp2 = 0;
 		return;
 	}
-	size -= pageSize - offset;
-	virtStart += pageSize - offset;
 
-	if (size <= pageSize) {
-		command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-		command_.readWrite.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
-			helix::addressToPhysical(virtStart));
+	if (pages.size() == 2) {
+		command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(pages[1]);
 		return;
 	}
 
-	auto prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
-	auto *prpList = prpObj.data();
+	// Otherwise, PRP2 points to a PRP list. If a list is full, its last entry
+	// points to the next list.
+	size_t entriesPerList = pageSize >> 3;
 
-	prp2 = helix::ptrToPhysical(prpList);
+	auto prpObj = arch::dma_array<uint64_t>{nullptr, entriesPerList};
+	auto *prpList = prpObj.data();
+	command_.common.dataPtr.prp2 = convert_endian<endian::little, endian::native>(
+		helix::ptrToPhysical(prpList));
 	prpLists.push_back(std::move(prpObj));
 
-	int i = 0;
-	for (;;) {
-		if (i == pageSize >> 3) {
-			auto *oldPrpList = prpList;
-			prpObj = arch::dma_array<uint64_t>{nullptr, pageSize >> 3};
+	size_t i = 0;
+	for (size_t k = 1; k < pages.size(); k++) {
+		if (i == entriesPerList - 1 && k + 1 < pages.size()) {
+			prpObj = arch::dma_array<uint64_t>{nullptr, entriesPerList};
+			prpList[i] = convert_endian<endian::little, endian::native>(
+				helix::ptrToPhysical(prpObj.data()));
 			prpList = prpObj.data();
 			prpLists.push_back(std::move(prpObj));
-
-			prpList[0] = oldPrpList[i - 1];
-			oldPrpList[i - 1] = convert_endian<endian::little, endian::native>(
-				helix::ptrToPhysical(prpList));
-			i = 1;
+			i = 0;
 		}
-		prpList[i++] = convert_endian<endian::little, endian::native>(
-			helix::addressToPhysical(virtStart));
-		virtStart += pageSize;
-
-		if (size <= pageSize)
-			break;
-		size -= pageSize;
+		prpList[i++] = convert_endian<endian::little, endian::native>(pages[k]);
 	}
-
-	command_.readWrite.dataPtr.prp1 = convert_endian<endian::little, endian::native>(prp1);
-	command_.readWrite.dataPtr.prp2 = convert_endian<endian::little, endian::native>(prp2);
 }
@@ -4,6 +4,7 @@
 #include <async/promise.hpp>
 #include <frg/std_compat.hpp>
 #include <arch/dma_structs.hpp>
+#include <helix/memory.hpp>
 
 #include "spec.hpp"
 
@@ -22,12 +23,22 @@ struct Command {
 		return promise_.get_future();
 	}
 
+	// The flag is set on completion; used to poll for completion of the command.
+	void setCompletionFlag(bool *flag) {
+		completionFlag_ = flag;
+	}
+
 	void complete(uint16_t status, spec::CompletionEntry::Result result) {
+		if (completionFlag_)
+			*completionFlag_ = true;
 		promise_.set_value(Result{status, result});
 	}
 
 private:
 	spec::Command command_;
+	bool *completionFlag_ = nullptr;
 	async::promise<Result, frg::stl_allocator> promise_;
 	std::vector<arch::dma_array<uint64_t>> prpLists;
+	// Keeps the data buffer pinned until the command is destructed.
+	helix::PinnedRange pinnedBuffer_;
 };
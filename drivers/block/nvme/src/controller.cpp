@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <arch/bit.hpp>
 #include <helix/timer.hpp>
+#include <iostream>
 
 #include "controller.hpp"
 
@@ -17,6 +19,7 @@ namespace flags {
 	namespace cap {
 		constexpr arch::field<uint64_t, uint16_t> mqes{0, 16};
 		constexpr arch::field<uint64_t, uint8_t> dstrd{32, 4};
+		constexpr arch::field<uint64_t, uint8_t> mpsmin{48, 4};
 	} // namespace cap
 
 	namespace vs {
@@ -37,15 +40,20 @@ namespace flags {
 } // namespace flags
 
 Controller::Controller(int64_t parentId, protocols::hw::Device hwDevice, helix::Mapping hbaRegs,
-					   helix::UniqueDescriptor, helix::UniqueDescriptor irq)
+					   helix::UniqueDescriptor, std::vector<helix::UniqueDescriptor> irqs,
+					   bool useMsis)
 	: hwDevice_{std::move(hwDevice)}, regsMapping_{std::move(hbaRegs)},
-	  regs_{regsMapping_.get()}, irq_{std::move(irq)}, parentId_{parentId} {
+	  regs_{regsMapping_.get()}, irqs_{std::move(irqs)}, useMsis_{useMsis},
+	  parentId_{parentId} {
+	assert(!irqs_.empty());
 }
 
 async::detached Controller::run() {
-	co_await hwDevice_.enableBusIrq();
+	if (!useMsis_)
+		co_await hwDevice_.enableBusIrq();
 
-	handleIrqs();
+	for (unsigned int i = 0; i < irqs_.size(); i++)
+		handleIrqs(i);
 
 	co_await reset();
 	co_await scanNamespaces();
@@ -54,23 +62,26 @@ async::detached Controller::run() {
 		ns->run();
 }
 
-async::detached Controller::handleIrqs() {
-	irqSequence_ = 0;
+async::detached Controller::handleIrqs(unsigned int vector) {
+	auto &irq = irqs_[vector];
+	uint64_t sequence = 0;
 
 	while (true) {
-		auto await = co_await helix_ng::awaitEvent(irq_, irqSequence_);
+		auto await = co_await helix_ng::awaitEvent(irq, sequence);
 		HEL_CHECK(await.error());
-		irqSequence_ = await.sequence();
+		sequence = await.sequence();
 
 		int found = 0;
 		for (auto &q : activeQueues_) {
-			found |= q->handleIrq();
+			if (q->getIrqVector() == vector)
+				found |= q->handleIrq();
 		}
 
-		if (found) {
-			HEL_CHECK(helAcknowledgeIrq(irq_.getHandle(), kHelAckAcknowledge, irqSequence_));
+		// MSIs are edge-triggered and never shared; acknowledge them unconditionally.
+		if (found || useMsis_) {
+			HEL_CHECK(helAcknowledgeIrq(irq.getHandle(), kHelAckAcknowledge, sequence));
 		} else {
-			HEL_CHECK(helAcknowledgeIrq(irq_.getHandle(), kHelAckNack, irqSequence_));
+			HEL_CHECK(helAcknowledgeIrq(irq.getHandle(), kHelAckNack, sequence));
 		}
 	}
 }
@@ -104,6 +115,7 @@ async::result<void> Controller::reset() {
 
 	queueDepth_ = std::min((cap & flags::cap::mqes) + 1, IO_QUEUE_DEPTH);
 	dbStride_ = 1 << (cap & flags::cap::dstrd);
+	minPageSize_ = size_t{1} << (12 + (cap & flags::cap::mpsmin));
 
 	version_ = regs_.load(regs::vs);
 
@@ -122,15 +134,54 @@ async::result<void> Controller::reset() {
 
 	co_await enable();
 
-	auto ioQ = std::make_unique<Queue>(1, queueDepth_, regs_.subspace(doorbellsOffset + 1 * 8 * dbStride_));
-	ioQ->init();
+	// Allocate one I/O queue per interrupt vector (i.e., per CPU if MSI-X is available).
+	// The admin queue shares vector 0 with the first I/O queue.
+	auto numIoQueues = co_await requestIoQueues(irqs_.size());
 
-	if (co_await setupIoQueue(ioQ.get())) {
+	for (unsigned int i = 1; i <= numIoQueues; i++) {
+		auto ioQ = std::make_unique<Queue>(i, queueDepth_,
+				regs_.subspace(doorbellsOffset + i * 8 * dbStride_), (i - 1) % irqs_.size());
+		ioQ->init();
+
+		if (!(co_await setupIoQueue(ioQ.get())))
+			break;
 		ioQ->run();
+		ioQueues_.push_back(ioQ.get());
 		activeQueues_.push_back(std::move(ioQ));
 	}
 
 	assert(activeQueues_.size() >= 2 && "At least need one IO queue");
+	std::cout << "block/nvme: Using " << ioQueues_.size() << " I/O queues on "
+			<< irqs_.size() << (useMsis_ ? " MSI" : " legacy") << " vector(s)" << std::endl;
+}
+
+// Returns the number of I/O queue pairs that the controller granted us.
+async::result<unsigned int> Controller::requestIoQueues(unsigned int count) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	auto &adminQ = activeQueues_.front();
+	auto cmd = std::make_unique<Command>();
+	auto &cmdBuf = cmd->getCommandBuffer().setFeatures;
+
+	// Both counts are 0's based.
+	uint32_t numQueues = ((count - 1) << 16) | (count - 1);
+
+	cmdBuf.opcode = spec::kSetFeatures;
+	cmdBuf.fid = convert_endian<endian::little, endian::native>((uint32_t)spec::kNumberOfQueues);
+	cmdBuf.dword11 = convert_endian<endian::little, endian::native>(numQueues);
+
+	auto res = co_await adminQ->submitCommand(std::move(cmd));
+	if (res.first != 0) {
+		std::cout << "\e[33mblock/nvme: Failed to set number of queues, status "
+				<< res.first << "\e[39m" << std::endl;
+		co_return 1;
+	}
+
+	auto granted = convert_endian<endian::little>(res.second.u32);
+	unsigned int numSQs = (granted & 0xFFFF) + 1;
+	unsigned int numCQs = (granted >> 16) + 1;
+	co_return std::min({count, numSQs, numCQs});
 }
 
 async::result<bool> Controller::setupIoQueue(Queue *q) {
@@ -160,7 +211,7 @@ async::result<Command::Result> Controller::createCQ(Queue *q) {
 	cmdBuf.cqid = convert_endian<endian::little, endian::native>((uint16_t)q->getQueueId());
 	cmdBuf.qSize = convert_endian<endian::little, endian::native>((uint16_t)q->getQueueDepth() - 1);
 	cmdBuf.cqFlags = convert_endian<endian::little, endian::native>((uint16_t)flags);
-	cmdBuf.irqVector = 0; // TODO: set to MSI vector
+	cmdBuf.irqVector = convert_endian<endian::little, endian::native>((uint16_t)q->getIrqVector());
 
 	return adminQ->submitCommand(std::move(cmd));
 }
@@ -241,6 +292,10 @@ async::result<void> Controller::scanNamespaces() {
 
 	nn = convert_endian<endian::little>(idCtrl.nn);
 
+	// MDTS is given in units of the minimum page size; zero means that it is unlimited.
+	if (idCtrl.mdts)
+		maxTransferSize_ = minPageSize_ << idCtrl.mdts;
+
 	if (version_ >= flags::vs::version(1, 1, 0)) {
 		auto nsList = arch::dma_array<uint32_t>{nullptr, 1024};
 		int numLists = (nn + 1023) >> 10;
@@ -288,8 +343,12 @@ async::result<void> Controller::createNamespace(unsigned int nsid) {
 	activeNamespaces_.push_back(std::move(ns));
 }
 
-async::result<Command::Result> Controller::submitIoCommand(std::unique_ptr<Command> cmd) {
-	auto &ioQ = activeQueues_.back();
+async::result<Command::Result> Controller::submitIoCommand(std::unique_ptr<Command> cmd,
+		uint64_t pollNs, bool *polled) {
+	// All submissions originate from the same thread; spread them over the queues
+	// (and hence over the interrupt vectors).
+	auto ioQ = ioQueues_[nextIoQueue_];
+	nextIoQueue_ = (nextIoQueue_ + 1) % ioQueues_.size();
 
-	return ioQ->submitCommand(std::move(cmd));
+	return ioQ->submitCommand(std::move(cmd), pollNs, polled);
 }
@@ -10,33 +10,51 @@
 
 struct Controller {
 	Controller(int64_t parentId, protocols::hw::Device hwDevice, helix::Mapping hbaRegs,
-			   helix::UniqueDescriptor ahciBar, helix::UniqueDescriptor irq);
+			   helix::UniqueDescriptor ahciBar, std::vector<helix::UniqueDescriptor> irqs,
+			   bool useMsis);
 
 	async::detached run();
 
-	async::result<Command::Result> submitIoCommand(std::unique_ptr<Command> cmd);
+	async::result<Command::Result> submitIoCommand(std::unique_ptr<Command> cmd,
+			uint64_t pollNs = 0, bool *polled = nullptr);
 
 	inline int64_t getParentId() const {
 		return parentId_;
 	}
+
+	// Maximal size of a single transfer in bytes (zero if unlimited).
+	inline size_t getMaxTransferSize() const {
+		return maxTransferSize_;
+	}
+
+	inline unsigned int getQueueDepth() const {
+		return queueDepth_;
+	}
 private:
 	static constexpr int IO_QUEUE_DEPTH = 1024;
 
 	protocols::hw::Device hwDevice_;
 	helix::Mapping regsMapping_;
 	arch::mem_space regs_;
-	helix::UniqueDescriptor irq_;
+	// With MSI(-X), vector i is delivered to CPU i.
+	std::vector<helix::UniqueDescriptor> irqs_;
+	bool useMsis_;
 
+	// Contains the admin queue, followed by the I/O queues.
 	std::vector<std::unique_ptr<Queue>> activeQueues_;
+	// I/O queues, in the order of their interrupt vectors.
+	std::vector<Queue *> ioQueues_;
+	// The driver runs on a single thread; submissions are distributed round-robin.
+	size_t nextIoQueue_ = 0;
 	std::vector<std::unique_ptr<Namespace>> activeNamespaces_;
 
 	int64_t parentId_;
 	unsigned int queueDepth_;
 	uint32_t dbStride_;
+	size_t minPageSize_;
+	size_t maxTransferSize_ = 0;
 	uint32_t version_;
 
-	uint64_t irqSequence_;
-
 	async::result<void> reset();
 	async::result<void> scanNamespaces();
 
@@ -44,6 +62,7 @@ private:
 	async::result<void> enable();
 	async::result<void> disable();
 
+	async::result<unsigned int> requestIoQueues(unsigned int count);
 	async::result<bool> setupIoQueue(Queue *q);
 	async::result<Command::Result> createCQ(Queue *q);
 	async::result<Command::Result> createSQ(Queue *q);
@@ -54,5 +73,5 @@ private:
 
 	async::result<void> createNamespace(unsigned int nsid);
 
-	async::detached handleIrqs();
+	async::detached handleIrqs(unsigned int vector);
 };
@@ -1,10 +1,123 @@
+#include <algorithm>
+#include <charconv>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
 
+#include <async/oneshot-event.hpp>
+#include <bragi/helpers-std.hpp>
+#include <helix/ipc.hpp>
+#include <kerncfg.bragi.hpp>
 #include <protocols/mbus/client.hpp>
 #include <protocols/hw/client.hpp>
 
 #include "controller.hpp"
 
+namespace {
+
+// Upper bound on the number of MSI vectors (and hence I/O queues) per controller.
+constexpr unsigned int maxMsiVectors = 16;
+
+// Polling blocks the driver's event loop, hence we bound the poll timeout.
+constexpr uint64_t maxPollNs = 100'000;
+
+// Parses an unsigned decimal number that spans all of str.
+template<typename T>
+std::optional<T> parseNumber(std::string_view str) {
+	T value;
+	auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+	if (ec != std::errc{} || ptr != str.data() + str.size())
+		return std::nullopt;
+	return value;
+}
+
+} // namespace
+
+// Parses options of the form nvme.<option>=<value> from the kernel command line.
+async::result<void> parseCmdline() {
+	auto root = co_await mbus::Instance::global().getRoot();
+
+	auto filter = mbus::Conjunction({
+		mbus::EqualsFilter("class", "kerncfg")
+	});
+
+	async::oneshot_event foundKerncfg;
+	helix::UniqueLane kerncfgLane;
+	auto handler = mbus::ObserverHandler{}
+	.withAttach([&] (mbus::Entity entity, mbus::Properties) -> async::detached {
+		kerncfgLane = helix::UniqueLane(co_await entity.bind());
+		foundKerncfg.raise();
+	});
+
+	co_await root.linkObserver(std::move(filter), std::move(handler));
+	co_await foundKerncfg.wait();
+
+	managarm::kerncfg::GetCmdlineRequest req;
+	auto [offer, sendReq, recvResp, recvCmdline] =
+		co_await helix_ng::exchangeMsgs(
+			kerncfgLane,
+			helix_ng::offer(
+				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::recvInline(),
+				helix_ng::recvInline()
+			)
+		);
+	HEL_CHECK(offer.error());
+	HEL_CHECK(sendReq.error());
+	HEL_CHECK(recvResp.error());
+	HEL_CHECK(recvCmdline.error());
+
+	auto resp = *bragi::parse_head_only<managarm::kerncfg::SvrResponse>(recvResp);
+	assert(resp.error() == managarm::kerncfg::Error::SUCCESS);
+
+	std::istringstream cmdline{std::string{reinterpret_cast<const char *>(recvCmdline.data()),
+			recvCmdline.length()}};
+	std::string option;
+	while (cmdline >> option) {
+		// nvme.poll_ns=<ns> applies to all namespaces,
+		// nvme.poll_ns.<nsid>=<ns> to the namespaces with the given ID.
+		const std::string_view pollOption = "nvme.poll_ns";
+		if (!option.starts_with(pollOption))
+			continue;
+
+		std::string_view rest{option};
+		rest.remove_prefix(pollOption.size());
+		auto equals = rest.find('=');
+		if (equals == std::string_view::npos) {
+			std::cout << "block/nvme: Ignoring malformed option " << option << std::endl;
+			continue;
+		}
+
+		std::optional<unsigned int> nsid;
+		if (equals) {
+			if (rest[0] == '.')
+				nsid = parseNumber<unsigned int>(rest.substr(1, equals - 1));
+			if (!nsid) {
+				std::cout << "block/nvme: Ignoring malformed option " << option << std::endl;
+				continue;
+			}
+		}
+
+		auto value = parseNumber<uint64_t>(rest.substr(equals + 1));
+		if (!value) {
+			std::cout << "block/nvme: Ignoring malformed option " << option << std::endl;
+			continue;
+		}
+
+		auto pollNs = std::min(*value, maxPollNs);
+		if (nsid) {
+			Namespace::setPollTimeout(*nsid, pollNs);
+			std::cout << "block/nvme: Polling for up to " << pollNs
+					<< " ns on namespace " << *nsid << std::endl;
+		} else {
+			Namespace::setDefaultPollTimeout(pollNs);
+			std::cout << "block/nvme: Polling for up to " << pollNs << " ns" << std::endl;
+		}
+	}
+}
+
 std::vector<std::unique_ptr<Controller>> globalControllers;
 
 async::detached bindController(mbus::Entity entity) {
@@ -14,12 +127,27 @@ async::detached bindController(mbus::Entity entity) {
 	auto &barInfo = info.barInfo[0];
 	assert(barInfo.ioType == protocols::hw::IoType::kIoTypeMemory);
 	auto bar0 = co_await device.accessBar(0);
-	auto irq = co_await device.accessIrq();
+
+	// Steer MSI vector i to CPU i. The kernel refuses CPUs that do not exist,
+	// so we end up with (at most) one vector per CPU.
+	std::vector<helix::UniqueDescriptor> irqs;
+	for (unsigned int i = 0; i < std::min(info.numMsis, maxMsiVectors); i++) {
+		auto irq = co_await device.tryInstallMsi(i, i);
+		if (!irq)
+			break;
+		irqs.push_back(std::move(irq));
+	}
+
+	bool useMsis = !irqs.empty();
+	if (useMsis)
+		co_await device.enableMsi();
+	else
+		irqs.push_back(co_await device.accessIrq());
 
 	helix::Mapping mapping{bar0, barInfo.offset, barInfo.length};
 
 	auto controller = std::make_unique<Controller>(entity.getId(), std::move(device), std::move(mapping),
-			   std::move(bar0), std::move(irq));
+			   std::move(bar0), std::move(irqs), useMsis);
 	controller->run();
 	globalControllers.push_back(std::move(controller));
 }
@@ -42,9 +170,15 @@ async::detached observeControllers() {
 	co_await root.linkObserver(std::move(filter), std::move(handler));
 }
 
+async::detached runDriver() {
+	// Options need to be known before namespaces are created.
+	co_await parseCmdline();
+	observeControllers();
+}
+
 int main() {
 	std::cout << "block/nvme: Starting driver\n";
 
-	observeControllers();
+	runDriver();
 	async::run_forever(helix::currentDispatcher);
 }
@@ -1,11 +1,66 @@
+#include <algorithm>
 #include <arch/bit.hpp>
+#include <helix/timer.hpp>
+#include <string>
+#include <unordered_map>
 
 #include "namespace.hpp"
 #include "controller.hpp"
 
+namespace {
+	constexpr bool logLatencies = false;
+
+	// Print the latency histograms every logInterval commands.
+	constexpr uint64_t logInterval = 1 << 16;
+
+	// Default poll timeout (in ns) of all namespaces; zero means that
+	// completions are only signaled by interrupts.
+	uint64_t defaultPollNs = 0;
+	// Poll timeouts of individual namespaces, by namespace ID.
+	std::unordered_map<unsigned int, uint64_t> namespacePollNs;
+}
+
+void Namespace::setDefaultPollTimeout(uint64_t pollNs) {
+	defaultPollNs = pollNs;
+}
+
+void Namespace::setPollTimeout(unsigned int nsid, uint64_t pollNs) {
+	namespacePollNs[nsid] = pollNs;
+}
+
 Namespace::Namespace(Controller *controller, unsigned int nsid, int lbaShift)
 	: BlockDevice{(size_t)1 << lbaShift, controller->getParentId()}, controller_(controller), nsid_(nsid),
-	  lbaShift_(lbaShift) {
+	  lbaShift_(lbaShift), pollNs_(defaultPollNs) {
+	if (auto it = namespacePollNs.find(nsid); it != namespacePollNs.end())
+		pollNs_ = it->second;
+
+	// The number of logical blocks of read and write commands is a 16-bit field (0's based).
+	maxSectorsPerRequest = 0x10000;
+	if (auto maxTransfer = controller->getMaxTransferSize(); maxTransfer)
+		maxSectorsPerRequest = std::min(maxSectorsPerRequest, maxTransfer >> lbaShift);
+	maxInflightRequests = controller->getQueueDepth();
+}
+
+async::result<Command::Result> Namespace::submit_(std::unique_ptr<Command> cmd) {
+	uint64_t startNs, endNs;
+	HEL_CHECK(helGetClock(&startNs));
+
+	bool polled = false;
+	auto result = co_await controller_->submitIoCommand(std::move(cmd), pollNs_, &polled);
+
+	HEL_CHECK(helGetClock(&endNs));
+	if (polled)
+		polledLatency_.record(endNs - startNs);
+	else
+		irqLatency_.record(endNs - startNs);
+
+	if (logLatencies && !(++numCompleted_ % logInterval)) {
+		auto name = "nvme namespace " + std::to_string(nsid_);
+		polledLatency_.dump(name.c_str(), "polled");
+		irqLatency_.dump(name.c_str(), "interrupt");
+	}
+
+	co_return result;
 }
 
 async::detached Namespace::run() {
@@ -27,7 +82,7 @@ async::result<void> Namespace::readSectors(uint64_t sector, void *buffer, size_t
 	cmdBuf.length = convert_endian<endian::little, endian::native>((uint16_t)numSectors - 1);
 	cmd->setupBuffer(arch::dma_buffer_view{nullptr, buffer, numSectors << lbaShift_});
 
-	co_await controller_->submitIoCommand(std::move(cmd));
+	co_await submit_(std::move(cmd));
 }
 
 async::result<void> Namespace::writeSectors(uint64_t sector, const void *buffer, size_t numSectors) {
@@ -43,7 +98,7 @@ async::result<void> Namespace::writeSectors(uint64_t sector, const void *buffer,
 	cmdBuf.length = convert_endian<endian::little, endian::native>((uint16_t)numSectors - 1);
 	cmd->setupBuffer(arch::dma_buffer_view{nullptr, (char *)buffer, numSectors << lbaShift_});
 
-	co_await controller_->submitIoCommand(std::move(cmd));
+	co_await submit_(std::move(cmd));
 }
 
 async::result<size_t> Namespace::getSize() {
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <memory>
+
 #include <async/result.hpp>
 #include <blockfs.hpp>
 
+#include "command.hpp"
+
 struct Controller;
 
 struct Namespace : blockfs::BlockDevice {
@@ -14,8 +18,25 @@ struct Namespace : blockfs::BlockDevice {
 	async::result<void> writeSectors(uint64_t sector, const void *buf, size_t numSectors) override;
 	async::result<size_t> getSize() override;
 
+	// Hybrid polling: after submission, spin on the CQ for up to the poll timeout
+	// before waiting for the completion interrupt. Zero disables polling.
+
+	// Sets the poll timeout of namespaces that are created afterwards
+	// (set by the nvme.poll_ns= command line option).
+	static void setDefaultPollTimeout(uint64_t pollNs);
+	// Overrides the default for namespaces with the given ID
+	// (set by the nvme.poll_ns.<nsid>= command line option).
+	static void setPollTimeout(unsigned int nsid, uint64_t pollNs);
+
 private:
+	async::result<Command::Result> submit_(std::unique_ptr<Command> cmd);
+
 	Controller *controller_;
 	unsigned int nsid_;
 	int lbaShift_;
+	uint64_t pollNs_ = 0;
+
+	uint64_t numCompleted_ = 0;
+	blockfs::LatencyHistogram polledLatency_;
+	blockfs::LatencyHistogram irqLatency_;
 };
@@ -1,12 +1,15 @@
 #include <arch/bit.hpp>
 #include <helix/ipc.hpp>
 #include <helix/memory.hpp>
+#include <helix/timer.hpp>
 
 #include "queue.hpp"
 #include "spec.hpp"
 
-Queue::Queue(unsigned int qid, unsigned int depth, arch::mem_space doorbells)
-	: qid_(qid), depth_(depth), doorbells_(doorbells), sqTail_(0), cqHead_(0), cqPhase_(1) {
+Queue::Queue(unsigned int qid, unsigned int depth, arch::mem_space doorbells,
+		unsigned int irqVector)
+	: qid_(qid), depth_(depth), irqVector_(irqVector), doorbells_(doorbells),
+	  sqTail_(0), cqHead_(0), cqPhase_(1), commandsInFlight_(0) {
 	queuedCmds_.resize(depth);
 }
 
@@ -116,9 +119,34 @@ async::result<void> Queue::submitCommandToDevice(std::unique_ptr<Command> cmd) {
 	commandsInFlight_++;
 }
 
-async::result<Command::Result> Queue::submitCommand(std::unique_ptr<Command> cmd) {
+async::result<Command::Result> Queue::submitCommand(std::unique_ptr<Command> cmd,
+		uint64_t pollNs, bool *polled) {
 	auto future = cmd->getFuture();
 
+	bool completed = false;
+	if (pollNs)
+		cmd->setCompletionFlag(&completed);
+
+	// If a slot is free, this submits the command to the device synchronously.
 	pendingCmdQueue_.put(std::move(cmd));
+
+	// Spinning blocks the event loop, including the submission of other commands.
+	// Hence, we only poll if this is the only command in flight; with a deeper
+	// queue, the interrupt path is not the bottleneck anyway.
+	if (commandsInFlight_ != 1)
+		pollNs = 0;
+
+	if (pollNs) {
+		// Spin on the phase bit of the CQ. This avoids the latency of the
+		// interrupt path (at the cost of CPU time); if the command does not
+		// complete in time, we fall back to the interrupt.
+		helix::busyWaitUntil(pollNs, [&] {
+			handleIrq();
+			return completed;
+		});
+		if (polled)
+			*polled = completed;
+	}
+
 	co_return *(co_await future.get());
 }
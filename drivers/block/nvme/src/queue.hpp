@@ -11,7 +11,8 @@
 #include "spec.hpp"
 
 struct Queue {
-	Queue(unsigned int index, unsigned int depth, arch::mem_space doorbells);
+	Queue(unsigned int index, unsigned int depth, arch::mem_space doorbells,
+			unsigned int irqVector = 0);
 
 	void init();
 	async::detached run();
@@ -22,6 +23,10 @@ struct Queue {
 	unsigned int getQueueDepth() const {
 		return depth_;
 	}
+	// Index of the interrupt vector that this queue's CQ signals.
+	unsigned int getIrqVector() const {
+		return irqVector_;
+	}
 
 	uintptr_t getCqPhysAddr() const {
 		return cqPhys_;
@@ -30,13 +35,18 @@ struct Queue {
 		return sqPhys_;
 	}
 
-	async::result<Command::Result> submitCommand(std::unique_ptr<Command> cmd);
+	// If pollNs is non-zero, spin on the CQ for up to pollNs after submission before
+	// waiting for the interrupt. polled (if non-null) is set if polling found the completion.
+	async::result<Command::Result> submitCommand(std::unique_ptr<Command> cmd,
+			uint64_t pollNs = 0, bool *polled = nullptr);
 
+	// Processes all new CQ entries. Called on interrupts and while polling.
 	int handleIrq();
 
 private:
 	unsigned int qid_;
 	unsigned int depth_;
+	unsigned int irqVector_;
 	arch::mem_space doorbells_;
 	spec::CompletionEntry *cqes_;
 	void *sqCmds_;
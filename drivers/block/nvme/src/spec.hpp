@@ -13,6 +13,11 @@ enum AdminOpcode {
 	kDeleteCQ = 0x4,
 	kCreateCQ = 0x5,
 	kIdentify = 0x6,
+	kSetFeatures = 0x9,
+};
+
+enum FeatureId {
+	kNumberOfQueues = 0x07,
 };
 
 enum CommandFlags {
@@ -258,12 +263,25 @@ struct IdentifyCommand {
 	uint32_t __reserved11[5];
 };
 
+struct SetFeaturesCommand {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t commandId;
+	uint32_t nsid;
+	uint64_t __reserved2[2];
+	DataPointer dataPtr;
+	uint32_t fid;
+	uint32_t dword11;
+	uint32_t __reserved12[4];
+};
+
 union Command {
 	CommonCommand common;
 	ReadWriteCommand readWrite;
 	CreateCQCommand createCQ;
 	CreateSQCommand createSQ;
 	IdentifyCommand identify;
+	SetFeaturesCommand setFeatures;
 };
 static_assert(sizeof(Command) == 64);
 
@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <algorithm>
 #include <iostream>
 
 #include "block.hpp"
@@ -9,123 +10,253 @@ namespace virtio {
 
 static bool logInitiateRetire = false;
 
+// Maximal number of virtqs that we set up.
+static constexpr unsigned int maxQueues = 16;
+
 // --------------------------------------------------------
 // UserRequest
 // --------------------------------------------------------
 
-UserRequest::UserRequest(bool write_, uint64_t sector_, void *buffer_, size_t num_sectors_)
-: write{write_}, sector{sector_}, buffer{buffer_}, numSectors{num_sectors_} { }
+UserRequest::UserRequest(uint32_t type_, uint64_t sector_, void *buffer_, size_t num_sectors_)
+: type{type_}, sector{sector_}, buffer{buffer_}, numSectors{num_sectors_} { }
 
 // --------------------------------------------------------
 // Device
 // --------------------------------------------------------
 
+Device::RequestQueue::RequestQueue(virtio_core::Queue *queue_)
+: queue{queue_},
+		virtRequestBuffer{new VirtRequest[queue_->numDescriptors()]},
+		statusBuffer{new uint8_t[queue_->numDescriptors()]},
+		segmentBuffer{new SegmentBatch[queue_->numDescriptors()]} {
+	// natural alignment makes sure that request headers do not cross page boundaries
+	assert((uintptr_t)virtRequestBuffer.get() % sizeof(VirtRequest) == 0);
+	assert((uintptr_t)segmentBuffer.get() % sizeof(SegmentBatch) == 0);
+}
+
 Device::Device(std::unique_ptr<virtio_core::Transport> transport, int64_t parent_id)
-: blockfs::BlockDevice{512, parent_id}, _transport{std::move(transport)},
-		_requestQueue{nullptr}, _size{0} { }
+: blockfs::BlockDevice{512, parent_id}, _transport{std::move(transport)}, _size{0} { }
 
 void Device::runDevice() {
+	bool multiQueue = false;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_MQ)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_MQ);
+		multiQueue = true;
+	}
+	bool discard = false;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_DISCARD)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_DISCARD);
+		discard = true;
+	}
+	bool writeZeroes = false;
+	if(_transport->checkDeviceFeature(VIRTIO_BLK_F_WRITE_ZEROES)) {
+		_transport->acknowledgeDriverFeature(VIRTIO_BLK_F_WRITE_ZEROES);
+		writeZeroes = true;
+	}
 	_transport->finalizeFeatures();
-	_transport->claimQueues(1);
-	_requestQueue = _transport->setupQueue(0);
+
+	// Use one virtq per interrupt vector (i.e., per CPU), capped by the device.
+	unsigned int numQueues = 1;
+	if(multiQueue) {
+		numQueues = std::min({static_cast<unsigned int>(_transport->space().load(spec::regs::numQueues)),
+				_transport->numQueueVectors(), maxQueues});
+		numQueues = std::max(numQueues, 1U);
+	}
+
+	_transport->claimQueues(numQueues);
+	for(unsigned int i = 0; i < numQueues; i++)
+		_queues.push_back(std::make_unique<RequestQueue>(_transport->setupQueue(i)));
+
+	if(discard) {
+		_maxDiscardSectors = _transport->space().load(spec::regs::maxDiscardSectors);
+		_maxDiscardSegments = std::clamp(size_t{_transport->space().load(spec::regs::maxDiscardSegments)},
+				size_t{1}, maxBatchSegments);
+	}
+	if(writeZeroes) {
+		_maxWriteZeroesSectors = _transport->space().load(spec::regs::maxWriteZeroesSectors);
+		_maxWriteZeroesSegments = std::clamp(size_t{_transport->space().load(spec::regs::maxWriteZeroesSegments)},
+				size_t{1}, maxBatchSegments);
+	}
 
 	auto size = static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[0]))
 			| (static_cast<uint64_t>(_transport->space().load(spec::regs::capacity[1])) << 32);
-	std::cout << "virtio: Disk size: " << size << " sectors" << std::endl;
+	std::cout << "virtio: Disk size: " << size << " sectors, " << numQueues << " queue(s)"
+			<< (_maxDiscardSectors ? ", discard" : "")
+			<< (_maxWriteZeroesSectors ? ", write zeroes" : "") << std::endl;
 	_size = size;
 
 	_transport->runDevice();
 
-	// perform device specific setup
-	virtRequestBuffer = new VirtRequest[_requestQueue->numDescriptors()];
-	statusBuffer = new uint8_t[_requestQueue->numDescriptors()];
-
-	// natural alignment makes sure that request headers do not cross page boundaries
-	assert((uintptr_t)virtRequestBuffer % sizeof(VirtRequest) == 0);
+	// Transfers are split to the size of the virtqs (see _submitTransfer()), but the
+	// number of requests that the virtqs can hold is limited: each request needs
+	// at least three descriptors.
+	maxInflightRequests = 0;
+	for(auto &rq : _queues)
+		maxInflightRequests += rq->queue->numDescriptors() / 3;
 
 	// setup an interrupt for the device
-	_processRequests();
+	for(auto &rq : _queues)
+		_processRequests(rq.get());
 
 	blockfs::runDevice(this);
 }
 
-async::result<void> Device::readSectors(uint64_t sector,
+auto Device::_selectQueue() -> RequestQueue * {
+	// The driver is single-threaded, hence the CPU that we run on says nothing
+	// about the submitter. Spread the requests over all virtqs instead.
+	auto rq = _queues[_nextQueue].get();
+	_nextQueue = (_nextQueue + 1) % _queues.size();
+	return rq;
+}
+
+async::result<void> Device::_submitTransfer(uint32_t type, uint64_t sector,
 		void *buffer, size_t num_sectors) {
 	// Natural alignment makes sure a sector does not cross a page boundary.
 	assert(!((uintptr_t)buffer % 512));
-//	printf("readSectors(%lu, %lu)\n", sector, num_sectors);
+
+	auto rq = _selectQueue();
 
 	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
+	auto max_sectors = rq->queue->numDescriptors() / 4;
 	assert(max_sectors >= 1);
 
 	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(false, sector + progress,
+		auto request = new UserRequest(type, sector + progress,
 				(char *)buffer + 512 * progress,
 				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.raise();
+		rq->pendingQueue.push(request);
+		rq->pendingDoorbell.raise();
 		co_await request->event.wait();
 		delete request;
 	}
 }
 
+async::result<void> Device::readSectors(uint64_t sector,
+		void *buffer, size_t num_sectors) {
+	co_await _submitTransfer(VIRTIO_BLK_T_IN, sector, buffer, num_sectors);
+}
+
 async::result<void> Device::writeSectors(uint64_t sector,
 		const void *buffer, size_t num_sectors) {
-	// Natural alignment makes sure a sector does not cross a page boundary.
-	assert(!((uintptr_t)buffer % 512));
-//	printf("writeSectors(%lu, %lu)\n", sector, num_sectors);
+	co_await _submitTransfer(VIRTIO_BLK_T_OUT, sector, const_cast<void *>(buffer), num_sectors);
+}
 
-	// Limit to ensure that we don't monopolize the device.
-	auto max_sectors = _requestQueue->numDescriptors() / 4;
-	assert(max_sectors >= 1);
+async::result<void> Device::discardSectors(uint64_t sector, size_t num_sectors) {
+	if(!_maxDiscardSectors)
+		co_return;
+
+	// Requests are submitted concurrently, such that _processRequests() can batch them.
+	auto rq = _selectQueue();
+	std::vector<std::unique_ptr<UserRequest>> requests;
+	for(size_t progress = 0; progress < num_sectors; progress += _maxDiscardSectors) {
+		auto request = std::make_unique<UserRequest>(VIRTIO_BLK_T_DISCARD, sector + progress,
+				nullptr, std::min(num_sectors - progress, _maxDiscardSectors));
+		rq->pendingQueue.push(request.get());
+		requests.push_back(std::move(request));
+	}
+	rq->pendingDoorbell.raise();
 
-	for(size_t progress = 0; progress < num_sectors; progress += max_sectors) {
-		auto request = new UserRequest(true, sector + progress,
-				(char *)buffer + 512 * progress,
-				std::min(num_sectors - progress, max_sectors));
-		_pendingQueue.push(request);
-		_pendingDoorbell.raise();
+	for(auto &request : requests)
 		co_await request->event.wait();
-		delete request;
+}
+
+async::result<void> Device::writeZeroes(uint64_t sector, size_t num_sectors) {
+	if(!_maxWriteZeroesSectors) {
+		co_await BlockDevice::writeZeroes(sector, num_sectors);
+		co_return;
+	}
+
+	auto rq = _selectQueue();
+	std::vector<std::unique_ptr<UserRequest>> requests;
+	for(size_t progress = 0; progress < num_sectors; progress += _maxWriteZeroesSectors) {
+		auto request = std::make_unique<UserRequest>(VIRTIO_BLK_T_WRITE_ZEROES, sector + progress,
+				nullptr, std::min(num_sectors - progress, _maxWriteZeroesSectors));
+		rq->pendingQueue.push(request.get());
+		requests.push_back(std::move(request));
 	}
+	rq->pendingDoorbell.raise();
+
+	for(auto &request : requests)
+		co_await request->event.wait();
 }
 
 async::result<size_t> Device::getSize() {
 	co_return _size * 512;
 }
 
-async::detached Device::_processRequests() {
+async::detached Device::_processRequests(RequestQueue *rq) {
 	while(true) {
-		if(_pendingQueue.empty()) {
-			co_await _pendingDoorbell.async_wait();
+		if(rq->pendingQueue.empty()) {
+			co_await rq->pendingDoorbell.async_wait();
 			continue;
 		}
 
-		auto request = _pendingQueue.front();
-		_pendingQueue.pop();
+		auto request = rq->pendingQueue.front();
+		rq->pendingQueue.pop();
 		assert(request->numSectors);
 
 		// Setup the descriptor for the request header.
 		virtio_core::Chain chain;
-		chain.append(co_await _requestQueue->obtainDescriptor());
+		chain.append(co_await rq->queue->obtainDescriptor());
 
-		VirtRequest *header = &virtRequestBuffer[chain.front().tableIndex()];
-		if(request->write) {
-			header->type = VIRTIO_BLK_T_OUT;
-		}else{
-			header->type = VIRTIO_BLK_T_IN;
-		}
+		VirtRequest *header = &rq->virtRequestBuffer[chain.front().tableIndex()];
+		header->type = request->type;
 		header->reserved = 0;
 		header->sector = request->sector;
 
 		chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
 				header, sizeof(VirtRequest)});
 
+		if(request->type == VIRTIO_BLK_T_DISCARD || request->type == VIRTIO_BLK_T_WRITE_ZEROES) {
+			// Batch all consecutive requests of the same type into a single request.
+			auto maxSegments = (request->type == VIRTIO_BLK_T_DISCARD)
+					? _maxDiscardSegments : _maxWriteZeroesSegments;
+			auto batch = new BatchRequest;
+			batch->requests.push_back(request);
+			while(!rq->pendingQueue.empty()
+					&& rq->pendingQueue.front()->type == request->type
+					&& batch->requests.size() < maxSegments) {
+				batch->requests.push_back(rq->pendingQueue.front());
+				rq->pendingQueue.pop();
+			}
+
+			// The sector field of the header is unused for these requests.
+			header->sector = 0;
+
+			auto segments = rq->segmentBuffer[chain.front().tableIndex()].segments;
+			for(size_t i = 0; i < batch->requests.size(); i++) {
+				segments[i].sector = batch->requests[i]->sector;
+				segments[i].numSectors = batch->requests[i]->numSectors;
+				segments[i].flags = 0;
+			}
+
+			chain.append(co_await rq->queue->obtainDescriptor());
+			chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
+					segments, sizeof(DiscardSegment) * batch->requests.size()});
+
+			chain.append(co_await rq->queue->obtainDescriptor());
+			chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
+					&rq->statusBuffer[chain.front().tableIndex()], 1});
+
+			if(logInitiateRetire)
+				std::cout << "Submitting batch of " << batch->requests.size()
+						<< " segments" << std::endl;
+
+			rq->queue->postDescriptor(chain.front(), batch,
+					[] (virtio_core::Request *base_request) {
+				auto batch = static_cast<BatchRequest *>(base_request);
+				for(auto request : batch->requests)
+					request->event.raise();
+				delete batch;
+			});
+			rq->queue->notify();
+			continue;
+		}
+
 		// Setup descriptors for the transfered data.
 		for(size_t i = 0; i < request->numSectors; i++) {
-			chain.append(co_await _requestQueue->obtainDescriptor());
-			if(request->write) {
+			chain.append(co_await rq->queue->obtainDescriptor());
+			if(request->type == VIRTIO_BLK_T_OUT) {
 				chain.setupBuffer(virtio_core::hostToDevice, arch::dma_buffer_view{nullptr,
 						(char *)request->buffer + 512 * i, 512});
 			}else{
@@ -139,12 +270,12 @@ async::detached Device::_processRequests() {
 					<< " data descriptors" << std::endl;
 
 		// Setup a descriptor for the status byte.
-		chain.append(co_await _requestQueue->obtainDescriptor());
+		chain.append(co_await rq->queue->obtainDescriptor());
 		chain.setupBuffer(virtio_core::deviceToHost, arch::dma_buffer_view{nullptr,
-				&statusBuffer[chain.front().tableIndex()], 1});
+				&rq->statusBuffer[chain.front().tableIndex()], 1});
 
 		// Submit the request to the device
-		_requestQueue->postDescriptor(chain.front(), request,
+		rq->queue->postDescriptor(chain.front(), request,
 				[] (virtio_core::Request *base_request) {
 			auto request = static_cast<UserRequest *>(base_request);
 			if(logInitiateRetire)
@@ -152,7 +283,7 @@ async::detached Device::_processRequests() {
 						<< " data descriptors" << std::endl;
 			request->event.raise();
 		});
-		_requestQueue->notify();
+		rq->queue->notify();
 	}
 }
 
@@ -1,6 +1,6 @@
-
 #include <memory>
 #include <queue>
+#include <vector>
 
 #include <blockfs.hpp>
 #include <core/virtio/core.hpp>
@@ -20,15 +20,44 @@ struct VirtRequest {
 };
 static_assert(sizeof(VirtRequest) == 16, "Bad sizeof(VirtRequest)");
 
+// Payload of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES requests.
+struct DiscardSegment {
+	uint64_t sector;
+	uint32_t numSectors;
+	uint32_t flags;
+};
+static_assert(sizeof(DiscardSegment) == 16, "Bad sizeof(DiscardSegment)");
+
+// Maximal number of discard / write zeroes requests that are batched into a single request.
+inline constexpr size_t maxBatchSegments = 32;
+
+// Natural alignment makes sure that a batch does not cross a page boundary.
+struct alignas(sizeof(DiscardSegment) * maxBatchSegments) SegmentBatch {
+	DiscardSegment segments[maxBatchSegments];
+};
+
 enum {
 	VIRTIO_BLK_T_IN = 0,
-	VIRTIO_BLK_T_OUT = 1
+	VIRTIO_BLK_T_OUT = 1,
+	VIRTIO_BLK_T_DISCARD = 11,
+	VIRTIO_BLK_T_WRITE_ZEROES = 13
+};
+
+enum {
+	VIRTIO_BLK_F_MQ = 12,
+	VIRTIO_BLK_F_DISCARD = 13,
+	VIRTIO_BLK_F_WRITE_ZEROES = 14
 };
 
 namespace spec::regs {
 	inline constexpr arch::scalar_register<uint32_t> capacity[] = {
 			arch::scalar_register<uint32_t>{0},
 			arch::scalar_register<uint32_t>{4}};
+	inline constexpr arch::scalar_register<uint16_t> numQueues{34};
+	inline constexpr arch::scalar_register<uint32_t> maxDiscardSectors{36};
+	inline constexpr arch::scalar_register<uint32_t> maxDiscardSegments{40};
+	inline constexpr arch::scalar_register<uint32_t> maxWriteZeroesSectors{48};
+	inline constexpr arch::scalar_register<uint32_t> maxWriteZeroesSegments{52};
 }
 
 struct Device;
@@ -38,9 +67,10 @@ struct Device;
 // --------------------------------------------------------
 
 struct UserRequest : virtio_core::Request {
-	UserRequest(bool write, uint64_t sector, void *buffer, size_t num_sectors);
+	UserRequest(uint32_t type, uint64_t sector, void *buffer, size_t num_sectors);
 
-	bool write;
+	// One of the VIRTIO_BLK_T_* constants.
+	uint32_t type;
 	uint64_t sector;
 	void *buffer;
 	size_t numSectors;
@@ -48,6 +78,11 @@ struct UserRequest : virtio_core::Request {
 	async::oneshot_event event;
 };
 
+// Completes a batch of discard / write zeroes requests at once.
+struct BatchRequest : virtio_core::Request {
+	std::vector<UserRequest *> requests;
+};
+
 // --------------------------------------------------------
 // Device
 // --------------------------------------------------------
@@ -63,29 +98,53 @@ struct Device : blockfs::BlockDevice {
 	async::result<void> writeSectors(uint64_t sector,
 			const void *buffer, size_t num_sectors) override;
 
+	async::result<void> discardSectors(uint64_t sector, size_t num_sectors) override;
+
+	async::result<void> writeZeroes(uint64_t sector, size_t num_sectors) override;
+
 	async::result<size_t> getSize() override;
 
 private:
-	// Submits requests from _pendingQueue to the device.
-	async::detached _processRequests();
+	// Per-virtq state. Each virtq is bound to its own interrupt vector (if possible).
+	struct RequestQueue {
+		RequestQueue(virtio_core::Queue *queue);
 
-	std::unique_ptr<virtio_core::Transport> _transport;
+		virtio_core::Queue *queue;
+
+		// Stores UserRequest objects that have not been submitted yet.
+		std::queue<UserRequest *> pendingQueue;
+		async::recurring_event pendingDoorbell;
+
+		// These buffers store virtio-block request headers, status bytes and
+		// discard segments. They are indexed by the index of the request's first descriptor.
+		std::unique_ptr<VirtRequest[]> virtRequestBuffer;
+		std::unique_ptr<uint8_t[]> statusBuffer;
+		std::unique_ptr<SegmentBatch[]> segmentBuffer;
+	};
 
-	// The single virtq of this device.
-	virtio_core::Queue *_requestQueue;
+	// Returns the virtq that the next request is submitted to (round-robin).
+	RequestQueue *_selectQueue();
 
-	// Stores UserRequest objects that have not been submitted yet.
-	std::queue<UserRequest *> _pendingQueue;
-	async::recurring_event _pendingDoorbell;
+	// Splits a transfer into requests and submits them to the device.
+	async::result<void> _submitTransfer(uint32_t type, uint64_t sector,
+			void *buffer, size_t num_sectors);
 
-	// these two buffer store virtio-block request header and status bytes
-	// they are indexed by the index of the request's first descriptor
-	VirtRequest *virtRequestBuffer;
-	uint8_t *statusBuffer;
+	// Submits requests from the pending queue to the device.
+	async::detached _processRequests(RequestQueue *rq);
+
+	std::unique_ptr<virtio_core::Transport> _transport;
+
+	std::vector<std::unique_ptr<RequestQueue>> _queues;
+	size_t _nextQueue = 0;
+
+	// Limits of discard and write zeroes requests (zero if unsupported).
+	size_t _maxDiscardSectors = 0;
+	size_t _maxDiscardSegments = 0;
+	size_t _maxWriteZeroesSectors = 0;
+	size_t _maxWriteZeroesSegments = 0;
 
 	// The size of the disk
 	size_t _size;
 };
 
 } } // namespace block::virtio
-
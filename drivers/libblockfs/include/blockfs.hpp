@@ -1,10 +1,27 @@
 #pragma once
 
+#include <array>
 #include <async/result.hpp>
 #include <stdint.h>
 
 namespace blockfs {
 
+// Histogram of request latencies with power-of-two buckets (in microseconds).
+// Used by the block queue; drivers can use it for their own statistics.
+struct LatencyHistogram {
+	static constexpr int numBuckets = 24;
+
+	void record(uint64_t nanos);
+
+	void dump(const char *device, const char *name);
+
+private:
+	std::array<uint64_t, numBuckets> buckets_ = {};
+	uint64_t count_ = 0;
+	uint64_t sum_ = 0;
+	uint64_t max_ = 0;
+};
+
 struct BlockDevice {
 	BlockDevice(size_t sector_size, int64_t parent_id);
 
@@ -17,12 +34,42 @@ struct BlockDevice {
 		throw std::runtime_error("BlockDevice does not support writeSectors()");
 	}
 
+	// Hints that the given sectors are no longer in use.
+	// The default implementation ignores the hint.
+	virtual async::result<void> discardSectors(uint64_t, size_t) {
+		co_return;
+	}
+
+	// Sets the given sectors to zero.
+	// The default implementation writes zero-filled buffers via writeSectors().
+	virtual async::result<void> writeZeroes(uint64_t sector, size_t num_sectors);
+
 	virtual async::result<size_t> getSize() = 0;
 
+	// Returns the device that processes the requests to this device, i.e., this device
+	// unless it is layered on top of another device (like partitions and queues).
+	virtual BlockDevice *physicalDevice() {
+		return this;
+	}
+
 	size_t size;
 	const size_t sectorSize;
 	const int64_t parentId;
 
+	// Maximum number of page cache requests that libblockfs processes concurrently,
+	// over all files on this device and per file. Drivers can adjust these
+	// to the queue depth of the device before calling runDevice().
+	size_t maxManageRequests = 32;
+	size_t maxManageRequestsPerFile = 8;
+
+	// Limits of the block queue that libblockfs puts in front of the driver:
+	// maximal number of sectors per request (zero if unlimited), maximal number
+	// of requests that are submitted to the driver concurrently and the time (in ns)
+	// for which an idle queue is plugged to collect mergeable requests.
+	size_t maxSectorsPerRequest = 0;
+	size_t maxInflightRequests = 32;
+	uint64_t plugDelay = 0;
+
 protected:
 };
 
@@ -22,6 +22,238 @@ namespace {
 
 	constexpr int pageShift = 12;
 	constexpr size_t pageSize = size_t{1} << pageShift;
+
+	// Linear directories of at least this size get an in-memory name index.
+	constexpr size_t dirIndexThreshold = 4 * pageSize;
+
+	// Returns the index of the first clear bit in [begin, end) or end if there is none.
+	uint32_t findClearBit(const uint32_t *words, uint32_t begin, uint32_t end) {
+		for(auto i = begin; i < end; ) {
+			auto word = ~words[i / 32] & (~uint32_t(0) << (i % 32));
+			if(word) {
+				auto bit = (i & ~uint32_t(31)) + __builtin_ctz(word);
+				return std::min(bit, end);
+			}
+			i = (i & ~uint32_t(31)) + 32;
+		}
+		return end;
+	}
+
+	// Locks the pages that back [offset, offset + length) of a managed memory object.
+	async::result<helix::UniqueDescriptor> lockPages(helix::BorrowedDescriptor memory,
+			uintptr_t offset, size_t length) {
+		auto misalign = offset & (pageSize - 1);
+		helix::LockMemoryView lock_memory;
+		auto &&submit = helix::submitLockMemoryView(memory, &lock_memory,
+				offset - misalign, (misalign + length + (pageSize - 1)) & ~(pageSize - 1),
+				helix::Dispatcher::global());
+		co_await submit.async_wait();
+		HEL_CHECK(lock_memory.error());
+		co_return lock_memory.descriptor();
+	}
+
+	DirEntry makeDirEntry(DiskDirEntry *disk_entry) {
+		DirEntry entry;
+		entry.inode = disk_entry->inode;
+
+		switch(disk_entry->fileType) {
+		case EXT2_FT_REG_FILE:
+			entry.fileType = kTypeRegular; break;
+		case EXT2_FT_DIR:
+			entry.fileType = kTypeDirectory; break;
+		case EXT2_FT_SYMLINK:
+			entry.fileType = kTypeSymlink; break;
+		default:
+			entry.fileType = kTypeNone;
+		}
+
+		return entry;
+	}
+
+	bool matchesName(DiskDirEntry *disk_entry, const std::string &name) {
+		return disk_entry->inode
+				&& name.length() == disk_entry->nameLength
+				&& !memcmp(disk_entry->name, name.data(), name.length());
+	}
+
+	// Scans the directory entries in [begin, end) of the given mapping.
+	std::optional<uintptr_t> scanEntries(void *mapping, uintptr_t begin, uintptr_t end,
+			const std::string &name) {
+		uintptr_t offset = begin;
+		while(offset < end) {
+			assert(!(offset & 3));
+			assert(offset + sizeof(DiskDirEntry) <= end);
+			auto disk_entry = reinterpret_cast<DiskDirEntry *>(
+					reinterpret_cast<char *>(mapping) + offset);
+			assert(disk_entry->recordLength);
+
+			if(matchesName(disk_entry, name))
+				return offset;
+
+			offset += disk_entry->recordLength;
+		}
+		assert(offset == end);
+
+		return std::nullopt;
+	}
+
+	// --------------------------------------------------------
+	// Directory hash functions (compatible with Linux' fs/ext4/hash.c).
+	// --------------------------------------------------------
+
+	uint32_t rotateLeft(uint32_t x, int s) {
+		return (x << s) | (x >> (32 - s));
+	}
+
+	void teaTransform(uint32_t buf[4], const uint32_t in[4]) {
+		uint32_t sum = 0;
+		uint32_t b0 = buf[0], b1 = buf[1];
+		uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+		for(int n = 0; n < 16; n++) {
+			sum += 0x9E3779B9;
+			b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+			b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+		}
+
+		buf[0] += b0;
+		buf[1] += b1;
+	}
+
+	void halfMd4Transform(uint32_t buf[4], const uint32_t in[8]) {
+		auto f = [] (uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+		auto g = [] (uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+		auto h = [] (uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+
+		constexpr uint32_t k2 = 013240474631;
+		constexpr uint32_t k3 = 015666365641;
+
+		uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+		a = rotateLeft(a + f(b, c, d) + in[0], 3);
+		d = rotateLeft(d + f(a, b, c) + in[1], 7);
+		c = rotateLeft(c + f(d, a, b) + in[2], 11);
+		b = rotateLeft(b + f(c, d, a) + in[3], 19);
+		a = rotateLeft(a + f(b, c, d) + in[4], 3);
+		d = rotateLeft(d + f(a, b, c) + in[5], 7);
+		c = rotateLeft(c + f(d, a, b) + in[6], 11);
+		b = rotateLeft(b + f(c, d, a) + in[7], 19);
+
+		a = rotateLeft(a + g(b, c, d) + in[1] + k2, 3);
+		d = rotateLeft(d + g(a, b, c) + in[3] + k2, 5);
+		c = rotateLeft(c + g(d, a, b) + in[5] + k2, 9);
+		b = rotateLeft(b + g(c, d, a) + in[7] + k2, 13);
+		a = rotateLeft(a + g(b, c, d) + in[0] + k2, 3);
+		d = rotateLeft(d + g(a, b, c) + in[2] + k2, 5);
+		c = rotateLeft(c + g(d, a, b) + in[4] + k2, 9);
+		b = rotateLeft(b + g(c, d, a) + in[6] + k2, 13);
+
+		a = rotateLeft(a + h(b, c, d) + in[3] + k3, 3);
+		d = rotateLeft(d + h(a, b, c) + in[7] + k3, 9);
+		c = rotateLeft(c + h(d, a, b) + in[2] + k3, 11);
+		b = rotateLeft(b + h(c, d, a) + in[6] + k3, 15);
+		a = rotateLeft(a + h(b, c, d) + in[1] + k3, 3);
+		d = rotateLeft(d + h(a, b, c) + in[5] + k3, 9);
+		c = rotateLeft(c + h(d, a, b) + in[0] + k3, 11);
+		b = rotateLeft(b + h(c, d, a) + in[4] + k3, 15);
+
+		buf[0] += a;
+		buf[1] += b;
+		buf[2] += c;
+		buf[3] += d;
+	}
+
+	// Converts (a prefix of) the name into num words of hash input.
+	template<typename Char>
+	void nameToHashBuffer(const char *msg, int len, uint32_t *buf, int num) {
+		auto p = reinterpret_cast<const Char *>(msg);
+
+		uint32_t pad = static_cast<uint32_t>(len) | (static_cast<uint32_t>(len) << 8);
+		pad |= pad << 16;
+
+		uint32_t val = pad;
+		if(len > num * 4)
+			len = num * 4;
+		for(int i = 0; i < len; i++) {
+			val = static_cast<int>(p[i]) + (val << 8);
+			if((i % 4) == 3) {
+				*buf++ = val;
+				val = pad;
+				num--;
+			}
+		}
+		if(--num >= 0)
+			*buf++ = val;
+		while(--num >= 0)
+			*buf++ = pad;
+	}
+
+	template<typename Char>
+	uint32_t legacyHash(const char *name, int len) {
+		auto p = reinterpret_cast<const Char *>(name);
+		uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+
+		for(int i = 0; i < len; i++) {
+			uint32_t hash = hash1 + (hash0 ^ (static_cast<int>(p[i]) * 7152373));
+			if(hash & 0x80000000)
+				hash -= 0x7FFFFFFF;
+			hash1 = hash0;
+			hash0 = hash;
+		}
+		return hash0 << 1;
+	}
+
+	// Returns std::nullopt for unsupported hash versions.
+	std::optional<uint32_t> dirHash(const std::string &name, int version, const uint32_t seed[4]) {
+		uint32_t buf[4] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476};
+		if(seed[0] || seed[1] || seed[2] || seed[3])
+			memcpy(buf, seed, sizeof(buf));
+
+		auto p = name.data();
+		int len = name.length();
+
+		uint32_t hash;
+		uint32_t in[8];
+		switch(version) {
+		case DX_HASH_LEGACY:
+			hash = legacyHash<signed char>(p, len);
+			break;
+		case DX_HASH_LEGACY_UNSIGNED:
+			hash = legacyHash<unsigned char>(p, len);
+			break;
+		case DX_HASH_HALF_MD4:
+		case DX_HASH_HALF_MD4_UNSIGNED:
+			for(; len > 0; len -= 32, p += 32) {
+				if(version == DX_HASH_HALF_MD4)
+					nameToHashBuffer<signed char>(p, len, in, 8);
+				else
+					nameToHashBuffer<unsigned char>(p, len, in, 8);
+				halfMd4Transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+		case DX_HASH_TEA_UNSIGNED:
+			for(; len > 0; len -= 16, p += 16) {
+				if(version == DX_HASH_TEA)
+					nameToHashBuffer<signed char>(p, len, in, 4);
+				else
+					nameToHashBuffer<unsigned char>(p, len, in, 4);
+				teaTransform(buf, in);
+			}
+			hash = buf[0];
+			break;
+		default:
+			return std::nullopt;
+		}
+
+		// The lowest bit is reserved to mark hash collisions in index blocks
+		// and the highest hash is reserved as an EOF marker.
+		hash &= ~uint32_t(1);
+		if(hash == 0xFFFFFFFE)
+			hash = 0xFFFFFFFC;
+		return hash;
+	}
 }
 
 // --------------------------------------------------------
@@ -29,7 +261,8 @@ namespace {
 // --------------------------------------------------------
 
 Inode::Inode(FileSystem &fs, uint32_t number)
-: fs(fs), number(number), isReady(false) { }
+: fs(fs), number(number), isReady(false),
+	manageLimiter{fs.device->maxManageRequestsPerFile} { }
 
 void Inode::setFileSize(size_t size) {
 	assert(!(size & ~uint64_t(0xFFFFFFFF)));
@@ -44,48 +277,189 @@ Inode::findEntry(std::string name) {
 		co_return protocols::fs::Error::notDirectory;
 	assert(fileMapping.size() == fileSize());
 
-	helix::LockMemoryView lock_memory;
-	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
-	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
-			&lock_memory,
-			0, map_size, helix::Dispatcher::global());
-	co_await submit.async_wait();
-	HEL_CHECK(lock_memory.error());
+	// For hashed directories, only the leaf blocks selected by the index are scanned.
+	if(fs.hasDirIndex && (diskInode()->flags & EXT2_INDEX_FL)) {
+		auto leaves = co_await probeHtree(name);
+		if(leaves) {
+			for(auto block : *leaves) {
+				uintptr_t leaf_offset = uintptr_t{block} << fs.blockShift;
+				if(leaf_offset + fs.blockSize > fileSize()) {
+					std::cout << "\e[33m" "ext2fs: htree of inode " << number
+							<< " points past the end of the directory" "\e[39m" << std::endl;
+					break;
+				}
 
-	// Read the directory structure.
-	uintptr_t offset = 0;
-	while(offset < fileSize()) {
-		assert(!(offset & 3));
-		assert(offset + sizeof(DiskDirEntry) <= fileSize());
+				auto lock = co_await lockPages(helix::BorrowedDescriptor(frontalMemory),
+						leaf_offset, fs.blockSize);
+				auto offset = scanEntries(fileMapping.get(),
+						leaf_offset, leaf_offset + fs.blockSize, name);
+				if(offset)
+					co_return makeDirEntry(reinterpret_cast<DiskDirEntry *>(
+							reinterpret_cast<char *>(fileMapping.get()) + *offset));
+			}
+			co_return std::nullopt;
+		}
+	}
+
+	// Large linear directories are looked up through the in-memory index.
+	if(dirIndexValid) {
+		auto it = dirIndex.find(name);
+		if(it == dirIndex.end())
+			co_return std::nullopt;
+
+		auto lock = co_await lockPages(helix::BorrowedDescriptor(frontalMemory),
+				it->second, sizeof(DiskDirEntry) + name.length());
 		auto disk_entry = reinterpret_cast<DiskDirEntry *>(
+				reinterpret_cast<char *>(fileMapping.get()) + it->second);
+		assert(matchesName(disk_entry, name));
+		co_return makeDirEntry(disk_entry);
+	}
+
+	auto lock = co_await lockPages(helix::BorrowedDescriptor(frontalMemory),
+			0, fileSize());
+
+	if(fileSize() >= dirIndexThreshold) {
+		uintptr_t offset = 0;
+		while(offset < fileSize()) {
+			assert(!(offset & 3));
+			assert(offset + sizeof(DiskDirEntry) <= fileSize());
+			auto disk_entry = reinterpret_cast<DiskDirEntry *>(
+					reinterpret_cast<char *>(fileMapping.get()) + offset);
+			assert(disk_entry->recordLength);
+
+			if(disk_entry->inode)
+				dirIndex.emplace(std::string(disk_entry->name, disk_entry->nameLength), offset);
+
+			offset += disk_entry->recordLength;
+		}
+		assert(offset == fileSize());
+		dirIndexValid = true;
+
+		auto it = dirIndex.find(name);
+		if(it == dirIndex.end())
+			co_return std::nullopt;
+		co_return makeDirEntry(reinterpret_cast<DiskDirEntry *>(
+				reinterpret_cast<char *>(fileMapping.get()) + it->second));
+	}
+
+	// Read the directory structure.
+	auto offset = scanEntries(fileMapping.get(), 0, fileSize(), name);
+	if(!offset)
+		co_return std::nullopt;
+	co_return makeDirEntry(reinterpret_cast<DiskDirEntry *>(
+			reinterpret_cast<char *>(fileMapping.get()) + *offset));
+}
+
+async::result<std::optional<std::vector<uint32_t>>>
+Inode::probeHtree(const std::string &name) {
+	auto dxEntryAt = [&] (uintptr_t offset) {
+		return reinterpret_cast<DiskDxEntry *>(
 				reinterpret_cast<char *>(fileMapping.get()) + offset);
-		assert(disk_entry->recordLength);
+	};
 
-		if(disk_entry->inode
-				&& name.length() == disk_entry->nameLength
-				&& !memcmp(disk_entry->name, name.data(), name.length())) {
-			DirEntry entry;
-			entry.inode = disk_entry->inode;
-
-			switch(disk_entry->fileType) {
-			case EXT2_FT_REG_FILE:
-				entry.fileType = kTypeRegular; break;
-			case EXT2_FT_DIR:
-				entry.fileType = kTypeDirectory; break;
-			case EXT2_FT_SYMLINK:
-				entry.fileType = kTypeSymlink; break;
-			default:
-				entry.fileType = kTypeNone;
+	if(fileSize() < fs.blockSize)
+		co_return std::nullopt;
+
+	auto root_lock = co_await lockPages(helix::BorrowedDescriptor(frontalMemory),
+			0, fs.blockSize);
+
+	// The root info follows the "." and ".." entries which both occupy 12 bytes.
+	auto info = reinterpret_cast<DiskDxRootInfo *>(
+			reinterpret_cast<char *>(fileMapping.get()) + 24);
+	// Linux supports two levels of interior nodes (with the largedir feature).
+	if(info->reservedZero || (info->unusedFlags & 1) || info->indirectLevels > 2
+			|| 24 + info->infoLength + sizeof(DiskDxEntry) > fs.blockSize) {
+		std::cout << "\e[33m" "ext2fs: Unsupported htree root in inode " << number
+				<< ", falling back to linear lookup" "\e[39m" << std::endl;
+		co_return std::nullopt;
+	}
+
+	int version = info->hashVersion;
+	if(fs.unsignedDirHash && version <= DX_HASH_TEA)
+		version += 3;
+	auto hash = dirHash(name, version, fs.dirHashSeed);
+	if(!hash) {
+		std::cout << "\e[33m" "ext2fs: Unsupported htree hash version " << version
+				<< " in inode " << number << ", falling back to linear lookup" "\e[39m" << std::endl;
+		co_return std::nullopt;
+	}
+
+	uintptr_t node_offset = 24 + info->infoLength;
+	helix::UniqueDescriptor node_lock;
+	int levels = info->indirectLevels;
+	// Hash of the entry that follows our subtree in the innermost parent node.
+	std::optional<uint32_t> next_hash;
+	while(true) {
+		auto entries = dxEntryAt(node_offset);
+		auto count_limit = reinterpret_cast<DiskDxCountLimit *>(entries);
+		unsigned int count = count_limit->count;
+		auto node_begin = node_offset & ~uintptr_t(fs.blockSize - 1);
+		if(!count || count > count_limit->limit
+				|| node_offset + count * sizeof(DiskDxEntry) > node_begin + fs.blockSize)
+			co_return std::nullopt;
+
+		// Binary search for the last entry whose hash is not larger than ours.
+		// Entry 0 has no hash, it covers everything below the hash of entry 1.
+		unsigned int lo = 1, hi = count;
+		while(lo < hi) {
+			auto mid = lo + (hi - lo) / 2;
+			if(entries[mid].hash > *hash)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		auto at = lo - 1;
+		uint32_t block = entries[at].block & 0x0FFFFFFF;
+
+		if(!levels--) {
+			std::vector<uint32_t> leaves{block};
+
+			// Entries that collide with our hash may continue in the following leaves.
+			// Such leaves are marked by setting the lowest bit of their hash.
+			auto continues = [&] (uint32_t h) {
+				return (h & 1) && (h & ~uint32_t(1)) == *hash;
+			};
+			for(auto i = at + 1; ; i++) {
+				if(i == count) {
+					// We do not follow collisions across index blocks;
+					// fall back to a linear scan in this (rare) case.
+					if(next_hash && continues(*next_hash))
+						co_return std::nullopt;
+					break;
+				}
+				if(!continues(entries[i].hash))
+					break;
+				leaves.push_back(entries[i].block & 0x0FFFFFFF);
 			}
 
-			co_return entry;
+			co_return leaves;
 		}
 
-		offset += disk_entry->recordLength;
+		if(at + 1 < count)
+			next_hash = entries[at + 1].hash;
+
+		// Interior nodes start with an empty DiskDirEntry that spans the whole block.
+		node_begin = uintptr_t{block} << fs.blockShift;
+		if(node_begin + fs.blockSize > fileSize())
+			co_return std::nullopt;
+		node_lock = co_await lockPages(helix::BorrowedDescriptor(frontalMemory),
+				node_begin, fs.blockSize);
+		node_offset = node_begin + 8;
 	}
-	assert(offset == fileSize());
+}
 
-	co_return std::nullopt;
+async::result<void> Inode::dropHtree() {
+	if(!(diskInode()->flags & EXT2_INDEX_FL))
+		co_return;
+
+	// We only maintain directories as linear lists of entries. Modifying them
+	// invalidates the htree, hence we turn them back into unindexed directories
+	// (just like pre-htree Linux kernels do); e2fsck -D can rebuild the index.
+	diskInode()->flags &= ~EXT2_INDEX_FL;
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			diskMapping.get(), fs.inodeSize);
+	HEL_CHECK(syncInode.error());
 }
 
 async::result<std::optional<DirEntry>>
@@ -98,12 +472,16 @@ Inode::link(std::string name, int64_t ino, blockfs::FileType type) {
 	assert(fileType == kTypeDirectory);
 	assert(fileMapping.size() == fileSize());
 
+	co_await dropHtree();
+
 	// Lock the mapping into memory before calling this function.
 	auto appendDirEntry = [&](size_t offset, size_t length)
 			-> async::result<std::optional<DirEntry>> {
 		auto diskEntry = reinterpret_cast<DiskDirEntry *>(
 				reinterpret_cast<char *>(fileMapping.get()) + offset);
 		memset(diskEntry, 0, sizeof(DiskDirEntry));
+		if(dirIndexValid)
+			dirIndex[name] = offset;
 		diskEntry->inode = ino;
 		diskEntry->recordLength = length;
 		diskEntry->nameLength = name.length();
@@ -215,6 +593,8 @@ async::result<frg::expected<protocols::fs::Error>> Inode::unlink(std::string nam
 		co_return protocols::fs::Error::notDirectory;
 	assert(fileMapping.size() == fileSize());
 
+	co_await dropHtree();
+
 	helix::LockMemoryView lock_memory;
 	auto map_size = (fileSize() + 0xFFF) & ~size_t(0xFFF);
 	auto &&submit = helix::submitLockMemoryView(helix::BorrowedDescriptor(frontalMemory),
@@ -240,6 +620,7 @@ async::result<frg::expected<protocols::fs::Error>> Inode::unlink(std::string nam
 			// we can assume that a previous entry exists.
 			assert(previous_entry);
 			previous_entry->recordLength += disk_entry->recordLength;
+			dirIndex.erase(name);
 
 			// Flush the data to disk.
 			// TODO: It would be enough to flush only one or two pages here.
@@ -406,8 +787,8 @@ async::result<void> FileSystem::init() {
 	std::vector<uint8_t> buffer(1024);
 	co_await device->readSectors(2, buffer.data(), 2);
 
-	DiskSuperblock sb;
-	memcpy(&sb, buffer.data(), sizeof(DiskSuperblock));
+	memcpy(&superblock, buffer.data(), sizeof(DiskSuperblock));
+	auto &sb = superblock;
 	assert(sb.magic == 0xEF53);
 
 	inodeSize = sb.inodeSize;
@@ -418,8 +799,13 @@ async::result<void> FileSystem::init() {
 	blocksPerGroup = sb.blocksPerGroup;
 	inodesPerGroup = sb.inodesPerGroup;
 	blocksCount = sb.blocksCount;
+	firstDataBlock = sb.firstDataBlock;
 	inodesCount = sb.inodesCount;
-	numBlockGroups = (sb.blocksCount + (sb.blocksPerGroup - 1)) / sb.blocksPerGroup;
+	numBlockGroups = (sb.blocksCount - sb.firstDataBlock
+			+ (sb.blocksPerGroup - 1)) / sb.blocksPerGroup;
+	hasDirIndex = sb.featureCompat & EXT2_FEATURE_COMPAT_DIR_INDEX;
+	unsignedDirHash = sb.flags & EXT2_FLAGS_UNSIGNED_HASH;
+	memcpy(dirHashSeed, sb.hashSeed, sizeof(dirHashSeed));
 
 	if(logSuperblock) {
 		std::cout << "ext2fs: Revision is: " << sb.revLevel << std::endl;
@@ -438,6 +824,7 @@ async::result<void> FileSystem::init() {
 
 	blockGroupDescriptorBuffer.resize((numBlockGroups * sizeof(DiskGroupDesc) + 511) & ~size_t(511));
 	bgdt = (DiskGroupDesc *)blockGroupDescriptorBuffer.data();
+	blockSearchHints.resize(numBlockGroups, 0);
 
 	auto bgdt_offset = (2048 + blockSize - 1) & ~size_t(blockSize - 1);
 	co_await device->readSectors((bgdt_offset >> blockShift) * sectorsPerBlock,
@@ -817,6 +1204,9 @@ async::detached FileSystem::initiateInode(std::shared_ptr<Inode> inode) {
 
 async::detached FileSystem::manageFileData(std::shared_ptr<Inode> inode) {
 	while(true) {
+		// Do not accept more requests than we are willing to process concurrently.
+		co_await inode->manageLimiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit = helix::submitManageMemory(helix::BorrowedDescriptor(inode->backingMemory),
 				&manage, helix::Dispatcher::global());
@@ -824,38 +1214,52 @@ async::detached FileSystem::manageFileData(std::shared_ptr<Inode> inode) {
 		HEL_CHECK(manage.error());
 		assert(manage.offset() + manage.length() <= ((inode->fileSize() + 0xFFF) & ~size_t(0xFFF)));
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtWrite};
+		auto ticket = inode->manageRanges.enqueue(manage.offset(), manage.length());
+		handleFileData(inode, manage.type(), manage.offset(), manage.length(), ticket);
+	}
+}
 
-			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
+async::detached FileSystem::handleFileData(std::shared_ptr<Inode> inode, int type,
+		uintptr_t offset, size_t length, RangeSerializer::Ticket ticket) {
+	auto &deviceLimiter = deviceManageLimiter(device);
+	co_await inode->manageRanges.wait(ticket);
+	co_await deviceLimiter.acquire();
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			co_await inode->fs.readDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+	if(type == kHelManageInitialize) {
+		helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+				static_cast<ptrdiff_t>(offset), length, kHelMapProtWrite};
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageInitialize,
-					manage.offset(), manage.length()));
-		}else{
-			assert(manage.type() == kHelManageWriteback);
+		assert(!(offset % blockSize));
+		size_t backed_size = std::min(length, inode->fileSize() - offset);
+		size_t num_blocks = (backed_size + (blockSize - 1)) / blockSize;
 
-			helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
-					static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtRead};
+		assert(num_blocks * blockSize <= length);
+		co_await readDataBlocks(inode, offset / blockSize,
+				num_blocks, file_map.get());
 
-			assert(!(manage.offset() % inode->fs.blockSize));
-			size_t backed_size = std::min(manage.length(), inode->fileSize() - manage.offset());
-			size_t num_blocks = (backed_size + (inode->fs.blockSize - 1)) / inode->fs.blockSize;
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageInitialize,
+				offset, length));
+	}else{
+		assert(type == kHelManageWriteback);
 
-			assert(num_blocks * inode->fs.blockSize <= manage.length());
-			co_await inode->fs.writeDataBlocks(inode, manage.offset() / inode->fs.blockSize,
-					num_blocks, file_map.get());
+		helix::Mapping file_map{helix::BorrowedDescriptor{inode->backingMemory},
+				static_cast<ptrdiff_t>(offset), length, kHelMapProtRead};
 
-			HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
-					manage.offset(), manage.length()));
-		}
+		assert(!(offset % blockSize));
+		size_t backed_size = std::min(length, inode->fileSize() - offset);
+		size_t num_blocks = (backed_size + (blockSize - 1)) / blockSize;
+
+		assert(num_blocks * blockSize <= length);
+		co_await writeDataBlocks(inode, offset / blockSize,
+				num_blocks, file_map.get());
+
+		HEL_CHECK(helUpdateMemory(inode->backingMemory, kHelManageWriteback,
+				offset, length));
 	}
+
+	deviceLimiter.release();
+	inode->manageRanges.complete(ticket);
+	inode->manageLimiter.release();
 }
 
 async::detached FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
@@ -927,8 +1331,23 @@ async::detached FileSystem::manageIndirect(std::shared_ptr<Inode> inode,
 	}
 }
 
-async::result<uint32_t> FileSystem::allocateBlock() {
-	for(uint32_t bg_idx = 0; bg_idx < numBlockGroups; bg_idx++) {
+async::result<std::pair<uint32_t, size_t>>
+FileSystem::allocateBlocks(uint32_t goal, size_t count) {
+	assert(count);
+	if(goal < firstDataBlock || goal >= blocksCount)
+		goal = firstDataBlock;
+
+	auto goal_bg = (goal - firstDataBlock) / blocksPerGroup;
+	for(uint32_t k = 0; k < numBlockGroups; k++) {
+		auto bg_idx = (goal_bg + k) % numBlockGroups;
+		// Skip full groups without touching their bitmaps.
+		if(!bgdt[bg_idx].freeBlocksCount)
+			continue;
+
+		// The last group can be shorter than the others.
+		auto group_base = firstDataBlock + bg_idx * blocksPerGroup;
+		auto group_size = std::min(blocksPerGroup, blocksCount - group_base);
+
 		helix::LockMemoryView lock_bitmap;
 		auto &&submit_bitmap = helix::submitLockMemoryView(blockBitmap,
 				&lock_bitmap,
@@ -940,33 +1359,92 @@ async::result<uint32_t> FileSystem::allocateBlock() {
 		helix::Mapping bitmap_map{blockBitmap,
 				bg_idx << blockPagesShift, size_t{1} << blockPagesShift,
 				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
-
 		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
-		for(unsigned int i = 0; i < (blocksPerGroup + 31) / 32; i++) {
-			if(words[i] == 0xFFFFFFFF)
-				continue;
-			for(int j = 0; j < 32; j++) {
-				if(i * 32 + j >= blocksPerGroup)
-					break;
-				if(words[i] & (static_cast<uint32_t>(1) << j))
-					continue;
-				// TODO: Make sure we never return reserved blocks.
-				// TODO: Make sure we never return blocks higher than the max. block in the SB.
-				auto block = bg_idx * blocksPerGroup + i * 32 + j;
-				assert(block);
-				assert(block < blocksCount);
-				words[i] |= static_cast<uint32_t>(1) << j;
 
-				bgdt[bg_idx].freeBlocksCount--;
-				co_await writebackBgdt();
+		// Prefer the goal itself; otherwise take the first free block of the group.
+		// Bits below the hint are known to be allocated.
+		auto &hint = blockSearchHints[bg_idx];
+		uint32_t bit = group_size;
+		if(!k)
+			bit = findClearBit(words, std::max(hint, goal - group_base), group_size);
+		if(bit == group_size)
+			bit = findClearBit(words, hint, group_size);
+		if(bit == group_size) {
+			// The free count in the BGDT is wrong; do not look at this group again.
+			std::cout << "\e[33m" "ext2fs: Block group " << bg_idx
+					<< " has no free blocks despite its free count" "\e[39m" << std::endl;
+			hint = group_size;
+			continue;
+		}
+
+		// Extend the extent as far as possible.
+		size_t n = 1;
+		while(n < count && bit + n < group_size && n < bgdt[bg_idx].freeBlocksCount
+				&& !(words[(bit + n) / 32] & (static_cast<uint32_t>(1) << ((bit + n) % 32))))
+			n++;
+
+		for(size_t i = 0; i < n; i++)
+			words[(bit + i) / 32] |= static_cast<uint32_t>(1) << ((bit + i) % 32);
+		if(bit == hint)
+			hint = bit + n;
+
+		bgdt[bg_idx].freeBlocksCount -= n;
+		superblock.freeBlocksCount -= n;
 
-				co_return block;
+		auto block = group_base + bit;
+		assert(block);
+		assert(block + n <= blocksCount);
+		co_return std::pair<uint32_t, size_t>{block, n};
+	}
+
+	co_return std::pair<uint32_t, size_t>{0, 0};
+}
+
+async::result<void> FileSystem::freeBlocks(uint32_t block, size_t count) {
+	assert(block >= firstDataBlock);
+	assert(block + count <= blocksCount);
+
+	while(count) {
+		// The extent can cross block group boundaries.
+		auto bg_idx = (block - firstDataBlock) / blocksPerGroup;
+		auto group_base = firstDataBlock + bg_idx * blocksPerGroup;
+		uint32_t bit = block - group_base;
+		size_t n = std::min(count, size_t{blocksPerGroup - bit});
+
+		helix::LockMemoryView lock_bitmap;
+		auto &&submit_bitmap = helix::submitLockMemoryView(blockBitmap,
+				&lock_bitmap,
+				bg_idx << blockPagesShift, 1 << blockPagesShift,
+				helix::Dispatcher::global());
+		co_await submit_bitmap.async_wait();
+		HEL_CHECK(lock_bitmap.error());
+
+		helix::Mapping bitmap_map{blockBitmap,
+				bg_idx << blockPagesShift, size_t{1} << blockPagesShift,
+				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+		auto words = reinterpret_cast<uint32_t *>(bitmap_map.get());
+
+		uint32_t freed = 0;
+		for(size_t i = 0; i < n; i++) {
+			auto mask = static_cast<uint32_t>(1) << ((bit + i) % 32);
+			if(!(words[(bit + i) / 32] & mask)) {
+				std::cout << "\e[33m" "ext2fs: Block " << (block + i)
+						<< " is freed but not allocated" "\e[39m" << std::endl;
+				continue;
 			}
-			assert(!"Failed to find zero-bit");
+			words[(bit + i) / 32] &= ~mask;
+			freed++;
 		}
-	}
 
-	co_return 0;
+		auto &hint = blockSearchHints[bg_idx];
+		hint = std::min(hint, bit);
+
+		bgdt[bg_idx].freeBlocksCount += freed;
+		superblock.freeBlocksCount += freed;
+
+		block += n;
+		count -= n;
+	}
 }
 
 async::result<uint32_t> FileSystem::allocateInode() {
@@ -1001,7 +1479,9 @@ async::result<uint32_t> FileSystem::allocateInode() {
 				words[i] |= static_cast<uint32_t>(1) << j;
 
 				bgdt[bg_idx].freeInodesCount--;
+				superblock.freeInodesCount--;
 				co_await writebackBgdt();
+				co_await writebackSuperblock();
 
 				co_return ino;
 			}
@@ -1025,31 +1505,61 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 
 	auto disk_inode = inode->diskInode();
 
+	// Try to place the data next to the previous block of the file.
+	// Before we know that block, start at the inode's own block group.
+	uint32_t goal = firstDataBlock + ((inode->number - 1) / inodesPerGroup) * blocksPerGroup;
+	bool allocatedAny = false;
+
+	auto allocateSingle = [&] () -> async::result<uint32_t> {
+		auto [block, n] = co_await allocateBlocks(goal, 1);
+		assert(block && "Out of disk space"); // TODO: Fix this.
+		assert(n == 1);
+		disk_inode->blocks += (blockSize / 512);
+		goal = block + 1;
+		allocatedAny = true;
+		co_return block;
+	};
+
 	size_t prg = 0;
-	while(prg < num_blocks) {
-		if(block_offset + prg < i_range) {
-			while(prg < num_blocks
-					&& block_offset + prg < i_range) {
-				auto idx = block_offset + prg;
-				if(disk_inode->data.blocks.direct[idx]) {
-					prg++;
-					continue;
-				}
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				disk_inode->data.blocks.direct[idx] = block;
+
+	// Fills holes in slots[] (which covers the logical blocks [base, limit) of the file)
+	// that are touched by this request, using extents that are as long as possible.
+	auto fillSlots = [&] (uint32_t *slots, size_t base, size_t limit) -> async::result<void> {
+		while(prg < num_blocks
+				&& block_offset + prg < limit) {
+			auto idx = block_offset + prg - base;
+			if(slots[idx]) {
+				goal = slots[idx] + 1;
 				prg++;
+				continue;
 			}
+
+			size_t run = 1;
+			while(prg + run < num_blocks
+					&& block_offset + prg + run < limit
+					&& !slots[idx + run])
+				run++;
+
+			auto [block, n] = co_await allocateBlocks(goal, run);
+			assert(block && "Out of disk space"); // TODO: Fix this.
+			for(size_t i = 0; i < n; i++)
+				slots[idx + i] = block + i;
+			disk_inode->blocks += n * (blockSize / 512);
+			goal = block + n;
+			allocatedAny = true;
+			prg += n;
+		}
+	};
+
+	while(prg < num_blocks) {
+		if(block_offset + prg < i_range) {
+			co_await fillSlots(disk_inode->data.blocks.direct, 0, i_range);
 		}else if(block_offset + prg < s_range) {
 			bool needsReset = false;
 
 			// Allocate the single-indirect block itself.
 			if(!disk_inode->data.blocks.singleIndirect) {
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				disk_inode->data.blocks.singleIndirect = block;
+				disk_inode->data.blocks.singleIndirect = co_await allocateSingle();
 				needsReset = true;
 			}
 
@@ -1068,26 +1578,11 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 			if(needsReset)
 				memset(window, 0, size_t{1} << blockPagesShift);
 
-			while(prg < num_blocks
-					&& block_offset + prg < s_range) {
-				auto idx = block_offset + prg - i_range;
-				if(window[idx]) {
-					prg++;
-					continue;
-				}
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				window[idx] = block;
-				prg++;
-			}
+			co_await fillSlots(window, i_range, s_range);
 		}else if(block_offset + prg < d_range) {
 			bool doubleNeedsReset = false;
 			if(!disk_inode->data.blocks.doubleIndirect) {
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				disk_inode->data.blocks.doubleIndirect = block;
+				disk_inode->data.blocks.doubleIndirect = co_await allocateSingle();
 				doubleNeedsReset = true;
 			}
 
@@ -1109,15 +1604,11 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 			while(prg < num_blocks
 					&& block_offset + prg < d_range) {
 				int64_t indirect_frame = (block_offset + prg - s_range) >> (blockShift - 2);
-				int64_t indirect_index = (block_offset + prg - s_range) & ((1 << (blockShift - 2)) - 1);
 
 				bool needsReset = false;
 				if(!double_window[indirect_frame]) {
 					// Allocate the single indirect block.
-					auto block = co_await allocateBlock();
-					assert(block && "Out of disk space"); // TODO: Fix this.
-					disk_inode->blocks += (blockSize / 512);
-					double_window[indirect_frame] = block;
+					double_window[indirect_frame] = co_await allocateSingle();
 					needsReset = true;
 				}
 
@@ -1136,28 +1627,133 @@ async::result<void> FileSystem::assignDataBlocks(Inode *inode,
 				if(needsReset)
 					memset(window, 0, size_t{1} << blockPagesShift);
 
-				if(window[indirect_index]) {
-					prg++;
-					continue;
-				}
-
-				auto block = co_await allocateBlock();
-				assert(block && "Out of disk space"); // TODO: Fix this.
-				disk_inode->blocks += (blockSize / 512);
-				window[indirect_index] = block;
-				prg++;
+				auto frame_base = s_range + indirect_frame * per_indirect;
+				co_await fillSlots(window, frame_base, frame_base + per_indirect);
 			}
 		}else{
 			assert(!"TODO: Implement allocation in triple indirect blocks");
 		}
 	}
 
+	// Write back the allocation metadata once per request instead of once per block.
+	if(allocatedAny) {
+		co_await writebackBgdt();
+		co_await writebackSuperblock();
+	}
+
 	auto syncInode = co_await helix_ng::synchronizeSpace(
 			helix::BorrowedDescriptor{kHelNullHandle},
 			inode->diskMapping.get(), inodeSize);
 	HEL_CHECK(syncInode.error());
 }
 
+async::result<void> FileSystem::freeDataBlocks(Inode *inode, uint64_t block_offset) {
+	size_t per_indirect = blockSize / 4;
+
+	// Number of blocks that can be accessed by:
+	size_t i_range = 12; // Direct blocks only.
+	size_t s_range = i_range + per_indirect; // Plus the first single indirect block.
+	size_t d_range = s_range + per_indirect * per_indirect; // Plus the first double indirect block.
+
+	auto disk_inode = inode->diskInode();
+
+	// Extents of freed blocks; adjacent blocks are merged to reduce the number of discards.
+	std::vector<std::pair<uint32_t, size_t>> extents;
+
+	auto releaseSlots = [&] (uint32_t *slots, size_t count) {
+		for(size_t i = 0; i < count; i++) {
+			if(!slots[i])
+				continue;
+			if(!extents.empty() && extents.back().first + extents.back().second == slots[i]) {
+				extents.back().second++;
+			}else{
+				extents.push_back({slots[i], 1});
+			}
+			disk_inode->blocks -= (blockSize / 512);
+			slots[i] = 0;
+		}
+	};
+
+	// Indirection blocks stay allocated, even if they become empty: their pages
+	// in indirectOrder1/2 may still be written back to the block they point to.
+	if(block_offset < i_range)
+		releaseSlots(disk_inode->data.blocks.direct + block_offset, i_range - block_offset);
+
+	if(block_offset < s_range && disk_inode->data.blocks.singleIndirect) {
+		helix::LockMemoryView lock_indirect;
+		auto &&submit = helix::submitLockMemoryView(inode->indirectOrder1,
+				&lock_indirect, 0, 1 << blockPagesShift,
+				helix::Dispatcher::global());
+		co_await submit.async_wait();
+		HEL_CHECK(lock_indirect.error());
+
+		helix::Mapping indirect_map{inode->indirectOrder1,
+				0, size_t{1} << blockPagesShift,
+				kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+		auto window = reinterpret_cast<uint32_t *>(indirect_map.get());
+
+		auto start = std::max(block_offset, uint64_t{i_range}) - i_range;
+		releaseSlots(window + start, per_indirect - start);
+	}
+
+	if(block_offset < d_range && disk_inode->data.blocks.doubleIndirect) {
+		helix::LockMemoryView lock_double_indirect;
+		auto &&submit = helix::submitLockMemoryView(inode->indirectOrder1,
+				&lock_double_indirect, 1 << blockPagesShift, 1 << blockPagesShift,
+				helix::Dispatcher::global());
+		co_await submit.async_wait();
+		HEL_CHECK(lock_double_indirect.error());
+
+		helix::Mapping double_indirect_map{inode->indirectOrder1,
+				1 << blockPagesShift, size_t{1} << blockPagesShift,
+				kHelMapProtRead | kHelMapDontRequireBacking};
+		auto double_window = reinterpret_cast<uint32_t *>(double_indirect_map.get());
+
+		auto start = std::max(block_offset, uint64_t{s_range}) - s_range;
+		for(size_t frame = start / per_indirect; frame < per_indirect; frame++) {
+			if(!double_window[frame])
+				continue;
+
+			helix::LockMemoryView lock_indirect;
+			auto &&submit = helix::submitLockMemoryView(inode->indirectOrder2,
+					&lock_indirect, frame << blockPagesShift, 1 << blockPagesShift,
+					helix::Dispatcher::global());
+			co_await submit.async_wait();
+			HEL_CHECK(lock_indirect.error());
+
+			helix::Mapping indirect_map{inode->indirectOrder2,
+					static_cast<ptrdiff_t>(frame << blockPagesShift), size_t{1} << blockPagesShift,
+					kHelMapProtRead | kHelMapProtWrite | kHelMapDontRequireBacking};
+			auto window = reinterpret_cast<uint32_t *>(indirect_map.get());
+
+			auto frame_base = frame * per_indirect;
+			auto first = std::max(start, uint64_t{frame_base}) - frame_base;
+			releaseSlots(window + first, per_indirect - first);
+		}
+	}
+
+	if(disk_inode->data.blocks.tripleIndirect)
+		std::cout << "\e[33m" "ext2fs: Blocks of inode " << inode->number
+				<< " in triple indirect blocks are not freed" "\e[39m" << std::endl;
+
+	if(extents.empty())
+		co_return;
+
+	// Drop the references to the blocks before the blocks become free.
+	auto syncInode = co_await helix_ng::synchronizeSpace(
+			helix::BorrowedDescriptor{kHelNullHandle},
+			inode->diskMapping.get(), inodeSize);
+	HEL_CHECK(syncInode.error());
+
+	for(auto [block, n] : extents)
+		co_await freeBlocks(block, n);
+	co_await writebackBgdt();
+	co_await writebackSuperblock();
+
+	for(auto [block, n] : extents)
+		co_await device->discardSectors(block * sectorsPerBlock, n * sectorsPerBlock);
+}
+
 async::result<void> FileSystem::readDataBlocks(std::shared_ptr<Inode> inode,
 		uint64_t offset, size_t num_blocks, void *buffer) {
 	// We perform "block-fusion" here i.e. we try to read/write multiple
@@ -1286,7 +1882,7 @@ async::result<void> FileSystem::writeDataBlocks(std::shared_ptr<Inode> inode,
 	auto fuse = [] (size_t index, size_t remaining, uint32_t *list, size_t limit) {
 		size_t n = 1;
 		while(n < remaining && index + n < limit) {
-			if(list[index + n] != list[index] + n)
+			if(!list[index] || list[index + n] != list[index] + n)
 				break;
 			n++;
 		}
@@ -1358,16 +1954,31 @@ async::result<void> FileSystem::writeDataBlocks(std::shared_ptr<Inode> inode,
 //		std::cout << "Issuing write of " << issue.second
 //				<< " blocks, starting at " << issue.first << std::endl;
 
-		assert(issue.first);
-		co_await device->writeSectors(issue.first * sectorsPerBlock,
-				(const uint8_t *)buffer + progress * blockSize,
-				issue.second * sectorsPerBlock);
+		// Holes can be part of a dirty page if truncate() freed blocks of that page.
+		// The page cache only contains zeros for them, so there is nothing to write.
+		if(issue.first)
+			co_await device->writeSectors(issue.first * sectorsPerBlock,
+					(const uint8_t *)buffer + progress * blockSize,
+					issue.second * sectorsPerBlock);
 		progress += issue.second;
 	}
 }
 
 
 async::result<void> FileSystem::truncate(Inode *inode, size_t size) {
+	auto oldSize = inode->fileSize();
+
+	// The page that contains the new end of the file stays in the page cache.
+	// Clear its tail such that the data does not reappear if the file grows again.
+	auto pageEnd = std::min(oldSize, (size + 0xFFF) & ~uint64_t(0xFFF));
+	if(size < pageEnd) {
+		std::vector<char> zeros(pageEnd - size);
+		auto writeMemory = co_await helix_ng::writeMemory(
+				helix::BorrowedDescriptor(inode->frontalMemory),
+				size, zeros.size(), zeros.data());
+		HEL_CHECK(writeMemory.error());
+	}
+
 	HEL_CHECK(helResizeMemory(inode->backingMemory,
 			(size + 0xFFF) & ~size_t(0xFFF)));
 	inode->setFileSize(size);
@@ -1375,7 +1986,9 @@ async::result<void> FileSystem::truncate(Inode *inode, size_t size) {
 			helix::BorrowedDescriptor{kHelNullHandle},
 			inode->diskMapping.get(), inodeSize);
 	HEL_CHECK(syncInode.error());
-	co_return;
+
+	if(size < oldSize)
+		co_await freeDataBlocks(inode, (size + blockSize - 1) >> blockShift);
 }
 
 async::result<void> FileSystem::writebackBgdt() {
@@ -1384,6 +1997,11 @@ async::result<void> FileSystem::writebackBgdt() {
 			blockGroupDescriptorBuffer.data(), blockGroupDescriptorBuffer.size() / 512);
 }
 
+async::result<void> FileSystem::writebackSuperblock() {
+	// The superblock always starts at byte 1024.
+	co_await device->writeSectors(2, &superblock, 2);
+}
+
 // --------------------------------------------------------
 // OpenFile
 // --------------------------------------------------------
@@ -15,6 +15,7 @@
 
 #include <blockfs.hpp>
 #include "common.hpp"
+#include "manage.hpp"
 #include "fs.bragi.hpp"
 
 namespace blockfs {
@@ -93,7 +94,9 @@ struct DiskSuperblock {
 	//-- Other options --
 	uint32_t defaultMountOptions;
 	uint32_t firstMetaBg;
-	uint8_t unused[760];
+	uint8_t unused0[88];
+	uint32_t flags;
+	uint8_t unused1[668];
 };
 static_assert(sizeof(DiskSuperblock) == 1024, "Bad DiskSuperblock struct size");
 
@@ -135,6 +138,18 @@ enum {
 	EXT2_ROOT_INO = 2
 };
 
+enum {
+	EXT2_FEATURE_COMPAT_DIR_INDEX = 0x0020
+};
+
+enum {
+	EXT2_FLAGS_UNSIGNED_HASH = 0x0002
+};
+
+enum {
+	EXT2_INDEX_FL = 0x00001000
+};
+
 enum {
 	EXT2_S_IFMT = 0xF000,
 	EXT2_S_IFLNK = 0xA000,
@@ -156,6 +171,42 @@ enum {
 	EXT2_FT_SYMLINK = 7
 };
 
+// The following structures are used by hashed (htree) directories.
+// The root block starts with the "." and ".." entries, followed by DiskDxRootInfo.
+// Interior index blocks start with an empty DiskDirEntry spanning the whole block.
+// In both cases, the DiskDxEntry array follows; the hash of its first element
+// is replaced by a DiskDxCountLimit.
+
+struct DiskDxRootInfo {
+	uint32_t reservedZero;
+	uint8_t hashVersion;
+	uint8_t infoLength;
+	uint8_t indirectLevels;
+	uint8_t unusedFlags;
+};
+static_assert(sizeof(DiskDxRootInfo) == 8, "Bad DiskDxRootInfo struct size");
+
+struct DiskDxCountLimit {
+	uint16_t limit;
+	uint16_t count;
+};
+static_assert(sizeof(DiskDxCountLimit) == 4, "Bad DiskDxCountLimit struct size");
+
+struct DiskDxEntry {
+	uint32_t hash;
+	uint32_t block;
+};
+static_assert(sizeof(DiskDxEntry) == 8, "Bad DiskDxEntry struct size");
+
+enum {
+	DX_HASH_LEGACY = 0,
+	DX_HASH_HALF_MD4 = 1,
+	DX_HASH_TEA = 2,
+	DX_HASH_LEGACY_UNSIGNED = 3,
+	DX_HASH_HALF_MD4_UNSIGNED = 4,
+	DX_HASH_TEA_UNSIGNED = 5
+};
+
 // --------------------------------------------------------
 // DirEntry
 // --------------------------------------------------------
@@ -188,6 +239,12 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	async::result<frg::expected<protocols::fs::Error, std::optional<DirEntry>>>
 	findEntry(std::string name);
 
+	// Walks the htree index of this directory. Returns the logical blocks that
+	// may contain the entry or std::nullopt if the index cannot be used.
+	async::result<std::optional<std::vector<uint32_t>>> probeHtree(const std::string &name);
+	// Clears the htree flag before the directory is modified.
+	async::result<void> dropHtree();
+
 	async::result<std::optional<DirEntry>> link(std::string name, int64_t ino, blockfs::FileType type);
 	async::result<frg::expected<protocols::fs::Error>> unlink(std::string name);
 	async::result<std::optional<DirEntry>> mkdir(std::string name);
@@ -214,6 +271,10 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	HelHandle frontalMemory;
 	helix::Mapping fileMapping;
 
+	// Limits and orders the concurrently processed page cache requests.
+	InflightLimiter manageLimiter;
+	RangeSerializer manageRanges;
+
 	// Caches indirection blocks reachable from the inode.
 	// - Indirection level 1/1 for single indirect blocks.
 	// - Indirection level 1/2 for double indirect blocks.
@@ -235,6 +296,11 @@ struct Inode : std::enable_shared_from_this<Inode> {
 	FlockManager flockManager;
 
 	std::unordered_set<std::string> obstructedLinks;
+
+	// In-memory index of large linear directories, mapping names to the offsets
+	// of their DiskDirEntry. Built lazily by findEntry(), maintained by link() and unlink().
+	bool dirIndexValid = false;
+	std::unordered_map<std::string, uint32_t> dirIndex;
 };
 
 // --------------------------------------------------------
@@ -261,14 +327,25 @@ struct FileSystem {
 
 	async::detached initiateInode(std::shared_ptr<Inode> inode);
 	async::detached manageFileData(std::shared_ptr<Inode> inode);
+	async::detached handleFileData(std::shared_ptr<Inode> inode, int type,
+			uintptr_t offset, size_t length, RangeSerializer::Ticket ticket);
 	async::detached manageIndirect(std::shared_ptr<Inode> inode, int order,
 			helix::UniqueDescriptor memory);
 
-	async::result<uint32_t> allocateBlock();
+	// Allocates up to count contiguous blocks, preferably starting at goal.
+	// Returns the first block and the number of blocks of the extent (or {0, 0} if the disk is full).
+	// The caller is responsible for writing back the BGDT and the superblock.
+	async::result<std::pair<uint32_t, size_t>> allocateBlocks(uint32_t goal, size_t count);
+	// Returns count contiguous blocks to the block bitmap.
+	// The caller is responsible for writing back the BGDT and the superblock.
+	async::result<void> freeBlocks(uint32_t block, size_t count);
 	async::result<uint32_t> allocateInode();
 
 	async::result<void> assignDataBlocks(Inode *inode,
 			uint64_t block_offset, size_t num_blocks);
+	// Frees all data blocks of the file starting at logical block block_offset
+	// and discards them on the device.
+	async::result<void> freeDataBlocks(Inode *inode, uint64_t block_offset);
 
 	async::result<void> readDataBlocks(std::shared_ptr<Inode> inode, uint64_t block_offset,
 			size_t num_blocks, void *buffer);
@@ -278,6 +355,7 @@ struct FileSystem {
 	async::result<void> truncate(Inode *inode, size_t size);
 
 	async::result<void> writebackBgdt();
+	async::result<void> writebackSuperblock();
 
 	BlockDevice *device;
 	uint16_t inodeSize;
@@ -290,8 +368,16 @@ struct FileSystem {
 	uint32_t inodesPerGroup;
 	uint32_t blocksCount;
 	uint32_t inodesCount;
+	uint32_t firstDataBlock;
+	DiskSuperblock superblock;
+	bool hasDirIndex;
+	bool unsignedDirHash;
+	uint32_t dirHashSeed[4];
 	std::vector<std::byte> blockGroupDescriptorBuffer;
 	DiskGroupDesc *bgdt;
+	// Per block group: all blocks below this index are known to be allocated.
+	// freeBlocks() lowers the hints again.
+	std::vector<uint32_t> blockSearchHints;
 
 	helix::UniqueDescriptor blockBitmap;
 	helix::UniqueDescriptor inodeBitmap;
@@ -66,7 +66,13 @@ Partition &Table::getPartition(int index) {
 Partition::Partition(Table &table, Guid id, Guid type,
 		uint64_t start_lba, uint64_t num_sectors)
 : BlockDevice(table.getDevice()->sectorSize, table.getDevice()->parentId), _table(table),
-	_id(id), _type(type), _startLba(start_lba), _numSectors(num_sectors) { }
+	_id(id), _type(type), _startLba(start_lba), _numSectors(num_sectors) {
+	maxManageRequests = table.getDevice()->maxManageRequests;
+	maxManageRequestsPerFile = table.getDevice()->maxManageRequestsPerFile;
+	maxSectorsPerRequest = table.getDevice()->maxSectorsPerRequest;
+	maxInflightRequests = table.getDevice()->maxInflightRequests;
+	plugDelay = table.getDevice()->plugDelay;
+}
 
 Guid Partition::type() {
 	return _type;
@@ -84,9 +90,23 @@ async::result<void> Partition::writeSectors(uint64_t sector, const void *buffer,
 			buffer, count);
 }
 
+async::result<void> Partition::discardSectors(uint64_t sector, size_t count) {
+	assert(sector + count <= _numSectors);
+	return _table.getDevice()->discardSectors(_startLba + sector, count);
+}
+
+async::result<void> Partition::writeZeroes(uint64_t sector, size_t count) {
+	assert(sector + count <= _numSectors);
+	return _table.getDevice()->writeZeroes(_startLba + sector, count);
+}
+
 async::result<size_t> Partition::getSize() {
 	co_return _numSectors * sectorSize;
 }
 
+BlockDevice *Partition::physicalDevice() {
+	return _table.getDevice()->physicalDevice();
+}
+
 } } // namespace blockfs::gpt
 
@@ -104,8 +104,14 @@ struct Partition : public BlockDevice {
 	async::result<void> writeSectors(uint64_t sector, const void *buffer,
 			size_t num_sectors) override;
 
+	async::result<void> discardSectors(uint64_t sector, size_t num_sectors) override;
+
+	async::result<void> writeZeroes(uint64_t sector, size_t num_sectors) override;
+
 	async::result<size_t> getSize() override;
 
+	BlockDevice *physicalDevice() override;
+
 	Guid id();
 
 	Guid type();
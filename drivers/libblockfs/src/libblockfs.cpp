@@ -1,4 +1,6 @@
+#include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <iostream>
 #include <algorithm>
@@ -15,6 +17,7 @@
 #include <blockfs.hpp>
 #include "gpt.hpp"
 #include "ext2fs.hpp"
+#include "queue.hpp"
 #include "raw.hpp"
 #include "fs.bragi.hpp"
 #include <bragi/helpers-std.hpp>
@@ -601,6 +604,23 @@ constexpr protocols::fs::FileOperations rawOperations {
 BlockDevice::BlockDevice(size_t sector_size, int64_t parent_id)
 : size(0), sectorSize(sector_size), parentId(parent_id) { }
 
+async::result<void> BlockDevice::writeZeroes(uint64_t sector, size_t num_sectors) {
+	constexpr size_t pageSize = 0x1000;
+	constexpr size_t maxChunkSize = 0x10000;
+
+	auto chunkSectors = std::max(maxChunkSize / sectorSize, size_t{1});
+	auto bufferSize = (chunkSectors * sectorSize + pageSize - 1) & ~(pageSize - 1);
+	auto buffer = aligned_alloc(pageSize, bufferSize);
+	assert(buffer);
+	memset(buffer, 0, bufferSize);
+
+	for(size_t progress = 0; progress < num_sectors; progress += chunkSectors)
+		co_await writeSectors(sector + progress, buffer,
+				std::min(num_sectors - progress, chunkSectors));
+
+	free(buffer);
+}
+
 async::detached servePartition(helix::UniqueLane lane) {
 	std::cout << "unix device: Connection" << std::endl;
 
@@ -794,7 +814,10 @@ async::detached runDevice(BlockDevice *device) {
 	ostByteCounter = co_await ostContext.announceItem("numBytes");
 	ostTimeCounter = co_await ostContext.announceItem("time");
 
-	table = new gpt::Table(device);
+	// All requests pass through the block queue.
+	auto queue = new BlockQueue(device);
+
+	table = new gpt::Table(queue);
 	co_await table->parse();
 
 	int64_t diskId = 0;
@@ -0,0 +1,71 @@
+#include <unordered_map>
+
+#include "manage.hpp"
+
+namespace blockfs {
+
+// --------------------------------------------------------
+// InflightLimiter
+// --------------------------------------------------------
+
+InflightLimiter::InflightLimiter(size_t limit)
+: limit_{limit} {
+	assert(limit_);
+}
+
+async::result<void> InflightLimiter::acquire() {
+	while(inFlight_ >= limit_)
+		co_await doorbell_.async_wait();
+	inFlight_++;
+}
+
+void InflightLimiter::release() {
+	assert(inFlight_);
+	if(inFlight_-- == limit_)
+		doorbell_.raise();
+}
+
+// --------------------------------------------------------
+// RangeSerializer
+// --------------------------------------------------------
+
+auto RangeSerializer::enqueue(uint64_t offset, size_t length) -> Ticket {
+	return ranges_.insert(ranges_.end(), Range{offset, length});
+}
+
+async::result<void> RangeSerializer::wait(Ticket ticket) {
+	while(isBlocked_(ticket))
+		co_await doorbell_.async_wait();
+}
+
+void RangeSerializer::complete(Ticket ticket) {
+	ranges_.erase(ticket);
+	doorbell_.raise();
+}
+
+bool RangeSerializer::isBlocked_(Ticket ticket) {
+	for(auto it = ranges_.begin(); it != ticket; ++it) {
+		if(it->offset < ticket->offset + ticket->length
+				&& ticket->offset < it->offset + it->length)
+			return true;
+	}
+	return false;
+}
+
+// --------------------------------------------------------
+// Free functions
+// --------------------------------------------------------
+
+InflightLimiter &deviceManageLimiter(BlockDevice *device) {
+	static std::unordered_map<BlockDevice *, InflightLimiter> limiters;
+
+	// All partitions of a disk share the limiter of the disk.
+	device = device->physicalDevice();
+
+	auto it = limiters.find(device);
+	if(it == limiters.end())
+		it = limiters.emplace(device, device->maxManageRequests).first;
+	return it->second;
+}
+
+} // namespace blockfs
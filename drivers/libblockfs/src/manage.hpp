@@ -0,0 +1,54 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <list>
+
+#include <async/recurring-event.hpp>
+#include <async/result.hpp>
+#include <blockfs.hpp>
+
+namespace blockfs {
+
+// Limits the number of operations that are processed concurrently.
+struct InflightLimiter {
+	InflightLimiter(size_t limit);
+
+	async::result<void> acquire();
+	void release();
+
+private:
+	size_t limit_;
+	size_t inFlight_ = 0;
+	async::recurring_event doorbell_;
+};
+
+// Orders operations on overlapping byte ranges by their arrival.
+// Operations on disjoint ranges proceed concurrently.
+struct RangeSerializer {
+	struct Range {
+		uint64_t offset;
+		size_t length;
+	};
+
+	using Ticket = std::list<Range>::iterator;
+
+	// Must be called in arrival order, i.e., before the operation suspends.
+	Ticket enqueue(uint64_t offset, size_t length);
+
+	// Waits until all earlier operations on overlapping ranges are complete.
+	async::result<void> wait(Ticket ticket);
+
+	void complete(Ticket ticket);
+
+private:
+	bool isBlocked_(Ticket ticket);
+
+	std::list<Range> ranges_;
+	async::recurring_event doorbell_;
+};
+
+// Returns the limiter that is shared by all page cache requests to a physical device.
+InflightLimiter &deviceManageLimiter(BlockDevice *device);
+
+} // namespace blockfs
@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <helix/timer.hpp>
+
+#include "queue.hpp"
+
+namespace blockfs {
+
+namespace {
+	constexpr bool logLatencies = false;
+
+	// Print the latency histograms every logInterval requests.
+	constexpr uint64_t logInterval = 1 << 16;
+
+	// Requests are only merged up to this size. Since the drivers expect
+	// a single buffer per request, merging requires a bounce buffer.
+	constexpr size_t maxMergeBytes = 128 * 1024;
+}
+
+// --------------------------------------------------------
+// LatencyHistogram
+// --------------------------------------------------------
+
+void LatencyHistogram::record(uint64_t nanos) {
+	auto micros = nanos / 1000;
+	int bucket = 0;
+	while(bucket + 1 < numBuckets && (uint64_t{1} << bucket) <= micros)
+		bucket++;
+	buckets_[bucket]++;
+	count_++;
+	sum_ += nanos;
+	max_ = std::max(max_, nanos);
+}
+
+void LatencyHistogram::dump(const char *device, const char *name) {
+	if(!count_)
+		return;
+
+	std::cout << "libblockfs: " << name << " latency on " << device << ": "
+			<< count_ << " requests, avg " << (sum_ / count_) / 1000 << " us, max "
+			<< max_ / 1000 << " us" << std::endl;
+	for(int i = 0; i < numBuckets; i++) {
+		if(!buckets_[i])
+			continue;
+		std::cout << "libblockfs:     < " << (uint64_t{1} << i) << " us: "
+				<< buckets_[i] << std::endl;
+	}
+}
+
+// --------------------------------------------------------
+// BlockQueue
+// --------------------------------------------------------
+
+BlockQueue::BlockQueue(BlockDevice *device)
+: BlockDevice{device->sectorSize, device->parentId}, device_{device} {
+	maxManageRequests = device->maxManageRequests;
+	maxManageRequestsPerFile = device->maxManageRequestsPerFile;
+	maxSectorsPerRequest = device->maxSectorsPerRequest;
+	maxInflightRequests = device->maxInflightRequests;
+	plugDelay = device->plugDelay;
+	assert(maxInflightRequests);
+
+	dispatch_();
+}
+
+async::result<void> BlockQueue::readSectors(uint64_t sector, void *buffer,
+		size_t num_sectors) {
+	return submit_(false, sector, buffer, num_sectors);
+}
+
+async::result<void> BlockQueue::writeSectors(uint64_t sector, const void *buffer,
+		size_t num_sectors) {
+	return submit_(true, sector, const_cast<void *>(buffer), num_sectors);
+}
+
+// Discard and write zeroes requests do not carry data, hence they are neither
+// merged nor split here; the driver splits them to its own limits.
+async::result<void> BlockQueue::discardSectors(uint64_t sector, size_t num_sectors) {
+	return device_->discardSectors(sector, num_sectors);
+}
+
+async::result<void> BlockQueue::writeZeroes(uint64_t sector, size_t num_sectors) {
+	return device_->writeZeroes(sector, num_sectors);
+}
+
+async::result<size_t> BlockQueue::getSize() {
+	return device_->getSize();
+}
+
+BlockDevice *BlockQueue::physicalDevice() {
+	return device_->physicalDevice();
+}
+
+async::result<void> BlockQueue::submit_(bool write, uint64_t sector, void *buffer,
+		size_t num_sectors) {
+	if(!num_sectors)
+		co_return;
+
+	uint64_t now;
+	HEL_CHECK(helGetClock(&now));
+
+	// Split the request to the limits of the device.
+	auto limit = maxSectorsPerRequest ? maxSectorsPerRequest : num_sectors;
+	std::vector<Request> requests((num_sectors + limit - 1) / limit);
+	for(size_t i = 0; i < requests.size(); i++) {
+		auto &req = requests[i];
+		req.write = write;
+		req.sector = sector + i * limit;
+		req.numSectors = std::min(limit, num_sectors - i * limit);
+		req.buffer = reinterpret_cast<std::byte *>(buffer) + i * limit * sectorSize;
+		req.queueTime = now;
+		pending_.push_back(&req);
+	}
+	pendingDoorbell_.raise();
+
+	for(auto &req : requests)
+		co_await req.done.wait();
+}
+
+auto BlockQueue::takeMergeable_(bool write, uint64_t sector, size_t count) -> Request * {
+	// Merged requests must fit into the bounce buffer and into a single driver request.
+	auto maxSectors = maxMergeBytes / sectorSize;
+	if(maxSectorsPerRequest)
+		maxSectors = std::min(maxSectors, maxSectorsPerRequest);
+
+	for(auto it = pending_.begin(); it != pending_.end(); ++it) {
+		auto req = *it;
+		// Requests must not overtake requests of the opposite direction,
+		// as they might access the same sectors.
+		if(req->write != write)
+			break;
+		if(req->sector != sector + count && req->sector + req->numSectors != sector)
+			continue;
+		if(count + req->numSectors > maxSectors)
+			continue;
+		pending_.erase(it);
+		return req;
+	}
+	return nullptr;
+}
+
+async::detached BlockQueue::dispatch_() {
+	while(true) {
+		while(pending_.empty())
+			co_await pendingDoorbell_.async_wait();
+
+		// Plug the queue: give concurrent submitters a chance to queue requests
+		// that can be merged with the current ones. We only do this if the device is idle;
+		// otherwise, requests accumulate anyway while we wait for a free slot.
+		if(plugDelay && !inFlight_)
+			co_await helix::sleepFor(plugDelay);
+
+		while(inFlight_ >= maxInflightRequests)
+			co_await completionDoorbell_.async_wait();
+
+		// Requests are dispatched in FIFO order; requests that are adjacent
+		// to the head of the queue are merged into it.
+		auto head = pending_.front();
+		pending_.pop_front();
+
+		std::vector<Request *> batch{head};
+		uint64_t sector = head->sector;
+		size_t count = head->numSectors;
+		while(auto req = takeMergeable_(head->write, sector, count)) {
+			if(req->sector < sector) {
+				batch.insert(batch.begin(), req);
+				sector = req->sector;
+			}else{
+				batch.push_back(req);
+			}
+			count += req->numSectors;
+		}
+
+		inFlight_++;
+		issue_(std::move(batch));
+	}
+}
+
+async::detached BlockQueue::issue_(std::vector<Request *> batch) {
+	auto first = batch.front();
+	auto write = first->write;
+
+	if(batch.size() == 1) {
+		if(write) {
+			co_await device_->writeSectors(first->sector, first->buffer, first->numSectors);
+		}else{
+			co_await device_->readSectors(first->sector, first->buffer, first->numSectors);
+		}
+	}else{
+		size_t count = 0;
+		for(auto req : batch)
+			count += req->numSectors;
+
+		std::vector<std::byte> bounce(count * sectorSize);
+		if(write) {
+			size_t offset = 0;
+			for(auto req : batch) {
+				memcpy(bounce.data() + offset, req->buffer, req->numSectors * sectorSize);
+				offset += req->numSectors * sectorSize;
+			}
+			co_await device_->writeSectors(first->sector, bounce.data(), count);
+		}else{
+			co_await device_->readSectors(first->sector, bounce.data(), count);
+			size_t offset = 0;
+			for(auto req : batch) {
+				memcpy(req->buffer, bounce.data() + offset, req->numSectors * sectorSize);
+				offset += req->numSectors * sectorSize;
+			}
+		}
+	}
+
+	uint64_t now;
+	HEL_CHECK(helGetClock(&now));
+
+	assert(inFlight_);
+	inFlight_--;
+	completionDoorbell_.raise();
+
+	for(auto req : batch) {
+		if(write) {
+			writeLatency_.record(now - req->queueTime);
+		}else{
+			readLatency_.record(now - req->queueTime);
+		}
+		req->done.raise();
+	}
+
+	auto previous = numCompleted_;
+	numCompleted_ += batch.size();
+	if(logLatencies && previous / logInterval != numCompleted_ / logInterval) {
+		auto name = std::to_string(parentId);
+		readLatency_.dump(name.c_str(), "read");
+		writeLatency_.dump(name.c_str(), "write");
+	}
+}
+
+} // namespace blockfs
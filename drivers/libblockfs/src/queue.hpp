@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <list>
+
+#include <async/oneshot-event.hpp>
+#include <async/recurring-event.hpp>
+#include <async/result.hpp>
+#include <blockfs.hpp>
+
+namespace blockfs {
+
+// Block-layer request queue that sits between the file systems and a driver.
+// Contiguous requests of the same direction are merged while they wait for the
+// device, requests are split to the limits of the device and at most
+// BlockDevice::maxInflightRequests requests are submitted to the driver at once.
+struct BlockQueue final : BlockDevice {
+	BlockQueue(BlockDevice *device);
+
+	async::result<void> readSectors(uint64_t sector, void *buffer,
+			size_t num_sectors) override;
+
+	async::result<void> writeSectors(uint64_t sector, const void *buffer,
+			size_t num_sectors) override;
+
+	async::result<void> discardSectors(uint64_t sector, size_t num_sectors) override;
+
+	async::result<void> writeZeroes(uint64_t sector, size_t num_sectors) override;
+
+	async::result<size_t> getSize() override;
+
+	BlockDevice *physicalDevice() override;
+
+private:
+	struct Request {
+		bool write;
+		uint64_t sector;
+		size_t numSectors;
+		void *buffer;
+		uint64_t queueTime;
+		async::oneshot_event done;
+	};
+
+	async::result<void> submit_(bool write, uint64_t sector, void *buffer,
+			size_t num_sectors);
+
+	async::detached dispatch_();
+
+	async::detached issue_(std::vector<Request *> batch);
+
+	// Removes a pending request that can be merged into [sector, sector + count).
+	Request *takeMergeable_(bool write, uint64_t sector, size_t count);
+
+	BlockDevice *device_;
+
+	std::list<Request *> pending_;
+	async::recurring_event pendingDoorbell_;
+
+	size_t inFlight_ = 0;
+	async::recurring_event completionDoorbell_;
+
+	uint64_t numCompleted_ = 0;
+	LatencyHistogram readLatency_;
+	LatencyHistogram writeLatency_;
+};
+
+} // namespace blockfs
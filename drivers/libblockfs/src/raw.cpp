@@ -4,7 +4,7 @@ namespace blockfs {
 namespace raw {
 
 RawFs::RawFs(BlockDevice *device)
-: device{device} { }
+: device{device}, manageLimiter{device->maxManageRequestsPerFile} { }
 
 async::result<void> RawFs::init() {
 	auto device_size = co_await device->getSize();
@@ -18,49 +18,65 @@ async::result<void> RawFs::init() {
 
 async::detached RawFs::manageMapping() {
 	while(true) {
+		co_await manageLimiter.acquire();
+
 		helix::ManageMemory manage;
 		auto &&submit = helix::submitManageMemory(helix::BorrowedDescriptor{backingMemory},
 				&manage, helix::Dispatcher::global());
 		co_await submit.async_wait();
 		HEL_CHECK(manage.error());
 
-		auto device_size = co_await device->getSize();
-		auto cache_size = (device_size + 0xFFF) & ~size_t(0xFFF);
-		assert(manage.offset() + manage.length() <= cache_size);
+		auto ticket = manageRanges.enqueue(manage.offset(), manage.length());
+		handleMapping(manage.type(), manage.offset(), manage.length(), ticket);
+	}
+}
+
+async::detached RawFs::handleMapping(int type, uintptr_t offset, size_t length,
+		RangeSerializer::Ticket ticket) {
+	auto &deviceLimiter = deviceManageLimiter(device);
+	co_await manageRanges.wait(ticket);
+	co_await deviceLimiter.acquire();
 
-		if(manage.type() == kHelManageInitialize) {
-			helix::Mapping file_map{helix::BorrowedDescriptor{backingMemory},
-				static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtWrite};
-			assert(!(manage.offset() & device->sectorSize));
+	auto device_size = co_await device->getSize();
+	auto cache_size = (device_size + 0xFFF) & ~size_t(0xFFF);
+	assert(offset + length <= cache_size);
 
-			size_t backed_size = std::min(manage.length(), device_size - manage.offset());
-			size_t num_blocks = (backed_size + device->sectorSize - 1) / device->sectorSize;
+	if(type == kHelManageInitialize) {
+		helix::Mapping file_map{helix::BorrowedDescriptor{backingMemory},
+			static_cast<ptrdiff_t>(offset), length, kHelMapProtWrite};
+		assert(!(offset & device->sectorSize));
 
-			assert(num_blocks * device->sectorSize <= manage.length());
-			co_await device->readSectors(manage.offset() / device->sectorSize, file_map.get(),
-					num_blocks);
+		size_t backed_size = std::min(length, device_size - offset);
+		size_t num_blocks = (backed_size + device->sectorSize - 1) / device->sectorSize;
 
-			HEL_CHECK(helUpdateMemory(backingMemory, kHelManageInitialize,
-						manage.offset(), manage.length()));
-		} else {
-			assert(manage.type() == kHelManageWriteback);
+		assert(num_blocks * device->sectorSize <= length);
+		co_await device->readSectors(offset / device->sectorSize, file_map.get(),
+				num_blocks);
 
-			helix::Mapping file_map{helix::BorrowedDescriptor{backingMemory},
-				static_cast<ptrdiff_t>(manage.offset()), manage.length(), kHelMapProtRead};
+		HEL_CHECK(helUpdateMemory(backingMemory, kHelManageInitialize,
+					offset, length));
+	} else {
+		assert(type == kHelManageWriteback);
 
-			assert(!(manage.offset() & device->sectorSize));
+		helix::Mapping file_map{helix::BorrowedDescriptor{backingMemory},
+			static_cast<ptrdiff_t>(offset), length, kHelMapProtRead};
 
-			size_t backed_size = std::min(manage.length(), device_size - manage.offset());
-			size_t num_blocks = (backed_size + device->sectorSize - 1) / device->sectorSize;
+		assert(!(offset & device->sectorSize));
 
-			assert(num_blocks * device->sectorSize <= manage.length());
-			co_await device->writeSectors(manage.offset() / device->sectorSize, file_map.get(),
-					num_blocks);
+		size_t backed_size = std::min(length, device_size - offset);
+		size_t num_blocks = (backed_size + device->sectorSize - 1) / device->sectorSize;
 
-			HEL_CHECK(helUpdateMemory(backingMemory, kHelManageWriteback,
-						manage.offset(), manage.length()));
-		}
+		assert(num_blocks * device->sectorSize <= length);
+		co_await device->writeSectors(offset / device->sectorSize, file_map.get(),
+				num_blocks);
+
+		HEL_CHECK(helUpdateMemory(backingMemory, kHelManageWriteback,
+					offset, length));
 	}
+
+	deviceLimiter.release();
+	manageRanges.complete(ticket);
+	manageLimiter.release();
 }
 
 OpenFile::OpenFile(RawFs *rawFs)
@@ -5,6 +5,8 @@
 #include <protocols/fs/file-locks.hpp>
 #include <blockfs.hpp>
 
+#include "manage.hpp"
+
 namespace blockfs {
 namespace raw {
 
@@ -17,11 +19,15 @@ struct RawFs {
 	async::result<void> init();
 
 	async::detached manageMapping();
+	async::detached handleMapping(int type, uintptr_t offset, size_t length,
+			RangeSerializer::Ticket ticket);
 
 	BlockDevice *device;
 	HelHandle backingMemory;
 	HelHandle frontalMemory;
 	helix::Mapping fileMapping;
+	InflightLimiter manageLimiter;
+	RangeSerializer manageRanges;
 	FlockManager flockManager;
 };
 
@@ -1,7 +1,17 @@
 #include <nic/virtio/virtio.hpp>
 
 #include <arch/dma_pool.hpp>
+#include <arch/register.hpp>
+#include <async/basic.hpp>
+#include <async/oneshot-event.hpp>
+#include <async/recurring-event.hpp>
+#include <algorithm>
+#include <cassert>
 #include <core/virtio/core.hpp>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <vector>
 
 namespace {
 	constexpr bool logFrames = false;
@@ -11,14 +21,82 @@ namespace {
 // Device feature bits.
 constexpr size_t legacyHeaderSize = 10;
 enum {
-	VIRTIO_NET_F_MAC = 5
+	VIRTIO_NET_F_CSUM = 0,
+	VIRTIO_NET_F_GUEST_CSUM = 1,
+	VIRTIO_NET_F_MAC = 5,
+	VIRTIO_NET_F_HOST_TSO4 = 11,
+	VIRTIO_NET_F_CTRL_VQ = 17,
+	VIRTIO_NET_F_MQ = 22,
+	VIRTIO_NET_F_RSS = 60
 };
 
+namespace spec::regs {
+	inline constexpr arch::scalar_register<uint16_t> maxVirtqueuePairs{8};
+	inline constexpr arch::scalar_register<uint8_t> rssMaxKeySize{17};
+	inline constexpr arch::scalar_register<uint16_t> rssMaxIndirectionTableLength{18};
+	inline constexpr arch::scalar_register<uint32_t> supportedHashTypes{20};
+}
+
+// Control virtq commands.
+enum {
+	VIRTIO_NET_CTRL_MQ = 4
+};
+
+enum {
+	VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET = 0,
+	VIRTIO_NET_CTRL_MQ_RSS_CONFIG = 1
+};
+
+constexpr uint8_t VIRTIO_NET_OK = 0;
+
+// Hash types for VIRTIO_NET_CTRL_MQ_RSS_CONFIG.
+enum {
+	VIRTIO_NET_RSS_HASH_TYPE_IPv4 = 1,
+	VIRTIO_NET_RSS_HASH_TYPE_TCPv4 = 2,
+	VIRTIO_NET_RSS_HASH_TYPE_UDPv4 = 4
+};
+
+// Maximal number of queue pairs that we set up.
+constexpr unsigned int maxQueuePairs = 16;
+
+// Length of the RSS indirection table (if the device supports it).
+constexpr size_t rssTableLength = 128;
+
+// The well-known default Toeplitz key (as used by most NIC drivers).
+constexpr uint8_t rssKey[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+// Computes the Toeplitz hash of input, as specified for RSS.
+// The key must be at least 4 bytes longer than the input.
+uint32_t toeplitzHash(const uint8_t *input, size_t size) {
+	assert(size + 4 <= sizeof(rssKey));
+	uint32_t result = 0;
+	uint32_t window = (uint32_t{rssKey[0]} << 24) | (uint32_t{rssKey[1]} << 16)
+			| (uint32_t{rssKey[2]} << 8) | rssKey[3];
+	for(size_t i = 0; i < size; i++) {
+		for(int b = 7; b >= 0; b--) {
+			if(input[i] & (1 << b))
+				result ^= window;
+			window = (window << 1) | ((rssKey[i + 4] >> b) & 1);
+		}
+	}
+	return result;
+}
+
 // Bits for VirtHeader::flags.
 enum {
-	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1
+	VIRTIO_NET_HDR_F_NEEDS_CSUM = 1,
+	VIRTIO_NET_HDR_F_DATA_VALID = 2
 };
 
+// Largest frame that we transmit with TSO.
+constexpr size_t maxTsoFrameSize = 14 + 0xFFFF;
+
 // Values for VirtHeader::gsoType.
 enum {
 	VIRTIO_NET_HDR_GSO_NONE = 0,
@@ -44,12 +122,68 @@ struct VirtioNic : nic::Link {
 	virtual async::result<void> receive(arch::dma_buffer_view) override;
 	virtual async::result<void> send(const arch::dma_buffer_view) override;
 
+	virtual size_t numReceiveQueues() override;
+	virtual size_t receiveQueueDepth(size_t queue) override;
+	virtual async::result<void> postReceiveBuffers(size_t queue,
+			std::vector<arch::dma_buffer> buffers) override;
+	virtual async::result<std::vector<ReceivedFrame>> receiveBurst(size_t queue,
+			size_t max) override;
+	virtual async::result<void> sendBurst(std::vector<TxFrame> frames) override;
+
 	virtual ~VirtioNic() override = default;
 private:
+	struct RxRequest;
+
+	// A receive virtq and a transmit virtq. With VIRTIO_NET_F_MQ, each pair is bound
+	// to its own interrupt vector (if possible) and the device steers flows to pairs.
+	struct QueuePair {
+		virtio_core::Queue *receiveVq;
+		virtio_core::Queue *transmitVq;
+
+		// Receive buffers that were filled by the device, in order of completion.
+		std::deque<RxRequest *> receivedFrames;
+		async::recurring_event receiveDoorbell;
+	};
+
+	// A receive buffer that is owned by the device.
+	struct RxRequest : virtio_core::Request {
+		RxRequest(VirtioNic *nic, QueuePair *pair, arch::dma_buffer frame)
+		: pair{pair}, header{&nic->dmaPool_}, frame{std::move(frame)} { }
+
+		QueuePair *pair;
+		arch::dma_object<VirtHeader> header;
+		arch::dma_buffer frame;
+	};
+
+	struct TxRequest : virtio_core::Request {
+		TxRequest(VirtioNic *nic)
+		: header{&nic->dmaPool_} { }
+
+		arch::dma_object<VirtHeader> header;
+		async::oneshot_event event;
+	};
+
+	// Enables all queue pairs (and RSS, if supported) via the control virtq.
+	async::detached enableQueuePairs_();
+
+	// Submits a command to the control virtq; returns true if the device accepted it.
+	async::result<bool> sendControl_(uint8_t cls, uint8_t command, const void *data, size_t size);
+
+	// Selects the queue pair that a frame is transmitted on, such that all frames
+	// of a flow are transmitted on the pair that the device receives the flow on.
+	size_t selectTransmitQueue_(arch::dma_buffer_view frame);
+
 	std::unique_ptr<virtio_core::Transport> transport_;
 	arch::contiguous_pool dmaPool_;
-	virtio_core::Queue *receiveVq_;
-	virtio_core::Queue *transmitVq_;
+	std::vector<std::unique_ptr<QueuePair>> queues_;
+	virtio_core::Queue *controlVq_ = nullptr;
+
+	// Number of queue pairs that the device currently uses. This is only
+	// raised to queues_.size() once the device accepted the MQ command.
+	size_t activePairs_ = 1;
+	bool rss_ = false;
+	uint32_t hashTypes_ = VIRTIO_NET_RSS_HASH_TYPE_IPv4
+			| VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
 };
 
 VirtioNic::VirtioNic(std::unique_ptr<virtio_core::Transport> transport)
@@ -68,50 +202,318 @@ VirtioNic::VirtioNic(std::unique_ptr<virtio_core::Transport> transport)
 		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_MAC);
 	}
 
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_CSUM)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_CSUM);
+		offloads_ |= nic::OFFLOAD_TX_CSUM;
+
+		// TSO requires checksum offload.
+		if(transport_->checkDeviceFeature(VIRTIO_NET_F_HOST_TSO4)) {
+			transport_->acknowledgeDriverFeature(VIRTIO_NET_F_HOST_TSO4);
+			offloads_ |= nic::OFFLOAD_TSO4;
+		}
+	}
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_GUEST_CSUM)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_GUEST_CSUM);
+		offloads_ |= nic::OFFLOAD_RX_CSUM;
+	}
+
+	// Multiple queue pairs are configured via the control virtq.
+	bool multiQueue = false;
+	if(transport_->checkDeviceFeature(VIRTIO_NET_F_CTRL_VQ)
+			&& transport_->checkDeviceFeature(VIRTIO_NET_F_MQ)) {
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_CTRL_VQ);
+		transport_->acknowledgeDriverFeature(VIRTIO_NET_F_MQ);
+		multiQueue = true;
+
+		if(transport_->checkDeviceFeature(VIRTIO_NET_F_RSS)) {
+			transport_->acknowledgeDriverFeature(VIRTIO_NET_F_RSS);
+			rss_ = true;
+		}
+	}
+
 	transport_->finalizeFeatures();
-	transport_->claimQueues(2);
-	receiveVq_ = transport_->setupQueue(0);
-	transmitVq_ = transport_->setupQueue(1);
+
+	// Use one queue pair per interrupt vector (i.e., per CPU), capped by the device.
+	unsigned int numPairs = 1;
+	unsigned int maxPairs = 1;
+	if(multiQueue) {
+		maxPairs = transport_->space().load(spec::regs::maxVirtqueuePairs);
+		numPairs = std::min({maxPairs, transport_->numQueueVectors(), maxQueuePairs});
+		numPairs = std::max(numPairs, 1U);
+	}
+
+	if(rss_) {
+		auto keySize = transport_->space().load(spec::regs::rssMaxKeySize);
+		auto tableLength = transport_->space().load(spec::regs::rssMaxIndirectionTableLength);
+		hashTypes_ &= transport_->space().load(spec::regs::supportedHashTypes);
+		if(keySize < sizeof(rssKey) || tableLength < rssTableLength || !hashTypes_) {
+			rss_ = false;
+			hashTypes_ = VIRTIO_NET_RSS_HASH_TYPE_IPv4
+					| VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
+		}
+	}
+
+	// The control virtq follows the queues of all pairs that the device supports.
+	// Both queues of pair i are bound to vector i (i.e., to CPU i).
+	transport_->claimQueues(multiQueue ? 2 * maxPairs + 1 : 2);
+	for(unsigned int i = 0; i < numPairs; i++) {
+		auto pair = std::make_unique<QueuePair>();
+		pair->receiveVq = transport_->setupQueue(2 * i, i);
+		pair->transmitVq = transport_->setupQueue(2 * i + 1, i);
+		queues_.push_back(std::move(pair));
+	}
+	if(multiQueue)
+		controlVq_ = transport_->setupQueue(2 * maxPairs, 0);
 
 	transport_->runDevice();
+
+	std::cout << "virtio-driver: Using " << numPairs << " queue pair(s)"
+			<< (rss_ ? " with RSS" : "") << std::endl;
+	if(multiQueue)
+		enableQueuePairs_();
+}
+
+async::detached VirtioNic::enableQueuePairs_() {
+	if(rss_) {
+		// struct virtio_net_rss_config, the indirection table spreads flows over all pairs.
+		std::vector<uint8_t> config;
+		auto put16 = [&] (uint16_t v) {
+			config.push_back(v & 0xFF);
+			config.push_back(v >> 8);
+		};
+		put16(hashTypes_ & 0xFFFF);
+		put16(hashTypes_ >> 16);
+		put16(rssTableLength - 1);
+		put16(0); // Unclassified frames go to the first pair.
+		for(size_t i = 0; i < rssTableLength; i++)
+			put16(i % queues_.size());
+		put16(queues_.size());
+		config.push_back(sizeof(rssKey));
+		config.insert(config.end(), std::begin(rssKey), std::end(rssKey));
+
+		if(!co_await sendControl_(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+				config.data(), config.size())) {
+			std::cout << "virtio-driver: Device rejected RSS configuration" << std::endl;
+			rss_ = false;
+		}
+	}
+
+	if(!rss_) {
+		uint16_t pairs = queues_.size();
+		if(!co_await sendControl_(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+				&pairs, sizeof(pairs))) {
+			std::cout << "virtio-driver: Device rejected number of queue pairs" << std::endl;
+			co_return;
+		}
+	}
+
+	activePairs_ = queues_.size();
+}
+
+async::result<bool> VirtioNic::sendControl_(uint8_t cls, uint8_t command,
+		const void *data, size_t size) {
+	assert(controlVq_);
+	arch::dma_buffer header{&dmaPool_, 2};
+	arch::dma_buffer payload{&dmaPool_, size};
+	arch::dma_buffer ack{&dmaPool_, 1};
+	auto headerBytes = reinterpret_cast<uint8_t *>(header.data());
+	headerBytes[0] = cls;
+	headerBytes[1] = command;
+	memcpy(payload.data(), data, size);
+	*reinterpret_cast<uint8_t *>(ack.data()) = 0xFF;
+
+	virtio_core::Chain chain;
+	chain.append(co_await controlVq_->obtainDescriptor());
+	chain.setupBuffer(virtio_core::hostToDevice, header.subview(0));
+	chain.append(co_await controlVq_->obtainDescriptor());
+	chain.setupBuffer(virtio_core::hostToDevice, payload.subview(0));
+	chain.append(co_await controlVq_->obtainDescriptor());
+	chain.setupBuffer(virtio_core::deviceToHost, ack.subview(0));
+
+	co_await controlVq_->submitDescriptor(chain.front());
+	co_return *reinterpret_cast<uint8_t *>(ack.data()) == VIRTIO_NET_OK;
+}
+
+size_t VirtioNic::selectTransmitQueue_(arch::dma_buffer_view frame) {
+	if(activePairs_ == 1)
+		return 0;
+
+	// Only IPv4 is hashed; everything else goes to the first pair.
+	auto p = reinterpret_cast<const uint8_t *>(frame.data());
+	if(frame.size() < 14 + 20 || p[12] != 0x08 || p[13] != 0x00)
+		return 0;
+	auto ip = p + 14;
+	size_t ihl = (ip[0] & 0x0F) * 4;
+	uint8_t protocol = ip[9];
+	bool fragment = ((ip[6] & 0x3F) | ip[7]) != 0;
+
+	// Hash the tuple as the device does on receive: the remote side is the source.
+	uint8_t input[12];
+	memcpy(input, ip + 16, 4);
+	memcpy(input + 4, ip + 12, 4);
+	size_t inputSize = 0;
+	bool hashPorts = !fragment && frame.size() >= 14 + ihl + 4
+			&& ((protocol == 6 && (hashTypes_ & VIRTIO_NET_RSS_HASH_TYPE_TCPv4))
+				|| (protocol == 17 && (hashTypes_ & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)));
+	if(hashPorts) {
+		auto ports = ip + ihl;
+		memcpy(input + 8, ports + 2, 2);
+		memcpy(input + 10, ports, 2);
+		inputSize = 12;
+	}else if(hashTypes_ & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+		inputSize = 8;
+	}else{
+		return 0;
+	}
+
+	auto hash = toeplitzHash(input, inputSize);
+	if(rss_)
+		return (hash & (rssTableLength - 1)) % activePairs_;
+	// Without RSS, the device steers flows to the pair that they are transmitted on.
+	return hash % activePairs_;
 }
 
 async::result<void> VirtioNic::receive(arch::dma_buffer_view frame) {
+	auto receiveVq = queues_[0]->receiveVq;
 	arch::dma_object<VirtHeader> header { &dmaPool_ };
 
 	virtio_core::Chain chain;
-	chain.append(co_await receiveVq_->obtainDescriptor());
+	chain.append(co_await receiveVq->obtainDescriptor());
 	chain.setupBuffer(virtio_core::deviceToHost,
 			header.view_buffer().subview(0, legacyHeaderSize));
-	chain.append(co_await receiveVq_->obtainDescriptor());
+	chain.append(co_await receiveVq->obtainDescriptor());
 	chain.setupBuffer(virtio_core::deviceToHost, frame);
 
-	co_await receiveVq_->submitDescriptor(chain.front());
+	co_await receiveVq->submitDescriptor(chain.front());
 
 	co_return;
 }
 
-async::result<void> VirtioNic::send(const arch::dma_buffer_view payload) {
-	if (payload.size() > 1514) {
-		throw std::runtime_error("data exceeds mtu");
+size_t VirtioNic::numReceiveQueues() {
+	return queues_.size();
+}
+
+size_t VirtioNic::receiveQueueDepth(size_t queue) {
+	// Each frame occupies two descriptors.
+	return queues_[queue]->receiveVq->numDescriptors() / 2;
+}
+
+async::result<void> VirtioNic::postReceiveBuffers(size_t queue,
+		std::vector<arch::dma_buffer> buffers) {
+	auto pair = queues_[queue].get();
+	for(auto &buffer : buffers) {
+		auto request = new RxRequest{this, pair, std::move(buffer)};
+
+		virtio_core::Chain chain;
+		chain.append(co_await pair->receiveVq->obtainDescriptor());
+		chain.setupBuffer(virtio_core::deviceToHost,
+				request->header.view_buffer().subview(0, legacyHeaderSize));
+		chain.append(co_await pair->receiveVq->obtainDescriptor());
+		chain.setupBuffer(virtio_core::deviceToHost, request->frame);
+
+		pair->receiveVq->postDescriptor(chain.front(), request,
+				[] (virtio_core::Request *base_request) {
+			auto request = static_cast<RxRequest *>(base_request);
+			request->pair->receivedFrames.push_back(request);
+			request->pair->receiveDoorbell.raise();
+		});
 	}
+	pair->receiveVq->notify();
+}
 
-	arch::dma_object<VirtHeader> header { &dmaPool_ };
-	memset(header.data(), 0, sizeof(VirtHeader));
+async::result<std::vector<nic::Link::ReceivedFrame>> VirtioNic::receiveBurst(size_t queue,
+		size_t max) {
+	assert(max);
+	auto pair = queues_[queue].get();
+	while(pair->receivedFrames.empty())
+		co_await pair->receiveDoorbell.async_wait();
 
-	virtio_core::Chain chain;
-	chain.append(co_await transmitVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::hostToDevice,
-			header.view_buffer().subview(0, legacyHeaderSize));
-	chain.append(co_await transmitVq_->obtainDescriptor());
-	chain.setupBuffer(virtio_core::hostToDevice, payload);
+	std::vector<ReceivedFrame> frames;
+	while(!pair->receivedFrames.empty() && frames.size() < max) {
+		auto request = pair->receivedFrames.front();
+		pair->receivedFrames.pop_front();
+
+		// With VIRTIO_NET_F_GUEST_CSUM, frames from the host may carry a partial checksum
+		// (NEEDS_CSUM); treat them like frames that the device validated.
+		nic::RxMetadata metadata;
+		if(offloads_ & nic::OFFLOAD_RX_CSUM)
+			metadata.checksumValid = request->header->flags
+					& (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID);
 
+		frames.push_back({std::move(request->frame), metadata});
+		delete request;
+	}
 	if(logFrames) {
-		std::cout << "virtio-driver: sending frame" << std::endl;
+		std::cout << "virtio-driver: received " << frames.size() << " frames on queue "
+				<< queue << std::endl;
+	}
+	co_return frames;
+}
+
+async::result<void> VirtioNic::send(const arch::dma_buffer_view payload) {
+	std::vector<TxFrame> frames;
+	frames.push_back({payload, {}});
+	co_await sendBurst(std::move(frames));
+}
+
+async::result<void> VirtioNic::sendBurst(std::vector<TxFrame> frames) {
+	std::vector<std::unique_ptr<TxRequest>> requests;
+	// Queues that need to be notified, indexed by queue pair.
+	std::vector<bool> pending(queues_.size(), false);
+	for(auto &[payload, metadata] : frames) {
+		// Earlier frames of the burst may already be posted, hence we cannot bail out
+		// here; drop the oversized frame instead.
+		if (payload.size() > (metadata.segmentSize ? maxTsoFrameSize : 1514)) {
+			std::cout << "\e[31m" "virtio-driver: Dropping frame of size " << payload.size()
+					<< " that exceeds the MTU" "\e[39m" << std::endl;
+			continue;
+		}
+
+		auto request = std::make_unique<TxRequest>(this);
+		memset(request->header.data(), 0, sizeof(VirtHeader));
+		if(metadata.needsChecksum) {
+			assert(offloads_ & nic::OFFLOAD_TX_CSUM);
+			request->header->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+			request->header->csumStart = metadata.checksumStart;
+			request->header->csumOffset = metadata.checksumOffset;
+		}
+		if(metadata.segmentSize) {
+			assert(offloads_ & nic::OFFLOAD_TSO4);
+			request->header->gsoType = VIRTIO_NET_HDR_GSO_TCPV4;
+			request->header->gsoSize = metadata.segmentSize;
+			request->header->hdrLen = metadata.headerLength;
+		}
+
+		auto queue = selectTransmitQueue_(payload);
+		auto transmitVq = queues_[queue]->transmitVq;
+
+		virtio_core::Chain chain;
+		chain.append(co_await transmitVq->obtainDescriptor());
+		chain.setupBuffer(virtio_core::hostToDevice,
+				request->header.view_buffer().subview(0, legacyHeaderSize));
+		chain.append(co_await transmitVq->obtainDescriptor());
+		chain.setupBuffer(virtio_core::hostToDevice, payload);
+
+		transmitVq->postDescriptor(chain.front(), request.get(),
+				[] (virtio_core::Request *base_request) {
+			auto request = static_cast<TxRequest *>(base_request);
+			request->event.raise();
+		});
+		requests.push_back(std::move(request));
+		pending[queue] = true;
+	}
+
+	if(logFrames) {
+		std::cout << "virtio-driver: sending " << frames.size() << " frames" << std::endl;
+	}
+	for(size_t i = 0; i < queues_.size(); i++) {
+		if(pending[i])
+			queues_[i]->transmitVq->notify();
 	}
-	co_await transmitVq_->submitDescriptor(chain.front());
+	for(auto &request : requests)
+		co_await request->event.wait();
 	if(logFrames) {
-		std::cout << "virtio-driver: sent frame" << std::endl;
+		std::cout << "virtio-driver: sent " << frames.size() << " frames" << std::endl;
 	}
 }
 } // namespace
@@ -224,6 +224,15 @@ extern inline __attribute__ (( always_inline )) HelError helPointerPhysical(cons
 	return error;
 };
 
+extern inline __attribute__ (( always_inline )) HelError helTranslateRange(const void *pointer,
+		size_t size, struct HelPhysicalRun *runs, size_t *numRuns, HelHandle *handle) {
+	HelWord handle_word;
+	HelError error = helSyscall4_1(kHelCallTranslateRange, (HelWord)pointer, (HelWord)size,
+			(HelWord)runs, (HelWord)numRuns, &handle_word);
+	*handle = (HelHandle)handle_word;
+	return error;
+};
+
 extern inline __attribute__ (( always_inline )) HelError helSubmitReadMemory(HelHandle handle,
 		uintptr_t address, size_t length, void *buffer,
 		HelHandle queue, uintptr_t context) {
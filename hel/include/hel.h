@@ -18,7 +18,7 @@
 
 enum {
 	// largest system call number plus 1
-	kHelNumCalls = 104,
+	kHelNumCalls = 105,
 
 	kHelCallLog = 1,
 	kHelCallPanic = 10,
@@ -50,6 +50,7 @@ enum {
 	kHelCallSubmitSynchronizeSpace = 53,
 	kHelCallUnmapMemory = 36,
 	kHelCallPointerPhysical = 43,
+	kHelCallTranslateRange = 104,
 	kHelCallSubmitReadMemory = 77,
 	kHelCallSubmitWriteMemory = 78,
 	kHelCallMemoryInfo = 26,
@@ -236,6 +237,12 @@ struct HelAllocRestrictions {
 	int addressBits;
 };
 
+//! A physically contiguous part of a virtual range (see helTranslateRange()).
+struct HelPhysicalRun {
+	uintptr_t address;
+	size_t length;
+};
+
 enum HelManagedFlags {
 	kHelManagedReadahead = 1
 };
@@ -772,6 +779,28 @@ HEL_C_LINKAGE HelError helUnmapMemory(HelHandle spaceHandle, void *pointer, size
 
 HEL_C_LINKAGE HelError helPointerPhysical(const void *pointer, uintptr_t *physical);
 
+//! Translates a virtual range of the current address space into physical addresses
+//! and pins the range in memory (e.g., for DMA).
+//!
+//! Physically contiguous pages are fused into a single run.
+//! The range must be contained in a single mapping; otherwise,
+//! kHelErrOutOfBounds is returned. If @p pointer + @p size overflows,
+//! kHelErrIllegalArgs is returned.
+//! @param[in] pointer
+//!     Start of the virtual range. Does not need to be page aligned.
+//! @param[in] size
+//!     Size of the virtual range. Must not be zero.
+//! @param[out] runs
+//!     Array that receives the physical runs.
+//! @param[in,out] numRuns
+//!     On entry, the capacity of @p runs. On exit, the number of runs.
+//!     If the capacity is too small, kHelErrBufferTooSmall is returned
+//!     and @p numRuns is set to the required capacity.
+//! @param[out] handle
+//!     Handle that keeps the range pinned until it is closed.
+HEL_C_LINKAGE HelError helTranslateRange(const void *pointer, size_t size,
+		struct HelPhysicalRun *runs, size_t *numRuns, HelHandle *handle);
+
 //! Load memory (i.e., bytes) from a descriptor.
 //!
 //! This is an asynchronous operation.
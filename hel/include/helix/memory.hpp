@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string.h>
+#include <algorithm>
+#include <vector>
 
 #include <hel.h>
 #include <helix/ipc.hpp>
@@ -81,4 +83,67 @@ inline uintptr_t addressToPhysical(uintptr_t p) {
 	return phys;
 }
 
+// Translates a virtual range into physically contiguous runs and keeps it pinned
+// in memory until the object is destructed. Intended for DMA setup: this takes
+// a single syscall instead of one helPointerPhysical() call per page.
+struct PinnedRange {
+	static constexpr size_t pageSize = 0x1000;
+
+	PinnedRange() = default;
+
+	PinnedRange(const void *pointer, size_t size) {
+		if(!size)
+			return;
+
+		_runs.resize(8);
+		while(true) {
+			size_t numRuns = _runs.size();
+			HelHandle handle;
+			auto error = helTranslateRange(pointer, size, _runs.data(), &numRuns, &handle);
+			if(error == kHelErrBufferTooSmall) {
+				_runs.resize(numRuns);
+				continue;
+			}else if(error == kHelErrOutOfBounds) {
+				// The range crosses a mapping; fall back to per-page translation.
+				// In this case, the range is not pinned by us.
+				_runs.clear();
+				_translatePages(pointer, size);
+				return;
+			}
+			HEL_CHECK(error);
+
+			_runs.resize(numRuns);
+			_lock = UniqueDescriptor{handle};
+			return;
+		}
+	}
+
+	const std::vector<HelPhysicalRun> &runs() const {
+		return _runs;
+	}
+
+	auto begin() const { return _runs.begin(); }
+	auto end() const { return _runs.end(); }
+
+private:
+	void _translatePages(const void *pointer, size_t size) {
+		auto address = reinterpret_cast<uintptr_t>(pointer);
+		size_t progress = 0;
+		while(progress < size) {
+			auto misalign = (address + progress) & (pageSize - 1);
+			auto chunk = std::min(size - progress, pageSize - misalign);
+			auto physical = addressToPhysical(address + progress);
+			if(!_runs.empty() && _runs.back().address + _runs.back().length == physical) {
+				_runs.back().length += chunk;
+			}else{
+				_runs.push_back(HelPhysicalRun{physical, chunk});
+			}
+			progress += chunk;
+		}
+	}
+
+	std::vector<HelPhysicalRun> _runs;
+	UniqueDescriptor _lock;
+};
+
 } // namespace helix
@@ -518,8 +518,8 @@ extern IrqSpinlock globalIrqSlotsLock;
 
 namespace {
 	struct ApicMsiPin final : MsiPin {
-		ApicMsiPin(frg::string<KernelAlloc> name, unsigned int vector)
-		: MsiPin{std::move(name)}, vector_{vector} { }
+		ApicMsiPin(frg::string<KernelAlloc> name, unsigned int vector, uint32_t apicId)
+		: MsiPin{std::move(name)}, vector_{vector}, apicId_{apicId} { }
 
 		IrqStrategy program(TriggerMode mode, Polarity) override {
 			assert(mode == TriggerMode::edge);
@@ -541,7 +541,8 @@ namespace {
 		}
 
 		uint64_t getMessageAddress() override {
-			return 0xFEE00000;
+			// Physical destination mode; the destination ID is in bits 12-19.
+			return 0xFEE00000 | (static_cast<uint64_t>(apicId_) << 12);
 		}
 
 		uint32_t getMessageData() override {
@@ -550,10 +551,16 @@ namespace {
 
 	private:
 		unsigned int vector_;
+		uint32_t apicId_;
 	};
 }
 
-MsiPin *allocateApicMsi(frg::string<KernelAlloc> name) {
+MsiPin *allocateApicMsi(frg::string<KernelAlloc> name, size_t cpu) {
+	assert(cpu < static_cast<size_t>(getCpuCount()));
+	auto apicId = getCpuData(cpu)->localApicId;
+	// TODO: Support x2APIC destination IDs (via interrupt remapping).
+	assert(apicId < 256);
+
 	auto guard = frg::guard(&globalIrqSlotsLock);
 
 	int slotIndex = -1;
@@ -568,7 +575,7 @@ MsiPin *allocateApicMsi(frg::string<KernelAlloc> name) {
 
 	// Create an IRQ pin for the MSI.
 	auto pin = frg::construct<ApicMsiPin>(*kernelAlloc,
-			std::move(name), 64 + slotIndex);
+			std::move(name), 64 + slotIndex, apicId);
 	pin->configure(IrqConfiguration{
 		.trigger = TriggerMode::edge,
 		.polarity = Polarity::high
@@ -126,7 +126,8 @@ void sendGlobalNmi();
 // MSI management
 // --------------------------------------------------------
 
-MsiPin *allocateApicMsi(frg::string<KernelAlloc> name);
+// Allocates an MSI that is delivered to the given CPU.
+MsiPin *allocateApicMsi(frg::string<KernelAlloc> name, size_t cpu);
 
 // --------------------------------------------------------
 // I/O APIC management
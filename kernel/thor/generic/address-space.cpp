@@ -625,6 +625,8 @@ VirtualSpace::synchronize(VirtualAddr address, size_t size) {
 		auto cleanOutcome = _ops->cleanPages(mapping->address + mappingOffset, mapping->view.get(),
 				mapping->viewOffset + mappingOffset, mappingChunk);
 		assert(cleanOutcome);
+		// Do not wait for the writeback policy to flush the pages.
+		mapping->view->expediteWriteback(mapping->viewOffset + mappingOffset, mappingChunk);
 
 		overallProgress += mappingChunk;
 	}
@@ -727,6 +729,69 @@ VirtualSpace::retrievePhysical(VirtualAddr address, smarter::shared_ptr<WorkQueu
 	}
 }
 
+coroutine<frg::expected<Error, MemoryViewLockHandle>>
+VirtualSpace::lockPhysicalRuns(VirtualAddr address, size_t size,
+		frg::vector<frg::tuple<PhysicalAddr, size_t>, KernelAlloc> &runs,
+		smarter::shared_ptr<WorkQueue> wq) {
+	assert(size);
+
+	// We do not take _consistencyMutex here since we are only interested in a snapshot.
+	smarter::shared_ptr<Mapping> mapping;
+	{
+		auto irq_lock = frg::guard(&irqMutex());
+		auto space_guard = frg::guard(&_snapshotMutex);
+
+		mapping = _findMapping(address);
+	}
+	if(!mapping)
+		co_return Error::fault;
+
+	// size is controlled by user space; make sure that rounding it up does not overflow.
+	auto misalign = address & (kPageSize - 1);
+	auto startInMapping = address - misalign - mapping->address;
+	size_t unalignedSize;
+	if(__builtin_add_overflow(misalign, size, &unalignedSize))
+		co_return Error::illegalArgs;
+	// The range crosses the end of the mapping.
+	if(unalignedSize > mapping->length - startInMapping)
+		co_return Error::outOfBounds;
+	auto alignedSize = (unalignedSize + kPageSize - 1) & ~(kPageSize - 1);
+	assert(alignedSize <= mapping->length - startInMapping);
+
+	MemoryViewLockHandle lockHandle{mapping->view,
+			mapping->viewOffset + startInMapping, alignedSize};
+	co_await lockHandle.acquire(wq);
+	if(!lockHandle)
+		co_return Error::fault;
+
+	FetchFlags fetchFlags = 0;
+	if(mapping->flags & MappingFlags::dontRequireBacking)
+		fetchFlags |= fetchDisallowBacking;
+
+	size_t progress = 0;
+	for(size_t pg = 0; pg < alignedSize; pg += kPageSize) {
+		FRG_CO_TRY(co_await mapping->view->fetchRange(
+				mapping->viewOffset + startInMapping + pg, fetchFlags, wq));
+
+		auto [physical, cacheMode] = mapping->resolveRange(startInMapping + pg);
+		// Since we have locked the MemoryView, the physical address remains valid here.
+		assert(physical != PhysicalAddr(-1));
+
+		auto disp = pg ? 0 : misalign;
+		auto chunk = frg::min(size - progress, kPageSize - disp);
+		if(!runs.empty()
+				&& runs.back().get<0>() + runs.back().get<1>() == physical + disp) {
+			runs.back().get<1>() += chunk;
+		}else{
+			runs.push_back(frg::tuple<PhysicalAddr, size_t>{physical + disp, chunk});
+		}
+		progress += chunk;
+	}
+	assert(progress == size);
+
+	co_return std::move(lockHandle);
+}
+
 smarter::shared_ptr<Mapping> VirtualSpace::_findMapping(VirtualAddr address) {
 	auto current = _mappings.get_root();
 	while(current) {
@@ -1013,6 +1013,56 @@ HelError helPointerPhysical(const void *pointer, uintptr_t *physical) {
 	return kHelErrNone;
 }
 
+HelError helTranslateRange(const void *pointer, size_t size,
+		HelPhysicalRun *runs, size_t *numRuns, HelHandle *handle) {
+	auto thisThread = getCurrentThread();
+	auto thisUniverse = thisThread->getUniverse();
+	auto space = thisThread->getAddressSpace().lock();
+
+	if(!size)
+		return kHelErrIllegalArgs;
+
+	size_t maxRuns;
+	if(!readUserObject(numRuns, maxRuns))
+		return kHelErrFault;
+
+	frg::vector<frg::tuple<PhysicalAddr, size_t>, KernelAlloc> kernelRuns{*kernelAlloc};
+	auto lockOrError = Thread::asyncBlockCurrent(space->lockPhysicalRuns(
+			reinterpret_cast<VirtualAddr>(pointer), size, kernelRuns,
+			thisThread->mainWorkQueue()->take()));
+	if(!lockOrError) {
+		if(lockOrError.error() == Error::illegalArgs)
+			return kHelErrIllegalArgs;
+		if(lockOrError.error() == Error::outOfBounds)
+			return kHelErrOutOfBounds;
+		assert(lockOrError.error() == Error::fault);
+		return kHelErrFault;
+	}
+
+	if(!writeUserObject(numRuns, kernelRuns.size()))
+		return kHelErrFault;
+	if(kernelRuns.size() > maxRuns)
+		return kHelErrBufferTooSmall;
+
+	for(size_t i = 0; i < kernelRuns.size(); i++) {
+		HelPhysicalRun run{kernelRuns[i].get<0>(), kernelRuns[i].get<1>()};
+		if(!writeUserObject(runs + i, run))
+			return kHelErrFault;
+	}
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		Universe::Guard universeGuard(thisUniverse->lock);
+
+		*handle = thisUniverse->attachDescriptor(universeGuard,
+				MemoryViewLockDescriptor{
+					smarter::allocate_shared<NamedMemoryViewLock>(
+						*kernelAlloc, std::move(lockOrError.value()))});
+	}
+
+	return kHelErrNone;
+}
+
 HelError helSubmitReadMemory(HelHandle handle, uintptr_t address,
 		size_t length, void *buffer,
 		HelHandle queueHandle, uintptr_t context) {
@@ -1210,6 +1260,9 @@ HelError helSubmitWriteMemory(HelHandle handle, uintptr_t address,
 		}
 		(void)limit;
 
+		// Do not let writers dirty memory faster than it can be written back.
+		co_await throttleDirtyWriters();
+
 		Error error = Error::success;
 		{
 			char temp[128];
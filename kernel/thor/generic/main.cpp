@@ -689,6 +689,12 @@ void handleSyscall(SyscallImageAccessor image) {
 		*image.error() = helPointerPhysical((void *)arg0, &physical);
 		*image.out0() = physical;
 	} break;
+	case kHelCallTranslateRange: {
+		HelHandle handle;
+		*image.error() = helTranslateRange((const void *)arg0, (size_t)arg1,
+				(HelPhysicalRun *)arg2, (size_t *)arg3, &handle);
+		*image.out0() = handle;
+	} break;
 	case kHelCallSubmitReadMemory: {
 		*image.error() = helSubmitReadMemory((HelHandle)arg0, (uintptr_t)arg1,
 				(size_t)arg2, (void *)arg3,
@@ -1,3 +1,5 @@
+#include <atomic>
+
 #include <thor-internal/coroutine.hpp>
 #include <thor-internal/fiber.hpp>
 #include <thor-internal/main.hpp>
@@ -10,6 +12,21 @@ namespace thor {
 namespace {
 	constexpr bool logUsage = false;
 	constexpr bool logUncaching = false;
+	constexpr bool logWriteback = false;
+
+	// Dirty pages are written back once they are older than this (in ns).
+	constexpr uint64_t dirtyExpiry = 5'000'000'000;
+	// Interval (in ns) at which the writeback fiber checks for expired pages.
+	constexpr uint64_t writebackInterval = 500'000'000;
+	// Maximal number of pages that are fused into a single writeback request.
+	constexpr size_t maxWritebackCluster = 256;
+
+	// Once the number of dirty pages exceeds totalPages / dirtyBackgroundDivisor,
+	// writeback is started regardless of the age of the pages.
+	constexpr size_t dirtyBackgroundDivisor = 10;
+	// Once the number of dirty pages exceeds totalPages / dirtyThrottleDivisor,
+	// writers that dirty memory are blocked until writeback catches up.
+	constexpr size_t dirtyThrottleDivisor = 5;
 
 	// The following flags are debugging options to debug the correctness of various components.
 	constexpr bool tortureUncaching = false;
@@ -188,6 +205,128 @@ static initgraph::Task initReclaim{&globalInitEngine, "generic.init-reclaim",
 	}
 };
 
+// --------------------------------------------------------
+// Writeback policy.
+// --------------------------------------------------------
+
+// Counts pages in the kStateWantWriteback, kStateWriteback
+// and kStateAnotherWriteback states (over all ManagedSpaces).
+static std::atomic<size_t> globalDirtyPages{0};
+
+static bool dirtyAboveBackgroundRatio() {
+	return globalDirtyPages.load(std::memory_order_relaxed)
+			> physicalAllocator->numTotalPages() / dirtyBackgroundDivisor;
+}
+
+static bool dirtyAboveThrottleRatio() {
+	return globalDirtyPages.load(std::memory_order_relaxed)
+			> physicalAllocator->numTotalPages() / dirtyThrottleDivisor;
+}
+
+struct WritebackScheduler {
+	// Called with the mutex of the ManagedSpace held.
+	void addSpace(ManagedSpace *space) {
+		auto lock = frg::guard(&_mutex);
+
+		if(space->writebackScheduled)
+			return;
+		// Keep the ManagedSpace alive until the fiber processes it.
+		space->selfPtr.ctr()->increment();
+		space->writebackScheduled = true;
+		_spaceList.push_back(space);
+	}
+
+	auto awaitProgress() {
+		return async::sequence(
+			async::transform(
+				_progressEvent.async_wait(),
+				[] (auto) { }
+			),
+			WorkQueue::generalQueue()->schedule()
+		);
+	}
+
+	void raiseProgress() {
+		_progressEvent.raise();
+	}
+
+	void runWritebackFiber() {
+		KernelFiber::run([=] {
+			while(true) {
+				frg::intrusive_list<
+					ManagedSpace,
+					frg::locate_member<
+						ManagedSpace,
+						frg::default_list_hook<ManagedSpace>,
+						&ManagedSpace::writebackHook
+					>
+				> spaces;
+				{
+					auto irqLock = frg::guard(&irqMutex());
+					auto lock = frg::guard(&_mutex);
+
+					while(!_spaceList.empty()) {
+						auto space = _spaceList.pop_front();
+						space->writebackScheduled = false;
+						spaces.push_back(space);
+					}
+				}
+
+				if(logWriteback)
+					infoLogger() << "thor: "
+							<< globalDirtyPages.load(std::memory_order_relaxed) * (kPageSize / 1024)
+							<< " KiB of dirty pages" << frg::endlog;
+
+				// DeferredManagement re-registers spaces that still have pending writeback.
+				while(!spaces.empty()) {
+					auto space = spaces.pop_front();
+					space->_deferredManagement.invoke();
+					space->selfPtr.ctr()->decrement();
+				}
+
+				// Wake up throttled writers periodically, even if no writeback completed.
+				raiseProgress();
+
+				KernelFiber::asyncBlockCurrent(generalTimerEngine()->sleepFor(writebackInterval));
+			}
+		});
+	}
+
+private:
+	frg::ticket_spinlock _mutex;
+
+	frg::intrusive_list<
+		ManagedSpace,
+		frg::locate_member<
+			ManagedSpace,
+			frg::default_list_hook<ManagedSpace>,
+			&ManagedSpace::writebackHook
+		>
+	> _spaceList;
+
+	async::recurring_event _progressEvent;
+};
+
+static frg::manual_box<WritebackScheduler> globalWritebackScheduler;
+
+static initgraph::Task initWriteback{&globalInitEngine, "generic.init-writeback",
+	initgraph::Requires{getFibersAvailableStage()},
+	[] {
+		globalWritebackScheduler.initialize();
+		globalWritebackScheduler->runWritebackFiber();
+	}
+};
+
+coroutine<void> throttleDirtyWriters() {
+	while(dirtyAboveThrottleRatio()) {
+		if(logWriteback)
+			infoLogger() << "thor: Throttling writer, "
+					<< globalDirtyPages.load(std::memory_order_relaxed)
+					<< " pages are dirty" << frg::endlog;
+		co_await globalWritebackScheduler->awaitProgress();
+	}
+}
+
 // --------------------------------------------------------
 // MemoryView.
 // --------------------------------------------------------
@@ -349,6 +488,10 @@ void MemoryView::submitManage(ManageNode *) {
 	panicLogger() << "MemoryView does not support management!" << frg::endlog;
 }
 
+void MemoryView::expediteWriteback(uintptr_t, size_t) {
+	// Only views that are backed by a ManagedSpace delay writeback.
+}
+
 Error MemoryView::setIndirection(size_t, smarter::shared_ptr<MemoryView>,
 		uintptr_t, size_t) {
 	return Error::illegalObject;
@@ -874,24 +1017,47 @@ void ManagedSpace::_progressManagement(ManageList &pending) {
 	// "Proper" priorization should probably be done in the userspace driver
 	// (we do not want to store per-page priorities here).
 
+	// The _writebackList is ordered by dirtyTime. Pages at its front are written back
+	// once they expire, if there are too many dirty pages or if writeback was expedited.
+	// To produce large requests, we cluster the oldest page with all dirty pages
+	// that surround it in the file (regardless of their position in the list).
+	auto now = systemClockSource()->currentNanos();
+	auto forceWriteback = dirtyAboveBackgroundRatio();
 	while(!_writebackList.empty() && !_managementQueue.empty()) {
-		auto page = _writebackList.front();
-		auto index = page->identity;
+		auto oldest = frg::container_of(_writebackList.front(), &ManagedPage::cachePage);
+		assert(oldest->loadState == kStateWantWriteback);
+		if(!forceWriteback && oldest->dirtyTime
+				&& now - oldest->dirtyTime < dirtyExpiry)
+			break;
 
-		// Fuse the request with adjacent pages in the list.
-		ptrdiff_t count = 0;
-		while(!_writebackList.empty()) {
-			auto fuse_cache_page = _writebackList.front();
-			auto fuse_index = fuse_cache_page->identity;
-			auto fuse_managed_page = frg::container_of(fuse_cache_page, &ManagedPage::cachePage);
-			if(fuse_index != index + count)
-				break;
-			assert(fuse_managed_page->loadState == kStateWantWriteback);
-			fuse_managed_page->loadState = kStateWriteback;
+		auto isQueued = [&] (size_t index) -> ManagedPage * {
+			auto pit = pages.find(index);
+			if(!pit || pit->loadState != kStateWantWriteback)
+				return nullptr;
+			return pit;
+		};
+
+		// Determine the extent of the cluster.
+		size_t index = oldest->cachePage.identity;
+		size_t count = 1;
+		while(index && count < maxWritebackCluster && isQueued(index - 1)) {
+			index--;
 			count++;
-			_writebackList.pop_front();
 		}
-		assert(count);
+		while(count < maxWritebackCluster && isQueued(index + count))
+			count++;
+
+		for(size_t i = 0; i < count; i++) {
+			auto pit = pages.find(index + i);
+			assert(pit);
+			assert(pit->loadState == kStateWantWriteback);
+			pit->loadState = kStateWriteback;
+			_writebackList.erase(_writebackList.iterator_to(&pit->cachePage));
+		}
+
+		if(logWriteback)
+			infoLogger() << "thor: Writing back " << count << " pages at index "
+					<< index << frg::endlog;
 
 		auto node = _managementQueue.pop_front();
 		node->setup(Error::success, ManageRequest::writeback,
@@ -925,6 +1091,24 @@ void ManagedSpace::_progressManagement(ManageList &pending) {
 	}
 }
 
+void ManagedSpace::_queueWriteback(ManagedPage *pit) {
+	assert(pit->loadState == kStatePresent
+			|| pit->loadState == kStateEvicting
+			|| pit->loadState == kStateAnotherWriteback);
+	// Pages in kStateAnotherWriteback are still accounted as dirty.
+	if(pit->loadState != kStateAnotherWriteback)
+		globalDirtyPages.fetch_add(1, std::memory_order_relaxed);
+	pit->loadState = kStateWantWriteback;
+	pit->dirtyTime = systemClockSource()->currentNanos();
+	_writebackList.push_back(&pit->cachePage);
+}
+
+void ManagedSpace::_scheduleWriteback() {
+	if(_writebackList.empty())
+		return;
+	globalWritebackScheduler->addSpace(this);
+}
+
 void ManagedSpace::_progressMonitors(MonitorList &pending) {
 	// TODO: Accelerate this by storing the monitors in a RB tree ordered by their progress.
 	auto progressNode = [&] (MonitorNode *node) -> bool {
@@ -1102,14 +1286,14 @@ Error BackingMemory::updateRange(ManageRequest type, size_t offset, size_t lengt
 
 				if(pit->loadState == ManagedSpace::kStateWriteback) {
 					pit->loadState = ManagedSpace::kStatePresent;
+					globalDirtyPages.fetch_sub(1, std::memory_order_relaxed);
 					if(!pit->lockCount)
 						globalReclaimer->addPage(&pit->cachePage);
 				}else{
-					assert(pit->loadState == ManagedSpace::kStateAnotherWriteback);
-					pit->loadState = ManagedSpace::kStateWantWriteback;
-					_managed->_writebackList.push_back(&pit->cachePage);
+					_managed->_queueWriteback(pit);
 				}
 			}
+			_managed->_scheduleWriteback();
 		}
 
 		_managed->_progressMonitors(pending);
@@ -1120,6 +1304,9 @@ Error BackingMemory::updateRange(ManageRequest type, size_t offset, size_t lengt
 		node->event.raise();
 	}
 
+	if(type == ManageRequest::writeback)
+		globalWritebackScheduler->raiseProgress();
+
 	return Error::success;
 }
 
@@ -1292,14 +1479,12 @@ void FrontalMemory::markDirty(uintptr_t offset, size_t size) {
 			auto pit = _managed->pages.find(index);
 			assert(pit);
 			if(pit->loadState == ManagedSpace::kStatePresent) {
-				pit->loadState = ManagedSpace::kStateWantWriteback;
 				if(!pit->lockCount)
 					globalReclaimer->removePage(&pit->cachePage);
-				_managed->_writebackList.push_back(&pit->cachePage);
+				_managed->_queueWriteback(pit);
 			}else if(pit->loadState == ManagedSpace::kStateEvicting) {
-				pit->loadState = ManagedSpace::kStateWantWriteback;
 				assert(!pit->lockCount);
-				_managed->_writebackList.push_back(&pit->cachePage);
+				_managed->_queueWriteback(pit);
 			}else if(pit->loadState == ManagedSpace::kStateWriteback) {
 				pit->loadState = ManagedSpace::kStateAnotherWriteback;
 			}else{
@@ -1314,6 +1499,33 @@ void FrontalMemory::markDirty(uintptr_t offset, size_t size) {
 	_managed->_deferredManagement.invoke();
 }
 
+void FrontalMemory::expediteWriteback(uintptr_t offset, size_t size) {
+	assert(!(offset % kPageSize));
+	assert(!(size % kPageSize));
+
+	{
+		auto irqLock = frg::guard(&irqMutex());
+		auto lock = frg::guard(&_managed->mutex);
+
+		// Move the pages to the front of the _writebackList; a dirtyTime of zero
+		// makes _progressManagement() issue them immediately.
+		for(size_t pg = 0; pg < size; pg += kPageSize) {
+			auto index = (offset + pg) >> kPageShift;
+			auto pit = _managed->pages.find(index);
+			if(!pit || pit->loadState != ManagedSpace::kStateWantWriteback)
+				continue;
+			if(!pit->dirtyTime)
+				continue;
+			pit->dirtyTime = 0;
+			_managed->_writebackList.erase(
+					_managed->_writebackList.iterator_to(&pit->cachePage));
+			_managed->_writebackList.push_front(&pit->cachePage);
+		}
+	}
+
+	_managed->_deferredManagement.invoke();
+}
+
 size_t FrontalMemory::getLength() {
 	// Size is constant so we do not need to lock.
 	return _managed->numPages << kPageShift;
@@ -1428,6 +1640,19 @@ void IndirectMemory::markDirty(uintptr_t offset, size_t size) {
 			+ inSlotOffset, size);
 }
 
+void IndirectMemory::expediteWriteback(uintptr_t offset, size_t size) {
+	auto irqLock = frg::guard(&irqMutex());
+	auto lock = frg::guard(&mutex_);
+
+	auto slot = offset >> 32;
+	auto inSlotOffset = offset & ((uintptr_t(1) << 32) - 1);
+	assert(slot < indirections_.size()); // TODO: Return Error::fault.
+	assert(indirections_[slot]); // TODO: Return Error::fault.
+	assert(inSlotOffset + size <= indirections_[slot]->size); // TODO: Return Error::fault.
+	indirections_[slot]->memory->expediteWriteback(indirections_[slot]->offset
+			+ inSlotOffset, size);
+}
+
 size_t IndirectMemory::getLength() {
 	return indirections_.size() << 32;
 }
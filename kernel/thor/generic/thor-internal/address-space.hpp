@@ -512,6 +512,15 @@ public:
 	coroutine<frg::expected<Error, PhysicalAddr>>
 	retrievePhysical(VirtualAddr address, smarter::shared_ptr<WorkQueue> wq);
 
+	// Locks the pages of [address, address + size) and appends the physical
+	// address ranges that back them to runs (fusing physically contiguous pages).
+	// The range must not cross a mapping (Error::outOfBounds).
+	// The pages remain locked until the returned handle is destructed.
+	coroutine<frg::expected<Error, MemoryViewLockHandle>>
+	lockPhysicalRuns(VirtualAddr address, size_t size,
+			frg::vector<frg::tuple<PhysicalAddr, size_t>, KernelAlloc> &runs,
+			smarter::shared_ptr<WorkQueue> wq);
+
 	size_t rss() {
 		return _ops->getRss();
 	}
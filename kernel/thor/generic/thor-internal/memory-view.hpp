@@ -316,6 +316,10 @@ public:
 	// Marks a range of pages as dirty.
 	virtual void markDirty(uintptr_t offset, size_t size) = 0;
 
+	// Requests that dirty pages in a range are written back without waiting
+	// for the writeback policy (e.g., because user space synchronizes them).
+	virtual void expediteWriteback(uintptr_t offset, size_t size);
+
 	virtual void submitManage(ManageNode *handle);
 
 	// Called (e.g. by user space) to update a range after loading or writeback.
@@ -850,6 +854,8 @@ struct ManagedSpace : CacheBundle {
 		PhysicalAddr physical = PhysicalAddr(-1);
 		LoadState loadState = kStateMissing;
 		unsigned int lockCount = 0;
+		// Time (in ns) at which the page entered the _writebackList.
+		uint64_t dirtyTime = 0;
 		CachePage cachePage;
 	};
 
@@ -866,6 +872,7 @@ struct ManagedSpace : CacheBundle {
 				auto lock = frg::guard(&self->mutex);
 
 				self->_progressManagement(pending);
+				self->_scheduleWriteback();
 			}
 
 			while(!pending.empty()) {
@@ -890,6 +897,11 @@ struct ManagedSpace : CacheBundle {
 	void _progressManagement(ManageList &pending);
 	void _progressMonitors(MonitorList &pending);
 
+	// Puts a page into the kStateWantWriteback state.
+	void _queueWriteback(ManagedPage *pit);
+	// Registers this space with the writeback policy if it has pending writeback.
+	void _scheduleWriteback();
+
 	smarter::borrowed_ptr<ManagedSpace> selfPtr;
 
 	frg::ticket_spinlock mutex;
@@ -923,8 +935,15 @@ struct ManagedSpace : CacheBundle {
 	MonitorList _monitorQueue;
 
 	DeferredWork<DeferredManagement> _deferredManagement{{this}};
+
+	// Protected by the mutex of the writeback policy.
+	frg::default_list_hook<ManagedSpace> writebackHook;
+	bool writebackScheduled = false;
 };
 
+// Blocks writers while too much memory is dirty.
+coroutine<void> throttleDirtyWriters();
+
 struct BackingMemory final : MemoryView {
 public:
 	BackingMemory(smarter::shared_ptr<ManagedSpace> managed)
@@ -971,6 +990,7 @@ public:
 			fetchRange(uintptr_t offset, FetchFlags flags,
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void markDirty(uintptr_t offset, size_t size) override;
+	void expediteWriteback(uintptr_t offset, size_t size) override;
 
 	coroutine<frg::expected<Error, PhysicalAddr>> takeGlobalFutex(uintptr_t offset,
 			smarter::shared_ptr<WorkQueue> wq) override;
@@ -1000,6 +1020,7 @@ struct IndirectMemory final : MemoryView {
 			fetchRange(uintptr_t offset, FetchFlags flags,
 			smarter::shared_ptr<WorkQueue> wq) override;
 	void markDirty(uintptr_t offset, size_t size) override;
+	void expediteWriteback(uintptr_t offset, size_t size) override;
 
 	Error setIndirection(size_t slot, smarter::shared_ptr<MemoryView> memory,
 			uintptr_t offset, size_t size) override;
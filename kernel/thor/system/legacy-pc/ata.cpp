@@ -4,6 +4,7 @@
 #include <thor-internal/io.hpp>
 #include <thor-internal/main.hpp>
 #include <thor-internal/mbus.hpp>
+#include <thor-internal/pci/pci.hpp>
 #include <thor-internal/stream.hpp>
 #include <hw.frigg_bragi.hpp>
 
@@ -12,8 +13,36 @@
 
 namespace thor::legacy_pc {
 
+namespace {
+
+// Returns a PCI IDE controller that can bus-master the primary channel while it is
+// in compatibility mode (i.e., the channel that this object exposes).
+pci::PciDevice *findBusMaster() {
+	for(auto &device : *pci::allDevices) {
+		if(device->classCode != 0x01 || device->subClass != 0x01)
+			continue;
+		// Bit 0 of the programming interface: primary channel in native mode.
+		// Bit 7 of the programming interface: bus-mastering is supported.
+		if((device->interface & 0x01) || !(device->interface & 0x80))
+			continue;
+		auto &bar = device->bars[4];
+		if(bar.type != pci::PciBar::kBarIo || bar.hostType != pci::PciBar::kBarIo)
+			continue;
+		return device.get();
+	}
+	return nullptr;
+}
+
+} // anonymous namespace
+
 struct AtaBusObject : private KernelBusObject {
 	coroutine<void> run() {
+		_busMaster = findBusMaster();
+		if(_busMaster)
+			infoLogger() << "thor: Legacy ATA uses bus-master IDE at "
+					<< _busMaster->bus << "." << _busMaster->slot << "." << _busMaster->function
+					<< frg::endlog;
+
 		Properties properties;
 		properties.stringProperty("legacy", frg::string<KernelAlloc>(*kernelAlloc, "ata"));
 
@@ -82,6 +111,17 @@ private:
 			resp.add_bars(std::move(altBar));
 
 			for(size_t k = 2; k < 6; k++) {
+				// BAR 4 is the bus-master IDE register block (if any).
+				if(k == 4 && _busMaster) {
+					managarm::hw::PciBar<KernelAlloc> bmideBar{*kernelAlloc};
+					bmideBar.set_io_type(managarm::hw::IoType::PORT);
+					bmideBar.set_host_type(managarm::hw::IoType::PORT);
+					bmideBar.set_address(_busMaster->bars[4].address);
+					bmideBar.set_length(_busMaster->bars[4].length);
+					resp.add_bars(std::move(bmideBar));
+					continue;
+				}
+
 				managarm::hw::PciBar<KernelAlloc> noBar{*kernelAlloc};
 				noBar.set_io_type(managarm::hw::IoType::NO_BAR);
 				resp.add_bars(std::move(noBar));
@@ -106,6 +146,9 @@ private:
 			}else if(req->index() == 1) {
 				space->addPort(0x3F6);
 				resp.set_error(managarm::hw::Errors::SUCCESS);
+			}else if(req->index() == 4 && _busMaster) {
+				space = _busMaster->bars[4].io;
+				resp.set_error(managarm::hw::Errors::SUCCESS);
 			}else{
 				resp.set_error(managarm::hw::Errors::OUT_OF_BOUNDS);
 			}
@@ -138,6 +181,28 @@ private:
 			auto irqError = co_await PushDescriptorSender{lane, IrqDescriptor{object}};
 			if(irqError != Error::success)
 				co_return irqError;
+		}else if(preamble.id() == bragi::message_id<managarm::hw::EnableBusmasterRequest>) {
+			auto req = bragi::parse_head_only<managarm::hw::EnableBusmasterRequest>(reqBuffer, *kernelAlloc);
+
+			if (!req) {
+				infoLogger() << "thor: Closing lane due to illegal HW request." << frg::endlog;
+				co_return Error::protocolViolation;
+			}
+
+			managarm::hw::SvrResponse<KernelAlloc> resp{*kernelAlloc};
+
+			if(_busMaster) {
+				auto bus = _busMaster->parentBus;
+				auto command = bus->io->readConfigHalf(bus,
+						_busMaster->slot, _busMaster->function, pci::kPciCommand);
+				bus->io->writeConfigHalf(bus, _busMaster->slot, _busMaster->function,
+						pci::kPciCommand, command | 0x0004);
+				resp.set_error(managarm::hw::Errors::SUCCESS);
+			}else{
+				resp.set_error(managarm::hw::Errors::ILLEGAL_ARGUMENTS);
+			}
+
+			FRG_CO_TRY(co_await sendResponse(lane, std::move(resp)));
 		}else{
 			infoLogger() << "thor: Dismissing conversation due to illegal HW request." << frg::endlog;
 			co_await DismissSender{lane};
@@ -146,10 +211,13 @@ private:
 
 		co_return frg::success;
 	}
+
+	pci::PciDevice *_busMaster = nullptr;
 };
 
 static initgraph::Task initAtaTask{&globalInitEngine, "legacy_pc.init-ata",
-	initgraph::Requires{getFibersAvailableStage()},
+	initgraph::Requires{getFibersAvailableStage(),
+		pci::getDevicesEnumeratedStage()},
 	[] {
 		// For now, we only need the kernel fiber to make sure mbusClient is already initialized.
 		KernelFiber::run([=] {
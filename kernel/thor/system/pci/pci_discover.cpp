@@ -7,6 +7,7 @@
 #include <thor-internal/kernel_heap.hpp>
 #include <thor-internal/main.hpp>
 #include <thor-internal/address-space.hpp>
+#include <thor-internal/cpu-data.hpp>
 #include <thor-internal/framebuffer/boot-screen.hpp>
 #include <thor-internal/pci/pci.hpp>
 #include <thor-internal/stream.hpp>
@@ -353,7 +354,8 @@ coroutine<frg::expected<Error>> PciEntity::handleRequest(LaneHandle lane) {
 
 		if ((msiIndex < 0 && msixIndex < 0)
 				|| !parentBus->msiController
-				|| req->index() >= numMsis) {
+				|| req->index() >= numMsis
+				|| req->cpu() >= static_cast<uint32_t>(getCpuCount())) {
 			managarm::hw::SvrResponse<KernelAlloc> resp{*kernelAlloc};
 			resp.set_error(managarm::hw::Errors::ILLEGAL_ARGUMENTS);
 
@@ -370,7 +372,8 @@ coroutine<frg::expected<Error>> PciEntity::handleRequest(LaneHandle lane) {
 				+ frg::string<KernelAlloc>{*kernelAlloc, "-"}
 				+ frg::to_allocated_string(*kernelAlloc, function)
 				+ frg::string<KernelAlloc>{*kernelAlloc, "."}
-				+ frg::to_allocated_string(*kernelAlloc, req->index()));
+				+ frg::to_allocated_string(*kernelAlloc, req->index()),
+				req->cpu());
 		if(!interrupt) {
 			infoLogger() << "thor: Could not allocate interrupt vector for MSI" << frg::endlog;
 
@@ -1216,7 +1219,7 @@ void checkPciFunction(PciBus *bus, uint32_t slot, uint32_t function,
 			auto offset = device->caps[device->msixIndex].offset;
 
 			auto msgControl = io->readConfigHalf(bus, slot, function, offset + 2);
-			device->numMsis = (msgControl & 0x7F) + 1;
+			device->numMsis = (msgControl & 0x7FF) + 1;
 			infoLogger() << "            " << device->numMsis
 					<< " MSI-X vectors available" << frg::endlog;
 
@@ -24,6 +24,19 @@ struct Socket : File {
 		co_return resultOrError.value();
 	}
 
+	async::result<frg::expected<Error, AcceptResult>> accept(Process *) override {
+		auto laneOrError = co_await _file.accept();
+		if(!laneOrError) {
+			if(laneOrError.error() == protocols::fs::Error::wouldBlock)
+				co_return Error::wouldBlock;
+			co_return Error::illegalArguments;
+		}
+
+		auto file = smarter::make_shared<Socket>(std::move(laneOrError.value()));
+		file->setupWeakFile(file);
+		co_return File::constructHandle(file);
+	}
+
 	helix::BorrowedDescriptor getPassthroughLane() override {
 		return _file.getLane();
 	}
@@ -178,7 +178,7 @@ async::result<protocols::fs::Error> File::ptBind(void *object,
 	return self->bind(process.get(), addr_ptr, addr_length);
 }
 
-async::result<protocols::fs::Error> File::ptListen(void *object) {
+async::result<protocols::fs::Error> File::ptListen(void *object, int) {
 	auto self = static_cast<File *>(object);
 	return self->listen();
 }
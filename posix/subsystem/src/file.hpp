@@ -178,7 +178,7 @@ public:
 			std::vector<uint32_t> fds);
 
 	static async::result<protocols::fs::Error>
-	ptListen(void *object);
+	ptListen(void *object, int backlog);
 
 	static async::result<frg::expected<protocols::fs::Error, size_t>>
 	ptPeername(void *object, void *addr_ptr, size_t max_addr_length);
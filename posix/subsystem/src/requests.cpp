@@ -2398,8 +2398,12 @@ async::result<void> serveRequests(std::shared_ptr<Process> self,
 
 			auto newfileResult = co_await sockfile->accept(self.get());
 			if(!newfileResult) {
-				assert(newfileResult.error() == Error::wouldBlock);
-				co_await sendErrorResponse(managarm::posix::Errors::WOULD_BLOCK);
+				if(newfileResult.error() == Error::illegalArguments) {
+					co_await sendErrorResponse(managarm::posix::Errors::ILLEGAL_ARGUMENTS);
+				}else{
+					assert(newfileResult.error() == Error::wouldBlock);
+					co_await sendErrorResponse(managarm::posix::Errors::WOULD_BLOCK);
+				}
 				continue;
 			}
 			auto newfile = newfileResult.value();
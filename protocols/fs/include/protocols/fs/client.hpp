@@ -3,7 +3,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <span>
 #include <unordered_map>
+#include <utility>
 
 #include <async/result.hpp>
 #include <async/cancellation.hpp>
@@ -39,6 +41,28 @@ struct File {
 
 	async::result<helix::UniqueDescriptor> accessMemory();
 
+	// Receives up to msgs.size() messages in a single exchange.
+	// On entry, dataLength and addrLength are the sizes of the buffers of each message;
+	// messages are truncated to the smallest of them. On return, they are set to the
+	// lengths of the received messages. Returns the number of received messages.
+	async::result<frg::expected<Error, size_t>>
+	recvMsgBatch(uint32_t flags, std::span<BatchedMsg> msgs);
+
+	// Sends all messages in a single exchange. Returns the number of sent messages.
+	async::result<frg::expected<Error, size_t>>
+	sendMsgBatch(uint32_t flags, std::span<const BatchedMsg> msgs);
+
+	// Returns the lane of the accepted connection.
+	async::result<frg::expected<Error, helix::UniqueDescriptor>> accept();
+
+	// Returns the memory of the socket's data rings (see socket-rings.hpp)
+	// and the size of each ring.
+	async::result<frg::expected<Error, std::pair<helix::UniqueDescriptor, size_t>>>
+	mapSocketRings();
+
+	// Notifies the server that data was produced to or consumed from the rings.
+	async::result<frg::expected<Error>> ringDoorbell();
+
 private:
 	helix::UniqueDescriptor _lane;
 };
@@ -37,6 +37,9 @@ enum class Error {
 	noSpaceLeft = 21,
 	noBackingDevice = 23,
 	isDirectory = 22,
+	connectionRefused = 25,
+	timedOut = 26,
+	connectionReset = 27,
 };
 
 inline managarm::fs::Errors mapFsError(Error e) {
@@ -64,6 +67,11 @@ inline managarm::fs::Errors mapFsError(Error e) {
 		case Error::noSpaceLeft: return managarm::fs::Errors::NO_SPACE_LEFT;
 		case Error::noBackingDevice: return managarm::fs::Errors::NO_BACKING_DEVICE;
 		case Error::isDirectory: return managarm::fs::Errors::IS_DIRECTORY;
+		// The C library does not map CONNECTION_REFUSED, TIMED_OUT and CONNECTION_RESET
+		// yet; until it does, report the closest errors that it understands.
+		case Error::connectionRefused: return managarm::fs::Errors::HOST_UNREACHABLE;
+		case Error::timedOut: return managarm::fs::Errors::HOST_UNREACHABLE;
+		case Error::connectionReset: return managarm::fs::Errors::BROKEN_PIPE;
 	}
 }
 
@@ -83,6 +91,15 @@ struct RecvData {
 };
 
 using RecvResult = std::variant<Error, RecvData>;
+
+// One message of a batch, see RecvMsgBatchRequest and SendMsgBatchRequest.
+struct BatchedMsg {
+	void *data;
+	size_t dataLength;
+	void *addr;
+	size_t addrLength;
+	uint32_t flags;
+};
 using SendResult = std::variant<Error, size_t>;
 
 struct CtrlBuilder {
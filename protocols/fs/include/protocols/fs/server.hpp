@@ -15,6 +15,7 @@
 #include <smarter.hpp>
 #include <deque>
 #include <memory>
+#include <span>
 
 namespace managarm::fs {
 	struct CntRequest;
@@ -49,6 +50,12 @@ using OpenResult = std::pair<helix::UniqueLane, helix::UniqueLane>;
 using MkdirResult = std::pair<std::shared_ptr<void>, int64_t>;
 using SymlinkResult = std::pair<std::shared_ptr<void>, int64_t>;
 
+// Memory that is shared by PT_MAP_SOCKET_RINGS, see socket-rings.hpp.
+struct SocketRingsResult {
+	helix::BorrowedDescriptor memory;
+	size_t ringSize;
+};
+
 using TraverseLinksResult = frg::expected<Error, std::tuple<std::vector<std::pair<std::shared_ptr<void>, int64_t>>, FileType, size_t>>;
 
 struct FileOperations {
@@ -135,11 +142,35 @@ struct FileOperations {
 		sockname = f;
 		return *this;
 	}
-	constexpr FileOperations &withListen(async::result<Error> (*f)(void *object)) {
+	constexpr FileOperations &withListen(async::result<Error> (*f)(void *object, int backlog)) {
 		listen = f;
 		return *this;
 	}
+	constexpr FileOperations &withAccept(async::result<frg::expected<Error, helix::UniqueLane>>
+			(*f)(void *object)) {
+		accept = f;
+		return *this;
+	}
+	constexpr FileOperations &withMapSocketRings(async::result<frg::expected<Error, SocketRingsResult>>
+			(*f)(void *object)) {
+		mapSocketRings = f;
+		return *this;
+	}
+	constexpr FileOperations &withRingDoorbell(async::result<Error> (*f)(void *object)) {
+		ringDoorbell = f;
+		return *this;
+	}
 
+	constexpr FileOperations &withRecvMsgBatch(async::result<frg::expected<Error, size_t>>
+			(*f)(void *object, const char *creds, uint32_t flags, std::span<BatchedMsg> msgs)) {
+		recvMsgBatch = f;
+		return *this;
+	}
+	constexpr FileOperations &withSendMsgBatch(async::result<frg::expected<Error, size_t>>
+			(*f)(void *object, const char *creds, uint32_t flags, std::span<const BatchedMsg> msgs)) {
+		sendMsgBatch = f;
+		return *this;
+	}
 	constexpr FileOperations &withPeername(async::result<frg::expected<Error, size_t>> (*f)(void *object,
 			void *addr_ptr, size_t max_addr_length)) {
 		peername = f;
@@ -173,7 +204,13 @@ struct FileOperations {
 	(*pollStatus)(void *object);
 	async::result<Error> (*bind)(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
-	async::result<Error> (*listen)(void *object);
+	async::result<Error> (*listen)(void *object, int backlog);
+	// Returns a passthrough lane for the accepted connection.
+	async::result<frg::expected<Error, helix::UniqueLane>> (*accept)(void *object);
+	// Returns the memory of the socket's data rings; the rings are used from now on.
+	async::result<frg::expected<Error, SocketRingsResult>> (*mapSocketRings)(void *object);
+	// Called when the owner has produced or consumed data in the socket's rings.
+	async::result<Error> (*ringDoorbell)(void *object);
 	async::result<Error> (*connect)(void *object, const char *credentials,
 			const void *addr_ptr, size_t addr_length);
 	async::result<size_t> (*sockname)(void *object, void *addr_ptr, size_t max_addr_length);
@@ -187,6 +224,13 @@ struct FileOperations {
 			void *addr_buf, size_t addr_size,
 			std::vector<uint32_t> fds);
 	async::result<frg::expected<Error, size_t>> (*peername)(void *object, void *addr_ptr, size_t max_addr_length);
+	// Receives up to msgs.size() messages into the buffers described by msgs, and updates
+	// the lengths and flags of the received messages. Returns the number of messages.
+	async::result<frg::expected<Error, size_t>> (*recvMsgBatch)(void *object, const char *creds,
+			uint32_t flags, std::span<BatchedMsg> msgs);
+	// Returns the number of messages that were sent; fails only if none was sent.
+	async::result<frg::expected<Error, size_t>> (*sendMsgBatch)(void *object, const char *creds,
+			uint32_t flags, std::span<const BatchedMsg> msgs);
 	async::result<frg::expected<Error, int>> (*getSeals)(void *object);
 	async::result<frg::expected<Error, int>> (*addSeals)(void *object, int seals);
 
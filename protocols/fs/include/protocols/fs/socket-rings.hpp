@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace protocols {
+namespace fs {
+
+// Layout of the memory that PT_MAP_SOCKET_RINGS shares between a socket's server
+// and its owner. The memory starts with a SocketRingsControl structure (padded to
+// socketRingsControlSize), followed by the send ring and the receive ring.
+// Both rings have the size that is returned by PT_MAP_SOCKET_RINGS (a power of two).
+// The owner can map the rings at any time; data that the server already buffered
+// is moved into them.
+//
+// Indices are free-running byte counters; the byte at index i is stored at offset
+// i & (ringSize - 1) of the ring. Each index is only written by one side.
+// After producing data to the send ring or consuming data from the receive ring,
+// the owner sends PT_RING_DOORBELL. The server notifies the owner via the usual
+// poll mechanism (EPOLLIN / EPOLLOUT). The server does not trust the indices that
+// the owner writes: updates that move an index backwards or beyond the space
+// (or data) in the ring are ignored.
+// Once the rings are mapped, the owner must transfer all data through them;
+// read, write, PT_RECVMSG and PT_SENDMSG fail with ILLEGAL_OPERATION_TARGET.
+
+struct SocketRingIndices {
+	// Written by the producer, advanced after the data is stored.
+	alignas(64) std::atomic<uint64_t> produced;
+	// Written by the consumer, advanced after the data is no longer needed.
+	alignas(64) std::atomic<uint64_t> consumed;
+};
+
+struct SocketRingsControl {
+	// Produced by the owner, consumed by the server.
+	SocketRingIndices send;
+	// Produced by the server, consumed by the owner.
+	SocketRingIndices recv;
+};
+
+inline constexpr size_t socketRingsControlSize = 0x1000;
+static_assert(sizeof(SocketRingsControl) <= socketRingsControlSize);
+
+inline constexpr size_t socketSendRingOffset() {
+	return socketRingsControlSize;
+}
+
+inline constexpr size_t socketRecvRingOffset(size_t ringSize) {
+	return socketRingsControlSize + ringSize;
+}
+
+inline constexpr size_t socketRingsMemorySize(size_t ringSize) {
+	return socketRingsControlSize + 2 * ringSize;
+}
+
+} } // namespace protocols::fs
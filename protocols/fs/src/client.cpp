@@ -1,5 +1,10 @@
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
+
+#include <frg/std_compat.hpp>
+#include <bragi/helpers-std.hpp>
 
 #include "fs.bragi.hpp"
 #include "protocols/fs/client.hpp"
@@ -201,5 +206,221 @@ async::result<helix::UniqueDescriptor> File::accessMemory() {
 	co_return recv_memory.descriptor();
 }
 
+async::result<frg::expected<Error, size_t>>
+File::recvMsgBatch(uint32_t flags, std::span<BatchedMsg> msgs) {
+	assert(!msgs.empty());
+	size_t size = msgs[0].dataLength;
+	size_t addrSize = msgs[0].addrLength;
+	for(auto &msg : msgs) {
+		size = std::min(size, msg.dataLength);
+		addrSize = std::min(addrSize, msg.addrLength);
+	}
+
+	managarm::fs::RecvMsgBatchRequest req;
+	req.set_count(msgs.size());
+	req.set_size(size);
+	req.set_flags(flags);
+	req.set_addr_size(addrSize);
+
+	auto [offer, send_req, imbue_creds, recv_head] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBragiHeadOnly(req, frg::stl_allocator{}),
+				helix_ng::imbueCredentials(),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(recv_head.error());
+
+	auto preamble = bragi::read_preamble(recv_head);
+	assert(!preamble.error());
+
+	std::vector<std::byte> tail(preamble.tail_size());
+	auto [recv_tail] = co_await helix_ng::exchangeMsgs(
+		offer.descriptor(),
+		helix_ng::recvBuffer(tail.data(), tail.size())
+	);
+	HEL_CHECK(recv_tail.error());
+
+	auto resp = bragi::parse_head_tail<managarm::fs::RecvMsgBatchReply>(recv_head, tail);
+	recv_head.reset();
+	assert(resp);
+	if(resp->error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp->error());
+
+	// The addresses and the data of all messages arrive back to back.
+	size_t received = resp->sizes().size();
+	assert(received <= msgs.size());
+	std::vector<char> addr(received * addrSize);
+	std::vector<char> data(received * size);
+	auto [recv_addr, recv_data] = co_await helix_ng::exchangeMsgs(
+		offer.descriptor(),
+		helix_ng::recvBuffer(addr.data(), addr.size()),
+		helix_ng::recvBuffer(data.data(), data.size())
+	);
+	HEL_CHECK(recv_addr.error());
+	HEL_CHECK(recv_data.error());
+
+	size_t offset = 0;
+	for(size_t i = 0; i < received; i++) {
+		auto length = resp->sizes()[i];
+		assert(length <= size && offset + length <= recv_data.actualLength());
+		memcpy(msgs[i].data, data.data() + offset, length);
+		memcpy(msgs[i].addr, addr.data() + i * addrSize,
+				std::min(size_t{resp->addr_sizes()[i]}, addrSize));
+		msgs[i].dataLength = length;
+		msgs[i].addrLength = resp->addr_sizes()[i];
+		msgs[i].flags = resp->flags()[i];
+		offset += length;
+	}
+	co_return received;
+}
+
+async::result<frg::expected<Error, size_t>>
+File::sendMsgBatch(uint32_t flags, std::span<const BatchedMsg> msgs) {
+	managarm::fs::SendMsgBatchRequest req;
+	req.set_flags(flags);
+
+	// The data and the addresses of all messages are sent back to back.
+	std::vector<char> data;
+	std::vector<char> addr;
+	for(auto &msg : msgs) {
+		auto p = reinterpret_cast<const char *>(msg.data);
+		auto a = reinterpret_cast<const char *>(msg.addr);
+		data.insert(data.end(), p, p + msg.dataLength);
+		addr.insert(addr.end(), a, a + msg.addrLength);
+		req.add_sizes(msg.dataLength);
+		req.add_addr_sizes(msg.addrLength);
+	}
+
+	auto [offer, send_head, send_tail, send_data, imbue_creds, send_addr, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBragiHeadTail(req, frg::stl_allocator{}),
+				helix_ng::sendBuffer(data.data(), data.size()),
+				helix_ng::imbueCredentials(),
+				helix_ng::sendBuffer(addr.data(), addr.size()),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_head.error());
+	HEL_CHECK(send_tail.error());
+	HEL_CHECK(send_data.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(send_addr.error());
+	HEL_CHECK(recv_resp.error());
+
+	auto resp = bragi::parse_head_only<managarm::fs::SendMsgBatchReply>(recv_resp);
+	recv_resp.reset();
+	assert(resp);
+	if(resp->error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp->error());
+	co_return resp->count();
+}
+
+async::result<frg::expected<Error, helix::UniqueDescriptor>> File::accept() {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_ACCEPT);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::want_lane,
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp.error());
+
+	auto [recv_lane] = co_await helix_ng::exchangeMsgs(
+		offer.descriptor(),
+		helix_ng::pullDescriptor()
+	);
+	HEL_CHECK(recv_lane.error());
+	co_return recv_lane.descriptor();
+}
+
+async::result<frg::expected<Error, std::pair<helix::UniqueDescriptor, size_t>>>
+File::mapSocketRings() {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_MAP_SOCKET_RINGS);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::want_lane,
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp.error());
+
+	auto [recv_memory] = co_await helix_ng::exchangeMsgs(
+		offer.descriptor(),
+		helix_ng::pullDescriptor()
+	);
+	HEL_CHECK(recv_memory.error());
+	co_return std::make_pair(recv_memory.descriptor(), static_cast<size_t>(resp.size()));
+}
+
+async::result<frg::expected<Error>> File::ringDoorbell() {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_RING_DOORBELL);
+
+	auto ser = req.SerializeAsString();
+	uint8_t buffer[128];
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			_lane,
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvBuffer(buffer, 128)
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(buffer, recv_resp.actualLength());
+	if(resp.error() != managarm::fs::Errors::SUCCESS)
+		co_return static_cast<Error>(resp.error());
+	co_return {};
+}
+
 } } // namespace protocol::fs
 
@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <iostream>
 #include <vector>
 
+#include <frg/std_compat.hpp>
 #include <helix/ipc.hpp>
 
 #include <protocols/fs/server.hpp>
@@ -17,6 +19,12 @@ namespace fs {
 
 namespace {
 
+// Upper bound on the number of messages in RecvMsgBatchRequest / SendMsgBatchRequest.
+constexpr size_t maxBatchedMsgs = 64;
+// Upper bounds on the size of a single batched message and its address.
+constexpr size_t maxBatchedMsgSize = 0xFFFF;
+constexpr size_t maxBatchedAddrSize = sizeof(struct sockaddr_storage);
+
 async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		const FileOperations *file_ops,
 		managarm::fs::CntRequest req, helix::UniqueLane conversation) {
@@ -573,7 +581,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 				async::cancellation_token{});
 		if(!resultOrError) {
 			managarm::fs::SvrResponse resp;
-			resp.set_error(static_cast<managarm::fs::Errors>(resultOrError.error()));
+			resp.set_error(mapFsError(resultOrError.error()));
 
 			auto ser = resp.SerializeAsString();
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
@@ -614,7 +622,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		auto resultOrError = co_await file_ops->pollStatus(file.get());
 		if(!resultOrError) {
 			managarm::fs::SvrResponse resp;
-			resp.set_error(static_cast<managarm::fs::Errors>(resultOrError.error()));
+			resp.set_error(mapFsError(resultOrError.error()));
 
 			auto ser = resp.SerializeAsString();
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
@@ -666,7 +674,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		recv_addr.reset();
 
 		managarm::fs::SvrResponse resp;
-		resp.set_error(static_cast<managarm::fs::Errors>(error));
+		resp.set_error(mapFsError(error));
 
 		auto ser = resp.SerializeAsString();
 		auto [send_resp] = co_await helix_ng::exchangeMsgs(
@@ -702,7 +710,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 		recv_addr.reset();
 
 		managarm::fs::SvrResponse resp;
-		resp.set_error(static_cast<managarm::fs::Errors>(error));
+		resp.set_error(mapFsError(error));
 
 		auto ser = resp.SerializeAsString();
 		auto [send_resp] = co_await helix_ng::exchangeMsgs(
@@ -756,7 +764,7 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 
 		if (!result) {
 			managarm::fs::SvrResponse resp;
-			resp.set_error(static_cast<managarm::fs::Errors>(result.error()));
+			resp.set_error(mapFsError(result.error()));
 
 			auto ser = resp.SerializeAsString();
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
@@ -849,10 +857,104 @@ async::detached handlePassthrough(smarter::shared_ptr<void> file,
 			co_return;
 		}
 
-		co_await file_ops->listen(file.get());
+		auto error = co_await file_ops->listen(file.get(), req.backlog());
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(mapFsError(error));
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size())
+		);
+		HEL_CHECK(send_resp.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_ACCEPT) {
+		if(!file_ops->accept) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		auto result = co_await file_ops->accept(file.get());
+		if(!result) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(mapFsError(result.error()));
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		managarm::fs::SvrResponse resp;
+		resp.set_error(managarm::fs::Errors::SUCCESS);
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, push_lane] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::pushDescriptor(result.value())
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(push_lane.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_MAP_SOCKET_RINGS) {
+		if(!file_ops->mapSocketRings) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
+
+		auto result = co_await file_ops->mapSocketRings(file.get());
+		if(!result) {
+			managarm::fs::SvrResponse resp;
+			resp.set_error(mapFsError(result.error()));
+
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+			co_return;
+		}
 
 		managarm::fs::SvrResponse resp;
 		resp.set_error(managarm::fs::Errors::SUCCESS);
+		resp.set_size(result.value().ringSize);
+
+		auto ser = resp.SerializeAsString();
+		auto [send_resp, push_memory] = co_await helix_ng::exchangeMsgs(
+			conversation,
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::pushDescriptor(result.value().memory)
+		);
+		HEL_CHECK(send_resp.error());
+		HEL_CHECK(push_memory.error());
+	}else if(req.req_type() == managarm::fs::CntReqType::PT_RING_DOORBELL) {
+		managarm::fs::SvrResponse resp;
+		if(!file_ops->ringDoorbell) {
+			resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+		}else{
+			auto error = co_await file_ops->ringDoorbell(file.get());
+			resp.set_error(mapFsError(error));
+		}
 
 		auto ser = resp.SerializeAsString();
 		auto [send_resp] = co_await helix_ng::exchangeMsgs(
@@ -1123,6 +1225,214 @@ async::result<void> servePassthrough(helix::UniqueLane lane,
 				resp.set_size(res.value());
 			}
 
+			auto ser = resp.SerializeAsString();
+			auto [send_resp] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBuffer(ser.data(), ser.size())
+			);
+			HEL_CHECK(send_resp.error());
+		} else if(preamble.id() == managarm::fs::RecvMsgBatchRequest::message_id) {
+			auto req = bragi::parse_head_only<managarm::fs::RecvMsgBatchRequest>(recv_req);
+			recv_req.reset();
+
+			if(!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
+
+			auto [extract_creds] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::extractCredentials()
+			);
+			HEL_CHECK(extract_creds.error());
+
+			size_t count = std::min(size_t{req->count()}, maxBatchedMsgs);
+			bool valid = count && req->size() >= 0
+					&& static_cast<uint64_t>(req->size()) <= maxBatchedMsgSize
+					&& req->addr_size() <= maxBatchedAddrSize;
+			if((!file_ops->recvMsgBatch && !file_ops->recvMsg) || !valid) {
+				managarm::fs::RecvMsgBatchReply resp;
+				resp.set_error(!valid
+						? managarm::fs::Errors::ILLEGAL_ARGUMENT
+						: managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+
+				auto [send_resp, send_tail] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::sendBragiHeadTail(resp, frg::stl_allocator{})
+				);
+				HEL_CHECK(send_resp.error());
+				HEL_CHECK(send_tail.error());
+				continue;
+			}
+
+			// Messages are received into slots of the maximal size.
+			size_t size = req->size();
+			size_t addrSize = req->addr_size();
+			std::vector<char> buffer(count * size);
+			std::vector<char> addr(count * addrSize);
+			std::vector<BatchedMsg> msgs(count);
+			for(size_t i = 0; i < count; i++)
+				msgs[i] = {buffer.data() + i * size, size, addr.data() + i * addrSize, addrSize, 0};
+
+			frg::expected<Error, size_t> result = Error::none;
+			if(file_ops->recvMsgBatch) {
+				result = co_await file_ops->recvMsgBatch(file.get(),
+					extract_creds.credentials(), req->flags(), msgs);
+			}else{
+				// Fall back to receiving a single message.
+				auto single = co_await file_ops->recvMsg(file.get(),
+					extract_creds.credentials(), req->flags(),
+					msgs[0].data, size, msgs[0].addr, addrSize, 0);
+				if(auto error = std::get_if<Error>(&single); error) {
+					result = *error;
+				}else{
+					auto &data = std::get<RecvData>(single);
+					msgs[0].dataLength = data.dataLength;
+					msgs[0].addrLength = data.addressLength;
+					msgs[0].flags = data.flags;
+					result = size_t{1};
+				}
+			}
+
+			managarm::fs::RecvMsgBatchReply resp;
+			if(!result) {
+				resp.set_error(mapFsError(result.error()));
+
+				auto [send_resp, send_tail] = co_await helix_ng::exchangeMsgs(
+					conversation,
+					helix_ng::sendBragiHeadTail(resp, frg::stl_allocator{})
+				);
+				HEL_CHECK(send_resp.error());
+				HEL_CHECK(send_tail.error());
+				continue;
+			}
+
+			// Pack the data of all messages; slots only ever move to lower offsets.
+			size_t received = std::min(result.value(), count);
+			size_t packed = 0;
+			resp.set_error(managarm::fs::Errors::SUCCESS);
+			for(size_t i = 0; i < received; i++) {
+				auto length = std::min(msgs[i].dataLength, size);
+				memmove(buffer.data() + packed, msgs[i].data, length);
+				packed += length;
+				resp.add_sizes(length);
+				resp.add_addr_sizes(msgs[i].addrLength);
+				resp.add_flags(msgs[i].flags);
+			}
+
+			auto [send_resp, send_tail, send_addr, send_data] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::sendBragiHeadTail(resp, frg::stl_allocator{}),
+				helix_ng::sendBuffer(addr.data(), received * addrSize),
+				helix_ng::sendBuffer(buffer.data(), packed)
+			);
+			HEL_CHECK(send_resp.error());
+			HEL_CHECK(send_tail.error());
+			HEL_CHECK(send_addr.error());
+			HEL_CHECK(send_data.error());
+		} else if(preamble.id() == managarm::fs::SendMsgBatchRequest::message_id) {
+			std::vector<std::byte> tail(preamble.tail_size());
+			auto [recv_tail] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::recvBuffer(tail.data(), tail.size())
+			);
+			HEL_CHECK(recv_tail.error());
+
+			auto req = bragi::parse_head_tail<managarm::fs::SendMsgBatchRequest>(recv_req, tail);
+			recv_req.reset();
+
+			if(!req) {
+				std::cout << "posix: Rejecting request due to decoding failure" << std::endl;
+				break;
+			}
+
+			size_t count = req->sizes().size();
+			bool valid = count && count <= maxBatchedMsgs
+					&& req->addr_sizes().size() == count;
+
+			// The client sends the buffers even if the request is invalid, hence they are
+			// sized as declared by the request (clamping each size keeps the sums bounded).
+			uint64_t dataSize = 0;
+			uint64_t addrSize = 0;
+			for(auto size : req->sizes()) {
+				if(size > maxBatchedMsgSize)
+					valid = false;
+				dataSize += std::min(uint64_t{size}, uint64_t{maxBatchedMsgSize} + 1);
+			}
+			for(auto size : req->addr_sizes()) {
+				if(size > maxBatchedAddrSize)
+					valid = false;
+				addrSize += std::min(uint64_t{size}, uint64_t{maxBatchedAddrSize} + 1);
+			}
+			// Do not allocate unbounded buffers; the transfer fails with
+			// kHelErrBufferTooSmall then, which is handled below.
+			if(dataSize > maxBatchedMsgs * maxBatchedMsgSize)
+				dataSize = 0;
+			if(addrSize > maxBatchedMsgs * maxBatchedAddrSize)
+				addrSize = 0;
+
+			std::vector<char> buffer(dataSize);
+			std::vector<char> addr(addrSize);
+			auto [recv_data, extract_creds, recv_addr] = co_await helix_ng::exchangeMsgs(
+				conversation,
+				helix_ng::recvBuffer(buffer.data(), buffer.size()),
+				helix_ng::extractCredentials(),
+				helix_ng::recvBuffer(addr.data(), addr.size())
+			);
+			HEL_CHECK(extract_creds.error());
+			if(recv_data.error() == kHelErrBufferTooSmall
+					|| recv_addr.error() == kHelErrBufferTooSmall) {
+				valid = false;
+			}else{
+				HEL_CHECK(recv_data.error());
+				HEL_CHECK(recv_addr.error());
+			}
+
+			managarm::fs::SendMsgBatchReply resp;
+			if(!valid || recv_data.actualLength() != dataSize
+					|| recv_addr.actualLength() != addrSize) {
+				resp.set_error(managarm::fs::Errors::ILLEGAL_ARGUMENT);
+			}else if(!file_ops->sendMsgBatch && !file_ops->sendMsg) {
+				resp.set_error(managarm::fs::Errors::ILLEGAL_OPERATION_TARGET);
+			}else{
+				std::vector<BatchedMsg> msgs(count);
+				size_t dataOffset = 0;
+				size_t addrOffset = 0;
+				for(size_t i = 0; i < count; i++) {
+					msgs[i] = {buffer.data() + dataOffset, req->sizes()[i],
+							addr.data() + addrOffset, req->addr_sizes()[i], 0};
+					dataOffset += req->sizes()[i];
+					addrOffset += req->addr_sizes()[i];
+				}
+
+				frg::expected<Error, size_t> result = Error::none;
+				if(file_ops->sendMsgBatch) {
+					result = co_await file_ops->sendMsgBatch(file.get(),
+						extract_creds.credentials(), req->flags(), msgs);
+				}else{
+					// Fall back to sending the messages one by one.
+					size_t sent = 0;
+					for(auto &msg : msgs) {
+						auto single = co_await file_ops->sendMsg(file.get(),
+							extract_creds.credentials(), req->flags(),
+							msg.data, msg.dataLength, msg.addr, msg.addrLength, {});
+						if(!single) {
+							if(!sent)
+								result = single.error();
+							break;
+						}
+						result = ++sent;
+					}
+				}
+
+				if(!result) {
+					resp.set_error(mapFsError(result.error()));
+				}else{
+					resp.set_error(managarm::fs::Errors::SUCCESS);
+					resp.set_count(result.value());
+				}
+			}
+
 			auto ser = resp.SerializeAsString();
 			auto [send_resp] = co_await helix_ng::exchangeMsgs(
 				conversation,
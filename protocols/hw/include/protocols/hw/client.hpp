@@ -53,7 +53,10 @@ struct Device {
 	async::result<helix::UniqueDescriptor> accessBar(int index);
 	async::result<helix::UniqueDescriptor> accessExpansionRom();
 	async::result<helix::UniqueDescriptor> accessIrq();
-	async::result<helix::UniqueDescriptor> installMsi(int index);
+	async::result<helix::UniqueDescriptor> installMsi(int index, unsigned int cpu = 0);
+	// Like installMsi() but returns a null descriptor if the MSI cannot be installed
+	// (e.g., if the CPU does not exist), such that drivers can fall back.
+	async::result<helix::UniqueDescriptor> tryInstallMsi(int index, unsigned int cpu = 0);
 
 	async::result<void> claimDevice();
 	async::result<void> enableBusIrq();
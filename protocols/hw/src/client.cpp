@@ -1,6 +1,7 @@
 
 #include <memory>
 #include <iostream>
+#include <stdexcept>
 
 #include <vector>
 
@@ -210,9 +211,17 @@ async::result<helix::UniqueDescriptor> Device::accessIrq() {
 	co_return pull_irq.descriptor();
 }
 
-async::result<helix::UniqueDescriptor> Device::installMsi(int index) {
+async::result<helix::UniqueDescriptor> Device::installMsi(int index, unsigned int cpu) {
+	auto msi = co_await tryInstallMsi(index, cpu);
+	if(!msi)
+		throw std::runtime_error("protocols/hw: Failed to install MSI");
+	co_return std::move(msi);
+}
+
+async::result<helix::UniqueDescriptor> Device::tryInstallMsi(int index, unsigned int cpu) {
 	managarm::hw::InstallMsiRequest req;
 	req.set_index(index);
+	req.set_cpu(cpu);
 
 	auto [offer, send_req, recv_head] = co_await helix_ng::exchangeMsgs(
 			_lane,
@@ -232,18 +241,27 @@ async::result<helix::UniqueDescriptor> Device::installMsi(int index) {
 	recv_head.reset();
 
 	std::vector<std::byte> tailBuffer(preamble.tail_size());
-	auto [recv_tail, pull_msi] = co_await helix_ng::exchangeMsgs(
+	auto [recv_tail] = co_await helix_ng::exchangeMsgs(
 			offer.descriptor(),
-			helix_ng::recvBuffer(tailBuffer.data(), tailBuffer.size()),
-			helix_ng::pullDescriptor()
+			helix_ng::recvBuffer(tailBuffer.data(), tailBuffer.size())
 		);
 
 	HEL_CHECK(recv_tail.error());
-	HEL_CHECK(pull_msi.error());
 
 	auto resp = *bragi::parse_head_tail<managarm::hw::SvrResponse>(recv_head, tailBuffer);
 
-	assert(resp.error() == managarm::hw::Errors::SUCCESS);
+	if(resp.error() != managarm::hw::Errors::SUCCESS) {
+		std::cout << "protocols/hw: Could not install MSI " << index
+				<< " on CPU " << cpu << std::endl;
+		co_return helix::UniqueDescriptor{};
+	}
+
+	auto [pull_msi] = co_await helix_ng::exchangeMsgs(
+			offer.descriptor(),
+			helix_ng::pullDescriptor()
+		);
+
+	HEL_CHECK(pull_msi.error());
 
 	co_return pull_msi.descriptor();
 }
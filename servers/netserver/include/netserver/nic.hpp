@@ -3,9 +3,11 @@
 #include <arch/dma_pool.hpp>
 #include <async/result.hpp>
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <optional>
 #include <unordered_map>
+#include <vector>
 
 namespace nic {
 struct MacAddress {
@@ -41,27 +43,139 @@ enum EtherType : uint16_t {
 	ETHER_TYPE_ARP = 0x0806,
 };
 
-// TODO(arsen): Expose interface for csum offloading, constructing frames, and
-// other features of NICs
+//! Offloads that a Link can perform, see Link::offloads()
+enum Offload : uint32_t {
+	//! The device computes checksums of transmitted frames, see TxMetadata::needsChecksum
+	OFFLOAD_TX_CSUM = 1,
+	//! The device validates checksums of received frames, see RxMetadata::checksumValid
+	OFFLOAD_RX_CSUM = 2,
+	//! The device segments TCP over IPv4 frames, see TxMetadata::segmentSize
+	OFFLOAD_TSO4 = 4,
+};
+
+//! Per-frame offload requests for transmission. Offsets are relative to the start of the frame.
+struct TxMetadata {
+	//! If set, the device computes the one's complement sum from checksumStart to the end
+	//! of the frame and stores it at checksumStart + checksumOffset. The checksum field must
+	//! contain the sum of the pseudo header. Requires OFFLOAD_TX_CSUM.
+	bool needsChecksum = false;
+	uint16_t checksumStart = 0;
+	uint16_t checksumOffset = 0;
+	//! If non-zero, the device splits the TCP payload into segments of this size and
+	//! replicates the first headerLength bytes for each segment. Requires OFFLOAD_TSO4.
+	uint16_t segmentSize = 0;
+	uint16_t headerLength = 0;
+};
+
+//! Per-frame offload results for reception
+struct RxMetadata {
+	//! The device has validated the L4 checksum (or the frame comes from a trusted source
+	//! that did not compute it). Only set if the Link supports OFFLOAD_RX_CSUM.
+	bool checksumValid = false;
+};
+
+//! Recycles DMA buffers of a fixed size, such that sending and receiving frames does not
+//! allocate memory in the common case. Allocations that fit into a slot are served from
+//! a free list; larger ones are passed on to the next pool (or to the backing pool).
+//! Slots are cache-line aligned, hence frames never share cache lines.
+//! All memory comes from the backing pool, which must outlive the FramePool.
+struct FramePool final : arch::dma_pool {
+	FramePool(size_t slotSize, size_t maxCached, arch::dma_pool *backing,
+			arch::dma_pool *next = nullptr);
+	FramePool(const FramePool &) = delete;
+	FramePool &operator=(const FramePool &) = delete;
+	~FramePool();
+
+	void *allocate(size_t size, size_t count, size_t align) override;
+	void deallocate(void *pointer, size_t size, size_t count, size_t align) override;
+
+private:
+	// Free slots form an intrusive list. netserver runs on a single thread,
+	// hence the list does not need to be synchronized.
+	struct FreeSlot {
+		FreeSlot *next;
+	};
+
+	bool fitsSlot_(size_t size, size_t count, size_t align);
+
+	arch::dma_pool *backing_;
+	arch::dma_pool *next_;
+	size_t slotSize_;
+	// Limits the memory that is kept in the free list.
+	size_t maxCached_;
+	FreeSlot *freeList_ = nullptr;
+	size_t numCached_ = 0;
+};
+
+// TODO(arsen): Expose interface for constructing frames, and other features of NICs
 struct Link {
 	struct AllocatedBuffer {
 		arch::dma_buffer frame;
 		arch::dma_buffer_view payload;
 	};
 
+	struct ReceivedFrame {
+		arch::dma_buffer buffer;
+		RxMetadata metadata;
+	};
+
+	struct TxFrame {
+		arch::dma_buffer_view frame;
+		TxMetadata metadata;
+	};
+
+	struct QueuedFrame {
+		AllocatedBuffer buffer;
+		TxMetadata metadata;
+	};
+
+	//! Frames are allocated from dmaPool, which must outlive the link
 	Link(unsigned int mtu, arch::dma_pool *dmaPool);
 	virtual ~Link() = default;
 	//! Receives an entire frame from the network
 	virtual async::result<void> receive(arch::dma_buffer_view) = 0;
 	//! Sends an entire ethernet frame
 	virtual async::result<void> send(const arch::dma_buffer_view) = 0;
+
+	//! Number of receive queues; the device distributes flows among them
+	virtual size_t numReceiveQueues();
+	//! Number of receive buffers that the given queue can hold at once
+	virtual size_t receiveQueueDepth(size_t queue);
+	//! Hands buffers to the given queue that frames are received into
+	virtual async::result<void> postReceiveBuffers(size_t queue,
+			std::vector<arch::dma_buffer> buffers);
+	//! Waits for frames received on the given queue and returns up to max of them, in order
+	virtual async::result<std::vector<ReceivedFrame>> receiveBurst(size_t queue, size_t max);
+	//! Sends multiple entire ethernet frames, notifying the device only once.
+	//! Links with multiple queues transmit each flow on the queue that receives it.
+	virtual async::result<void> sendBurst(std::vector<TxFrame> frames);
+	//! Sends an entire ethernet frame, using the offloads requested in metadata
+	async::result<void> sendOffloaded(const arch::dma_buffer_view frame, TxMetadata metadata);
+	//! Sends a frame obtained from allocateFrame(), taking ownership of its buffer
+	virtual async::result<void> transmit(AllocatedBuffer buffer, TxMetadata metadata);
+	//! Sends multiple frames obtained from allocateFrame(), taking ownership of their buffers
+	virtual async::result<void> transmitBurst(std::vector<QueuedFrame> frames);
+	//! Queues a frame obtained from allocateFrame(); it is sent by the next flushTransmits()
+	void queueTransmit(AllocatedBuffer buffer, TxMetadata metadata);
+	//! Sends all queued frames in a single burst
+	async::result<void> flushTransmits();
+
+	//! Bitmask of Offload values that the device supports
+	uint32_t offloads();
+
 	arch::dma_pool *dmaPool();
-	AllocatedBuffer allocateFrame(MacAddress to, EtherType type,
+	//! Pool for frame buffers, backed by dmaPool(); buffers are recycled once they are destructed
+	arch::dma_pool *framePool();
+	//! Allocates a frame (from framePool()) and fills in the link layer header;
+	//! the payload is written in place
+	virtual AllocatedBuffer allocateFrame(MacAddress to, EtherType type,
 		size_t payloadSize);
 
 	MacAddress deviceMac();
 	int index();
-	std::string name();
+	virtual std::string name();
+	//! Whether the link loops frames back to the local host (and has no link layer)
+	virtual bool isLoopback();
 	unsigned int mtu;
 
 	static std::shared_ptr<Link> byIndex(int index);
@@ -71,6 +185,17 @@ protected:
 	arch::dma_pool *dmaPool_;
 	MacAddress mac_;
 	int index_;
+	uint32_t offloads_ = 0;
+private:
+	// Buffers posted via the default postReceiveBuffers().
+	std::deque<arch::dma_buffer> postedBuffers_;
+	// Frames queued by queueTransmit().
+	std::vector<QueuedFrame> queuedFrames_;
+
+	// Frames that exceed the slots of framePool_ (i.e., TSO frames and frames of
+	// links with a large MTU). Declared first, as framePool_ refers to it.
+	FramePool largeFramePool_;
+	FramePool framePool_;
 };
 
 async::detached runDevice(std::shared_ptr<Link> dev);
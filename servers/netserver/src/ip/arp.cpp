@@ -137,6 +137,8 @@ Neighbours::Entry &Neighbours::getEntry(uint32_t ip) {
 	HEL_CHECK(helGetClock(&time));
 	if (auto f = table_.find(ip); f != table_.end()) {
 		if (time + staleTimeMs * 1'000'000 <= f->second.mtime_ns) {
+			if (f->second.state != State::stale)
+				generation_++;
 			f->second.state = State::stale;
 		}
 		return f->second;
@@ -149,6 +151,8 @@ Neighbours::Entry &Neighbours::getEntry(uint32_t ip) {
 
 void Neighbours::updateTable(uint32_t ip, nic::MacAddress mac, std::weak_ptr<nic::Link> link) {
 	auto &entry = getEntry(ip);
+	if (entry.state != State::reachable || entry.mac != mac)
+		generation_++;
 	entry.mac = mac;
 	entry.state = State::reachable;
 	entry.link = std::move(link);
@@ -27,9 +27,15 @@ struct Neighbours {
 	void feedArp(nic::MacAddress destination, arch::dma_buffer_view arpData, std::weak_ptr<nic::Link> link);
 	void updateTable(uint32_t proto, nic::MacAddress hardware, std::weak_ptr<nic::Link> link);
 	std::map<uint32_t, Neighbours::Entry> &getTable();
+
+	// incremented whenever an entry changes its state or address
+	uint64_t generation() const {
+		return generation_;
+	}
 private:
 	Entry &getEntry(uint32_t addr);
 	std::map<uint32_t, Entry> table_;
+	uint64_t generation_ = 0;
 };
 
 Neighbours &neigh4();
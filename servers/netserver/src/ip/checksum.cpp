@@ -1,6 +1,158 @@
 #include "checksum.hpp"
 
 #include <arch/bit.hpp>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// The one's complement sum does not depend on the byte order (see RFC1071).
+// Hence, the kernels below sum up the data in native byte order and the result
+// is converted afterwards. They add 32-bit words to 64-bit accumulators, such that
+// carries only need to be folded once at the end; this cannot overflow for
+// buffers smaller than 4 GiB.
+
+using checksum_detail::Kernel;
+
+uint16_t fold(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+template<bool Copy>
+uint64_t sumGeneric(unsigned char *dest, const unsigned char *src, size_t size, uint64_t sum) {
+	while (size >= 16) {
+		uint32_t words[4];
+		memcpy(words, src, 16);
+		if constexpr (Copy) {
+			memcpy(dest, words, 16);
+			dest += 16;
+		}
+		sum += uint64_t{words[0]} + words[1] + words[2] + words[3];
+		src += 16;
+		size -= 16;
+	}
+
+	// pad the remaining bytes with zeros, this preserves the pairing of bytes
+	if (size) {
+		uint32_t words[4] = {};
+		memcpy(words, src, size);
+		if constexpr (Copy)
+			memcpy(dest, src, size);
+		sum += uint64_t{words[0]} + words[1] + words[2] + words[3];
+	}
+	return sum;
+}
+
+#if defined(__x86_64__)
+
+template<bool Copy>
+uint64_t sumSse2(unsigned char *dest, const unsigned char *src, size_t size, uint64_t sum) {
+	auto zero = _mm_setzero_si128();
+	auto acc = _mm_setzero_si128();
+	while (size >= 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+		if constexpr (Copy) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest), v);
+			dest += 16;
+		}
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+		src += 16;
+		size -= 16;
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+	return sumGeneric<Copy>(dest, src, size, sum + lanes[0] + lanes[1]);
+}
+
+template<bool Copy>
+[[gnu::target("avx2")]]
+uint64_t sumAvx2(unsigned char *dest, const unsigned char *src, size_t size, uint64_t sum) {
+	auto zero = _mm256_setzero_si256();
+	auto acc = _mm256_setzero_si256();
+	while (size >= 32) {
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+		if constexpr (Copy) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dest), v);
+			dest += 32;
+		}
+		acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+		acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+		src += 32;
+		size -= 32;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+	return sumSse2<Copy>(dest, src, size, sum + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+#elif defined(__aarch64__)
+
+template<bool Copy>
+uint64_t sumNeon(unsigned char *dest, const unsigned char *src, size_t size, uint64_t sum) {
+	auto acc = vdupq_n_u64(0);
+	while (size >= 16) {
+		auto v = vld1q_u8(src);
+		if constexpr (Copy) {
+			vst1q_u8(dest, v);
+			dest += 16;
+		}
+		acc = vpadalq_u32(acc, vreinterpretq_u32_u8(v));
+		src += 16;
+		size -= 16;
+	}
+
+	return sumGeneric<Copy>(dest, src, size,
+		sum + vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1));
+}
+
+#endif
+
+struct Kernels {
+	Kernel sum;
+	Kernel copy;
+};
+
+Kernels selectKernels() {
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return {&sumAvx2<false>, &sumAvx2<true>};
+	return {&sumSse2<false>, &sumSse2<true>};
+#elif defined(__aarch64__)
+	return {&sumNeon<false>, &sumNeon<true>};
+#else
+	return {&sumGeneric<false>, &sumGeneric<true>};
+#endif
+}
+
+const Kernels kernels = selectKernels();
+
+} // namespace
+
+std::vector<checksum_detail::KernelInfo> checksum_detail::supportedKernels() {
+	std::vector<KernelInfo> result;
+	result.push_back({"generic", &sumGeneric<false>, &sumGeneric<true>});
+#if defined(__x86_64__)
+	result.push_back({"sse2", &sumSse2<false>, &sumSse2<true>});
+	if (__builtin_cpu_supports("avx2"))
+		result.push_back({"avx2", &sumAvx2<false>, &sumAvx2<true>});
+#elif defined(__aarch64__)
+	result.push_back({"neon", &sumNeon<false>, &sumNeon<true>});
+#endif
+	return result;
+}
 
 void Checksum::update(uint16_t word)  {
 	state_ += word;
@@ -10,22 +162,38 @@ void Checksum::update(uint16_t word)  {
 }
 
 void Checksum::update(const void *data, size_t size) {
-	using namespace arch;
-	auto iter = static_cast<const unsigned char*>(data);
-	if (size % 2 != 0) {
-		size--;
-		update(iter[size] << 8);
-	}
-	auto end = iter + size;
-	for (; iter < end; iter += 2) {
-		update(iter[0] << 8 | iter[1]);
-	}
+	auto sum = kernels.sum(nullptr, static_cast<const unsigned char *>(data), size, 0);
+	addSum_(sum, size);
 }
 
 void Checksum::update(arch::dma_buffer_view view) {
 	update(view.data(), view.size());
 }
 
+void Checksum::update(const Checksum &other) {
+	uint16_t word = other.state_;
+	if (odd_)
+		word = (word >> 8) | (word << 8);
+	update(word);
+	odd_ ^= other.odd_;
+}
+
+void Checksum::updateAndCopy(void *dest, const void *src, size_t size) {
+	auto sum = kernels.copy(static_cast<unsigned char *>(dest),
+		static_cast<const unsigned char *>(src), size, 0);
+	addSum_(sum, size);
+}
+
+void Checksum::addSum_(uint64_t sum, size_t size) {
+	using namespace arch;
+	uint16_t word = convert_endian<endian::big, endian::native>(fold(sum));
+	// data that starts at an odd offset is shifted by one byte
+	if (odd_)
+		word = (word >> 8) | (word << 8);
+	update(word);
+	odd_ ^= size & 1;
+}
+
 uint16_t Checksum::finalize() {
 	auto state_ = this->state_;
 	return ~state_;
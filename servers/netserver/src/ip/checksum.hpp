@@ -1,14 +1,43 @@
 #pragma once
 
 #include <arch/dma_structs.hpp>
+#include <vector>
 
-// 16-bit one's compliment sum checksum, as described in RFC791, amongst others
+// 16-bit one's compliment sum checksum, as described in RFC791, amongst others.
+// Data can be added in pieces of arbitrary size.
 struct Checksum {
 	void update(uint16_t word);
 	void update(const void *mem, size_t size);
 	void update(arch::dma_buffer_view area);
+	// adds the data summed up by other, as if it was passed to update() directly
+	void update(const Checksum &other);
+	// same as update(src, size), but also copies the data to dest
+	void updateAndCopy(void *dest, const void *src, size_t size);
 	uint16_t finalize();
 
 private:
+	void addSum_(uint64_t sum, size_t size);
+
 	uint32_t state_ = 0;
+	// whether an odd number of bytes has been summed up so far
+	bool odd_ = false;
 };
+
+namespace checksum_detail {
+
+// Adds up the data in 32-bit words (in native byte order) to sum.
+// The copying variants also copy the data to dest.
+using Kernel = uint64_t (*)(unsigned char *dest, const unsigned char *src,
+		size_t size, uint64_t sum);
+
+struct KernelInfo {
+	const char *name;
+	Kernel sum;
+	Kernel copy;
+};
+
+// Returns all kernels that the CPU supports, starting with the portable one.
+// This is only used by tests and benchmarks.
+std::vector<KernelInfo> supportedKernels();
+
+} // namespace checksum_detail
@@ -6,6 +6,8 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <algorithm>
+#include <bit>
+#include <cassert>
 #include <cstring>
 #include <iostream>
 #include <iomanip>
@@ -26,26 +28,9 @@ Ip4 &ip4() {
 	return inst;
 }
 
-bool Ip4Router::addRoute(Route r) {
-	return routes.emplace(std::move(r)).second;
-}
-
-std::optional<Route> Ip4Router::resolveRoute(uint32_t ip) {
-	for (auto i = routes.begin(); i != routes.end(); i++) {
-		const auto &r = *i;
-		if (r.network.sameNet(ip)) {
-			if (r.link.expired()) {
-				i = routes.erase(i);
-				continue;
-			}
-			return { r };
-		}
-	}
-	return {};
-}
-
-bool operator<(const CidrAddress &lhs, const CidrAddress &) {
-	return std::tie(lhs.prefix, lhs.ip) < std::tie(lhs.prefix, lhs.ip);
+bool operator<(const CidrAddress &lhs, const CidrAddress &rhs) {
+	// more specific networks sort lower
+	return std::tie(rhs.prefix, lhs.ip) < std::tie(lhs.prefix, rhs.ip);
 }
 
 auto operator<=>(const Route &lhs, const Route &rhs) {
@@ -68,6 +53,94 @@ bool operator==(const Route &lhs, const Route &rhs) {
 	return operator<=>(lhs, rhs) == 0;
 }
 
+namespace {
+// number of leading bits that a and b have in common, at most limit
+uint8_t commonPrefix(uint32_t a, uint32_t b, uint8_t limit) {
+	auto common = static_cast<uint8_t>(std::countl_zero(a ^ b));
+	return std::min(common, limit);
+}
+
+// the bit of ip that follows the first prefix bits, selects the child node
+int branchBit(uint32_t ip, uint8_t prefix) {
+	return (ip >> (31 - prefix)) & 1;
+}
+} // namespace
+
+bool Ip4Router::addRoute(Route r) {
+	auto [it, inserted] = routes.emplace(std::move(r));
+	if (!inserted)
+		return false;
+	generation_++;
+
+	CidrAddress key { it->network.ip & it->network.mask(), it->network.prefix };
+	auto slot = &root_;
+	while (true) {
+		auto &node = *slot;
+		if (!node) {
+			node = std::make_unique<Node>(key);
+			node->routes.push_back(it);
+			return true;
+		}
+
+		auto common = commonPrefix(node->prefix.ip, key.ip,
+			std::min(node->prefix.prefix, key.prefix));
+		if (common == node->prefix.prefix && common == key.prefix) {
+			auto pos = std::find_if(node->routes.begin(), node->routes.end(),
+				[&] (auto other) { return *it < *other; });
+			node->routes.insert(pos, it);
+			return true;
+		}
+
+		if (common == node->prefix.prefix) {
+			slot = &node->children[branchBit(key.ip, common)];
+			continue;
+		}
+
+		// the prefixes diverge (or key is a prefix of node), split the edge
+		auto old = std::move(node);
+		if (common == key.prefix) {
+			node = std::make_unique<Node>(key);
+			node->routes.push_back(it);
+		} else {
+			node = std::make_unique<Node>(
+				CidrAddress { key.ip & CidrAddress { 0, common }.mask(), common });
+			auto leaf = std::make_unique<Node>(key);
+			leaf->routes.push_back(it);
+			node->children[branchBit(key.ip, common)] = std::move(leaf);
+		}
+		node->children[branchBit(old->prefix.ip, common)] = std::move(old);
+		return true;
+	}
+}
+
+std::optional<Route> Ip4Router::resolveRoute(uint32_t ip) {
+	// collect all nodes whose prefix matches, from shortest to longest
+	Node *matches[33];
+	size_t numMatches = 0;
+	for (auto node = root_.get(); node && node->prefix.sameNet(ip); ) {
+		if (!node->routes.empty())
+			matches[numMatches++] = node;
+		if (node->prefix.prefix == 32)
+			break;
+		node = node->children[branchBit(ip, node->prefix.prefix)].get();
+	}
+
+	// routes whose link disappeared are removed lazily; nodes stay in the trie
+	for (size_t i = numMatches; i-- > 0; ) {
+		auto &candidates = matches[i]->routes;
+		for (auto it = candidates.begin(); it != candidates.end(); ) {
+			if ((*it)->link.expired()) {
+				routes.erase(*it);
+				it = candidates.erase(it);
+				generation_++;
+				continue;
+			}
+			return **it;
+		}
+	}
+	return {};
+}
+
 bool Ip4Packet::parse(arch::dma_buffer owner, arch::dma_buffer_view frame) {
 	buffer_ = std::move(owner);
 	data = frame;
@@ -97,6 +170,160 @@ bool Ip4Packet::parse(arch::dma_buffer owner, arch::dma_buffer_view frame) {
 	return true;
 }
 
+namespace {
+// time after which incomplete datagrams are dropped, as in RFC791
+constexpr uint64_t reassemblyTimeout = 30'000'000'000;
+// limit on the buffers of the fragments of all incomplete datagrams
+constexpr size_t reassemblyMemoryLimit = 4 * 1024 * 1024;
+// limit on the fragments of a single datagram
+constexpr size_t maxFragments = 64;
+// largest payload of a datagram, see the length field of the header
+constexpr size_t maxPayload = 0xFFFF - sizeof(Ip4Packet::Header);
+
+uint64_t clockNs() {
+	uint64_t now;
+	HEL_CHECK(helGetClock(&now));
+	return now;
+}
+} // namespace
+
+std::optional<Ip4Packet> Ip4Reassembly::feed(Ip4Packet fragment) {
+	auto now = clockNs();
+	expire_(now);
+
+	auto offset = fragment.fragmentOffset();
+	auto size = fragment.payload().size();
+	auto more = fragment.moreFragments();
+	// all fragments but the last one carry multiples of 8 bytes
+	if ((more && (size == 0 || size % 8)) || offset + size > maxPayload) {
+		std::cout << "netserver: dropping invalid ip4 fragment" << std::endl;
+		return std::nullopt;
+	}
+
+	auto &hdr = fragment.header;
+	Key key { hdr.source, hdr.destination, hdr.ident, hdr.protocol };
+	auto [entry, inserted] = byKey_.try_emplace(key);
+	if (inserted) {
+		flows_.push_back(Flow { key, now + reassemblyTimeout });
+		entry->second = std::prev(flows_.end());
+	}
+	auto flowIt = entry->second;
+	auto &fragments = flowIt->fragments;
+
+	auto end = offset + size;
+	auto it = std::lower_bound(fragments.begin(), fragments.end(), offset,
+		[] (const Ip4Packet &p, size_t o) {
+			return p.fragmentOffset() < o;
+		});
+
+	// retransmitted fragments are ignored, any other overlap invalidates the
+	// datagram (as overlaps are only ever produced by attackers, cf. RFC5722)
+	if (it != fragments.end() && it->fragmentOffset() == offset
+			&& it->payload().size() == size)
+		return std::nullopt;
+	bool overlaps = (it != fragments.end() && it->fragmentOffset() < end)
+		|| (it != fragments.begin()
+			&& std::prev(it)->fragmentOffset() + std::prev(it)->payload().size() > offset);
+	bool pastEnd = flowIt->total && end > *flowIt->total;
+	bool badEnd = !more && (flowIt->total
+		|| (!fragments.empty() && fragments.back().fragmentOffset()
+			+ fragments.back().payload().size() > end));
+	if (overlaps || pastEnd || badEnd) {
+		std::cout << "netserver: dropping ip4 datagram with inconsistent fragments"
+			<< std::endl;
+		drop_(flowIt);
+		return std::nullopt;
+	}
+
+	if (fragments.size() == maxFragments) {
+		std::cout << "netserver: dropping ip4 datagram with too many fragments"
+			<< std::endl;
+		drop_(flowIt);
+		return std::nullopt;
+	}
+
+	if (!more)
+		flowIt->total = end;
+	flowIt->received += size;
+	// charge the entire receive buffer, as the fragment keeps all of it alive
+	auto charge = fragment.bufferSize();
+	flowIt->charged += charge;
+	memory_ += charge;
+	fragments.insert(it, std::move(fragment));
+
+	while (memory_ > reassemblyMemoryLimit) {
+		auto victim = flows_.begin();
+		bool self = victim == flowIt;
+		drop_(victim);
+		if (self)
+			return std::nullopt;
+	}
+
+	if (!flowIt->total || flowIt->received != *flowIt->total)
+		return std::nullopt;
+
+	// maxPayload assumes a header without options; the reassembled datagram
+	// takes the header of the first fragment, which may carry options
+	auto headerSize = flowIt->fragments.front().header_view().size();
+	if (headerSize + *flowIt->total > 0xFFFF) {
+		std::cout << "netserver: dropping oversized ip4 datagram" << std::endl;
+		drop_(flowIt);
+		return std::nullopt;
+	}
+
+	auto datagram = assemble_(*flowIt);
+	drop_(flowIt);
+	return datagram;
+}
+
+void Ip4Reassembly::expire_(uint64_t now) {
+	while (!flows_.empty() && flows_.front().deadline <= now)
+		drop_(flows_.begin());
+}
+
+void Ip4Reassembly::drop_(FlowIterator flow) {
+	memory_ -= flow->charged;
+	byKey_.erase(flow->key);
+	flows_.erase(flow);
+}
+
+Ip4Packet Ip4Reassembly::assemble_(Flow &flow) {
+	using arch::convert_endian;
+	using arch::endian;
+
+	// the header (including options) is taken from the first fragment
+	auto &first = flow.fragments.front();
+	auto headerSize = first.header_view().size();
+	auto size = headerSize + *flow.total;
+
+	arch::dma_buffer buffer { &dmaPool_, size };
+	auto dest = static_cast<char *>(buffer.data());
+	std::memcpy(dest, first.header_view().data(), headerSize);
+	for (auto &f : flow.fragments) {
+		auto payload = f.payload();
+		std::memcpy(dest + headerSize + f.fragmentOffset(),
+			payload.data(), payload.size());
+	}
+
+	Ip4Packet::Header hdr;
+	std::memcpy(&hdr, dest, sizeof(hdr));
+	hdr.length = convert_endian<endian::big>(static_cast<uint16_t>(size));
+	hdr.flags_offset = 0;
+	hdr.checksum = 0;
+	std::memcpy(dest, &hdr, sizeof(hdr));
+
+	Checksum chk;
+	chk.update(dest, headerSize);
+	hdr.checksum = convert_endian<endian::big>(chk.finalize());
+	std::memcpy(dest, &hdr, sizeof(hdr));
+
+	Ip4Packet datagram;
+	auto view = buffer.subview(0);
+	[[maybe_unused]] bool valid = datagram.parse(std::move(buffer), view);
+	assert(valid);
+	return datagram;
+}
+
 namespace {
 auto checkAddress(const void *addr_ptr, size_t addr_len, uint32_t &ip) {
 	struct sockaddr_in addr;
@@ -250,6 +477,40 @@ Ip4::targetByRemote(uint32_t remote) {
 	co_return Ip4TargetInfo { remote, source, *oroute, std::move(target) };
 }
 
+async::result<frg::expected<protocols::fs::Error, Ip4TargetInfo>>
+Ip4::resolveTarget(uint32_t remote, Ip4RouteCache &cache) {
+	if (cache.target && cache.remote == remote
+			&& cache.generation == targetGeneration_()
+			&& !cache.target->route.link.expired()) {
+		co_return *cache.target;
+	}
+	cache.target.reset();
+
+	auto ti = co_await targetByRemote(remote);
+	if (!ti) {
+		co_return protocols::fs::Error::netUnreachable;
+	}
+
+	if (!ti->link->isLoopback()) {
+		auto macTarget = ti->route.gateway ? ti->route.gateway : remote;
+		ti->mac = co_await neigh4().tryResolve(macTarget, ti->source);
+		if (!ti->mac) {
+			co_return protocols::fs::Error::hostUnreachable;
+		}
+	}
+
+	// the neighbour lookup may have bumped the generation
+	cache.remote = remote;
+	cache.generation = targetGeneration_();
+	cache.target = ti;
+	co_return std::move(*ti);
+}
+
+uint64_t Ip4::targetGeneration_() {
+	// all counters only increase, hence so does their sum
+	return ip4Router().generation() + ipsGeneration_ + neigh4().generation();
+}
+
 bool Ip4::hasIp(uint32_t addr) {
 	return std::any_of(ips.cbegin(), ips.cend(),
 		[addr] (auto &x) {
@@ -257,75 +518,179 @@ bool Ip4::hasIp(uint32_t addr) {
 		});
 }
 
-async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
-		void *data, size_t len, uint16_t proto) {
-	using arch::convert_endian;
-	using arch::endian;
+frg::expected<protocols::fs::Error, Ip4Frame>
+Ip4::allocateFrame(const Ip4TargetInfo &ti, size_t len) {
+	// loopback links have no link layer
+	assert(ti.mac || ti.link->isLoopback());
 
-	// TODO(arsen): fragmentation
-	// calculate header size
-	size_t header_size = sizeof(Ip4Packet::Header);
-	size_t packet_size = len + header_size;
-	// TODO(arsen): options
-	if (ti.route.mtu != 0 && ti.route.mtu < packet_size) {
-		std::cout << "netserver: cant fragment 1" << std::endl;
-		co_return protocols::fs::Error::messageSize;
+	size_t packet_size = len + sizeof(Ip4Packet::Header);
+	if (packet_size > 0xFFFF) {
+		return protocols::fs::Error::messageSize;
 	}
 
-	auto &target = ti.link;
-	if (target->mtu < packet_size) {
-		std::cout << "netserver: cant fragment 2" << std::endl;
-		co_return protocols::fs::Error::messageSize;
-	}
+	return Ip4Frame{ti.link->allocateFrame(ti.mac.value_or(nic::MacAddress{}),
+		nic::ETHER_TYPE_IP4, packet_size)};
+}
 
-	auto macTarget = ti.route.gateway;
-	if (macTarget == 0) {
-		macTarget = ti.remote;
+async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
+		void *data, size_t len, uint16_t proto, nic::TxMetadata metadata) {
+	if (!ti.mac && !ti.link->isLoopback()) {
+		auto macTarget = ti.route.gateway ? ti.route.gateway : ti.remote;
+		ti.mac = co_await neigh4().tryResolve(macTarget, ti.source);
+		if (!ti.mac) {
+			co_return protocols::fs::Error::hostUnreachable;
+		}
 	}
 
-	auto mac = co_await neigh4().tryResolve(macTarget, ti.source);
-	if (!mac) {
-		co_return protocols::fs::Error::hostUnreachable;
+	auto frame = allocateFrame(ti, len);
+	if (!frame) {
+		co_return frame.error();
 	}
+	std::memcpy(frame.value().payload().data(), data, len);
+	co_return co_await sendFrame(std::move(ti), std::move(frame.value()), proto, metadata);
+}
 
-	Ip4Packet::Header hdr;
-	// TODO(arsen): options
-	hdr.ihl = 0x45;
-	hdr.tos = 0;
-	hdr.length = packet_size;
-	// TODO(arsen): fragmentation
-	hdr.flags_offset = 0;
-	hdr.ttl = 64;
-	hdr.protocol = proto;
-	// filled out later, 0 for purposes of computation
-	hdr.checksum = 0;
-	hdr.source = ti.source;
-	hdr.destination = ti.remote;
+async::result<protocols::fs::Error> Ip4::sendFrame(Ip4TargetInfo ti,
+		Ip4Frame frame, uint16_t proto, nic::TxMetadata metadata) {
+	co_return co_await sendFrame_(std::move(ti), std::move(frame), proto, metadata, false);
+}
 
-	hdr.ensureEndian();
+async::result<protocols::fs::Error> Ip4::queueFrame(Ip4TargetInfo ti,
+		Ip4Frame frame, uint16_t proto, nic::TxMetadata metadata) {
+	co_return co_await sendFrame_(std::move(ti), std::move(frame), proto, metadata, true);
+}
 
-	Checksum chk;
-	// TODO(arsen): accomodate for options
-	chk.update(reinterpret_cast<void *>(&hdr), sizeof(hdr));
-	hdr.checksum = convert_endian<endian::big>(chk.finalize());
+async::result<protocols::fs::Error> Ip4::sendFrame_(Ip4TargetInfo ti,
+		Ip4Frame frame, uint16_t proto, nic::TxMetadata metadata, bool queue) {
+	using arch::convert_endian;
+	using arch::endian;
 
-	auto fb = target->allocateFrame(*mac, nic::ETHER_TYPE_IP4, packet_size);
+	size_t header_size = sizeof(Ip4Packet::Header);
+	size_t packet_size = frame.buffer.payload.size();
+	size_t len = packet_size - header_size;
 
-	std::memcpy(fb.payload.data(), &hdr, sizeof(hdr));
-	std::memcpy(fb.payload.subview(header_size).byte_data(), data, len);
+	auto &target = ti.link;
+	size_t mtu = target->mtu;
+	if (ti.route.mtu != 0) {
+		mtu = std::min(mtu, size_t{ti.route.mtu});
+	}
+
+	// segmented packets are split into MTU-sized frames by the NIC,
+	// everything else that exceeds the MTU is fragmented
+	bool segmented = metadata.segmentSize != 0;
+	bool fragmented = !segmented && packet_size > mtu;
+	// every link has to forward datagrams of 68 bytes without fragmentation
+	if (fragmented && mtu < 68) {
+		co_return protocols::fs::Error::messageSize;
+	}
+
+	auto ident = nextIdent_++;
+	auto writeHeader = [&] (void *dest, size_t length, uint16_t flagsOffset) {
+		Ip4Packet::Header hdr;
+		// TODO(arsen): options
+		hdr.ihl = 0x45;
+		hdr.tos = 0;
+		hdr.length = length;
+		hdr.ident = ident;
+		hdr.flags_offset = flagsOffset;
+		hdr.ttl = 64;
+		hdr.protocol = proto;
+		// filled out later, 0 for purposes of computation
+		hdr.checksum = 0;
+		hdr.source = ti.source;
+		hdr.destination = ti.remote;
+
+		hdr.ensureEndian();
+
+		Checksum chk;
+		// TODO(arsen): accomodate for options
+		chk.update(reinterpret_cast<void *>(&hdr), sizeof(hdr));
+		hdr.checksum = convert_endian<endian::big>(chk.finalize());
+		std::memcpy(dest, &hdr, sizeof(hdr));
+	};
+
+	if (!fragmented) {
+		auto &fb = frame.buffer;
+		writeHeader(fb.payload.data(), packet_size, 0);
+
+		// make offsets relative to the start of the frame
+		auto l4Offset = reinterpret_cast<char *>(fb.payload.data())
+			- reinterpret_cast<char *>(fb.frame.data()) + header_size;
+		if (metadata.needsChecksum)
+			metadata.checksumStart += l4Offset;
+		if (segmented)
+			metadata.headerLength += l4Offset;
+		if (queue)
+			target->queueTransmit(std::move(fb), metadata);
+		else
+			co_await target->transmit(std::move(fb), metadata);
+		co_return protocols::fs::Error::none;
+	}
 
-	co_await target->send(std::move(fb.frame));
+	// keep the order of frames that were queued before
+	if (queue)
+		co_await target->flushTransmits();
+
+	// the NIC cannot sum up a payload that is split across frames, hence the
+	// checksum is computed here and patched into the fragment that contains it
+	auto bytes = static_cast<const char *>(frame.payload().data());
+	uint16_t l4Checksum = 0;
+	size_t l4ChecksumAt = 0;
+	if (metadata.needsChecksum) {
+		// the checksum field already contains the pseudo header sum
+		Checksum chk;
+		chk.update(bytes + metadata.checksumStart, len - metadata.checksumStart);
+		auto sum = chk.finalize();
+		// a UDP checksum of zero means "no checksum"
+		if (sum == 0 && proto == static_cast<uint16_t>(IpProto::udp)) {
+			sum = 0xFFFF;
+		}
+		l4Checksum = convert_endian<endian::big>(sum);
+		l4ChecksumAt = metadata.checksumStart + metadata.checksumOffset;
+	}
+
+	// all fragments but the last one carry multiples of 8 bytes; as the
+	// checksum field is 2-byte aligned, it never spans two fragments
+	size_t chunk = (mtu - header_size) & ~size_t{7};
+	for (size_t offset = 0; offset < len; offset += chunk) {
+		auto size = std::min(chunk, len - offset);
+		uint16_t flagsOffset = offset / 8;
+		if (offset + size < len)
+			flagsOffset |= Ip4Packet::flagMoreFragments;
+
+		auto fb = target->allocateFrame(ti.mac.value_or(nic::MacAddress{}),
+			nic::ETHER_TYPE_IP4, header_size + size);
+		writeHeader(fb.payload.data(), header_size + size, flagsOffset);
+		auto payload = fb.payload.subview(header_size).byte_data();
+		std::memcpy(payload, bytes + offset, size);
+		if (metadata.needsChecksum && l4ChecksumAt >= offset
+				&& l4ChecksumAt < offset + size)
+			std::memcpy(payload + (l4ChecksumAt - offset), &l4Checksum, sizeof(l4Checksum));
+
+		co_await target->transmit(std::move(fb), {});
+	}
 	co_return protocols::fs::Error::none;
 }
 
 void Ip4::feedPacket(nic::MacAddress, nic::MacAddress,
-		arch::dma_buffer owner, arch::dma_buffer_view frame) {
+		arch::dma_buffer owner, arch::dma_buffer_view frame,
+		nic::RxMetadata metadata) {
 	Ip4Packet hdr;
 	if (!hdr.parse(std::move(owner), frame)) {
 		std::cout << "netserver: runt, or otherwise invalid, ip4 frame received"
 			<< std::endl;
 		return;
 	}
+	if (hdr.isFragment()) {
+		auto datagram = reassembly_.feed(std::move(hdr));
+		if (!datagram)
+			return;
+		// the checksum offload results of the fragments say nothing about
+		// the datagram, hence it is left unvalidated
+		hdr = std::move(*datagram);
+	} else {
+		hdr.checksumValid = metadata.checksumValid;
+	}
 	auto proto = hdr.header.protocol;
 
 	auto begin = sockets.lower_bound(proto);
@@ -351,6 +716,7 @@ void Ip4::feedPacket(nic::MacAddress, nic::MacAddress,
 
 void Ip4::setLink(CidrAddress addr, std::weak_ptr<nic::Link> l) {
 	ips.emplace(addr, std::move(l));
+	ipsGeneration_++;
 }
 
 std::shared_ptr<nic::Link> Ip4::getLink(uint32_t addr) {
@@ -362,6 +728,7 @@ std::shared_ptr<nic::Link> Ip4::getLink(uint32_t addr) {
 	auto ptr = iter->second.lock();
 	if (!ptr) {
 		ips.erase(iter);
+		ipsGeneration_++;
 		return {};
 	}
 	return ptr;
@@ -384,7 +751,10 @@ std::optional<CidrAddress> Ip4::getCidrByIndex(int index) {
 }
 
 bool Ip4::deleteLink(CidrAddress addr) {
-	return ips.erase(addr) > 0;
+	if (!ips.erase(addr))
+		return false;
+	ipsGeneration_++;
+	return true;
 }
 
 std::optional<uint32_t> Ip4::findLinkIp(uint32_t ipOnNet, nic::Link *link) {
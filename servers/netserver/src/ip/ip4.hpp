@@ -1,13 +1,17 @@
 #pragma once
 
 #include <arch/bit.hpp>
+#include <arch/dma_pool.hpp>
 #include <arch/dma_structs.hpp>
 #include <helix/ipc.hpp>
+#include <list>
 #include <map>
 #include <smarter.hpp>
 #include <netserver/nic.hpp>
 #include <protocols/fs/common.hpp>
 #include <set>
+#include <frg/expected.hpp>
+#include <vector>
 #include <cstdint>
 #include <memory>
 #include <optional>
@@ -63,13 +67,32 @@ struct Ip4Router {
 
 	// false if insertion fails
 	bool addRoute(Route r);
+	// returns the best route of the longest matching prefix
 	std::optional<Route> resolveRoute(uint32_t ip);
 
 	inline const std::set<Route> &getRoutes() const {
 		return routes;
 	}
+
+	// incremented whenever a route is added or removed
+	inline uint64_t generation() const {
+		return generation_;
+	}
 private:
+	// node of a path-compressed binary trie, keyed by the route prefixes
+	struct Node {
+		inline Node(CidrAddress prefix)
+			: prefix(prefix) {}
+
+		CidrAddress prefix;
+		// routes to exactly this prefix, best first; empty for pure branch nodes
+		std::vector<std::set<Route>::iterator> routes;
+		std::unique_ptr<Node> children[2];
+	};
+
 	std::set<Route> routes;
+	std::unique_ptr<Node> root_;
+	uint64_t generation_ = 0;
 };
 
 class Ip4Packet {
@@ -106,6 +129,8 @@ public:
 	} header;
 	static_assert(sizeof(header) == 20, "bad header size");
 	arch::dma_buffer_view data;
+	// the NIC has already validated the L4 checksum
+	bool checksumValid = false;
 
 	inline arch::dma_buffer_view payload() const {
 		return data.subview(header.ihl * 4);
@@ -115,8 +140,74 @@ public:
 		return data.subview(0, header.ihl * 4);
 	}
 
+	// size of the receive buffer that this packet keeps alive
+	inline size_t bufferSize() const {
+		return buffer_.size();
+	}
+
 	// assumes frame is a valid view into owner
 	bool parse(arch::dma_buffer owner, arch::dma_buffer_view frame);
+
+	// offset of the payload within the original datagram, in bytes
+	inline size_t fragmentOffset() const {
+		return (header.flags_offset & offsetMask) * 8;
+	}
+
+	inline bool moreFragments() const {
+		return header.flags_offset & flagMoreFragments;
+	}
+
+	inline bool isFragment() const {
+		return moreFragments() || fragmentOffset() != 0;
+	}
+
+	static constexpr uint16_t flagDontFragment = 0x4000;
+	static constexpr uint16_t flagMoreFragments = 0x2000;
+	static constexpr uint16_t offsetMask = 0x1FFF;
+};
+
+// reassembles fragmented datagrams, see RFC791 and RFC815. incomplete
+// datagrams are dropped after a timeout, when they consist of too many
+// fragments, or when the buffers of all fragments exceed a global memory
+// limit (oldest first)
+struct Ip4Reassembly {
+	// returns the datagram once all of its fragments have been received
+	std::optional<Ip4Packet> feed(Ip4Packet fragment);
+
+private:
+	struct Key {
+		uint32_t source;
+		uint32_t destination;
+		uint16_t ident;
+		uint8_t protocol;
+
+		friend auto operator<=>(const Key &, const Key &) = default;
+	};
+
+	struct Flow {
+		Key key;
+		uint64_t deadline;
+		// sorted by offset, fragments never overlap
+		std::vector<Ip4Packet> fragments;
+		// payload bytes received so far
+		size_t received = 0;
+		// size of the payload, known once the last fragment arrived
+		std::optional<size_t> total = std::nullopt;
+		// memory charged against the global limit
+		size_t charged = 0;
+	};
+
+	using FlowIterator = std::list<Flow>::iterator;
+
+	void expire_(uint64_t now);
+	void drop_(FlowIterator flow);
+	Ip4Packet assemble_(Flow &flow);
+
+	// ordered by creation, and hence by deadline
+	std::list<Flow> flows_;
+	std::map<Key, FlowIterator> byKey_;
+	size_t memory_ = 0;
+	arch::contiguous_pool dmaPool_;
 };
 
 struct Ip4TargetInfo {
@@ -124,6 +215,27 @@ struct Ip4TargetInfo {
 	uint32_t source;
 	Ip4Router::Route route;
 	std::shared_ptr<nic::Link> link;
+	// MAC address of the next hop; resolved by sendFrame if unset
+	std::optional<nic::MacAddress> mac = std::nullopt;
+};
+
+// a frame that a transport protocol builds in place; space for the link layer
+// and IPv4 headers is reserved in front of the payload, see Ip4::allocateFrame
+struct Ip4Frame {
+	arch::dma_buffer_view payload() {
+		return buffer.payload.subview(sizeof(Ip4Packet::Header));
+	}
+
+	// buffer.payload covers the IPv4 header and the payload
+	nic::Link::AllocatedBuffer buffer;
+};
+
+// per-socket cache of the target of the last remote, including the neighbour
+// lookup; invalidated when routes, addresses or neighbours change
+struct Ip4RouteCache {
+	uint32_t remote = 0;
+	uint64_t generation = 0;
+	std::optional<Ip4TargetInfo> target;
 };
 
 struct Ip4Socket;
@@ -131,7 +243,8 @@ struct Ip4 {
 	managarm::fs::Errors serveSocket(helix::UniqueLane lane, int type, int proto, int flags);
 	// frame is a view into the owner buffer, stripping away eth bits
 	void feedPacket(nic::MacAddress dest, nic::MacAddress src,
-		arch::dma_buffer owner, arch::dma_buffer_view frame);
+		arch::dma_buffer owner, arch::dma_buffer_view frame,
+		nic::RxMetadata metadata = {});
 
 	bool hasIp(uint32_t ip);
 	std::shared_ptr<nic::Link> getLink(uint32_t ip);
@@ -141,12 +254,40 @@ struct Ip4 {
 	std::optional<uint32_t> findLinkIp(uint32_t ipOnNet, nic::Link *link);
 
 	async::result<std::optional<Ip4TargetInfo>> targetByRemote(uint32_t);
+	// like targetByRemote, but also resolves the next hop's MAC address and
+	// reuses the target stored in cache if it is still valid
+	async::result<frg::expected<protocols::fs::Error, Ip4TargetInfo>>
+	resolveTarget(uint32_t, Ip4RouteCache &cache);
+	// allocates a frame for a payload of len bytes from the target's link;
+	// the MAC address of the target must already be resolved
+	frg::expected<protocols::fs::Error, Ip4Frame> allocateFrame(const Ip4TargetInfo &, size_t len);
+	// offsets in metadata are relative to the IP payload; only request
+	// offloads that are supported by the target's link
+	async::result<protocols::fs::Error> sendFrame(Ip4TargetInfo,
+		Ip4Frame, uint16_t, nic::TxMetadata metadata = {});
+	// same as above, but copies the payload into a new frame
 	async::result<protocols::fs::Error> sendFrame(Ip4TargetInfo,
 		void*, size_t,
-		uint16_t);
+		uint16_t, nic::TxMetadata metadata = {});
+	// like sendFrame, but only queues the frame on the target's link, see
+	// nic::Link::flushTransmits; datagrams that need fragmentation are sent
+	// immediately
+	async::result<protocols::fs::Error> queueFrame(Ip4TargetInfo,
+		Ip4Frame, uint16_t, nic::TxMetadata metadata = {});
 private:
+	async::result<protocols::fs::Error> sendFrame_(Ip4TargetInfo,
+		Ip4Frame, uint16_t, nic::TxMetadata metadata, bool queue);
+
+	// changes whenever a cached target might become invalid
+	uint64_t targetGeneration_();
+
 	std::multimap<int, smarter::shared_ptr<Ip4Socket>> sockets;
 	std::map<CidrAddress, std::weak_ptr<nic::Link>> ips;
+	uint64_t ipsGeneration_ = 0;
+
+	Ip4Reassembly reassembly_;
+	// identification of the next datagram that is sent
+	uint16_t nextIdent_ = 0;
 
 	Udp4 udp;
 	Tcp4 tcp;
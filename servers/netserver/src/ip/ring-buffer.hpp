@@ -0,0 +1,122 @@
+#pragma once
+
+#include <protocols/fs/socket-rings.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "checksum.hpp"
+
+// Byte ring that buffers the data of a TCP connection in one direction.
+struct RingBuffer {
+	RingBuffer(int shift)
+	: storage_{reinterpret_cast<char *>(operator new (1 << shift))}, shift_{shift} { }
+
+	RingBuffer(const RingBuffer &) = delete;
+
+	~RingBuffer() {
+		if(!shared_)
+			operator delete(storage_);
+	}
+
+	RingBuffer &operator= (const RingBuffer &) = delete;
+
+	size_t size() {
+		return size_t{1} << shift_;
+	}
+
+	// Moves the ring into storage that is shared with the socket's owner, see
+	// protocols/fs/socket-rings.hpp. The owner either produces or consumes the data
+	// in the ring; the index that it writes is picked up by refresh_().
+	void share(char *storage, protocols::fs::SocketRingIndices *indices, bool ownerProduces) {
+		assert(!shared_);
+		memcpy(storage, storage_, size());
+		operator delete(storage_);
+		storage_ = storage;
+		shared_ = indices;
+		ownerProduces_ = ownerProduces;
+		shared_->produced.store(enqPtr_, std::memory_order_release);
+		shared_->consumed.store(deqPtr_, std::memory_order_release);
+	}
+
+	size_t spaceForEnqueue() {
+		refresh_();
+		return spaceInRing_();
+	}
+
+	size_t availableToDequeue() {
+		refresh_();
+		return enqPtr_ - deqPtr_;
+	}
+
+	void enqueue(void *data, size_t size) {
+		assert(size <= spaceForEnqueue());
+		size_t ringSize = size_t{1} << shift_;
+		auto wrappedPtr = enqPtr_ & (ringSize - 1);
+		auto p = reinterpret_cast<char *>(data);
+		size_t bytesUntilEnd = std::min(size, ringSize - wrappedPtr);
+		memcpy(storage_ + wrappedPtr, p, bytesUntilEnd);
+		memcpy(storage_, p + bytesUntilEnd, size - bytesUntilEnd);
+		enqPtr_ += size;
+		if(shared_)
+			shared_->produced.store(enqPtr_, std::memory_order_release);
+	}
+
+	void dequeue(void *data, size_t size) {
+		dequeueLookahead(0, data, size);
+		dequeueAdvance(size);
+	}
+
+	// If csum is non-null, the data is also added to the checksum.
+	void dequeueLookahead(size_t offset, void *data, size_t size, Checksum *csum = nullptr) {
+		assert(offset + size <= enqPtr_ - deqPtr_);
+		size_t ringSize = size_t{1} << shift_;
+		auto wrappedPtr = (deqPtr_ + offset) & (ringSize - 1);
+		auto p = reinterpret_cast<char *>(data);
+		size_t bytesUntilEnd = std::min(size, ringSize - wrappedPtr);
+		if(csum) {
+			csum->updateAndCopy(p, storage_ + wrappedPtr, bytesUntilEnd);
+			csum->updateAndCopy(p + bytesUntilEnd, storage_, size - bytesUntilEnd);
+		}else{
+			memcpy(p, storage_ + wrappedPtr, bytesUntilEnd);
+			memcpy(p + bytesUntilEnd, storage_, size - bytesUntilEnd);
+		}
+	}
+
+	void dequeueAdvance(size_t size) {
+		deqPtr_ += size;
+		if(shared_)
+			shared_->consumed.store(deqPtr_, std::memory_order_release);
+	}
+
+private:
+	// Picks up the index that the owner writes. The owner is not trusted:
+	// indices only ever move forward and never beyond the other index.
+	void refresh_() {
+		if(!shared_)
+			return;
+		if(ownerProduces_) {
+			auto produced = shared_->produced.load(std::memory_order_acquire);
+			if(produced - enqPtr_ <= spaceInRing_())
+				enqPtr_ = produced;
+		}else{
+			auto consumed = shared_->consumed.load(std::memory_order_acquire);
+			if(consumed - deqPtr_ <= enqPtr_ - deqPtr_)
+				deqPtr_ = consumed;
+		}
+	}
+
+	size_t spaceInRing_() {
+		return (size_t{1} << shift_) - (enqPtr_ - deqPtr_);
+	}
+
+	char *storage_;
+	int shift_;
+	uint64_t enqPtr_ = 0;
+	uint64_t deqPtr_ = 0;
+	protocols::fs::SocketRingIndices *shared_ = nullptr;
+	bool ownerProduces_ = false;
+};
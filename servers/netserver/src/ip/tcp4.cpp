@@ -3,11 +3,19 @@
 #include <async/result.hpp>
 #include <arch/bit.hpp>
 #include <arch/variable.hpp>
+#include <helix/timer.hpp>
+#include <helix/memory.hpp>
 #include <protocols/fs/server.hpp>
+#include <protocols/fs/socket-rings.hpp>
+#include <cstddef>
 #include <cstring>
+#include <algorithm>
 #include <deque>
 #include <iomanip>
+#include <new>
+#include <optional>
 #include <random>
+#include <utility>
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
@@ -19,6 +27,7 @@
 
 #include "checksum.hpp"
 #include "ip4.hpp"
+#include "ring-buffer.hpp"
 #include "tcp4.hpp"
 
 namespace {
@@ -45,71 +54,26 @@ struct PseudoHeader {
 
 static_assert(sizeof(PseudoHeader) == 12);
 
-struct RingBuffer {
-	RingBuffer(int shift)
-	: storage_{reinterpret_cast<char *>(operator new (1 << shift))}, shift_{shift} { }
-
-	RingBuffer(const RingBuffer &) = delete;
-
-	~RingBuffer() {
-		operator delete(storage_);
-	}
-
-	RingBuffer &operator= (const RingBuffer &) = delete;
-
-	size_t spaceForEnqueue() {
-		return (size_t{1} << shift_) - (enqPtr_ - deqPtr_);
-	}
-
-	size_t availableToDequeue() {
-		return enqPtr_ - deqPtr_;
-	}
-
-	void enqueue(void *data, size_t size) {
-		assert(size <= spaceForEnqueue());
-		size_t ringSize = size_t{1} << shift_;
-		auto wrappedPtr = enqPtr_ & (ringSize - 1);
-		auto p = reinterpret_cast<char *>(data);
-		size_t bytesUntilEnd = std::min(size, ringSize - wrappedPtr);
-		memcpy(storage_ + wrappedPtr, p, bytesUntilEnd);
-		memcpy(storage_, p + bytesUntilEnd, size - bytesUntilEnd);
-		enqPtr_ += size;
-	}
-
-	void dequeue(void *data, size_t size) {
-		dequeueLookahead(0, data, size);
-		dequeueAdvance(size);
-	}
-
-	void dequeueLookahead(size_t offset, void *data, size_t size) {
-		assert(offset + size <= availableToDequeue());
-		size_t ringSize = size_t{1} << shift_;
-		auto wrappedPtr = deqPtr_ & (ringSize - 1);
-		auto p = reinterpret_cast<char *>(data);
-		size_t bytesUntilEnd = std::min(size, ringSize - wrappedPtr);
-		memcpy(p, storage_ + wrappedPtr, bytesUntilEnd);
-		memcpy(p + bytesUntilEnd, storage_, size - bytesUntilEnd);
-	}
-
-	void dequeueAdvance(size_t size) {
-		deqPtr_ += size;
-	}
-
-private:
-	char *storage_;
-	int shift_;
-	uint64_t enqPtr_ = 0;
-	uint64_t deqPtr_ = 0;
-};
-
 // TODO: Use a CSPRNG, see also UDP.
 static std::mt19937 globalPrng;
 
+uint64_t clockNs() {
+	uint64_t now;
+	HEL_CHECK(helGetClock(&now));
+	return now;
+}
+
+// Comparison of sequence numbers modulo 2^32.
+bool seqBefore(uint32_t a, uint32_t b) {
+	return static_cast<int32_t>(a - b) < 0;
+}
+
 } // namespace
 
 struct TcpHeader {
 	static constexpr arch::field<uint16_t, bool> finFlag{0, 1};
 	static constexpr arch::field<uint16_t, bool> synFlag{1, 1};
+	static constexpr arch::field<uint16_t, bool> rstFlag{2, 1};
 	static constexpr arch::field<uint16_t, bool> ackFlag{4, 1};
 	static constexpr arch::field<uint16_t, unsigned int> headerWords{12, 4};
 
@@ -125,12 +89,155 @@ struct TcpHeader {
 
 static_assert(sizeof(TcpHeader) == 20);
 
+namespace {
+
+enum TcpOptionKind : uint8_t {
+	endOfOptions = 0,
+	noOperation = 1,
+	maxSegmentSize = 2,
+	windowScale = 3,
+	timestamp = 8,
+};
+
+// Lengths of the options that we send (including padding).
+constexpr size_t mssOptionLength = 4;
+constexpr size_t windowScaleOptionLength = 4;
+constexpr size_t timestampOptionLength = 12;
+
+// TODO: Perform path MTU discovery.
+constexpr uint32_t defaultMss = 1000;
+// MSS that is assumed if the remote does not send the MSS option (RFC 9293).
+constexpr uint32_t fallbackMss = 536;
+// Lower bound for the MSS announced by the remote.
+constexpr uint32_t minMss = 64;
+
+// log2 of the size of the send and receive buffers.
+// Window scaling is used to announce receive windows larger than 64 KiB.
+constexpr int ringShift = 18;
+constexpr uint8_t localWindowShift = ringShift > 16 ? ringShift - 16 : 0;
+
+// Retransmission timeout parameters (RFC 6298). Like Linux, we use a lower
+// minimum than the 1 s recommended by the RFC.
+constexpr uint64_t initialRto = 1'000'000'000;
+constexpr uint64_t minRto = 200'000'000;
+constexpr uint64_t maxRto = 60'000'000'000;
+constexpr uint64_t clockGranularity = 1'000'000;
+
+// ACKs are delayed by at most this amount of time (RFC 9293 requires < 500 ms).
+constexpr uint64_t delayedAckTimeout = 40'000'000;
+
+// Number of duplicate ACKs that trigger a fast retransmit (RFC 5681).
+constexpr unsigned int dupAckThreshold = 3;
+
+// Maximal size of the accept queue of listening sockets (like Linux' somaxconn).
+constexpr size_t acceptBacklog = 128;
+// Maximal number of connections in the SYN_RECEIVED state per listening socket.
+constexpr size_t synBacklog = 256;
+// Number of consecutive retransmission timeouts after which we give up on the SYN,
+// on the SYN+ACK of an embryonic connection and on data (like Linux' tcp_syn_retries,
+// tcp_synack_retries and tcp_retries2).
+constexpr unsigned int maxSynRetransmits = 6;
+constexpr unsigned int maxSynAckRetransmits = 5;
+constexpr unsigned int maxRetransmits = 15;
+
+// Time that a closed connection waits for the remote's FIN after sending its own FIN
+// (like Linux' tcp_fin_timeout) and time that it lingers in TIME_WAIT.
+constexpr uint64_t finTimeout = 60'000'000'000;
+constexpr uint64_t timeWaitTimeout = 60'000'000'000;
+
+// Largest payload that fits into a single (TSO) IPv4 packet.
+constexpr size_t maxTsoPayload = 0xFFFF - sizeof(Ip4Packet::Header) - sizeof(TcpHeader);
+
+// Maximal number of segments that are sent in a single burst.
+constexpr size_t maxQueuedSegments = 32;
+
+// Fills in the checksum of the segment, or prepares it for checksum offload.
+// If payloadCsum is non-null, it already covers the data following the TCP header.
+nic::TxMetadata fillChecksum(const Ip4TargetInfo &targetInfo, uint32_t remote,
+		arch::dma_buffer_view segment, const Checksum *payloadCsum = nullptr) {
+	auto header = reinterpret_cast<TcpHeader *>(segment.data());
+	PseudoHeader pseudo {
+		.src = targetInfo.source,
+		.dst = remote,
+		.len = segment.size()
+	};
+	Checksum csum;
+	csum.update(&pseudo, sizeof(PseudoHeader));
+
+	nic::TxMetadata metadata;
+	if(targetInfo.link->offloads() & nic::OFFLOAD_TX_CSUM) {
+		// The NIC sums up the segment; it expects the (non-inverted) pseudo header sum.
+		header->checksum = static_cast<uint16_t>(~csum.finalize());
+		metadata.needsChecksum = true;
+		metadata.checksumOffset = offsetof(TcpHeader, checksum);
+		return metadata;
+	}
+
+	if(payloadCsum) {
+		auto headerLength = (header->flags.load() & TcpHeader::headerWords) * 4;
+		csum.update(segment.data(), headerLength);
+		csum.update(*payloadCsum);
+	}else{
+		csum.update(segment);
+	}
+	header->checksum = csum.finalize();
+	return metadata;
+}
+
+} // anonymous namespace
+
+struct TcpOptions {
+	std::optional<uint16_t> mss;
+	std::optional<uint8_t> windowShift;
+	bool hasTimestamp = false;
+	uint32_t tsValue = 0;
+	uint32_t tsEcho = 0;
+};
+
 struct TcpPacket {
 	arch::dma_buffer_view payload() {
 		auto words = header.flags.load() & TcpHeader::headerWords;
 		return packet->payload().subview(words * 4);
 	}
 
+	TcpOptions options() {
+		TcpOptions result;
+		auto words = header.flags.load() & TcpHeader::headerWords;
+		auto p = reinterpret_cast<const uint8_t *>(packet->payload().data());
+		size_t end = words * 4;
+		size_t i = sizeof(TcpHeader);
+		while(i < end) {
+			if(p[i] == endOfOptions)
+				break;
+			if(p[i] == noOperation) {
+				i++;
+				continue;
+			}
+			if(i + 2 > end || p[i + 1] < 2 || i + p[i + 1] > end)
+				break;
+
+			auto kind = p[i];
+			auto length = p[i + 1];
+			if(kind == maxSegmentSize && length == 4) {
+				arch::scalar_storage<uint16_t, arch::big_endian> mss;
+				memcpy(&mss, p + i + 2, 2);
+				result.mss = mss.load();
+			}else if(kind == windowScale && length == 3) {
+				// RFC 7323 limits the shift to 14.
+				result.windowShift = std::min(p[i + 2], uint8_t{14});
+			}else if(kind == timestamp && length == 10) {
+				arch::scalar_storage<uint32_t, arch::big_endian> value, echo;
+				memcpy(&value, p + i + 2, 4);
+				memcpy(&echo, p + i + 6, 4);
+				result.hasTimestamp = true;
+				result.tsValue = value.load();
+				result.tsEcho = echo.load();
+			}
+			i += length;
+		}
+		return result;
+	}
+
 	bool parse(smarter::shared_ptr<const Ip4Packet> packet) {
 		auto ipPayload = packet->payload();
 		if (ipPayload.size() < sizeof(TcpHeader))
@@ -143,7 +250,7 @@ struct TcpPacket {
 		if (ipPayload.size() < words * 4)
 			return false;
 
-		if (header.checksum.load()) {
+		if (header.checksum.load() && !packet->checksumValid) {
 			PseudoHeader pseudo {
 				.src = packet->header.source,
 				.dst = packet->header.destination,
@@ -186,10 +293,11 @@ protocols::fs::Error checkAddress(const void *addrPtr, size_t addrLength, TcpEnd
 
 struct Tcp4Socket {
 	Tcp4Socket(Tcp4 *parent, bool nonBlock)
-	: parent_(parent), nonBlock_{nonBlock}, recvRing_{14}, sendRing_{14} {}
+	: parent_(parent), nonBlock_{nonBlock}, recvRing_{ringShift}, sendRing_{ringShift} {}
 
 	~Tcp4Socket() {
-		parent_->unbind(localEp_);
+		// Tcp4 holds references to bound and connected sockets; see teardown_().
+		assert(!connectionKey_);
 	}
 
 	static auto makeSocket(Tcp4 *parent, bool nonBlock) {
@@ -199,6 +307,13 @@ struct Tcp4Socket {
 		return s;
 	}
 
+	// Serves the socket to its owner. The socket is closed once the owner closes the file.
+	static async::result<void> serve(helix::UniqueLane lane,
+			smarter::shared_ptr<Tcp4Socket> socket) {
+		co_await protocols::fs::servePassthrough(std::move(lane), socket, &ops);
+		socket->close_();
+	}
+
 	static async::result<protocols::fs::Error> bind(void *object,
 			const char *creds,
 			const void *addrPtr, size_t addrLength) {
@@ -317,22 +432,129 @@ struct Tcp4Socket {
 			co_return protocols::fs::Error::accessDenied;
 		}
 
+		if (self->listening_)
+			co_return protocols::fs::Error::illegalArguments;
+
 		// Bind the socket if necessary.
 		if (!self->localEp_.port && !self->bindAvailable()) {
 			std::cout << "netserver: No source port" << std::endl;
 			co_return protocols::fs::Error::addressNotAvailable;
 		}
 
+		// The source address is part of the connection's 4-tuple.
+		auto targetInfo = co_await ip4().targetByRemote(connectEp.ipAddress);
+		if (!targetInfo)
+			co_return protocols::fs::Error::netUnreachable;
+
+		TcpConnectionKey key{
+			.localIp = self->localEp_.ipAddress != INADDR_ANY
+					? self->localEp_.ipAddress : targetInfo->source,
+			.localPort = self->localEp_.port,
+			.remoteIp = connectEp.ipAddress,
+			.remotePort = connectEp.port
+		};
+		if (!self->parent_->registerConnection(self->holder_.lock(), key))
+			co_return protocols::fs::Error::addressInUse;
+		self->connectionKey_ = key;
+
+		// Obtain a new random sequence number.
+		auto randomSn = globalPrng();
+		self->localSettledSn_ = randomSn;
+		self->localFlushedSn_ = randomSn;
+		self->localHighestSn_ = randomSn;
+
 		// Connect to the remote.
 		self->connectState_ = ConnectState::sendSyn;
 		self->remoteEp_ = connectEp;
 		self->flushEvent_.raise();
 
 		while(true) {
-			if(self->connectState_ != ConnectState::sendSyn)
+			if(self->connectState_ != ConnectState::sendSyn || self->tornDown_)
 				break;
 			co_await self->settleEvent_.async_wait();
 		}
+		co_return self->takeError_();
+	}
+
+	static async::result<protocols::fs::Error> listen(void *object, int backlog) {
+		auto self = static_cast<Tcp4Socket *>(object);
+
+		if (self->connectState_ != ConnectState::none)
+			co_return protocols::fs::Error::illegalArguments;
+
+		// Like Linux, bind to an ephemeral port if necessary.
+		if (!self->localEp_.port && !self->bindAvailable()) {
+			std::cout << "netserver: No source port" << std::endl;
+			co_return protocols::fs::Error::addressInUse;
+		}
+
+		// Non-positive values select the maximum, calling listen() again updates the backlog.
+		if(backlog > 0) {
+			self->backlog_ = std::min(static_cast<size_t>(backlog), acceptBacklog);
+		}else{
+			self->backlog_ = acceptBacklog;
+		}
+		self->listening_ = true;
+		co_return protocols::fs::Error::none;
+	}
+
+	static async::result<frg::expected<protocols::fs::Error, helix::UniqueLane>>
+	accept(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+
+		if (!self->listening_)
+			co_return protocols::fs::Error::illegalArguments;
+
+		while(self->acceptQueue_.empty()) {
+			if(self->nonBlock_)
+				co_return protocols::fs::Error::wouldBlock;
+			co_await self->inEvent_.async_wait();
+		}
+
+		auto socket = std::move(self->acceptQueue_.front());
+		self->acceptQueue_.pop_front();
+
+		auto [localLane, remoteLane] = helix::createStream();
+		async::detach(serve(std::move(localLane), std::move(socket)));
+		co_return std::move(remoteLane);
+	}
+
+	static async::result<frg::expected<protocols::fs::Error, protocols::fs::SocketRingsResult>>
+	mapSocketRings(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+
+		if (self->listening_)
+			co_return protocols::fs::Error::illegalArguments;
+
+		if (!self->ringMemory_) {
+			auto ringSize = self->sendRing_.size();
+			auto memorySize = protocols::fs::socketRingsMemorySize(ringSize);
+
+			HelHandle handle;
+			HEL_CHECK(helAllocateMemory(memorySize, 0, nullptr, &handle));
+			self->ringMemory_ = helix::UniqueDescriptor{handle};
+			self->ringMapping_ = helix::Mapping{self->ringMemory_, 0, memorySize};
+
+			auto base = reinterpret_cast<char *>(self->ringMapping_.get());
+			auto control = new (base) protocols::fs::SocketRingsControl{};
+			// Data that is already buffered is moved into the shared rings.
+			self->sendRing_.share(base + protocols::fs::socketSendRingOffset(),
+					&control->send, true);
+			self->recvRing_.share(base + protocols::fs::socketRecvRingOffset(ringSize),
+					&control->recv, false);
+		}
+
+		co_return protocols::fs::SocketRingsResult{self->ringMemory_, self->sendRing_.size()};
+	}
+
+	static async::result<protocols::fs::Error> ringDoorbell(void *object) {
+		auto self = static_cast<Tcp4Socket *>(object);
+
+		if (!self->ringMemory_)
+			co_return protocols::fs::Error::illegalArguments;
+
+		// New data in the send ring, or space in the receive ring (i.e., a window update).
+		self->flushEvent_.raise();
 		co_return protocols::fs::Error::none;
 	}
 
@@ -360,12 +582,22 @@ struct Tcp4Socket {
 			std::cout << "\e[31m" "netserver/tcp: Encountered unexpected recvMsg() flags: "
 					<< flags << "\e[39m" << std::endl;
 
+		// Once the rings are shared, the owner advances the consumer index of the
+		// receive ring itself; copying out of the ring here would race with it.
+		if(self->ringMemory_)
+			co_return protocols::fs::Error::illegalOperationTarget;
+
 		size_t progress = 0;
 		while(progress < size) {
 			size_t available = self->recvRing_.availableToDequeue();
 			if(!available) {
 				if(progress)
 					break;
+				if(auto e = self->takeError_(); e != protocols::fs::Error::none)
+					co_return e;
+				// Report EOF once the remote closed its side.
+				if(self->remoteClosed_)
+					break;
 				if(self->nonBlock_)
 					co_return protocols::fs::Error::wouldBlock;
 				co_await self->inEvent_.async_wait();
@@ -397,8 +629,20 @@ struct Tcp4Socket {
 		auto self = static_cast<Tcp4Socket *>(object);
 		auto p = reinterpret_cast<char *>(data);
 
+		// See recvMsg(); here, the owner advances the producer index of the send ring.
+		if(self->ringMemory_)
+			co_return protocols::fs::Error::illegalOperationTarget;
+
 		size_t progress = 0;
 		while(progress < size) {
+			if(self->tornDown_) {
+				if(progress)
+					break;
+				if(auto e = self->takeError_(); e != protocols::fs::Error::none)
+					co_return e;
+				co_return protocols::fs::Error::brokenPipe;
+			}
+
 			size_t space = self->sendRing_.spaceForEnqueue();
 			if(!space) {
 				if(self->nonBlock_) {
@@ -448,12 +692,20 @@ struct Tcp4Socket {
 		auto self = static_cast<Tcp4Socket *>(object);
 
 		int active = 0;
+		if(self->listening_) {
+			if(!self->acceptQueue_.empty())
+				active |= EPOLLIN;
+			co_return protocols::fs::PollStatusResult{self->currentSeq_, active};
+		}
+
 		if(self->recvRing_.availableToDequeue())
 			active |= EPOLLIN;
 		if(self->sendRing_.spaceForEnqueue())
 			active |= EPOLLOUT;
 		if(self->remoteClosed_)
 			active |= EPOLLHUP;
+		if(self->error_ != protocols::fs::Error::none)
+			active |= EPOLLERR;
 
 		co_return protocols::fs::PollStatusResult{self->currentSeq_, active};
 	}
@@ -486,6 +738,10 @@ struct Tcp4Socket {
 		.pollWait = &pollWait,
 		.pollStatus = &pollStatus,
 		.bind = &bind,
+		.listen = &listen,
+		.accept = &accept,
+		.mapSocketRings = &mapSocketRings,
+		.ringDoorbell = &ringDoorbell,
 		.connect = &connect,
 		.sockname = &sockname,
 		.getFileFlags = &getFileFlags,
@@ -512,9 +768,59 @@ struct Tcp4Socket {
 
 private:
 	async::result<void> flushOutPackets_();
+	async::result<void> flushLoop_();
+	// Sends the segments that flushLoop_() queued on queuedLink_.
+	async::result<void> flushQueued_();
+
+	// Called once the owner closed the socket. Connected sockets send a FIN after
+	// the remaining data, other sockets are torn down immediately.
+	void close_();
+
+	// Removes the socket from Tcp4 (and from the SYN queue of its listener)
+	// and stops flushOutPackets_().
+	void teardown_();
+
+	// Drops the connection and reports the error to the owner.
+	void abort_(protocols::fs::Error error);
+
+	// Returns the pending error (if any) and clears it.
+	protocols::fs::Error takeError_() {
+		return std::exchange(error_, protocols::fs::Error::none);
+	}
 
 	void handleInPacket_(TcpPacket packet);
 
+	// Handles a SYN that was sent to a listening socket.
+	void handleListenPacket_(TcpPacket packet);
+
+	// Waits until flushEvent_ is raised or the deadline (if non-zero) expires.
+	async::result<void> waitForFlush_(uint64_t deadline);
+
+	// Size of the options that are sent with each (SYN or non-SYN) segment.
+	size_t optionsLength_(bool syn);
+	void writeOptions_(char *p, bool syn, uint16_t localMss);
+
+	// Maximal payload of a single segment.
+	size_t segmentPayload_() {
+		return mss_ - (timestampsEnabled_ ? timestampOptionLength : 0);
+	}
+
+	// Returns the window to announce (in bytes) and the value of the header's window field.
+	std::pair<uint32_t, uint16_t> windowToAnnounce_(bool syn);
+
+	// Applies the options of the remote's SYN.
+	void handleSynOptions_(const TcpOptions &options);
+	void establish_();
+
+	void updateRtt_(uint64_t sample);
+	void handleAck_(uint32_t ackPointer, const TcpOptions &options);
+	void handleDuplicateAck_();
+	void handleRetransmitTimeout_();
+
+	uint32_t bytesInFlight_() {
+		return localHighestSn_ - localSettledSn_;
+	}
+
 private:
 	friend struct Tcp4;
 
@@ -530,14 +836,38 @@ private:
 	TcpEndpoint remoteEp_;
 	TcpEndpoint localEp_;
 	smarter::weak_ptr<Tcp4Socket> holder_;
+	// Set once the socket is registered in Tcp4::connections.
+	std::optional<TcpConnectionKey> connectionKey_;
+	// Target of remoteEp_, avoids route and neighbour lookups for each segment.
+	Ip4RouteCache routeCache_;
+	// Link that flushLoop_() queued segments on (if any) and the number of those segments.
+	std::shared_ptr<nic::Link> queuedLink_;
+	size_t numQueued_ = 0;
 
 	ConnectState connectState_ = ConnectState::none;
 	bool remoteClosed_ = false;
 
+	// Set once the owner closed the socket; a FIN follows the data in sendRing_.
+	bool closed_ = false;
+	// Whether the remote closed its side before we did; the connection is torn
+	// down as soon as our FIN is acknowledged then.
+	bool lastAck_ = false;
+	// Whether our FIN was acknowledged.
+	bool finAcked_ = false;
+	// Deadline for FIN_WAIT and TIME_WAIT (zero if not running).
+	uint64_t closeDeadline_ = 0;
+	// Set once the socket is removed from Tcp4.
+	bool tornDown_ = false;
+	// Error that is reported by the next operation (like Linux' sk_err).
+	protocols::fs::Error error_ = protocols::fs::Error::none;
+
 	// Out-SN corresponding to the front of sendRing_.
 	uint32_t localSettledSn_ = 0;
 	// Out-SN that has already been flushed to the IP layer (>= localSettledSn_).
+	// This is reset to localSettledSn_ when the retransmission timer expires.
 	uint32_t localFlushedSn_ = 0;
+	// Highest out-SN that was ever flushed (>= localFlushedSn_).
+	uint32_t localHighestSn_ = 0;
 	// Out-SN of the end of the remote window (>= localSettledSn_).
 	uint32_t localWindowSn_ = 0;
 	// In-SN that we already acknowledged.
@@ -547,8 +877,60 @@ private:
 	// Size of received window that we announced to the remote side.
 	uint32_t announcedWindow_ = 0;
 
+	// Negotiated options (RFC 7323).
+	uint32_t mss_ = defaultMss;
+	bool windowScalingEnabled_ = false;
+	uint8_t remoteWindowShift_ = 0;
+	bool timestampsEnabled_ = false;
+	// Most recent timestamp of the remote, it is echoed in our segments.
+	uint32_t tsRecent_ = 0;
+
+	// RTT estimation and retransmission timer (RFC 6298), in nanoseconds.
+	bool haveRttSample_ = false;
+	uint64_t smoothedRtt_ = 0;
+	uint64_t rttVariance_ = 0;
+	uint64_t rto_ = initialRto;
+	// Deadline of the retransmission timer, zero if the timer is not running.
+	uint64_t rtoDeadline_ = 0;
+	// Number of retransmission timeouts since the last ACK that acknowledged new data.
+	unsigned int consecutiveTimeouts_ = 0;
+	// Without timestamps, we time one segment per RTT (Karn's algorithm).
+	bool rttTiming_ = false;
+	uint32_t rttTimedSn_ = 0;
+	uint64_t rttTimedSince_ = 0;
+
+	// NewReno congestion control (RFC 5681, RFC 6582), in bytes.
+	uint32_t congestionWindow_ = 0;
+	uint32_t slowStartThreshold_ = UINT32_MAX;
+	uint32_t windowIncrement_ = 0;
+	unsigned int duplicateAcks_ = 0;
+	bool inFastRecovery_ = false;
+	uint32_t recoverSn_ = 0;
+	// Set to retransmit the segment at localSettledSn_.
+	bool retransmitPending_ = false;
+
+	// Delayed ACKs: deadline of the delayed ACK timer (zero if not running)
+	// and whether an ACK needs to be sent immediately.
+	uint64_t delayedAckDeadline_ = 0;
+	bool ackNow_ = false;
+
+	// State of listening sockets. Connections move from the SYN queue
+	// to the accept queue once the handshake completes.
+	bool listening_ = false;
+	size_t backlog_ = acceptBacklog;
+	std::deque<smarter::shared_ptr<Tcp4Socket>> synQueue_;
+	std::deque<smarter::shared_ptr<Tcp4Socket>> acceptQueue_;
+
+	// State of sockets that are created by a listening socket.
+	// Such sockets share the local endpoint of the listener, hence they do not own a bind.
+	bool passive_ = false;
+	smarter::weak_ptr<Tcp4Socket> listener_;
+
 	RingBuffer recvRing_;
 	RingBuffer sendRing_;
+	// Memory that backs the rings once they are shared with the owner.
+	helix::UniqueDescriptor ringMemory_;
+	helix::Mapping ringMapping_;
 
 	async::recurring_event inEvent_;
 	async::recurring_event flushEvent_;
@@ -563,64 +945,398 @@ private:
 	async::recurring_event pollEvent_;
 };
 
+async::result<void> Tcp4Socket::waitForFlush_(uint64_t deadline) {
+	// Send the segments of this round before sleeping.
+	co_await flushQueued_();
+
+	if(!deadline) {
+		co_await flushEvent_.async_wait();
+		co_return;
+	}
+
+	auto now = clockNs();
+	if(now >= deadline)
+		co_return;
+
+	async::cancellation_event ev;
+	helix::TimeoutCancellation timer{deadline - now, ev};
+	co_await flushEvent_.async_wait(ev);
+	co_await timer.retire();
+}
+
+size_t Tcp4Socket::optionsLength_(bool syn) {
+	if(!syn)
+		return timestampsEnabled_ ? timestampOptionLength : 0;
+
+	// Active opens offer all options, passive opens only reply to the remote's options.
+	bool passive = connectState_ == ConnectState::sendSynAck;
+	size_t length = mssOptionLength;
+	if(!passive || windowScalingEnabled_)
+		length += windowScaleOptionLength;
+	if(!passive || timestampsEnabled_)
+		length += timestampOptionLength;
+	return length;
+}
+
+void Tcp4Socket::writeOptions_(char *p, bool syn, uint16_t localMss) {
+	auto writeTimestamp = [&] {
+		arch::scalar_storage<uint32_t, arch::big_endian> value{
+				static_cast<uint32_t>(clockNs() / 1'000'000)};
+		arch::scalar_storage<uint32_t, arch::big_endian> echo{tsRecent_};
+		p[0] = noOperation;
+		p[1] = noOperation;
+		p[2] = timestamp;
+		p[3] = 10;
+		memcpy(p + 4, &value, 4);
+		memcpy(p + 8, &echo, 4);
+		p += timestampOptionLength;
+	};
+
+	if(!syn) {
+		if(timestampsEnabled_)
+			writeTimestamp();
+		return;
+	}
+
+	bool passive = connectState_ == ConnectState::sendSynAck;
+	arch::scalar_storage<uint16_t, arch::big_endian> mss{localMss};
+	p[0] = maxSegmentSize;
+	p[1] = 4;
+	memcpy(p + 2, &mss, 2);
+	p += mssOptionLength;
+	if(!passive || windowScalingEnabled_) {
+		p[0] = noOperation;
+		p[1] = windowScale;
+		p[2] = 3;
+		p[3] = localWindowShift;
+		p += windowScaleOptionLength;
+	}
+	if(!passive || timestampsEnabled_)
+		writeTimestamp();
+}
+
+std::pair<uint32_t, uint16_t> Tcp4Socket::windowToAnnounce_(bool syn) {
+	// The window field of SYN segments is never scaled.
+	auto shift = (windowScalingEnabled_ && !syn) ? localWindowShift : 0;
+	auto field = std::min(recvRing_.spaceForEnqueue() >> shift, size_t{0xFFFF});
+	return {static_cast<uint32_t>(field << shift), static_cast<uint16_t>(field)};
+}
+
+void Tcp4Socket::handleSynOptions_(const TcpOptions &options) {
+	mss_ = std::clamp<uint32_t>(options.mss.value_or(fallbackMss), minMss, defaultMss);
+
+	// Window scaling and timestamps are only used if both sides send the option.
+	windowScalingEnabled_ = options.windowShift.has_value();
+	remoteWindowShift_ = options.windowShift.value_or(0);
+	timestampsEnabled_ = options.hasTimestamp;
+	if(options.hasTimestamp)
+		tsRecent_ = options.tsValue;
+}
+
+void Tcp4Socket::establish_() {
+	connectState_ = ConnectState::connected;
+	rtoDeadline_ = 0;
+	consecutiveTimeouts_ = 0;
+
+	// Take an RTT sample from the handshake (unless the SYN was retransmitted).
+	if(rttTiming_) {
+		updateRtt_(clockNs() - rttTimedSince_);
+		rttTiming_ = false;
+	}
+
+	// Initial congestion window as in RFC 6928.
+	congestionWindow_ = std::min(10 * mss_, std::max(2 * mss_, uint32_t{14600}));
+}
+
+void Tcp4Socket::updateRtt_(uint64_t sample) {
+	if(!haveRttSample_) {
+		smoothedRtt_ = sample;
+		rttVariance_ = sample / 2;
+		haveRttSample_ = true;
+	}else{
+		auto delta = (smoothedRtt_ > sample) ? smoothedRtt_ - sample : sample - smoothedRtt_;
+		rttVariance_ = (3 * rttVariance_ + delta) / 4;
+		smoothedRtt_ = (7 * smoothedRtt_ + sample) / 8;
+	}
+	rto_ = std::clamp(smoothedRtt_ + std::max(clockGranularity, 4 * rttVariance_),
+			minRto, maxRto);
+}
+
+void Tcp4Socket::handleAck_(uint32_t ackPointer, const TcpOptions &options) {
+	auto ackSn = localSettledSn_ + ackPointer;
+	auto now = clockNs();
+
+	// Take an RTT sample, either from the echoed timestamp or from the timed segment.
+	if(timestampsEnabled_ && options.hasTimestamp && options.tsEcho) {
+		uint32_t echoDelta = static_cast<uint32_t>(now / 1'000'000) - options.tsEcho;
+		updateRtt_(uint64_t{echoDelta} * 1'000'000);
+	}else if(rttTiming_ && !seqBefore(ackSn, rttTimedSn_)) {
+		updateRtt_(now - rttTimedSince_);
+		rttTiming_ = false;
+	}
+
+	// Update the congestion window (NewReno).
+	if(inFastRecovery_) {
+		if(!seqBefore(ackSn, recoverSn_)) {
+			// Full acknowledgement, deflate the window and leave fast recovery.
+			uint32_t flight = localHighestSn_ - ackSn;
+			congestionWindow_ = std::min(slowStartThreshold_, flight + mss_);
+			inFastRecovery_ = false;
+		}else{
+			// Partial acknowledgement, retransmit the next unacknowledged segment.
+			retransmitPending_ = true;
+			congestionWindow_ -= std::min(congestionWindow_, ackPointer);
+			if(ackPointer >= mss_)
+				congestionWindow_ += mss_;
+		}
+	}else if(congestionWindow_ < slowStartThreshold_) {
+		// Slow start, see also RFC 3465.
+		congestionWindow_ += std::min(ackPointer, mss_);
+	}else{
+		// Congestion avoidance: grow by one MSS per RTT.
+		windowIncrement_ += ackPointer;
+		if(windowIncrement_ >= congestionWindow_) {
+			windowIncrement_ -= congestionWindow_;
+			congestionWindow_ += mss_;
+		}
+	}
+	duplicateAcks_ = 0;
+
+	localSettledSn_ = ackSn;
+	if(seqBefore(localFlushedSn_, localSettledSn_))
+		localFlushedSn_ = localSettledSn_;
+	// Our FIN occupies one SN behind the data in sendRing_.
+	auto ackedBytes = std::min(size_t{ackPointer}, sendRing_.availableToDequeue());
+	sendRing_.dequeueAdvance(ackedBytes);
+	if(closed_ && ackedBytes < ackPointer)
+		finAcked_ = true;
+
+	// Restart the retransmission timer if data is still outstanding.
+	rtoDeadline_ = (localHighestSn_ != localSettledSn_) ? now + rto_ : 0;
+	consecutiveTimeouts_ = 0;
+}
+
+void Tcp4Socket::handleDuplicateAck_() {
+	++duplicateAcks_;
+	if(inFastRecovery_) {
+		// Each duplicate ACK indicates that a segment has left the network.
+		congestionWindow_ += mss_;
+		return;
+	}
+
+	if(duplicateAcks_ != dupAckThreshold)
+		return;
+
+	if(debugTcp)
+		std::cout << "netserver: TCP fast retransmit" << std::endl;
+	slowStartThreshold_ = std::max(bytesInFlight_() / 2, 2 * mss_);
+	congestionWindow_ = slowStartThreshold_ + dupAckThreshold * mss_;
+	recoverSn_ = localHighestSn_;
+	inFastRecovery_ = true;
+	retransmitPending_ = true;
+	rttTiming_ = false;
+}
+
+void Tcp4Socket::handleRetransmitTimeout_() {
+	++consecutiveTimeouts_;
+	if(connectState_ == ConnectState::sendSynAck
+			&& consecutiveTimeouts_ > maxSynAckRetransmits) {
+		if(debugTcp)
+			std::cout << "netserver: Dropping embryonic TCP connection" << std::endl;
+		teardown_();
+		return;
+	}
+	if((connectState_ == ConnectState::sendSyn && consecutiveTimeouts_ > maxSynRetransmits)
+			|| (connectState_ == ConnectState::connected
+				&& consecutiveTimeouts_ > maxRetransmits)) {
+		if(debugTcp)
+			std::cout << "netserver: TCP connection timed out" << std::endl;
+		abort_(protocols::fs::Error::timedOut);
+		return;
+	}
+
+	if(connectState_ == ConnectState::connected) {
+		slowStartThreshold_ = std::max(bytesInFlight_() / 2, 2 * mss_);
+		congestionWindow_ = mss_;
+		windowIncrement_ = 0;
+		duplicateAcks_ = 0;
+		inFastRecovery_ = false;
+		recoverSn_ = localHighestSn_;
+	}
+
+	// Go back N: resend everything that was not acknowledged yet.
+	localFlushedSn_ = localSettledSn_;
+	retransmitPending_ = false;
+	rttTiming_ = false;
+	rto_ = std::min(2 * rto_, maxRto);
+	rtoDeadline_ = 0;
+}
+
+void Tcp4Socket::close_() {
+	closed_ = true;
+
+	if(listening_) {
+		// Embryonic connections are dropped, connections that were not accepted are closed.
+		auto embryonic = std::move(synQueue_);
+		synQueue_.clear();
+		for(auto &socket : embryonic)
+			socket->teardown_();
+
+		auto unaccepted = std::move(acceptQueue_);
+		acceptQueue_.clear();
+		for(auto &socket : unaccepted)
+			socket->close_();
+	}
+
+	if(connectState_ != ConnectState::connected || tornDown_) {
+		teardown_();
+		return;
+	}
+
+	lastAck_ = remoteClosed_;
+	flushEvent_.raise();
+}
+
+void Tcp4Socket::teardown_() {
+	if(connectionKey_) {
+		parent_->unregisterConnection(*connectionKey_);
+		connectionKey_.reset();
+	}
+
+	// Sockets keep their local endpoint until they are closed.
+	if(closed_ && !passive_ && localEp_.port)
+		parent_->unbind(localEp_);
+
+	if(auto listener = listener_.lock(); listener) {
+		auto it = std::find(listener->synQueue_.begin(), listener->synQueue_.end(),
+				holder_.lock());
+		if(it != listener->synQueue_.end())
+			listener->synQueue_.erase(it);
+	}
+
+	tornDown_ = true;
+	flushEvent_.raise();
+}
+
+void Tcp4Socket::abort_(protocols::fs::Error error) {
+	error_ = error;
+	remoteClosed_ = true;
+	teardown_();
+
+	// Wake up all operations that wait for the connection.
+	hupSeq_ = ++currentSeq_;
+	inEvent_.raise();
+	settleEvent_.raise();
+	pollEvent_.raise();
+}
+
 async::result<void> Tcp4Socket::flushOutPackets_() {
+	// Keep the socket alive until it is torn down.
+	auto self = holder_.lock();
+
+	co_await flushLoop_();
+	co_await flushQueued_();
+}
+
+async::result<void> Tcp4Socket::flushQueued_() {
+	if(!queuedLink_)
+		co_return;
+	auto link = std::move(queuedLink_);
+	queuedLink_ = nullptr;
+	numQueued_ = 0;
+	co_await link->flushTransmits();
+}
+
+async::result<void> Tcp4Socket::flushLoop_() {
 	while(true) {
+		if(tornDown_)
+			co_return;
+
 		if(connectState_ == ConnectState::none) {
-			co_await flushEvent_.async_wait();
+			co_await waitForFlush_(0);
 			continue;
 		}
 
-		if(connectState_ == ConnectState::sendSyn) {
+		// Handle expired timers.
+		auto now = clockNs();
+		if(closeDeadline_ && now >= closeDeadline_) {
+			teardown_();
+			co_return;
+		}
+		if(rtoDeadline_ && now >= rtoDeadline_) {
+			if(debugTcp)
+				std::cout << "netserver: TCP retransmission timeout" << std::endl;
+			handleRetransmitTimeout_();
+			if(tornDown_)
+				co_return;
+		}
+		if(delayedAckDeadline_ && now >= delayedAckDeadline_) {
+			delayedAckDeadline_ = 0;
+			ackNow_ = true;
+		}
+
+		if(connectState_ == ConnectState::sendSyn
+				|| connectState_ == ConnectState::sendSynAck) {
 			if(localSettledSn_ != localFlushedSn_) {
-				co_await flushEvent_.async_wait();
+				co_await waitForFlush_(rtoDeadline_);
 				continue;
 			}
 
-			// Obtain a new random sequence number.
-			auto randomSn = globalPrng();
-			localSettledSn_ = randomSn;
-			localFlushedSn_ = randomSn;
+			bool passive = connectState_ == ConnectState::sendSynAck;
 
-			// Construct and transmit the initial SYN packet.
-			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress);
-			if (!targetInfo) {
+			// Construct and transmit the initial SYN (or SYN+ACK) packet.
+			auto targetOrError = co_await ip4().resolveTarget(remoteEp_.ipAddress, routeCache_);
+			if (!targetOrError) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Destination unreachable" << std::endl;
 				co_return;
 			}
+			auto targetInfo = std::move(targetOrError.value());
+
+			auto optionsLength = optionsLength_(true);
+			auto [window, windowField] = windowToAnnounce_(true);
 
-			std::vector<char> buf;
-			buf.resize(sizeof(TcpHeader));
+			// The segment is built in place, behind the space reserved for the IPv4 header.
+			auto frameOrError = ip4().allocateFrame(targetInfo, sizeof(TcpHeader) + optionsLength);
+			assert(frameOrError);
+			auto frame = std::move(frameOrError.value());
+			auto segment = frame.payload();
 
-			auto header = new (buf.data()) TcpHeader {
+			auto header = new (segment.data()) TcpHeader {
 				.srcPort = localEp_.port,
 				.destPort = remoteEp_.port,
 				.seqNumber = localFlushedSn_,
-				.ackNumber = 0,
-				.window = 0,
+				.ackNumber = passive ? remoteKnownSn_ : 0,
+				.window = windowField,
 				.checksum = 0,
 				.urgentPointer = 0
 			};
-			header->flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
-					| TcpHeader::synFlag(true));
+			header->flags.store(TcpHeader::headerWords((sizeof(TcpHeader) + optionsLength) / 4)
+					| TcpHeader::synFlag(true) | TcpHeader::ackFlag(passive));
 
-			// Fill in the checksum.
-			PseudoHeader pseudo {
-				.src = targetInfo->source,
-				.dst = remoteEp_.ipAddress,
-				.len = buf.size()
-			};
-			Checksum csum;
-			csum.update(&pseudo, sizeof(PseudoHeader));
-			csum.update(buf.data(), buf.size());
-			header->checksum = csum.finalize();
+			auto localMss = std::min(targetInfo.link->mtu - sizeof(Ip4Packet::Header)
+					- sizeof(TcpHeader), size_t{0xFFFF});
+			writeOptions_(static_cast<char *>(segment.data()) + sizeof(TcpHeader), true, localMss);
 
+			auto metadata = fillChecksum(targetInfo, remoteEp_.ipAddress, segment);
+
+			// Time the SYN unless it is a retransmission.
+			if(localFlushedSn_ == localHighestSn_) {
+				rttTiming_ = true;
+				rttTimedSince_ = now;
+			}
 			++localFlushedSn_;
+			localHighestSn_ = localFlushedSn_;
+			if(!rtoDeadline_)
+				rtoDeadline_ = now + rto_;
+			if(passive)
+				remoteAckedSn_ = remoteKnownSn_;
+			announcedWindow_ = window;
 
 			if(debugTcp)
-				std::cout << "netserver: Sending TCP SYN" << std::endl;
-			auto error = co_await ip4().sendFrame(std::move(*targetInfo),
-				buf.data(), buf.size(), static_cast<uint16_t>(IpProto::tcp));
+				std::cout << "netserver: Sending TCP " << (passive ? "SYN+ACK" : "SYN") << std::endl;
+			auto error = co_await ip4().sendFrame(std::move(targetInfo),
+				std::move(frame), static_cast<uint16_t>(IpProto::tcp), metadata);
 			if (error != protocols::fs::Error::none) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Could not send TCP packet" << std::endl;
@@ -629,83 +1345,178 @@ async::result<void> Tcp4Socket::flushOutPackets_() {
 		}else{
 			assert(connectState_ == ConnectState::connected);
 			size_t flushPointer = localFlushedSn_ - localSettledSn_;
-			size_t windowPointer = localWindowSn_ - localSettledSn_;
+			// We may send up to the remote's window, limited by the congestion window.
+			size_t windowPointer = std::min(size_t{localWindowSn_ - localSettledSn_},
+					size_t{congestionWindow_});
 
 			size_t bytesAvailable = sendRing_.availableToDequeue();
-			assert(bytesAvailable >= flushPointer);
+			// Once the owner closed the socket, the FIN follows the data.
+			assert(bytesAvailable + closed_ >= flushPointer);
+			size_t windowSpace = windowPointer > flushPointer ? windowPointer - flushPointer : 0;
 
-			// Check whether we need to send a packet.
-			// TODO: Add retransmission here.
-			bool wantData = (bytesAvailable > flushPointer && windowPointer > flushPointer);
-			bool wantAck = (remoteAckedSn_ != remoteKnownSn_);
-			bool wantWindowUpdate = (announcedWindow_ < recvRing_.spaceForEnqueue());
+			if(!flushPointer)
+				retransmitPending_ = false;
 
-			if(!wantData && !wantAck && !wantWindowUpdate) {
-				co_await flushEvent_.async_wait();
+			// Check whether we need to send a packet.
+			// To avoid the silly window syndrome, we only announce significant window updates.
+			auto [window, windowField] = windowToAnnounce_(false);
+			bool wantRetransmit = retransmitPending_;
+			bool wantData = (bytesAvailable > flushPointer && windowSpace);
+			bool wantFin = closed_ && flushPointer == bytesAvailable;
+			bool wantAck = ackNow_;
+			bool wantWindowUpdate = (window > announcedWindow_
+					&& window - announcedWindow_ >= std::min(size_t{mss_},
+							recvRing_.spaceForEnqueue() / 2));
+
+			if(!wantRetransmit && !wantData && !wantFin && !wantAck && !wantWindowUpdate) {
+				auto deadline = rtoDeadline_;
+				if(delayedAckDeadline_ && (!deadline || delayedAckDeadline_ < deadline))
+					deadline = delayedAckDeadline_;
+				if(closeDeadline_ && (!deadline || closeDeadline_ < deadline))
+					deadline = closeDeadline_;
+				co_await waitForFlush_(deadline);
 				continue;
 			}
 
 			// Construct and transmit the TCP packet.
-			auto targetInfo = co_await ip4().targetByRemote(remoteEp_.ipAddress);
-			if (!targetInfo) {
+			auto targetOrError = co_await ip4().resolveTarget(remoteEp_.ipAddress, routeCache_);
+			if (!targetOrError) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Destination unreachable" << std::endl;
 				co_return;
 			}
-
-			auto chunk = std::min({
-				bytesAvailable - flushPointer,
-				windowPointer - flushPointer,
-				size_t{1000} // TODO: Perform path MTU discovery.
-			});
-
-			std::vector<char> buf;
-			buf.resize(sizeof(TcpHeader) + chunk);
-
-			auto header = new (buf.data()) TcpHeader {
+			auto targetInfo = std::move(targetOrError.value());
+
+			// With TSO, the NIC splits large segments into MSS-sized ones.
+			auto offloads = targetInfo.link->offloads();
+			bool tso = (offloads & nic::OFFLOAD_TSO4) && (offloads & nic::OFFLOAD_TX_CSUM);
+			auto optionsLength = optionsLength_(false);
+
+			size_t offset = flushPointer;
+			size_t chunk = 0;
+			if(wantRetransmit) {
+				// Retransmit a single segment at the front of the send buffer.
+				offset = 0;
+				chunk = std::min({flushPointer, bytesAvailable, segmentPayload_()});
+			}else if(wantData) {
+				chunk = std::min({
+					bytesAvailable - flushPointer,
+					windowSpace,
+					tso ? maxTsoPayload - optionsLength : segmentPayload_()
+				});
+			}
+			uint32_t sn = localSettledSn_ + offset;
+			// Send the FIN with the last segment, unless we retransmit data that preceded it.
+			bool fin = closed_ && offset + chunk == bytesAvailable
+					&& (!wantRetransmit || flushPointer > bytesAvailable);
+
+			// The segment is built in place, such that the payload is only copied once.
+			auto frameOrError = ip4().allocateFrame(targetInfo,
+					sizeof(TcpHeader) + optionsLength + chunk);
+			assert(frameOrError);
+			auto frame = std::move(frameOrError.value());
+			auto segment = frame.payload();
+
+			auto header = new (segment.data()) TcpHeader {
 				.srcPort = localEp_.port,
 				.destPort = remoteEp_.port,
-				.seqNumber = localFlushedSn_,
+				.seqNumber = sn,
 				.ackNumber = remoteKnownSn_,
-				.window = std::min(recvRing_.spaceForEnqueue(), size_t{0xFFFF}),
+				.window = windowField,
 				.checksum = 0,
 				.urgentPointer = 0
 			};
-			header->flags.store(TcpHeader::headerWords(sizeof(TcpHeader) / 4)
-					| TcpHeader::ackFlag(true));
-
-			sendRing_.dequeueLookahead(flushPointer, buf.data() + sizeof(TcpHeader), chunk);
+			header->flags.store(TcpHeader::headerWords((sizeof(TcpHeader) + optionsLength) / 4)
+					| TcpHeader::ackFlag(true) | TcpHeader::finFlag(fin));
+			writeOptions_(static_cast<char *>(segment.data()) + sizeof(TcpHeader), false, 0);
+
+			// Without checksum offload, sum up the payload while copying it.
+			Checksum payloadCsum;
+			bool sumPayload = !(offloads & nic::OFFLOAD_TX_CSUM);
+			auto payload = segment.subview(sizeof(TcpHeader) + optionsLength);
+			sendRing_.dequeueLookahead(offset, payload.data(), chunk,
+					sumPayload ? &payloadCsum : nullptr);
+
+			auto metadata = fillChecksum(targetInfo, remoteEp_.ipAddress, segment,
+					sumPayload ? &payloadCsum : nullptr);
+			if(chunk > segmentPayload_()) {
+				metadata.segmentSize = segmentPayload_();
+				metadata.headerLength = sizeof(TcpHeader) + optionsLength;
+			}
 
-			// Fill in the checksum.
-			PseudoHeader pseudo {
-				.src = targetInfo->source,
-				.dst = remoteEp_.ipAddress,
-				.len = buf.size()
-			};
-			Checksum csum;
-			csum.update(&pseudo, sizeof(PseudoHeader));
-			csum.update(buf.data(), buf.size());
-			header->checksum = csum.finalize();
+			if(wantRetransmit) {
+				retransmitPending_ = false;
+			}else{
+				// Time one segment per RTT, but never a retransmitted one (Karn's algorithm).
+				if(chunk && !timestampsEnabled_ && !rttTiming_ && sn == localHighestSn_) {
+					rttTiming_ = true;
+					rttTimedSn_ = sn + chunk;
+					rttTimedSince_ = now;
+				}
+				localFlushedSn_ += chunk + fin; // FIN counts as one byte.
+				if(seqBefore(localHighestSn_, localFlushedSn_))
+					localHighestSn_ = localFlushedSn_;
+			}
+			if((chunk || fin) && !rtoDeadline_)
+				rtoDeadline_ = now + rto_;
+			if(fin && !closeDeadline_)
+				closeDeadline_ = now + finTimeout;
 
-			localFlushedSn_ += chunk;
+			// Every segment carries an ACK.
 			remoteAckedSn_ = remoteKnownSn_;
-			announcedWindow_ = recvRing_.spaceForEnqueue();
+			announcedWindow_ = window;
+			ackNow_ = false;
+			delayedAckDeadline_ = 0;
 
 			if(debugTcp)
-				std::cout << "netserver: Sending TCP data (" << chunk << " bytes)" << std::endl;
-			auto error = co_await ip4().sendFrame(std::move(*targetInfo),
-				buf.data(), buf.size(),
-				static_cast<uint16_t>(IpProto::tcp));
+				std::cout << "netserver: Sending TCP data (" << chunk << " bytes"
+						<< (wantRetransmit ? ", retransmission" : "") << ")" << std::endl;
+			// Segments are queued and sent in a single burst once there is nothing
+			// more to send (see waitForFlush_()).
+			if(queuedLink_ && queuedLink_ != targetInfo.link)
+				co_await flushQueued_();
+			queuedLink_ = targetInfo.link;
+			auto error = co_await ip4().queueFrame(std::move(targetInfo),
+				std::move(frame), static_cast<uint16_t>(IpProto::tcp), metadata);
 			if (error != protocols::fs::Error::none) {
 				// TODO: Return an error to users.
 				std::cout << "netserver: Could not send TCP packet" << std::endl;
 				co_return;
 			}
+			if(++numQueued_ == maxQueuedSegments)
+				co_await flushQueued_();
 		}
 	}
 }
 
 void Tcp4Socket::handleInPacket_(TcpPacket packet) {
+	auto options = packet.options();
+
+	if(packet.header.flags.load() & TcpHeader::rstFlag) {
+		if(connectState_ == ConnectState::sendSyn) {
+			// The RST is only valid if it acknowledges our SYN.
+			if(!(packet.header.flags.load() & TcpHeader::ackFlag)
+					|| packet.header.ackNumber.load() != localSettledSn_ + 1
+					|| localSettledSn_ == localFlushedSn_)
+				return;
+			abort_(protocols::fs::Error::connectionRefused);
+			return;
+		}
+
+		// Only accept RSTs within the receive window (RFC 9293).
+		uint32_t offset = packet.header.seqNumber.load() - remoteKnownSn_;
+		if(offset > announcedWindow_)
+			return;
+		if(debugTcp)
+			std::cout << "netserver: TCP connection reset by remote" << std::endl;
+		if(connectState_ == ConnectState::sendSynAck) {
+			teardown_();
+		}else{
+			abort_(protocols::fs::Error::connectionReset);
+		}
+		return;
+	}
+
 	if(connectState_ == ConnectState::sendSyn) {
 		if(localSettledSn_ == localFlushedSn_) {
 			std::cout << "netserver: Rejecting packet before SYN is sent [sendSyn]"
@@ -729,18 +1540,84 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 			return;
 		}
 
+		handleSynOptions_(options);
 		++localSettledSn_;
-		localWindowSn_ = localSettledSn_ + packet.header.window.load();
+		localWindowSn_ = localSettledSn_ + packet.header.window.load(); // Not scaled in SYNs.
 		remoteAckedSn_ = packet.header.seqNumber.load();
 		remoteKnownSn_ = packet.header.seqNumber.load() + 1; // SYN counts as one byte.
-		connectState_ = ConnectState::connected;
+		establish_();
+		ackNow_ = true;
+		flushEvent_.raise();
+		settleEvent_.raise();
+		return;
+	}
+
+	if(connectState_ == ConnectState::sendSynAck) {
+		if(packet.header.flags.load() & TcpHeader::synFlag) {
+			// The remote did not see our SYN+ACK; retransmit it.
+			if(packet.header.seqNumber.load() + 1 == remoteKnownSn_
+					&& localFlushedSn_ != localSettledSn_) {
+				localFlushedSn_ = localSettledSn_;
+				flushEvent_.raise();
+			}
+			return;
+		}
+
+		if(!(packet.header.flags.load() & TcpHeader::ackFlag)) {
+			std::cout << "netserver: Rejecting packet without ACK [sendSynAck]"
+					<< std::endl;
+			return;
+		}
+
+		if(packet.header.ackNumber.load() != localSettledSn_ + 1) {
+			std::cout << "netserver: Rejecting packet with bad ack-number [sendSynAck]"
+					<< std::endl;
+			return;
+		}
+
+		// Move the connection to the accept queue of the listener.
+		// If the accept queue is full, we drop the ACK and wait for the remote to resend.
+		auto listener = listener_.lock();
+		if(listener) {
+			if(listener->acceptQueue_.size() >= listener->backlog_) {
+				if(debugTcp)
+					std::cout << "netserver: Accept queue is full" << std::endl;
+				return;
+			}
+
+			auto self = holder_.lock();
+			auto it = std::find(listener->synQueue_.begin(), listener->synQueue_.end(), self);
+			assert(it != listener->synQueue_.end());
+			listener->synQueue_.erase(it);
+			listener->acceptQueue_.push_back(std::move(self));
+
+			listener->inSeq_ = ++listener->currentSeq_;
+			listener->inEvent_.raise();
+			listener->pollEvent_.raise();
+		}
+
+		++localSettledSn_;
+		localWindowSn_ = localSettledSn_
+				+ (uint32_t{packet.header.window.load()} << remoteWindowShift_);
+		establish_();
 		flushEvent_.raise();
 		settleEvent_.raise();
-	}else if(connectState_ == ConnectState::connected) {
+
+		// The ACK may already carry data, continue below.
+	}
+
+	if(connectState_ == ConnectState::connected) {
+		auto payload = packet.payload();
+		bool fin = packet.header.flags.load() & TcpHeader::finFlag;
+
+		// Remember the timestamp that we echo (RFC 7323). We do not implement PAWS.
+		if(timestampsEnabled_ && options.hasTimestamp
+				&& !seqBefore(remoteAckedSn_, packet.header.seqNumber.load()))
+			tsRecent_ = options.tsValue;
+
 		if(packet.header.seqNumber.load() == remoteKnownSn_) {
 			bool gotUpdate = false;
 
-			auto payload = packet.payload();
 			size_t chunk = std::min(payload.size(), recvRing_.spaceForEnqueue());
 			if(chunk) {
 				recvRing_.enqueue(payload.data(), chunk);
@@ -751,13 +1628,25 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 					announcedWindow_ -= chunk;
 				}
 
+				// Delay the ACK, but acknowledge at least every second full-sized segment.
+				if(remoteKnownSn_ - remoteAckedSn_ >= 2 * mss_) {
+					ackNow_ = true;
+				}else if(!delayedAckDeadline_) {
+					delayedAckDeadline_ = clockNs() + delayedAckTimeout;
+				}
+
 				inSeq_ = ++currentSeq_;
 				gotUpdate = true;
 			}
 
-			if(packet.header.flags.load() & TcpHeader::finFlag) {
+			if(fin) {
 				++remoteKnownSn_; // FIN counts as one byte.
 				remoteClosed_ = true;
+				ackNow_ = true;
+
+				// If we already closed our side, the connection enters TIME_WAIT.
+				if(closed_)
+					closeDeadline_ = clockNs() + timeWaitTimeout;
 
 				hupSeq_ = ++currentSeq_;
 				gotUpdate = true;
@@ -768,18 +1657,34 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 				flushEvent_.raise();
 				pollEvent_.raise();
 			}
+		}else if(payload.size() || fin) {
+			// Out-of-order segment, send a duplicate ACK immediately.
+			ackNow_ = true;
+			flushEvent_.raise();
 		}
 
 		if(packet.header.flags.load() & TcpHeader::ackFlag) {
-			size_t validWindow = localFlushedSn_ - localSettledSn_;
-			size_t ackPointer = packet.header.ackNumber.load() - localSettledSn_;
-			if(ackPointer <= validWindow) {
-				localSettledSn_ += ackPointer;
-				localWindowSn_ = localSettledSn_ + packet.header.window.load();
-				sendRing_.dequeueAdvance(ackPointer);
+			uint32_t validWindow = localHighestSn_ - localSettledSn_;
+			uint32_t ackPointer = packet.header.ackNumber.load() - localSettledSn_;
+			uint32_t window = uint32_t{packet.header.window.load()} << remoteWindowShift_;
+			if(!ackPointer) {
+				// Duplicate ACKs (as defined by RFC 5681) indicate a lost segment.
+				if(validWindow && !payload.size() && !fin
+						&& localSettledSn_ + window == localWindowSn_)
+					handleDuplicateAck_();
+				localWindowSn_ = localSettledSn_ + window;
+				flushEvent_.raise();
+			}else if(ackPointer <= validWindow) {
+				handleAck_(ackPointer, options);
+				localWindowSn_ = localSettledSn_ + window;
 				outSeq_ = ++currentSeq_;
+				flushEvent_.raise();
 				settleEvent_.raise();
 				pollEvent_.raise();
+
+				// The remote already closed its side, hence there is no TIME_WAIT.
+				if(finAcked_ && lastAck_)
+					teardown_();
 			}else{
 				std::cout << "netserver: Rejecting ack-number outside of valid window"
 						<< std::endl;
@@ -788,6 +1693,51 @@ void Tcp4Socket::handleInPacket_(TcpPacket packet) {
 	}
 }
 
+void Tcp4Socket::handleListenPacket_(TcpPacket packet) {
+	auto flags = packet.header.flags.load();
+	if(!(flags & TcpHeader::synFlag) || (flags & TcpHeader::ackFlag)) {
+		// TODO: Reply with a RST.
+		if(debugTcp)
+			std::cout << "netserver: Rejecting non-SYN packet [listen]" << std::endl;
+		return;
+	}
+
+	if(synQueue_.size() >= synBacklog) {
+		if(debugTcp)
+			std::cout << "netserver: SYN queue is full" << std::endl;
+		return;
+	}
+
+	TcpConnectionKey key{
+		.localIp = packet.packet->header.destination,
+		.localPort = packet.header.destPort.load(),
+		.remoteIp = packet.packet->header.source,
+		.remotePort = packet.header.srcPort.load()
+	};
+
+	auto socket = makeSocket(parent_, false);
+	socket->passive_ = true;
+	socket->listener_ = holder_;
+	socket->localEp_ = {key.localIp, key.localPort};
+	socket->remoteEp_ = {key.remoteIp, key.remotePort};
+
+	auto randomSn = globalPrng();
+	socket->localSettledSn_ = randomSn;
+	socket->localFlushedSn_ = randomSn;
+	socket->localHighestSn_ = randomSn;
+	socket->remoteKnownSn_ = packet.header.seqNumber.load() + 1; // SYN counts as one byte.
+	socket->handleSynOptions_(packet.options());
+
+	if(!parent_->registerConnection(socket, key)) {
+		socket->teardown_();
+		return;
+	}
+	socket->connectionKey_ = key;
+	socket->connectState_ = ConnectState::sendSynAck;
+	socket->flushEvent_.raise();
+	synQueue_.push_back(std::move(socket));
+}
+
 void Tcp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 	TcpPacket tcp;
 	if (!tcp.parse(std::move(packet))) {
@@ -799,19 +1749,32 @@ void Tcp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 		std::cout << "netserver: Received TCP packet at port " << tcp.header.destPort.load()
 				<< " (" << tcp.payload().size() << " bytes)" << std::endl;
 
+	TcpConnectionKey key{
+		.localIp = tcp.packet->header.destination,
+		.localPort = tcp.header.destPort.load(),
+		.remoteIp = tcp.packet->header.source,
+		.remotePort = tcp.header.srcPort.load()
+	};
+	if (auto it = connections.find(key); it != connections.end()) {
+		auto socket = it->second;
+		socket->handleInPacket_(std::move(tcp));
+		return;
+	}
+
 	auto it = binds.lower_bound({ 0, tcp.header.destPort.load() });
 	for (; it != binds.end() && it->first.port == tcp.header.destPort.load(); it++) {
 		auto existingEp = it->first;
 		if (existingEp.ipAddress == tcp.packet->header.destination
 				|| existingEp.ipAddress == INADDR_ANY) {
-			it->second->handleInPacket_(std::move(tcp));
-			break;
+			if (it->second->listening_)
+				it->second->handleListenPacket_(std::move(tcp));
+			return;
 		}
 	}
 }
 
 bool Tcp4::tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint wantedEp) {
-	auto it = binds.lower_bound(wantedEp);
+	auto it = binds.lower_bound({ 0, wantedEp.port });
 	for (; it != binds.end() && it->first.port == wantedEp.port; it++) {
 		auto existingEp = it->first;
 		if (existingEp.ipAddress == INADDR_ANY || wantedEp.ipAddress == INADDR_ANY
@@ -828,9 +1791,15 @@ bool Tcp4::unbind(TcpEndpoint e) {
 	return binds.erase(e) != 0;
 }
 
+bool Tcp4::registerConnection(smarter::shared_ptr<Tcp4Socket> socket, TcpConnectionKey key) {
+	return connections.emplace(key, std::move(socket)).second;
+}
+
+bool Tcp4::unregisterConnection(TcpConnectionKey key) {
+	return connections.erase(key) != 0;
+}
+
 void Tcp4::serveSocket(int flags, helix::UniqueLane lane) {
-	using protocols::fs::servePassthrough;
 	auto sock = Tcp4Socket::makeSocket(this, flags & SOCK_NONBLOCK);
-	async::detach(servePassthrough(std::move(lane), std::move(sock),
-			&Tcp4Socket::ops));
+	async::detach(Tcp4Socket::serve(std::move(lane), std::move(sock)));
 }
@@ -3,6 +3,7 @@
 #include <helix/ipc.hpp>
 #include <smarter.hpp>
 #include <map>
+#include <unordered_map>
 
 class Ip4Packet;
 
@@ -15,14 +16,39 @@ struct TcpEndpoint {
 	uint16_t port = 0;
 };
 
+// Identifies an established (or embryonic) connection.
+struct TcpConnectionKey {
+	bool operator==(const TcpConnectionKey &) const = default;
+
+	uint32_t localIp = 0;
+	uint16_t localPort = 0;
+	uint32_t remoteIp = 0;
+	uint16_t remotePort = 0;
+};
+
+struct TcpConnectionKeyHash {
+	size_t operator()(const TcpConnectionKey &k) const {
+		uint64_t ips = (uint64_t{k.localIp} << 32) | k.remoteIp;
+		uint64_t ports = (uint64_t{k.localPort} << 16) | k.remotePort;
+		return std::hash<uint64_t>{}(ips ^ (ports * 0x9E3779B97F4A7C15));
+	}
+};
+
 struct Tcp4Socket;
 
 struct Tcp4 {
 	void feedDatagram(smarter::shared_ptr<const Ip4Packet>);
 	bool tryBind(smarter::shared_ptr<Tcp4Socket> socket, TcpEndpoint ipAddress);
 	bool unbind(TcpEndpoint remote);
+	bool registerConnection(smarter::shared_ptr<Tcp4Socket> socket, TcpConnectionKey key);
+	bool unregisterConnection(TcpConnectionKey key);
 	void serveSocket(int flags, helix::UniqueLane lane);
 
 private:
+	// Reserves local endpoints; also used to find listening sockets.
 	std::map<TcpEndpoint, smarter::shared_ptr<Tcp4Socket>> binds;
+	// Packets are first demultiplexed by their 4-tuple, listeners are the fallback.
+	// Sockets unregister themselves once the connection is closed or dropped.
+	std::unordered_map<TcpConnectionKey, smarter::shared_ptr<Tcp4Socket>,
+			TcpConnectionKeyHash> connections;
 };
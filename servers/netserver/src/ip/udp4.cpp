@@ -5,26 +5,23 @@
 
 #include <async/basic.hpp>
 #include <async/result.hpp>
-#include <async/queue.hpp>
+#include <async/recurring-event.hpp>
 #include <arch/bit.hpp>
 #include <protocols/fs/server.hpp>
+#include <cstddef>
 #include <cstring>
+#include <deque>
 #include <iomanip>
+#include <memory>
 #include <random>
+#include <span>
+#include <vector>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 
 namespace {
-struct stl_allocator {
-	void *allocate(size_t size) {
-		return operator new(size);
-	}
-
-	void deallocate(void *p, size_t) {
-		return operator delete(p);
-	}
-};
+constexpr bool logDatagrams = false;
 
 template<typename T>
 void maybeFlip(T &x) {
@@ -79,7 +76,7 @@ struct Udp {
 		if (payload.size() < header.len) {
 			return false;
 		}
-		if (header.chk != 0) {
+		if (header.chk != 0 && !packet->checksumValid) {
 			PseudoHeader phdr;
 			phdr.src = packet->header.source;
 			phdr.dst = packet->header.destination;
@@ -219,23 +216,34 @@ struct Udp4Socket {
 			const char *creds,
 			uint32_t flags, void *data, size_t len,
 			void *addr_buf, size_t addr_size, size_t max_ctrl_len) {
-		using arch::convert_endian;
-		using arch::endian;
 		auto self = static_cast<Udp4Socket *>(obj);
-		auto element = co_await self->queue_.async_get();
-		auto packet = element->payload();
-		auto copy_size = std::min(packet.size(), len);
-		std::memcpy(data, packet.data(), copy_size);
-		sockaddr_in addr {
-			.sin_family = AF_INET,
-			.sin_port = convert_endian<endian::big>(element->header.src),
-			.sin_addr = {
-				convert_endian<endian::big>(element->packet->header.source)
-			}
-		};
-		std::memset(addr_buf, 0, addr_size);
-		std::memcpy(addr_buf, &addr, std::min(addr_size, sizeof(addr)));
-		co_return RecvData{{}, copy_size, sizeof(addr), 0};
+		while (self->queue_.empty())
+			co_await self->inEvent_.async_wait();
+
+		auto element = std::move(self->queue_.front());
+		self->queue_.pop_front();
+		auto copy_size = copyDatagram(element, data, len, addr_buf, addr_size);
+		co_return RecvData{{}, copy_size, sizeof(sockaddr_in), 0};
+	}
+
+	// waits for the first datagram only, and then takes all that are queued
+	static async::result<frg::expected<protocols::fs::Error, size_t>> recvmsgBatch(void *obj,
+			const char *creds, uint32_t flags, std::span<BatchedMsg> msgs) {
+		auto self = static_cast<Udp4Socket *>(obj);
+		while (self->queue_.empty())
+			co_await self->inEvent_.async_wait();
+
+		size_t n = 0;
+		for (; n < msgs.size() && !self->queue_.empty(); n++) {
+			auto element = std::move(self->queue_.front());
+			self->queue_.pop_front();
+			auto &msg = msgs[n];
+			msg.dataLength = copyDatagram(element, msg.data, msg.dataLength,
+				msg.addr, msg.addrLength);
+			msg.addrLength = sizeof(sockaddr_in);
+			msg.flags = 0;
+		}
+		co_return n;
 	}
 
 	static async::result<frg::expected<protocols::fs::Error, size_t>> sendmsg(void *obj,
@@ -275,8 +283,11 @@ struct Udp4Socket {
 			co_return protocols::fs::Error::accessDenied;
 		}
 
-		std::vector<char> buf;
-		buf.resize(sizeof(Udp::Header) + len);
+		// largest datagram that fits into an IPv4 packet
+		if (len > 0xFFFF - sizeof(Ip4Packet::Header) - sizeof(Udp::Header)) {
+			co_return protocols::fs::Error::messageSize;
+		}
+
 		Udp::Header header {
 			.src = source.port,
 			.dst = target.port,
@@ -290,10 +301,18 @@ struct Udp4Socket {
 		source.ensureEndian();
 		target.ensureEndian();
 
-		auto ti = co_await ip4().targetByRemote(targetIpNe);
-		if (!ti) {
-			co_return protocols::fs::Error::netUnreachable;
+		auto tiOrError = co_await ip4().resolveTarget(targetIpNe, self->routeCache_);
+		if (!tiOrError) {
+			co_return tiOrError.error();
+		}
+		auto ti = &tiOrError.value();
+
+		// the datagram is built in place, such that the payload is only copied once
+		auto frame = ip4().allocateFrame(*ti, sizeof(header) + len);
+		if (!frame) {
+			co_return frame.error();
 		}
+		auto datagram = frame.value().payload();
 
 		Checksum chk;
 		PseudoHeader psh {
@@ -302,30 +321,44 @@ struct Udp4Socket {
 			.len = header.len
 		};
 		chk.update(&psh, sizeof(psh));
-		chk.update(&header, sizeof(header));
-		chk.update(data, len);
-		header.chk = convert_endian<endian::big>(chk.finalize());
-
-		std::cout << "netserver:" << std::endl << std::hex
-			<< std::setw(8) << psh.src << std::endl
-			<< std::setw(8) << psh.dst << std::endl
-			<< std::setw(8) << psh.len << std::endl
-
-			<< std::setw(8) << header.src << std::endl
-			<< std::setw(8) << header.dst << std::endl
-			<< std::setw(8) << header.len << std::endl
-			<< std::setw(8) << header.chk << std::endl << std::dec;
-
-		if (header.chk == 0) {
-			header.chk = ~header.chk;
+		nic::TxMetadata metadata;
+		if (ti->link->offloads() & nic::OFFLOAD_TX_CSUM) {
+			// the NIC sums up the datagram, it expects the
+			// (non-inverted) pseudo header sum
+			header.chk = convert_endian<endian::big>(
+				static_cast<uint16_t>(~chk.finalize()));
+			metadata.needsChecksum = true;
+			metadata.checksumOffset = offsetof(Udp::Header, chk);
+		} else {
+			chk.update(&header, sizeof(header));
+			chk.updateAndCopy(datagram.subview(sizeof(header)).data(), data, len);
+			header.chk = convert_endian<endian::big>(chk.finalize());
+			// a checksum of zero means "no checksum"
+			if (header.chk == 0) {
+				header.chk = ~header.chk;
+			}
+		}
+
+		if (logDatagrams) {
+			std::cout << "netserver:" << std::endl << std::hex
+				<< std::setw(8) << psh.src << std::endl
+				<< std::setw(8) << psh.dst << std::endl
+				<< std::setw(8) << psh.len << std::endl
+
+				<< std::setw(8) << header.src << std::endl
+				<< std::setw(8) << header.dst << std::endl
+				<< std::setw(8) << header.len << std::endl
+				<< std::setw(8) << header.chk << std::endl << std::dec;
 		}
 
-		std::memcpy(buf.data(), &header, sizeof(header));
-		std::memcpy(buf.data() + sizeof(header), data, len);
+		std::memcpy(datagram.data(), &header, sizeof(header));
+		// without offload, the payload was copied while summing it up
+		if (metadata.needsChecksum) {
+			std::memcpy(datagram.subview(sizeof(header)).data(), data, len);
+		}
 
 		auto error = co_await ip4().sendFrame(std::move(*ti),
-			buf.data(), buf.size(),
-			static_cast<uint16_t>(IpProto::udp));
+			std::move(frame.value()), static_cast<uint16_t>(IpProto::udp), metadata);
 		if (error != protocols::fs::Error::none) {
 			co_return error;
 		}
@@ -333,11 +366,30 @@ struct Udp4Socket {
 	}
 
 
+	// stops at the first datagram that cannot be sent
+	static async::result<frg::expected<protocols::fs::Error, size_t>> sendmsgBatch(void *obj,
+			const char *creds, uint32_t flags, std::span<const BatchedMsg> msgs) {
+		size_t sent = 0;
+		for (auto &msg : msgs) {
+			auto result = co_await sendmsg(obj, creds, flags, msg.data, msg.dataLength,
+				msg.addr, msg.addrLength, {});
+			if (!result) {
+				if (!sent)
+					co_return result.error();
+				break;
+			}
+			sent++;
+		}
+		co_return sent;
+	}
+
 	constexpr static FileOperations ops {
 		.bind = &bind,
 		.connect = &connect,
 		.recvMsg = &recvmsg,
 		.sendMsg = &sendmsg,
+		.recvMsgBatch = &recvmsgBatch,
+		.sendMsgBatch = &sendmsgBatch,
 	};
 
 	bool bindAvailable(uint32_t addr = INADDR_ANY) {
@@ -368,9 +420,32 @@ struct Udp4Socket {
 private:
 	friend struct Udp4;
 
-	async::queue<Udp, stl_allocator> queue_;
+	// copies the payload and source address of a received datagram
+	static size_t copyDatagram(const Udp &element, void *data, size_t len,
+			void *addr_buf, size_t addr_size) {
+		using arch::convert_endian;
+		using arch::endian;
+		auto packet = element.payload();
+		auto copy_size = std::min(packet.size(), len);
+		std::memcpy(data, packet.data(), copy_size);
+		sockaddr_in addr {
+			.sin_family = AF_INET,
+			.sin_port = convert_endian<endian::big>(element.header.src),
+			.sin_addr = {
+				convert_endian<endian::big>(element.packet->header.source)
+			}
+		};
+		std::memset(addr_buf, 0, addr_size);
+		std::memcpy(addr_buf, &addr, std::min(addr_size, sizeof(addr)));
+		return copy_size;
+	}
+
+	std::deque<Udp> queue_;
+	async::recurring_event inEvent_;
 	Endpoint remote_;
 	Endpoint local_;
+	// target of the last destination, avoids route and neighbour lookups
+	Ip4RouteCache routeCache_;
 	Udp4 *parent_;
 	smarter::weak_ptr<Udp4Socket> holder_;
 };
@@ -382,14 +457,16 @@ void Udp4::feedDatagram(smarter::shared_ptr<const Ip4Packet> packet) {
 		return;
 	}
 
-	std::cout << "received udp datagram to port " << udp.header.dst << std::endl;
+	if (logDatagrams)
+		std::cout << "received udp datagram to port " << udp.header.dst << std::endl;
 
 	auto i = binds.lower_bound({ 0, udp.header.dst });
 	for (; i != binds.end() && i->first.port == udp.header.dst; i++) {
 		auto ep = i->first;
 		if (ep.addr == udp.packet->header.destination
 			|| ep.addr == INADDR_ANY) {
-			i->second->queue_.emplace(std::move(udp));
+			i->second->queue_.push_back(std::move(udp));
+			i->second->inEvent_.raise();
 			break;
 		}
 	}
@@ -0,0 +1,115 @@
+#include "loopback.hpp"
+
+#include <arch/dma_pool.hpp>
+#include <async/recurring-event.hpp>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+
+#include "ip/ip4.hpp"
+
+namespace {
+
+// Large enough for IPv4 packets of maximal size.
+constexpr unsigned int loopbackMtu = 65536;
+
+// Hands IPv4 packets to the local input path. Frames carry no link layer header
+// and the buffers allocated by allocateFrame() are passed on without copying them.
+struct LoopbackLink : nic::Link {
+	LoopbackLink();
+
+	virtual async::result<void> receive(arch::dma_buffer_view) override;
+	virtual async::result<void> send(const arch::dma_buffer_view) override;
+	virtual async::result<void> transmit(AllocatedBuffer buffer,
+		nic::TxMetadata metadata) override;
+	virtual async::result<void> transmitBurst(std::vector<QueuedFrame> frames) override;
+
+	virtual AllocatedBuffer allocateFrame(nic::MacAddress to, nic::EtherType type,
+		size_t payloadSize) override;
+
+	virtual std::string name() override;
+	virtual bool isLoopback() override;
+
+	virtual ~LoopbackLink() override = default;
+private:
+	// Delivers packets asynchronously, such that the receive path does not run
+	// in the context of (and recurse into) the sender.
+	async::detached processPackets_();
+
+	arch::contiguous_pool dmaPool_;
+	std::deque<AllocatedBuffer> pendingPackets_;
+	async::recurring_event pendingDoorbell_;
+};
+
+LoopbackLink::LoopbackLink()
+	: nic::Link(loopbackMtu, &dmaPool_)
+{
+	// Packets never leave the host, hence checksums do not need to be computed
+	// or validated; segmentation is not needed either.
+	offloads_ = nic::OFFLOAD_TX_CSUM | nic::OFFLOAD_RX_CSUM | nic::OFFLOAD_TSO4;
+
+	processPackets_();
+}
+
+async::result<void> LoopbackLink::receive(arch::dma_buffer_view) {
+	throw std::runtime_error("loopback packets are delivered to ip4 directly");
+}
+
+async::result<void> LoopbackLink::send(const arch::dma_buffer_view frame) {
+	AllocatedBuffer buffer{ arch::dma_buffer{ framePool(), frame.size() }, {} };
+	memcpy(buffer.frame.data(), frame.data(), frame.size());
+	buffer.payload = buffer.frame;
+	co_await transmit(std::move(buffer), {});
+}
+
+async::result<void> LoopbackLink::transmit(AllocatedBuffer buffer, nic::TxMetadata) {
+	pendingPackets_.push_back(std::move(buffer));
+	pendingDoorbell_.raise();
+	co_return;
+}
+
+async::result<void> LoopbackLink::transmitBurst(std::vector<QueuedFrame> frames) {
+	for (auto &queued : frames)
+		pendingPackets_.push_back(std::move(queued.buffer));
+	pendingDoorbell_.raise();
+	co_return;
+}
+
+nic::Link::AllocatedBuffer LoopbackLink::allocateFrame(nic::MacAddress, nic::EtherType,
+		size_t payloadSize) {
+	AllocatedBuffer buffer{ arch::dma_buffer{ framePool(), payloadSize }, {} };
+	buffer.payload = buffer.frame;
+	return buffer;
+}
+
+std::string LoopbackLink::name() {
+	return "lo";
+}
+
+bool LoopbackLink::isLoopback() {
+	return true;
+}
+
+async::detached LoopbackLink::processPackets_() {
+	while (true) {
+		if (pendingPackets_.empty()) {
+			co_await pendingDoorbell_.async_wait();
+			continue;
+		}
+
+		auto packet = std::move(pendingPackets_.front());
+		pendingPackets_.pop_front();
+		ip4().feedPacket({}, {}, std::move(packet.frame), packet.payload,
+			{ .checksumValid = true });
+	}
+}
+
+} // namespace
+
+namespace nic::loopback {
+
+std::shared_ptr<nic::Link> makeShared() {
+	return std::make_shared<LoopbackLink>();
+}
+
+} // namespace nic::loopback
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <netserver/nic.hpp>
+
+namespace nic::loopback {
+std::shared_ptr<nic::Link> makeShared();
+} // namespace nic::loopback
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <queue>
@@ -22,6 +23,7 @@
 
 #include "ip/ip4.hpp"
 #include "netlink/netlink.hpp"
+#include "loopback.hpp"
 
 #include <netserver/nic.hpp>
 #include <nic/virtio/virtio.hpp>
@@ -29,6 +31,9 @@
 // Maps mbus IDs to device objects
 std::unordered_map<int64_t, std::shared_ptr<nic::Link>> baseDeviceMap;
 
+// Key of the loopback link in baseDeviceMap, as it has no mbus ID.
+constexpr int64_t loopbackId = -1;
+
 std::optional<helix::UniqueDescriptor> posixLane;
 
 std::unordered_map<int64_t, std::shared_ptr<nic::Link>> &nic::Link::getLinks() {
@@ -52,7 +57,9 @@ async::result<void> doBind(mbus::Entity base_entity, virtio_core::DiscoverMode d
 	auto transport = co_await virtio_core::discover(std::move(hwDevice), discover_mode);
 
 	auto device = nic::virtio::makeShared(std::move(transport));
-	if (baseDeviceMap.empty()) {
+	bool firstDevice = std::none_of(baseDeviceMap.begin(), baseDeviceMap.end(),
+			[] (const auto &entry) { return entry.first != loopbackId; });
+	if (firstDevice) {
 		// default via 10.0.2.2 src 10.10.2.15
 		Ip4Router::Route wan { { 0, 0 }, device };
 		wan.gateway = 0x0a000202;
@@ -214,6 +221,17 @@ static constexpr protocols::svrctl::ControlOperations controlOps = {
 	.bind = bindDevice
 };
 
+void setupLoopback() {
+	auto lo = nic::loopback::makeShared();
+
+	// 127.0.0.0/8
+	ip4Router().addRoute({ { 0x7f000000, 8 }, lo });
+	// inet 127.0.0.1/8
+	ip4().setLink({ 0x7f000001, 8 }, lo);
+
+	baseDeviceMap.insert({loopbackId, lo});
+}
+
 // --------------------------------------------------------
 // main() function
 // --------------------------------------------------------
@@ -223,6 +241,8 @@ int main() {
 
 //	HEL_CHECK(helSetPriority(kHelThisThread, 3));
 
+	setupLoopback();
+
 	async::detach(protocols::svrctl::serveControl(&controlOps));
 	advertise();
 	async::run_forever(helix::currentDispatcher);
@@ -40,9 +40,11 @@ void NetlinkSocket::sendLinkPacket(std::shared_ptr<nic::Link> nic, void *h) {
 
 	b.message<struct ifinfomsg>({
 		.ifi_family = AF_UNSPEC,
-		.ifi_type = ARPHRD_ETHER,
+		.ifi_type = static_cast<unsigned short>(nic->isLoopback() ? ARPHRD_LOOPBACK : ARPHRD_ETHER),
 		.ifi_index = nic->index(),
-		.ifi_flags = IFF_UP | IFF_LOWER_UP | IFF_RUNNING | IFF_MULTICAST | IFF_BROADCAST,
+		.ifi_flags = nic->isLoopback()
+			? (IFF_UP | IFF_LOWER_UP | IFF_RUNNING | IFF_LOOPBACK)
+			: (IFF_UP | IFF_LOWER_UP | IFF_RUNNING | IFF_MULTICAST | IFF_BROADCAST),
 	});
 
 	constexpr struct ether_addr broadcast_addr = { {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF} };
@@ -2,7 +2,9 @@
 #include <netserver/nic.hpp>
 
 #include <algorithm>
+#include <cassert>
 #include <cstring>
+#include <new>
 #include <arch/bit.hpp>
 #include <frg/formatting.hpp>
 #include <frg/logging.hpp>
@@ -13,6 +15,15 @@ namespace {
 
 id_allocator<int> _allocator;
 
+constexpr size_t cacheLineSize = 64;
+
+// Slots of the standard frame pool fit an Ethernet frame of the default MTU.
+constexpr size_t frameSlotSize = 2048;
+constexpr size_t maxCachedFrames = 256;
+// Slots of the large frame pool fit any IPv4 packet, including its link layer header.
+constexpr size_t largeFrameSlotSize = (14 + 0xFFFF + cacheLineSize - 1) & ~(cacheLineSize - 1);
+constexpr size_t maxCachedLargeFrames = 16;
+
 } /* namespace */
 
 namespace nic {
@@ -33,8 +44,60 @@ bool operator!=(const MacAddress &l, const MacAddress &r) {
 	return !operator==(l, r);
 }
 
+FramePool::FramePool(size_t slotSize, size_t maxCached, arch::dma_pool *backing,
+		arch::dma_pool *next)
+: backing_{backing}, next_{next}, slotSize_{(slotSize + cacheLineSize - 1) & ~(cacheLineSize - 1)},
+		maxCached_{maxCached} { }
+
+FramePool::~FramePool() {
+	while(freeList_) {
+		auto slot = freeList_;
+		freeList_ = slot->next;
+		backing_->deallocate(slot, slotSize_, 1, cacheLineSize);
+	}
+}
+
+bool FramePool::fitsSlot_(size_t size, size_t count, size_t align) {
+	return size * count <= slotSize_ && align <= cacheLineSize;
+}
+
+void *FramePool::allocate(size_t size, size_t count, size_t align) {
+	if(!fitsSlot_(size, count, align)) {
+		if(next_)
+			return next_->allocate(size, count, align);
+		return backing_->allocate(size, count, align);
+	}
+
+	if(!freeList_)
+		return backing_->allocate(slotSize_, 1, cacheLineSize);
+	auto slot = freeList_;
+	freeList_ = slot->next;
+	numCached_--;
+	return slot;
+}
+
+void FramePool::deallocate(void *pointer, size_t size, size_t count, size_t align) {
+	if(!fitsSlot_(size, count, align)) {
+		if(next_) {
+			next_->deallocate(pointer, size, count, align);
+		}else{
+			backing_->deallocate(pointer, size, count, align);
+		}
+		return;
+	}
+
+	if(numCached_ == maxCached_) {
+		backing_->deallocate(pointer, slotSize_, 1, cacheLineSize);
+		return;
+	}
+	freeList_ = new (pointer) FreeSlot{freeList_};
+	numCached_++;
+}
+
 Link::Link(unsigned int mtu, arch::dma_pool *dmaPool)
-: mtu(mtu), dmaPool_(dmaPool), index_{_allocator.allocate()} {
+: mtu(mtu), dmaPool_(dmaPool), index_{_allocator.allocate()},
+		largeFramePool_{largeFrameSlotSize, maxCachedLargeFrames, dmaPool},
+		framePool_{frameSlotSize, maxCachedFrames, dmaPool, &largeFramePool_} {
 
 }
 
@@ -46,10 +109,18 @@ arch::dma_pool *Link::dmaPool() {
 	return dmaPool_;
 }
 
+arch::dma_pool *Link::framePool() {
+	return &framePool_;
+}
+
 int Link::index() {
 	return index_;
 }
 
+bool Link::isLoopback() {
+	return false;
+}
+
 std::string Link::name() {
 	std::string res;
 
@@ -62,12 +133,91 @@ std::string Link::name() {
 	return res;
 }
 
+// The default implementations of the burst APIs fall back to receive() and send().
+size_t Link::numReceiveQueues() {
+	return 1;
+}
+
+size_t Link::receiveQueueDepth(size_t queue) {
+	assert(!queue);
+	return 1;
+}
+
+async::result<void> Link::postReceiveBuffers(size_t queue,
+		std::vector<arch::dma_buffer> buffers) {
+	assert(!queue);
+	for(auto &buffer : buffers)
+		postedBuffers_.push_back(std::move(buffer));
+	co_return;
+}
+
+async::result<std::vector<Link::ReceivedFrame>> Link::receiveBurst(size_t queue, size_t max) {
+	assert(!queue);
+	assert(max);
+	assert(!postedBuffers_.empty());
+	auto buffer = std::move(postedBuffers_.front());
+	postedBuffers_.pop_front();
+	co_await receive(buffer);
+
+	std::vector<ReceivedFrame> frames;
+	frames.push_back({std::move(buffer), {}});
+	co_return frames;
+}
+
+async::result<void> Link::sendBurst(std::vector<TxFrame> frames) {
+	for(auto &tx : frames) {
+		// Links that support offloads must override sendBurst().
+		assert(!tx.metadata.needsChecksum && !tx.metadata.segmentSize);
+		co_await send(tx.frame);
+	}
+}
+
+async::result<void> Link::sendOffloaded(const arch::dma_buffer_view frame, TxMetadata metadata) {
+	assert(!metadata.needsChecksum || (offloads_ & OFFLOAD_TX_CSUM));
+	assert(!metadata.segmentSize || (offloads_ & OFFLOAD_TSO4));
+	std::vector<TxFrame> frames;
+	frames.push_back({frame, metadata});
+	co_await sendBurst(std::move(frames));
+}
+
+async::result<void> Link::transmit(AllocatedBuffer buffer, TxMetadata metadata) {
+	if(!metadata.needsChecksum && !metadata.segmentSize) {
+		co_await send(buffer.frame);
+	}else{
+		co_await sendOffloaded(buffer.frame, metadata);
+	}
+}
+
+async::result<void> Link::transmitBurst(std::vector<QueuedFrame> frames) {
+	// The buffers in frames stay alive until the burst is sent.
+	std::vector<TxFrame> burst;
+	for(auto &queued : frames)
+		burst.push_back({queued.buffer.frame, queued.metadata});
+	co_await sendBurst(std::move(burst));
+}
+
+void Link::queueTransmit(AllocatedBuffer buffer, TxMetadata metadata) {
+	queuedFrames_.push_back({std::move(buffer), metadata});
+}
+
+async::result<void> Link::flushTransmits() {
+	if(queuedFrames_.empty())
+		co_return;
+	auto frames = std::move(queuedFrames_);
+	queuedFrames_.clear();
+	co_await transmitBurst(std::move(frames));
+}
+
+uint32_t Link::offloads() {
+	return offloads_;
+}
+
 Link::AllocatedBuffer Link::allocateFrame(MacAddress to, EtherType type,
 		size_t payloadSize) {
 	// default implementation assume an Ethernet II frame
 	using namespace arch;
 	Link::AllocatedBuffer buf {
-		dma_buffer { dmaPool(), 14 + payloadSize }, {}
+		dma_buffer { framePool(), 14 + payloadSize }, {}
 	};
 
 	uint16_t et = static_cast<uint16_t>(type);
@@ -81,28 +231,62 @@ Link::AllocatedBuffer Link::allocateFrame(MacAddress to, EtherType type,
 	return buf;
 }
 
-async::detached runDevice(std::shared_ptr<nic::Link> dev) {
+namespace {
+
+constexpr size_t receiveBurstSize = 32;
+
+void feedFrame(std::shared_ptr<nic::Link> dev, arch::dma_buffer frameBuffer,
+		RxMetadata metadata) {
+	auto capsule = frameBuffer.subview(14);
+	auto data = reinterpret_cast<uint8_t*>(frameBuffer.data());
+	uint16_t ethertype = data[12] << 8 | data[13];
+	nic::MacAddress dstsrc[2];
+	std::memcpy(dstsrc, data, sizeof(dstsrc));
+
+	switch (ethertype) {
+	case ETHER_TYPE_IP4:
+		ip4().feedPacket(dstsrc[0], dstsrc[1],
+			std::move(frameBuffer), capsule, metadata);
+		break;
+	case ETHER_TYPE_ARP:
+		neigh4().feedArp(dstsrc[0], capsule, dev);
+		break;
+	default:
+		break;
+	}
+}
+
+// Receives frames from a single queue of the device. Each queue has its own worker,
+// such that a large burst on one queue does not delay the frames of other queues.
+async::detached runReceiveQueue(std::shared_ptr<nic::Link> dev, size_t queue) {
 	using namespace arch;
+
+	// Keep the device's receive queue filled, such that frames are not dropped
+	// while we process earlier frames.
+	std::vector<dma_buffer> buffers;
+	for(size_t i = 0; i < dev->receiveQueueDepth(queue); i++)
+		buffers.emplace_back(dev->framePool(), 1514);
+	co_await dev->postReceiveBuffers(queue, std::move(buffers));
+
 	while(true) {
-		dma_buffer frameBuffer { dev->dmaPool(), 1514 };
-		co_await dev->receive(frameBuffer);
-		auto capsule = frameBuffer.subview(14);
-		auto data = reinterpret_cast<uint8_t*>(frameBuffer.data());
-		uint16_t ethertype = data[12] << 8 | data[13];
-		nic::MacAddress dstsrc[2];
-		std::memcpy(dstsrc, data, sizeof(dstsrc));
-
-		switch (ethertype) {
-		case ETHER_TYPE_IP4:
-			ip4().feedPacket(dstsrc[0], dstsrc[1],
-				std::move(frameBuffer), capsule);
-			break;
-		case ETHER_TYPE_ARP:
-			neigh4().feedArp(dstsrc[0], capsule, dev);
-			break;
-		default:
-			break;
-		}
+		auto frames = co_await dev->receiveBurst(queue, receiveBurstSize);
+
+		std::vector<dma_buffer> replacements;
+		for(size_t i = 0; i < frames.size(); i++)
+			replacements.emplace_back(dev->framePool(), 1514);
+		co_await dev->postReceiveBuffers(queue, std::move(replacements));
+
+		for(auto &frame : frames)
+			feedFrame(dev, std::move(frame.buffer), frame.metadata);
 	}
 }
+
+} // anonymous namespace
+
+// All receive workers run on netserver's dispatcher thread.
+async::detached runDevice(std::shared_ptr<nic::Link> dev) {
+	for(size_t i = 0; i < dev->numReceiveQueues(); i++)
+		runReceiveQueue(dev, i);
+	co_return;
+}
 } // namespace nic
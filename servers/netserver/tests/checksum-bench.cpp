@@ -0,0 +1,79 @@
+#include <math.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "checksum.hpp"
+
+namespace {
+
+struct IterationsPerSecondBenchmark {
+	using clock = std::chrono::high_resolution_clock;
+
+	void launchRepetition() {
+		ref_ = clock::now();
+	}
+
+	bool isRepetitionDone() {
+		auto elapsed = duration_cast<std::chrono::nanoseconds>(
+					std::chrono::high_resolution_clock::now() - ref_);
+		return elapsed.count() > 1'000'000'000;
+	}
+
+	void announceIterations(uint64_t iters) {
+		std::cout << "    " << iters << " iterations per second" << std::endl;
+		results_.push_back(iters);
+	}
+
+	void finalizeStatistics() {
+		double avg = 0;
+		for(uint64_t n : results_)
+			avg += n;
+		avg /= results_.size();
+
+		double var = 0;
+		for(uint64_t n : results_)
+			var += (n - avg) * (n - avg);
+		var /= results_.size();
+
+		std::cout << "    avg: " << static_cast<uint64_t>(avg)
+				<< ", std: " << static_cast<uint64_t>(sqrt(var)) << std::endl;
+	}
+
+private:
+	std::vector<double> results_;
+	std::chrono::time_point<clock> ref_;
+};
+
+void doChecksumBenchmark(size_t size) {
+	std::vector<unsigned char> buffer(size, 0x5A);
+
+	for(auto &kernel : checksum_detail::supportedKernels()) {
+		std::cout << "checksum (" << kernel.name << "), size = " << size << std::endl;
+
+		IterationsPerSecondBenchmark bench;
+		volatile uint64_t sink;
+		for(int k = 0; k < 5; ++k) {
+			uint64_t n = 0;
+			bench.launchRepetition();
+			while(!bench.isRepetitionDone()) {
+				for(int i = 0; i < 100; ++i) {
+					sink = kernel.sum(nullptr, buffer.data(), size, 0);
+					++n;
+				}
+			}
+			bench.announceIterations(n);
+		}
+		bench.finalizeStatistics();
+		(void)sink;
+	}
+}
+
+} // anonymous namespace
+
+int main() {
+	doChecksumBenchmark(64);
+	doChecksumBenchmark(1500);
+	doChecksumBenchmark(64 * 1024);
+}
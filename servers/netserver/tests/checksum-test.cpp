@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "checksum.hpp"
+
+namespace {
+
+// Compares the checksum kernels against the portable kernel.
+void checkKernels() {
+	std::cout << "checksum kernels" << std::endl;
+
+	auto kernels = checksum_detail::supportedKernels();
+	auto &reference = kernels.front();
+
+	std::mt19937 rng{42};
+	std::vector<unsigned char> src(8192 + 64);
+	std::vector<unsigned char> dest(8192 + 64);
+	for(auto &b : src)
+		b = rng();
+
+	// All kernels must compute the same sum for all lengths and alignments.
+	for(int i = 0; i < 10000; ++i) {
+		auto offset = rng() % 64;
+		auto destOffset = rng() % 64;
+		auto size = rng() % 8193;
+		auto expected = reference.sum(nullptr, src.data() + offset, size, 0);
+		for(auto &kernel : kernels) {
+			memset(dest.data(), 0, dest.size());
+			auto sum = kernel.sum(nullptr, src.data() + offset, size, 0);
+			auto copySum = kernel.copy(dest.data() + destOffset, src.data() + offset, size, 0);
+			if(sum != expected || copySum != expected
+					|| memcmp(dest.data() + destOffset, src.data() + offset, size)) {
+				std::cout << "    " << kernel.name << " fails for offset " << offset
+						<< ", size " << size << std::endl;
+				abort();
+			}
+		}
+	}
+
+	// The checksum must not depend on how the data is split up,
+	// in particular if pieces of odd length are chained.
+	auto referenceChecksum = [] (const unsigned char *p, size_t size) -> uint16_t {
+		uint32_t sum = 0;
+		for(size_t k = 0; k < size; k += 2) {
+			sum += p[k] << 8;
+			if(k + 1 < size)
+				sum += p[k + 1];
+		}
+		while(sum >> 16)
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		return ~sum;
+	};
+
+	for(int i = 0; i < 10000; ++i) {
+		auto p = src.data() + rng() % 64;
+		auto size = rng() % 4097;
+
+		Checksum chained;
+		size_t progress = 0;
+		while(progress < size) {
+			auto chunk = std::min<size_t>(rng() % 64, size - progress);
+			switch(rng() % 3) {
+			case 0:
+				chained.update(p + progress, chunk);
+				break;
+			case 1:
+				chained.updateAndCopy(dest.data() + progress, p + progress, chunk);
+				break;
+			default: {
+				Checksum part;
+				part.update(p + progress, chunk);
+				chained.update(part);
+			}
+			}
+			progress += chunk;
+		}
+
+		auto expected = referenceChecksum(p, size);
+		auto result = chained.finalize();
+		if(result != expected) {
+			std::cout << "    chaining fails for size " << size << ": 0x" << std::hex
+					<< result << " != 0x" << expected << std::dec << std::endl;
+			abort();
+		}
+	}
+
+	std::cout << "    " << kernels.size() << " kernels OK" << std::endl;
+}
+
+} // anonymous namespace
+
+int main() {
+	checkKernels();
+}
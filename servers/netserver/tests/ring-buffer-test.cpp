@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <vector>
+
+#include "ring-buffer.hpp"
+
+#define CHECK(cond) do { \
+		if(!(cond)) { \
+			std::cout << "    " << __FILE__ << ":" << __LINE__ \
+					<< ": check failed: " #cond << std::endl; \
+			abort(); \
+		} \
+	} while(0)
+
+namespace {
+
+constexpr int shift = 12;
+constexpr size_t ringSize = size_t{1} << shift;
+
+unsigned char pattern(uint64_t index) {
+	return index % 251;
+}
+
+// The owner produces to the ring, netserver consumes (like the send ring).
+void checkOwnerProduces() {
+	std::cout << "owner produces" << std::endl;
+
+	RingBuffer ring{shift};
+	protocols::fs::SocketRingIndices indices;
+	std::vector<unsigned char> storage(ringSize);
+	ring.share(reinterpret_cast<char *>(storage.data()), &indices, true);
+
+	// Move the indices across the end of the ring several times.
+	uint64_t produced = 0;
+	uint64_t consumed = 0;
+	const uint64_t total = 5 * ringSize + 123;
+	std::vector<char> buffer(ringSize);
+	while(consumed < total) {
+		auto space = ringSize - (produced - indices.consumed.load());
+		auto chunk = std::min<uint64_t>({space, 1000, total - produced});
+		for(uint64_t i = 0; i < chunk; i++)
+			storage[(produced + i) & (ringSize - 1)] = pattern(produced + i);
+		produced += chunk;
+		indices.produced.store(produced);
+
+		auto available = ring.availableToDequeue();
+		CHECK(available == produced - consumed);
+		// Consume in odd sizes, such that reads straddle the end of the ring.
+		auto n = std::min<size_t>(available, 777);
+		ring.dequeue(buffer.data(), n);
+		for(size_t i = 0; i < n; i++)
+			CHECK(static_cast<unsigned char>(buffer[i]) == pattern(consumed + i));
+		consumed += n;
+		CHECK(indices.consumed.load() == consumed);
+	}
+
+	// Fill the ring partially.
+	for(uint64_t i = 0; i < 100; i++)
+		storage[(produced + i) & (ringSize - 1)] = pattern(produced + i);
+	produced += 100;
+	indices.produced.store(produced);
+	CHECK(ring.availableToDequeue() == 100);
+
+	// A malicious owner cannot move the producer index backwards...
+	indices.produced.store(produced - 1);
+	CHECK(ring.availableToDequeue() == 100);
+	indices.produced.store(consumed);
+	CHECK(ring.availableToDequeue() == 100);
+	indices.produced.store(0);
+	CHECK(ring.availableToDequeue() == 100);
+
+	// ... or beyond the space in the ring.
+	indices.produced.store(consumed + ringSize + 1);
+	CHECK(ring.availableToDequeue() == 100);
+	indices.produced.store(~uint64_t{0});
+	CHECK(ring.availableToDequeue() == 100);
+	CHECK(ring.spaceForEnqueue() == ringSize - 100);
+
+	// Filling the ring completely is fine.
+	indices.produced.store(consumed + ringSize);
+	CHECK(ring.availableToDequeue() == ringSize);
+	CHECK(!ring.spaceForEnqueue());
+
+	std::cout << "    OK" << std::endl;
+}
+
+// netserver produces to the ring, the owner consumes (like the receive ring).
+void checkOwnerConsumes() {
+	std::cout << "owner consumes" << std::endl;
+
+	RingBuffer ring{shift};
+	protocols::fs::SocketRingIndices indices;
+	std::vector<unsigned char> storage(ringSize);
+
+	// Data that is buffered before the ring is shared stays available.
+	std::vector<char> buffer(ringSize);
+	for(size_t i = 0; i < 300; i++)
+		buffer[i] = pattern(i);
+	ring.enqueue(buffer.data(), 300);
+	ring.share(reinterpret_cast<char *>(storage.data()), &indices, false);
+	CHECK(indices.produced.load() == 300);
+	CHECK(indices.consumed.load() == 0);
+
+	uint64_t produced = 300;
+	uint64_t consumed = 0;
+	const uint64_t total = 5 * ringSize + 123;
+	while(consumed < total) {
+		auto space = ring.spaceForEnqueue();
+		CHECK(space == ringSize - (produced - consumed));
+		auto chunk = std::min<uint64_t>({space, 1000, total - produced});
+		for(uint64_t i = 0; i < chunk; i++)
+			buffer[i] = pattern(produced + i);
+		ring.enqueue(buffer.data(), chunk);
+		produced += chunk;
+		CHECK(indices.produced.load() == produced);
+
+		auto n = std::min<uint64_t>(produced - consumed, 777);
+		for(uint64_t i = 0; i < n; i++)
+			CHECK(storage[(consumed + i) & (ringSize - 1)] == pattern(consumed + i));
+		consumed += n;
+		indices.consumed.store(consumed);
+	}
+
+	// Leave some data in the ring.
+	for(size_t i = 0; i < 100; i++)
+		buffer[i] = pattern(produced + i);
+	ring.enqueue(buffer.data(), 100);
+	produced += 100;
+	CHECK(ring.spaceForEnqueue() == ringSize - 100);
+
+	// A malicious owner cannot move the consumer index backwards...
+	indices.consumed.store(consumed - 1);
+	CHECK(ring.spaceForEnqueue() == ringSize - 100);
+	indices.consumed.store(0);
+	CHECK(ring.spaceForEnqueue() == ringSize - 100);
+
+	// ... or beyond the data in the ring.
+	indices.consumed.store(produced + 1);
+	CHECK(ring.spaceForEnqueue() == ringSize - 100);
+	indices.consumed.store(~uint64_t{0});
+	CHECK(ring.spaceForEnqueue() == ringSize - 100);
+	CHECK(ring.availableToDequeue() == 100);
+
+	// Consuming everything is fine.
+	indices.consumed.store(produced);
+	CHECK(ring.spaceForEnqueue() == ringSize);
+	CHECK(!ring.availableToDequeue());
+
+	std::cout << "    OK" << std::endl;
+}
+
+} // anonymous namespace
+
+int main() {
+	checkOwnerProduces();
+	checkOwnerConsumes();
+}
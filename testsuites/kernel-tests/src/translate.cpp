@@ -0,0 +1,88 @@
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <hel.h>
+#include <hel-syscalls.h>
+
+#include "testsuite.hpp"
+
+namespace {
+
+// Maps two separate memory objects back to back. Returns the start of the first mapping.
+std::byte *mapAdjacent() {
+	HelHandle first, second;
+	HEL_CHECK(helAllocateMemory(0x2000, 0, nullptr, &first));
+	HEL_CHECK(helAllocateMemory(0x1000, 0, nullptr, &second));
+
+	// Reserve two pages, then replace the second page by the second memory object.
+	void *window;
+	HEL_CHECK(helMapMemory(first, kHelNullHandle, nullptr, 0, 0x2000,
+			kHelMapProtRead | kHelMapProtWrite, &window));
+	auto p = reinterpret_cast<std::byte *>(window);
+	HEL_CHECK(helUnmapMemory(kHelNullHandle, p + 0x1000, 0x1000));
+	void *fixed;
+	HEL_CHECK(helMapMemory(second, kHelNullHandle, p + 0x1000, 0, 0x1000,
+			kHelMapProtRead | kHelMapProtWrite | kHelMapFixed, &fixed));
+	assert(fixed == p + 0x1000);
+
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, first));
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, second));
+	return p;
+}
+
+void unmapAdjacent(std::byte *p) {
+	HEL_CHECK(helUnmapMemory(kHelNullHandle, p, 0x1000));
+	HEL_CHECK(helUnmapMemory(kHelNullHandle, p + 0x1000, 0x1000));
+}
+
+} // anonymous namespace
+
+DEFINE_TEST(translateRangeSingleMapping, ([] {
+	auto p = mapAdjacent();
+
+	HelPhysicalRun runs[2];
+	size_t numRuns = 2;
+	HelHandle handle;
+	HEL_CHECK(helTranslateRange(p + 0x800, 0x400, runs, &numRuns, &handle));
+	assert(numRuns == 1);
+	assert(runs[0].length == 0x400);
+
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(p + 0x800, &physical));
+	assert(runs[0].address == physical);
+
+	HEL_CHECK(helCloseDescriptor(kHelThisUniverse, handle));
+	unmapAdjacent(p);
+}))
+
+// Drivers rely on kHelErrOutOfBounds to fall back to per-page translation
+// (see helix::PinnedRange) when a DMA buffer spans two mappings.
+DEFINE_TEST(translateRangeCrossMapping, ([] {
+	auto p = mapAdjacent();
+
+	HelPhysicalRun runs[2];
+	size_t numRuns = 2;
+	HelHandle handle;
+	assert(helTranslateRange(p + 0x800, 0x1000, runs, &numRuns, &handle)
+			== kHelErrOutOfBounds);
+
+	// The fallback: both halves can still be translated page by page.
+	uintptr_t physical;
+	HEL_CHECK(helPointerPhysical(p + 0x800, &physical));
+	HEL_CHECK(helPointerPhysical(p + 0x1000, &physical));
+
+	unmapAdjacent(p);
+}))
+
+DEFINE_TEST(translateRangeOverflow, ([] {
+	auto p = mapAdjacent();
+
+	HelPhysicalRun runs[2];
+	size_t numRuns = 2;
+	HelHandle handle;
+	assert(helTranslateRange(p + 0x800, SIZE_MAX, runs, &numRuns, &handle)
+			== kHelErrIllegalArgs);
+
+	unmapAdjacent(p);
+}))
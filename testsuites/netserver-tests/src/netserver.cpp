@@ -0,0 +1,145 @@
+#include <arpa/inet.h>
+#include <cassert>
+#include <string.h>
+
+#include <async/oneshot-event.hpp>
+#include <protocols/mbus/client.hpp>
+
+#include "fs.bragi.hpp"
+#include "netserver.hpp"
+
+namespace {
+
+helix::UniqueLane netserverLane;
+bool enumeratedNetserver = false;
+async::oneshot_event foundNetserver;
+
+async::result<helix::BorrowedLane> getNetserverLane() {
+	if(!enumeratedNetserver) {
+		enumeratedNetserver = true;
+
+		auto root = co_await mbus::Instance::global().getRoot();
+
+		auto filter = mbus::Conjunction({
+			mbus::EqualsFilter("class", "netserver")
+		});
+
+		auto handler = mbus::ObserverHandler{}
+		.withAttach([] (mbus::Entity entity, mbus::Properties) -> async::detached {
+			netserverLane = helix::UniqueLane(co_await entity.bind());
+			foundNetserver.raise();
+		});
+
+		co_await root.linkObserver(std::move(filter), std::move(handler));
+	}
+
+	co_await foundNetserver.wait();
+	co_return netserverLane;
+}
+
+// Sends a request that is followed by an address (like PT_BIND and PT_CONNECT).
+async::result<protocols::fs::Error> sendAddressRequest(protocols::fs::File &file,
+		managarm::fs::CntReqType type, const struct sockaddr_in &addr) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(type);
+
+	auto ser = req.SerializeAsString();
+
+	auto [offer, send_req, imbue_creds, send_addr, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			file.getLane(),
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::imbueCredentials(),
+				helix_ng::sendBuffer(&addr, sizeof(struct sockaddr_in)),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(imbue_creds.error());
+	HEL_CHECK(send_addr.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	co_return static_cast<protocols::fs::Error>(resp.error());
+}
+
+} // anonymous namespace
+
+async::result<protocols::fs::File> createSocket(int domain, int type, int proto) {
+	auto lane = co_await getNetserverLane();
+
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::CREATE_SOCKET);
+	req.set_domain(domain);
+	req.set_type(type);
+	req.set_protocol(proto);
+	req.set_flags(0);
+
+	auto ser = req.SerializeAsString();
+
+	auto [offer, send_req, recv_resp, recv_lane] = co_await helix_ng::exchangeMsgs(
+		lane,
+		helix_ng::offer(
+			helix_ng::sendBuffer(ser.data(), ser.size()),
+			helix_ng::recvInline(),
+			helix_ng::pullDescriptor()
+		)
+	);
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+	HEL_CHECK(recv_lane.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	assert(resp.error() == managarm::fs::Errors::SUCCESS);
+	co_return protocols::fs::File{recv_lane.descriptor()};
+}
+
+async::result<protocols::fs::Error> bindSocket(protocols::fs::File &file,
+		const struct sockaddr_in &addr) {
+	return sendAddressRequest(file, managarm::fs::CntReqType::PT_BIND, addr);
+}
+
+async::result<protocols::fs::Error> connectSocket(protocols::fs::File &file,
+		const struct sockaddr_in &addr) {
+	return sendAddressRequest(file, managarm::fs::CntReqType::PT_CONNECT, addr);
+}
+
+async::result<protocols::fs::Error> listenSocket(protocols::fs::File &file, int backlog) {
+	managarm::fs::CntRequest req;
+	req.set_req_type(managarm::fs::CntReqType::PT_LISTEN);
+	req.set_backlog(backlog);
+
+	auto ser = req.SerializeAsString();
+
+	auto [offer, send_req, recv_resp] =
+		co_await helix_ng::exchangeMsgs(
+			file.getLane(),
+			helix_ng::offer(
+				helix_ng::sendBuffer(ser.data(), ser.size()),
+				helix_ng::recvInline()
+			)
+		);
+
+	HEL_CHECK(offer.error());
+	HEL_CHECK(send_req.error());
+	HEL_CHECK(recv_resp.error());
+
+	managarm::fs::SvrResponse resp;
+	resp.ParseFromArray(recv_resp.data(), recv_resp.length());
+	co_return static_cast<protocols::fs::Error>(resp.error());
+}
+
+struct sockaddr_in loopbackAddress(uint16_t port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return addr;
+}
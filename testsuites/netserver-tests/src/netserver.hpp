@@ -0,0 +1,24 @@
+#pragma once
+
+#include <netinet/in.h>
+
+#include <async/result.hpp>
+#include <helix/ipc.hpp>
+#include <protocols/fs/client.hpp>
+
+// These tests talk to netserver over its fs protocol directly, such that they
+// exercise requests that libc (which lives outside of this tree) does not send.
+
+// Creates a socket that is served by netserver.
+async::result<protocols::fs::File> createSocket(int domain, int type, int proto);
+
+async::result<protocols::fs::Error> bindSocket(protocols::fs::File &file,
+		const struct sockaddr_in &addr);
+
+async::result<protocols::fs::Error> connectSocket(protocols::fs::File &file,
+		const struct sockaddr_in &addr);
+
+async::result<protocols::fs::Error> listenSocket(protocols::fs::File &file, int backlog);
+
+// Returns the address 127.0.0.1:port.
+struct sockaddr_in loopbackAddress(uint16_t port);
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cassert>
+#include <sys/epoll.h>
+#include <utility>
+
+#include <helix/memory.hpp>
+#include <protocols/fs/socket-rings.hpp>
+
+#include "netserver.hpp"
+#include "testsuite.hpp"
+
+namespace {
+
+constexpr uint16_t listenerPort = 7310;
+
+unsigned char pattern(uint64_t index) {
+	return index % 251;
+}
+
+struct MappedRings {
+	helix::UniqueDescriptor memory;
+	helix::Mapping mapping;
+	size_t ringSize;
+
+	protocols::fs::SocketRingsControl *control() {
+		return reinterpret_cast<protocols::fs::SocketRingsControl *>(mapping.get());
+	}
+
+	unsigned char *sendRing() {
+		return reinterpret_cast<unsigned char *>(mapping.get())
+				+ protocols::fs::socketSendRingOffset();
+	}
+
+	unsigned char *recvRing() {
+		return reinterpret_cast<unsigned char *>(mapping.get())
+				+ protocols::fs::socketRecvRingOffset(ringSize);
+	}
+};
+
+async::result<MappedRings> mapRings(protocols::fs::File &file) {
+	auto result = co_await file.mapSocketRings();
+	assert(result);
+	auto [memory, ringSize] = std::move(result.value());
+	helix::Mapping mapping{memory, 0, protocols::fs::socketRingsMemorySize(ringSize)};
+	co_return MappedRings{std::move(memory), std::move(mapping), ringSize};
+}
+
+async::result<void> testRings() {
+	auto listener = co_await createSocket(AF_INET, SOCK_STREAM, 0);
+	auto e = co_await bindSocket(listener, loopbackAddress(listenerPort));
+	assert(e == protocols::fs::Error::none);
+	e = co_await listenSocket(listener, 1);
+	assert(e == protocols::fs::Error::none);
+
+	auto client = co_await createSocket(AF_INET, SOCK_STREAM, 0);
+	e = co_await connectSocket(client, loopbackAddress(listenerPort));
+	assert(e == protocols::fs::Error::none);
+	auto accepted = co_await listener.accept();
+	assert(accepted);
+	protocols::fs::File server{std::move(accepted.value())};
+
+	auto clientRings = co_await mapRings(client);
+	auto serverRings = co_await mapRings(server);
+	assert(clientRings.ringSize == serverRings.ringSize);
+	auto ringSize = clientRings.ringSize;
+	auto &send = clientRings.control()->send;
+	auto &recv = serverRings.control()->recv;
+
+	// Move the data across the end of the rings several times.
+	const uint64_t total = 3 * ringSize + 12345;
+	uint64_t produced = send.produced.load(std::memory_order_relaxed);
+	uint64_t consumed = recv.consumed.load(std::memory_order_relaxed);
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	bool misbehaved = false;
+	uint64_t serverSeq = 0;
+	while(received < total) {
+		bool progress = false;
+
+		auto space = ringSize - (produced - send.consumed.load(std::memory_order_acquire));
+		auto chunk = std::min(space, total - sent);
+		if(chunk) {
+			for(uint64_t i = 0; i < chunk; i++)
+				clientRings.sendRing()[(produced + i) & (ringSize - 1)] = pattern(sent + i);
+			produced += chunk;
+			sent += chunk;
+			send.produced.store(produced, std::memory_order_release);
+			auto doorbell = co_await client.ringDoorbell();
+			assert(doorbell);
+			progress = true;
+		}
+
+		// Midway, move the producer index backwards and beyond the free space.
+		// netserver must ignore both; the byte stream is checked below.
+		if(!misbehaved && sent >= total / 2) {
+			send.produced.store(produced - 100, std::memory_order_release);
+			auto doorbell = co_await client.ringDoorbell();
+			assert(doorbell);
+			send.produced.store(produced + 2 * ringSize, std::memory_order_release);
+			doorbell = co_await client.ringDoorbell();
+			assert(doorbell);
+			send.produced.store(produced, std::memory_order_release);
+			doorbell = co_await client.ringDoorbell();
+			assert(doorbell);
+			misbehaved = true;
+		}
+
+		auto available = recv.produced.load(std::memory_order_acquire) - consumed;
+		if(available) {
+			assert(available <= ringSize);
+			for(uint64_t i = 0; i < available; i++)
+				assert(serverRings.recvRing()[(consumed + i) & (ringSize - 1)]
+						== pattern(received + i));
+			consumed += available;
+			received += available;
+			recv.consumed.store(consumed, std::memory_order_release);
+			auto doorbell = co_await server.ringDoorbell();
+			assert(doorbell);
+			progress = true;
+		}
+
+		if(!progress) {
+			auto result = co_await server.pollWait(serverSeq, EPOLLIN);
+			assert(result);
+			serverSeq = std::get<0>(result.value());
+		}
+	}
+	assert(received == total);
+}
+
+} // anonymous namespace
+
+DEFINE_TEST(tcp_rings, ([] {
+	async::run(testRings(), helix::currentDispatcher);
+}))
@@ -0,0 +1,79 @@
+#include <arpa/inet.h>
+#include <cassert>
+#include <string.h>
+#include <unistd.h>
+
+#include "netserver.hpp"
+#include "testsuite.hpp"
+
+namespace {
+
+constexpr int numDatagrams = 8;
+constexpr uint16_t receiverPort = 7301;
+constexpr uint16_t senderPort = 7302;
+constexpr uint16_t limitPort = 7303;
+
+async::result<void> testBatch() {
+	auto receiver = co_await createSocket(AF_INET, SOCK_DGRAM, 0);
+	auto sender = co_await createSocket(AF_INET, SOCK_DGRAM, 0);
+	auto e = co_await bindSocket(receiver, loopbackAddress(receiverPort));
+	assert(e == protocols::fs::Error::none);
+	e = co_await bindSocket(sender, loopbackAddress(senderPort));
+	assert(e == protocols::fs::Error::none);
+
+	// A single SendMsgBatchRequest carries all datagrams.
+	auto dest = loopbackAddress(receiverPort);
+	char payloads[numDatagrams][16];
+	protocols::fs::BatchedMsg out[numDatagrams];
+	for(int i = 0; i < numDatagrams; i++) {
+		memset(payloads[i], 'a' + i, sizeof(payloads[i]));
+		out[i] = {payloads[i], size_t(i + 1), &dest, sizeof(struct sockaddr_in), 0};
+	}
+	auto sent = co_await sender.sendMsgBatch(0, out);
+	assert(sent && sent.value() == numDatagrams);
+
+	// Loopback delivers the datagrams asynchronously; give it time to queue all of them.
+	usleep(100'000);
+
+	// A single RecvMsgBatchRequest returns all queued datagrams.
+	char buffers[numDatagrams][16];
+	struct sockaddr_in addrs[numDatagrams];
+	protocols::fs::BatchedMsg in[numDatagrams];
+	for(int i = 0; i < numDatagrams; i++)
+		in[i] = {buffers[i], sizeof(buffers[i]), &addrs[i], sizeof(struct sockaddr_in), 0};
+	auto received = co_await receiver.recvMsgBatch(0, in);
+	assert(received && received.value() == numDatagrams);
+
+	for(int i = 0; i < numDatagrams; i++) {
+		assert(in[i].dataLength == size_t(i + 1));
+		for(int j = 0; j <= i; j++)
+			assert(buffers[i][j] == 'a' + i);
+		assert(in[i].addrLength == sizeof(struct sockaddr_in));
+		assert(addrs[i].sin_port == htons(senderPort));
+	}
+}
+
+async::result<void> testBatchLimit() {
+	auto sender = co_await createSocket(AF_INET, SOCK_DGRAM, 0);
+	auto e = co_await bindSocket(sender, loopbackAddress(limitPort));
+	assert(e == protocols::fs::Error::none);
+
+	// netserver rejects batches of more than 64 messages.
+	auto dest = loopbackAddress(receiverPort);
+	char payload = 'a';
+	protocols::fs::BatchedMsg out[65];
+	for(auto &msg : out)
+		msg = {&payload, 1, &dest, sizeof(struct sockaddr_in), 0};
+	auto sent = co_await sender.sendMsgBatch(0, out);
+	assert(!sent && sent.error() == protocols::fs::Error::illegalArguments);
+}
+
+} // anonymous namespace
+
+DEFINE_TEST(udp_batch, ([] {
+	async::run(testBatch(), helix::currentDispatcher);
+}))
+
+DEFINE_TEST(udp_batch_limit, ([] {
+	async::run(testBatchLimit(), helix::currentDispatcher);
+}))
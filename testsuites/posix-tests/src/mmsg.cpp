@@ -0,0 +1,152 @@
+#include <cassert>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "testsuite.hpp"
+
+// These tests check the semantics of recvmmsg() and sendmmsg(). Whether libc
+// implements them with the batched fs requests is decided outside of this tree;
+// netserver-tests exercises these requests directly.
+
+namespace {
+
+constexpr int numDatagrams = 4;
+
+// Returns a UDP socket that is bound to an ephemeral port on 127.0.0.1.
+int makeUdpSocket(struct sockaddr_in *addr) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd == -1)
+		assert(!"socket() failed");
+
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_in)))
+		assert(!"bind() failed");
+
+	socklen_t length = sizeof(struct sockaddr_in);
+	if(getsockname(fd, (struct sockaddr *)addr, &length))
+		assert(!"getsockname() failed");
+	return fd;
+}
+
+// Sends numDatagrams messages of different sizes via a single sendmmsg() call.
+// The destination is only set if addr is non-null.
+void sendBatch(int fd, struct sockaddr_in *addr) {
+	char payloads[numDatagrams][8];
+	struct iovec iovs[numDatagrams];
+	struct mmsghdr msgs[numDatagrams];
+	memset(msgs, 0, sizeof(msgs));
+	for(int i = 0; i < numDatagrams; i++) {
+		memset(payloads[i], 'a' + i, sizeof(payloads[i]));
+		iovs[i].iov_base = payloads[i];
+		iovs[i].iov_len = i + 1;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = addr;
+		msgs[i].msg_hdr.msg_namelen = addr ? sizeof(struct sockaddr_in) : 0;
+	}
+
+	int sent = 0;
+	while(sent < numDatagrams) {
+		int n = sendmmsg(fd, msgs + sent, numDatagrams - sent, 0);
+		if(n <= 0)
+			assert(!"sendmmsg() failed");
+		for(int i = sent; i < sent + n; i++)
+			assert(msgs[i].msg_len == static_cast<unsigned int>(i + 1));
+		sent += n;
+	}
+}
+
+// Receives the messages of sendBatch(), possibly in multiple recvmmsg() calls.
+void recvBatch(int fd) {
+	char buffers[numDatagrams][16];
+	struct iovec iovs[numDatagrams];
+	struct mmsghdr msgs[numDatagrams];
+
+	int received = 0;
+	while(received < numDatagrams) {
+		memset(msgs, 0, sizeof(msgs));
+		for(int i = 0; i < numDatagrams; i++) {
+			iovs[i].iov_base = buffers[i];
+			iovs[i].iov_len = sizeof(buffers[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int n = recvmmsg(fd, msgs, numDatagrams - received, MSG_WAITFORONE, nullptr);
+		if(n <= 0)
+			assert(!"recvmmsg() failed");
+
+		// Datagrams are received in order.
+		for(int i = 0; i < n; i++) {
+			int k = received + i;
+			assert(msgs[i].msg_len == static_cast<unsigned int>(k + 1));
+			for(int j = 0; j <= k; j++)
+				assert(buffers[i][j] == 'a' + k);
+		}
+		received += n;
+	}
+}
+
+} // anonymous namespace
+
+DEFINE_TEST(udp_recvmmsg, ([] {
+	struct sockaddr_in recv_addr, send_addr;
+	int recv_fd = makeUdpSocket(&recv_addr);
+	int send_fd = makeUdpSocket(&send_addr);
+
+	// Queue several datagrams before receiving them in batches.
+	for(int i = 0; i < numDatagrams; i++) {
+		char payload[8];
+		memset(payload, 'a' + i, sizeof(payload));
+		if(sendto(send_fd, payload, i + 1, 0,
+				(struct sockaddr *)&recv_addr, sizeof(struct sockaddr_in)) != i + 1)
+			assert(!"sendto() failed");
+	}
+
+	recvBatch(recv_fd);
+
+	close(send_fd);
+	close(recv_fd);
+}))
+
+DEFINE_TEST(udp_sendmmsg, ([] {
+	struct sockaddr_in recv_addr, send_addr;
+	int recv_fd = makeUdpSocket(&recv_addr);
+	int send_fd = makeUdpSocket(&send_addr);
+
+	sendBatch(send_fd, &recv_addr);
+	for(int i = 0; i < numDatagrams; i++) {
+		char buffer[16];
+		struct sockaddr_in addr;
+		socklen_t length = sizeof(struct sockaddr_in);
+		auto n = recvfrom(recv_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&addr, &length);
+		assert(n == i + 1);
+		for(int j = 0; j < n; j++)
+			assert(buffer[j] == 'a' + i);
+		assert(addr.sin_port == send_addr.sin_port);
+	}
+
+	close(send_fd);
+	close(recv_fd);
+}))
+
+DEFINE_TEST(unix_mmsg, ([] {
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds))
+		assert(!"socketpair() failed");
+
+	sendBatch(fds[0], nullptr);
+	recvBatch(fds[1]);
+
+	close(fds[0]);
+	close(fds[1]);
+}))
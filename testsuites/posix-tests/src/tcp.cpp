@@ -0,0 +1,99 @@
+#include <cassert>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "testsuite.hpp"
+
+DEFINE_TEST(tcp_loopback_connect, ([] {
+	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(server_fd == -1)
+		assert(!"server socket() failed");
+
+	// Bind to an ephemeral port.
+	struct sockaddr_in server_addr;
+	memset(&server_addr, 0, sizeof(struct sockaddr_in));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(bind(server_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)))
+		assert(!"bind() failed");
+	if(listen(server_fd, 50))
+		assert(!"listen() failed");
+
+	socklen_t server_length = sizeof(struct sockaddr_in);
+	if(getsockname(server_fd, (struct sockaddr *)&server_addr, &server_length))
+		assert(!"getsockname(server) failed");
+	assert(server_length == sizeof(struct sockaddr_in));
+	assert(server_addr.sin_port);
+
+	pid_t child = fork();
+	if(!child) {
+		int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(client_fd == -1)
+			assert(!"client socket() failed");
+		if(connect(client_fd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)))
+			assert(!"connect() to server failed");
+
+		if(send(client_fd, "ping", 4, 0) != 4)
+			assert(!"send() failed");
+
+		char buf[4];
+		size_t progress = 0;
+		while(progress < 4) {
+			auto n = recv(client_fd, buf + progress, 4 - progress, 0);
+			if(n <= 0)
+				assert(!"recv() failed");
+			progress += n;
+		}
+		assert(!memcmp(buf, "pong", 4));
+
+		// The server observes EOF once we close the connection.
+		close(client_fd);
+		exit(0);
+	} else {
+		int peer_fd = accept(server_fd, nullptr, nullptr);
+		if(peer_fd == -1)
+			assert(!"accept() failed");
+
+		struct sockaddr_in peer_addr;
+		socklen_t peer_length = sizeof(struct sockaddr_in);
+		if(getpeername(peer_fd, (struct sockaddr *)&peer_addr, &peer_length))
+			assert(!"getpeername(peer) failed");
+		assert(peer_addr.sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+
+		char buf[4];
+		size_t progress = 0;
+		while(progress < 4) {
+			auto n = recv(peer_fd, buf + progress, 4 - progress, 0);
+			if(n <= 0)
+				assert(!"recv() failed");
+			progress += n;
+		}
+		assert(!memcmp(buf, "ping", 4));
+
+		if(send(peer_fd, "pong", 4, 0) != 4)
+			assert(!"send() failed");
+
+		if(recv(peer_fd, buf, 4, 0) != 0)
+			assert(!"recv() did not report EOF");
+
+		int status = 0;
+		while(waitpid(child, &status, 0) == -1) {
+			if(errno == EINTR)
+				continue;
+			assert(!"waitpid() failed");
+		}
+		assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+		close(peer_fd);
+	}
+	close(server_fd);
+}))
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <cassert>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "testsuite.hpp"
+
+namespace {
+	// Large enough to use direct, single indirect and double indirect blocks.
+	constexpr size_t fileSize = 6 * 1024 * 1024;
+	constexpr size_t chunkSize = 64 * 1024;
+
+	// Unlike /tmp, /var/tmp is backed by the disk file system.
+	int openTestFile() {
+		char path[] = "/var/tmp/posix-tests.XXXXXX";
+		int fd = mkstemp(path);
+		assert(fd != -1);
+		int e = unlink(path);
+		assert(!e);
+		return fd;
+	}
+
+	void fillFile(int fd, char c, size_t offset, size_t size) {
+		std::vector<char> buffer(chunkSize, c);
+		for(size_t progress = 0; progress < size; progress += chunkSize) {
+			auto n = std::min(chunkSize, size - progress);
+			auto written = pwrite(fd, buffer.data(), n, offset + progress);
+			assert(written == static_cast<ssize_t>(n));
+		}
+	}
+
+	// Checks that the bytes [offset, offset + size) of the file are all c.
+	void checkFile(int fd, char c, size_t offset, size_t size) {
+		std::vector<char> buffer(chunkSize);
+		for(size_t progress = 0; progress < size; progress += chunkSize) {
+			auto n = std::min(chunkSize, size - progress);
+			auto chunk = pread(fd, buffer.data(), n, offset + progress);
+			assert(chunk == static_cast<ssize_t>(n));
+			for(size_t i = 0; i < n; i++)
+				assert(buffer[i] == c);
+		}
+	}
+
+	off_t fileLength(int fd) {
+		struct stat st;
+		int e = fstat(fd, &st);
+		assert(!e);
+		return st.st_size;
+	}
+}
+
+DEFINE_TEST(truncate_shrink_extend, ([] {
+	int fd = openTestFile();
+	fillFile(fd, 'a', 0, fileSize);
+
+	// Shrink to an offset that is not block aligned.
+	int e = ftruncate(fd, 5000);
+	assert(!e);
+	assert(fileLength(fd) == 5000);
+
+	// Data that was cut off must not reappear.
+	e = ftruncate(fd, fileSize);
+	assert(!e);
+	assert(fileLength(fd) == fileSize);
+	checkFile(fd, 'a', 0, 5000);
+	checkFile(fd, 0, 5000, fileSize - 5000);
+
+	close(fd);
+}))
+
+DEFINE_TEST(truncate_reuse_blocks, ([] {
+	int fd = openTestFile();
+	fillFile(fd, 'a', 0, fileSize);
+
+	int e = ftruncate(fd, 0);
+	assert(!e);
+	assert(fileLength(fd) == 0);
+
+	// Writing again allocates blocks for the whole range.
+	fillFile(fd, 'b', 0, fileSize);
+	assert(fileLength(fd) == fileSize);
+	checkFile(fd, 'b', 0, fileSize);
+
+	close(fd);
+}))